@@ -0,0 +1,98 @@
+
+#include <cstring>      // strerror()
+#include <memory>       // shared_ptr
+#include <pthread.h>    // multithreading
+#include <stdexcept>    // exceptions
+#include <sstream>      // stringstream (used by Log.h)
+#include <vector>       // vectors
+
+#include "BufferPool.h"
+#include "Log.h"
+#include "Sockets.h"    // MutexLock
+
+using namespace std;
+
+/// Smallest size class. Anything smaller isn't worth sorting.
+static const size_t MIN_SIZE_CLASS = 64;
+
+BufferPool::BufferPool (size_t maxBuffersPerClass_):
+	maxBuffersPerClass (maxBuffersPerClass_),
+	emptyBuffer        (new buffer_t(1, 0))
+{
+	int err;
+	if ((err = pthread_mutex_init(&classesMutex, NULL))) {
+		THROW_ERROR("Error creating mutex: " << strerror(err));
+	}
+}
+
+BufferPool::~BufferPool ()
+{
+	pthread_mutex_destroy(&classesMutex);
+}
+
+BufferPool::buffer_ptr
+BufferPool::acquire (size_t size)
+{
+	if (size == 0) {
+		return emptyBuffer;
+	}
+
+	size_t sizeClass = getSizeClass(size);
+
+	MutexLock lock(classesMutex);
+	lock.relock();
+
+	vector<buffer_ptr> &buffers = classes[sizeClass];
+
+	// A buffer that only the pool is holding on to is free to reuse
+	for (vector<buffer_ptr>::iterator itr = buffers.begin();
+	     itr != buffers.end();
+	     itr++)
+	{
+		if (itr->use_count() == 1) {
+			return *itr;
+		}
+	}
+
+	// Everything's in use. Allocate a new buffer outside the lock, since
+	// faulting in a few megabytes isn't quick.
+	lock.unlock();
+	buffer_ptr buffer(new buffer_t(sizeClass));
+	lock.relock();
+
+	if (buffers.size() < maxBuffersPerClass) {
+		TRACE("Adding buffer #" << buffers.size() + 1 << " to the "
+		   << sizeClass << "-byte size class");
+		buffers.push_back(buffer);
+	} else {
+		TRACE("The " << sizeClass << "-byte size class is full; "
+		   << "this buffer will be freed after use");
+	}
+
+	return buffer;
+}
+
+size_t
+BufferPool::getSizeClass (size_t size)
+{
+	if (size <= MIN_SIZE_CLASS) {
+		return MIN_SIZE_CLASS;
+	}
+
+	// Find the power of two at or below the size...
+	size_t base = MIN_SIZE_CLASS;
+	while (base * 2 <= size) {
+		base *= 2;
+	}
+
+	// ...then the first quarter step at or above it
+	size_t step = base / 4;
+	return base + ((size - base + step - 1) / step) * step;
+}
+
+shared_ptr<BufferPool>
+BufferPool::getSharedPool ()
+{
+	static shared_ptr<BufferPool> pool(new BufferPool());
+	return pool;
+}
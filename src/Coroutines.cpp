@@ -0,0 +1,311 @@
+#include <cstring>      // strerror()
+#include <memory>       // shared_ptr
+#include <pthread.h>    // multithreading
+#include <stdexcept>    // exceptions
+#include <sstream>      // stringstream (used by Log.h)
+#include <string>       // strings
+
+#include "Coroutines.h"
+#include "Log.h"
+
+using namespace std;
+
+/// Coroutine type behind spawn(), which runs by itself and frees itself
+/// once it's done
+struct DetachedTask
+{
+	struct promise_type
+	{
+		DetachedTask
+		get_return_object ()
+		{
+			return DetachedTask();
+		}
+
+		suspend_never
+		initial_suspend () noexcept
+		{
+			return suspend_never();
+		}
+
+		suspend_never
+		final_suspend () noexcept
+		{
+			return suspend_never();
+		}
+
+		void
+		return_void ()
+		{ }
+
+		void
+		unhandled_exception ()
+		{
+			ERROR("Uncaught exception in coroutine");
+		}
+	};
+};
+
+//--- ScheduleAwaiter ---//
+
+ScheduleAwaiter::ScheduleAwaiter (shared_ptr<EventLoop> executor_):
+	executor (executor_)
+{ }
+
+bool
+ScheduleAwaiter::await_ready ()
+{
+	return false;
+}
+
+void
+ScheduleAwaiter::await_suspend (coroutine_handle<> awaiting)
+{
+	executor->post([awaiting] () { awaiting.resume(); });
+}
+
+void
+ScheduleAwaiter::await_resume ()
+{ }
+
+ScheduleAwaiter
+schedule (shared_ptr<EventLoop> executor)
+{
+	return ScheduleAwaiter(executor);
+}
+
+static DetachedTask
+runDetached (shared_ptr<EventLoop> executor, Task<void> task)
+{
+	co_await schedule(executor);
+
+	try
+	{
+		co_await task;
+	}
+	catch (runtime_error e)
+	{
+		ERROR("Uncaught exception in coroutine: " << e.what());
+	}
+}
+
+void
+spawn (shared_ptr<EventLoop> executor, Task<void> task)
+{
+	runDetached(executor, move(task));
+}
+
+//--- CoConnection ---//
+
+CoConnection::CoConnection (int fd, in_addr_t remoteAddress, in_port_t remotePort,
+                            shared_ptr<EventLoop> executor_):
+	Connection      (fd, remoteAddress, remotePort),
+	executor        (executor_),
+	receiverAwaiter (NULL),
+	closed          (false),
+	handleIncoming (
+		[this] (message_t type, message_len_t length, void* buffer)
+	{
+		// Replies go to whoever's awaiting them in roundTrip()
+		if (handlingReply()) {
+			return;
+		}
+
+		// The buffer is only good until we return
+		uint8_t* buffer_p = static_cast<uint8_t*>(buffer);
+		Message message;
+		message.type = type;
+		message.body.assign(buffer_p, buffer_p + length);
+
+		MutexLock lock(inboxMutex);
+		lock.relock();
+
+		if (!receiver)
+		{
+			inbox.push_back(move(message));
+			return;
+		}
+
+		receiverAwaiter->message = move(message);
+		coroutine_handle<> waiting = receiver;
+		receiver = nullptr;
+		receiverAwaiter = NULL;
+
+		lock.unlock();
+
+		resume(waiting);
+	})
+{
+	TRACE_ENTER;
+
+	int err;
+	if ((err = pthread_mutex_init(&inboxMutex, NULL))) {
+		THROW_ERROR("Error creating mutex: " << strerror(err));
+	}
+
+	addDefaultMessageHandler(handleIncoming);
+
+	TRACE_EXIT;
+}
+
+CoConnection::~CoConnection ()
+{
+	removeDefaultMessageHandler(handleIncoming);
+	pthread_mutex_destroy(&inboxMutex);
+}
+
+shared_ptr<EventLoop>
+CoConnection::getExecutor ()
+{
+	return executor;
+}
+
+void
+CoConnection::resume (coroutine_handle<> handle)
+{
+	// Never on the thread handling messages: the coroutine would hold up
+	// the rest of them, and anything it sent would look like a reply
+	executor->post([handle] () { handle.resume(); });
+}
+
+void
+CoConnection::connectionClosed ()
+{
+	MutexLock lock(inboxMutex);
+	lock.relock();
+
+	closed = true;
+	if (!receiver) {
+		return;
+	}
+
+	receiverAwaiter->failed = true;
+	coroutine_handle<> waiting = receiver;
+	receiver = nullptr;
+	receiverAwaiter = NULL;
+
+	lock.unlock();
+
+	resume(waiting);
+}
+
+CoConnection::ReceiveAwaiter
+CoConnection::recv ()
+{
+	return ReceiveAwaiter(*this);
+}
+
+CoConnection::RoundTripAwaiter
+CoConnection::roundTrip (message_t type, size_t length, const void* data)
+{
+	return RoundTripAwaiter(*this, type, length, data);
+}
+
+CoConnection::RoundTripAwaiter
+CoConnection::roundTrip (message_t type, const string& data)
+{
+	return RoundTripAwaiter(*this, type, data.length(), data.c_str());
+}
+
+//--- CoConnection::ReceiveAwaiter ---//
+
+CoConnection::ReceiveAwaiter::ReceiveAwaiter (CoConnection& connection_):
+	connection (connection_),
+	failed     (false)
+{ }
+
+bool
+CoConnection::ReceiveAwaiter::await_ready ()
+{
+	return false;
+}
+
+bool
+CoConnection::ReceiveAwaiter::await_suspend (coroutine_handle<> awaiting)
+{
+	MutexLock lock(connection.inboxMutex);
+	lock.relock();
+
+	// Carry straight on if there's no need to wait
+	if (!connection.inbox.empty())
+	{
+		message = move(connection.inbox.front());
+		connection.inbox.pop_front();
+		return false;
+	}
+	if (connection.closed)
+	{
+		failed = true;
+		return false;
+	}
+
+	if (connection.receiver) {
+		THROW_ERROR("Another coroutine is already waiting on this connection");
+	}
+
+	connection.receiver = awaiting;
+	connection.receiverAwaiter = this;
+	return true;
+}
+
+CoConnection::Message
+CoConnection::ReceiveAwaiter::await_resume ()
+{
+	if (failed) {
+		THROW_ERROR("Connection has closed.");
+	}
+	return move(message);
+}
+
+//--- CoConnection::RoundTripAwaiter ---//
+
+CoConnection::RoundTripAwaiter::RoundTripAwaiter (CoConnection& connection_, message_t type_,
+                                                  size_t length, const void* data):
+	connection (connection_),
+	type       (type_),
+	failed     (false)
+{
+	// The caller's buffer may be gone by the time this is awaited
+	const uint8_t* data_p = static_cast<const uint8_t*>(data);
+	if (length != 0) {
+		body.assign(data_p, data_p + length);
+	}
+}
+
+bool
+CoConnection::RoundTripAwaiter::await_ready ()
+{
+	return false;
+}
+
+void
+CoConnection::RoundTripAwaiter::await_suspend (coroutine_handle<> awaiting)
+{
+	// The reply may come back before this returns, so nothing here is
+	// touched after the request goes out
+	CoConnection* connection_p = &connection;
+	connection.request(type, body.size(), body.empty() ? NULL : &body[0],
+		[this, connection_p, awaiting] (message_t type, message_len_t length, void* buffer)
+	{
+		if (type == CONNECTION_CLOSED_MESSAGE)
+		{
+			failed = true;
+		}
+		else
+		{
+			uint8_t* buffer_p = static_cast<uint8_t*>(buffer);
+			reply.type = type;
+			reply.body.assign(buffer_p, buffer_p + length);
+		}
+		connection_p->resume(awaiting);
+	});
+}
+
+Connection::Reply
+CoConnection::RoundTripAwaiter::await_resume ()
+{
+	if (failed) {
+		THROW_ERROR("Connection closed before the request was complete.");
+	}
+	return move(reply);
+}
@@ -0,0 +1,435 @@
+
+#include <sys/epoll.h>   // epoll_create1(), epoll_ctl(), epoll_wait()
+#include <sys/eventfd.h> // eventfd()
+
+#include <errno.h>       // errno
+#include <cstring>       // strerror()
+#include <memory>        // shared_ptr
+#include <pthread.h>     // multithreading
+#include <stdexcept>     // exceptions
+#include <sstream>       // stringstream (used by Log.h)
+#include <unistd.h>      // close(), sysconf()
+
+#include "EventLoop.h"
+#include "IoUring.h"
+#include "Log.h"
+#include "Sockets.h"     // MutexLock
+#include "Thread.h"
+
+using namespace std;
+
+//--- WorkerPool ---//
+
+WorkerPool::WorkerPool (int numThreads):
+	stopFlag (false)
+{
+	TRACE_ENTER;
+
+	int err;
+	if ((err = pthread_mutex_init(&tasksMutex, NULL))) {
+		THROW_ERROR("Error creating mutex: " << strerror(err));
+	}
+	if ((err = pthread_cond_init(&tasksCond, NULL))) {
+		THROW_ERROR("Error creating condition variable: " << strerror(err));
+	}
+
+	for (int i = 0; i < numThreads; i++)
+	{
+		threads.push_back(pthread_create_using_method<WorkerPool, void*>(
+			*this, &WorkerPool::workerThread, NULL
+		));
+	}
+
+	TRACE_EXIT;
+}
+
+WorkerPool::~WorkerPool ()
+{
+	stop();
+	pthread_cond_destroy(&tasksCond);
+	pthread_mutex_destroy(&tasksMutex);
+}
+
+void
+WorkerPool::post (task_t task)
+{
+	MutexLock lock(tasksMutex);
+	lock.relock();
+
+	tasks.push_back(task);
+	pthread_cond_signal(&tasksCond);
+}
+
+void
+WorkerPool::stop ()
+{
+	TRACE_ENTER;
+
+	MutexLock lock(tasksMutex);
+	lock.relock();
+	stopFlag = true;
+	pthread_cond_broadcast(&tasksCond);
+	lock.unlock();
+
+	for (vector<pthread_t>::iterator itr = threads.begin();
+	     itr != threads.end();
+	     itr++)
+	{
+		if (pthread_equal(*itr, pthread_self())) {
+			// A task is stopping the pool it's running on. It can't wait for
+			// itself, so let it exit on its own.
+			pthread_detach(*itr);
+			continue;
+		}
+
+		int err = pthread_join(*itr, NULL);
+		if (err) {
+			ERROR("pthread_join() failed: " << strerror(err));
+		}
+	}
+	threads.clear();
+
+	// Drop whatever references the abandoned tasks were holding
+	lock.relock();
+	tasks.clear();
+
+	TRACE_EXIT;
+}
+
+void
+WorkerPool::workerThread (void* unused)
+{
+	TRACE_ENTER;
+
+	MutexLock lock(tasksMutex);
+
+	while (true)
+	{
+		lock.relock();
+		while (tasks.empty() && !stopFlag) {
+			pthread_cond_wait(&tasksCond, &tasksMutex);
+		}
+
+		if (stopFlag) {
+			break;
+		}
+
+		task_t task = tasks.front();
+		tasks.pop_front();
+		lock.unlock();
+
+		try
+		{
+			task();
+		}
+		catch (runtime_error e)
+		{
+			ERROR("Uncaught exception in worker thread: " << e.what());
+		}
+		catch (bad_function_call e)
+		{
+			ERROR("Uncaught exception in worker thread: " << e.what());
+		}
+	}
+
+	TRACE_EXIT;
+}
+
+//--- EventLoop ---//
+
+EventLoop::EventLoop (int numLoopThreads, int numWorkerThreads, bool useIoUring):
+	nextLoopIndex (0),
+	stopFlag      (true),
+	workers       (numWorkerThreads > 0 ? numWorkerThreads : getNumCores())
+{
+	TRACE_ENTER;
+
+	if (numLoopThreads <= 0) {
+		numLoopThreads = getNumCores();
+	}
+
+	int err;
+	if ((err = pthread_mutex_init(&registrationsMutex, NULL))) {
+		THROW_ERROR("Error creating mutex: " << strerror(err));
+	}
+
+	for (int i = 0; i < numLoopThreads; i++)
+	{
+		int epollFd = epoll_create1(EPOLL_CLOEXEC);
+		if (epollFd == -1) {
+			THROW_ERROR("epoll_create1() failed: " << strerror(errno));
+		}
+		epollFds.push_back(epollFd);
+
+		int wakeFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+		if (wakeFd == -1) {
+			THROW_ERROR("eventfd() failed: " << strerror(errno));
+		}
+		wakeFds.push_back(wakeFd);
+
+		// The wakeup descriptor is the only one registered with a NULL pointer
+		epoll_event ev;
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN;
+		ev.data.ptr = NULL;
+		if (epoll_ctl(epollFd, EPOLL_CTL_ADD, wakeFd, &ev)) {
+			THROW_ERROR("epoll_ctl() failed: " << strerror(errno));
+		}
+	}
+
+	if (useIoUring) {
+		ioUring = IoUring::open();
+	}
+
+	MESSAGE("Created event loop with " << numLoopThreads << " epoll threads"
+	     << (ioUring ? ", sending through io_uring" : ""));
+
+	TRACE_EXIT;
+}
+
+EventLoop::~EventLoop ()
+{
+	stop();
+
+	// Waits for the last sends to complete
+	if (ioUring) {
+		ioUring->stop();
+	}
+
+	for (size_t i = 0; i < epollFds.size(); i++)
+	{
+		close(epollFds[i]);
+		close(wakeFds[i]);
+	}
+
+	pthread_mutex_destroy(&registrationsMutex);
+}
+
+void
+EventLoop::start ()
+{
+	TRACE_ENTER;
+
+	if (!stopFlag) {
+		TRACE("Event loop is already running");
+		return;
+	}
+
+	stopFlag = false;
+	for (int i = 0; i < (int) epollFds.size(); i++)
+	{
+		threads.push_back(pthread_create_using_method<EventLoop, int>(
+			*this, &EventLoop::loopThread, i
+		));
+	}
+
+	TRACE_EXIT;
+}
+
+void
+EventLoop::stop ()
+{
+	TRACE_ENTER;
+
+	stopFlag = true;
+
+	// Kick every loop thread out of epoll_wait()
+	for (size_t i = 0; i < wakeFds.size(); i++)
+	{
+		uint64_t one = 1;
+		if (write(wakeFds[i], &one, sizeof(one)) != sizeof(one)) {
+			WARNING("Unable to wake loop thread " << i << ": " << strerror(errno));
+		}
+	}
+
+	for (vector<pthread_t>::iterator itr = threads.begin();
+	     itr != threads.end();
+	     itr++)
+	{
+		int err = pthread_join(*itr, NULL);
+		if (err) {
+			ERROR("pthread_join() failed: " << strerror(err));
+		}
+	}
+	threads.clear();
+
+	workers.stop();
+
+	// Release the handlers. Do it outside the lock in case one of their
+	// destructors tries to remove itself.
+	MutexLock lock(registrationsMutex);
+	lock.relock();
+	map<EventHandler*, Registration> leftovers;
+	leftovers.swap(registrations);
+	lock.unlock();
+
+	TRACE_EXIT;
+}
+
+void
+EventLoop::add (shared_ptr<EventHandler> handler, uint32_t events)
+{
+	TRACE_ENTER;
+
+	MutexLock lock(registrationsMutex);
+	lock.relock();
+
+	Registration reg;
+	reg.handler = handler;
+	reg.loopIndex = nextLoopIndex;
+	nextLoopIndex = (nextLoopIndex + 1) % epollFds.size();
+
+	epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = events;
+	ev.data.ptr = handler.get();
+
+	if (epoll_ctl(epollFds[reg.loopIndex], EPOLL_CTL_ADD, handler->getEventFd(), &ev)) {
+		THROW_ERROR("epoll_ctl() failed to add descriptor " << handler->getEventFd()
+		         << ": " << strerror(errno));
+	}
+
+	registrations[handler.get()] = reg;
+
+	TRACE("Descriptor " << handler->getEventFd() << " is watched by loop thread "
+	   << reg.loopIndex);
+
+	TRACE_EXIT;
+}
+
+void
+EventLoop::modify (EventHandler& handler, uint32_t events)
+{
+	MutexLock lock(registrationsMutex);
+	lock.relock();
+
+	map<EventHandler*, Registration>::iterator itr = registrations.find(&handler);
+	if (itr == registrations.end()) {
+		return;
+	}
+
+	epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = events;
+	ev.data.ptr = &handler;
+
+	if (epoll_ctl(epollFds[itr->second.loopIndex], EPOLL_CTL_MOD, handler.getEventFd(), &ev)) {
+		THROW_ERROR("epoll_ctl() failed to modify descriptor " << handler.getEventFd()
+		         << ": " << strerror(errno));
+	}
+}
+
+void
+EventLoop::remove (EventHandler& handler)
+{
+	TRACE_ENTER;
+
+	MutexLock lock(registrationsMutex);
+	lock.relock();
+
+	map<EventHandler*, Registration>::iterator itr = registrations.find(&handler);
+	if (itr == registrations.end()) {
+		TRACE_EXIT;
+		return;
+	}
+
+	// The descriptor may already be closed, in which case epoll has
+	// forgotten about it on its own.
+	epoll_ctl(epollFds[itr->second.loopIndex], EPOLL_CTL_DEL, handler.getEventFd(), NULL);
+
+	// Hold on to the handler until the lock is released, in case this was
+	// the last reference and its destructor wants to call back in here.
+	shared_ptr<EventHandler> keepalive = itr->second.handler;
+	registrations.erase(itr);
+	lock.unlock();
+
+	TRACE_EXIT;
+}
+
+void
+EventLoop::post (function<void()> task)
+{
+	workers.post(task);
+}
+
+shared_ptr<IoUring>
+EventLoop::getIoUring ()
+{
+	return ioUring;
+}
+
+shared_ptr<EventHandler>
+EventLoop::find (EventHandler* handler_p)
+{
+	MutexLock lock(registrationsMutex);
+	lock.relock();
+
+	map<EventHandler*, Registration>::iterator itr = registrations.find(handler_p);
+	if (itr == registrations.end()) {
+		return shared_ptr<EventHandler>();
+	}
+	return itr->second.handler;
+}
+
+void
+EventLoop::loopThread (int index)
+{
+	TRACE_ENTER;
+
+	epoll_event events[MAX_EVENTS];
+
+	while (!stopFlag)
+	{
+		int count = epoll_wait(epollFds[index], events, MAX_EVENTS, -1);
+		if (count < 0)
+		{
+			if (errno == EINTR) {
+				continue;
+			}
+			THROW_ERROR("epoll_wait() failed: " << strerror(errno));
+		}
+
+		for (int i = 0; i < count && !stopFlag; i++)
+		{
+			EventHandler* handler_p = static_cast<EventHandler*>(events[i].data.ptr);
+			if (handler_p == NULL) {
+				// Woken up by stop()
+				continue;
+			}
+
+			// The handler may have been removed by another thread since
+			// epoll_wait() returned. Grab a reference so it can't vanish
+			// while it's being called.
+			shared_ptr<EventHandler> handler = find(handler_p);
+			if (!handler) {
+				continue;
+			}
+
+			bool keep;
+			try
+			{
+				keep = handler->handleEvents(events[i].events);
+			}
+			catch (runtime_error e)
+			{
+				ERROR("Uncaught exception in event handler: " << e.what());
+				keep = false;
+			}
+
+			if (!keep)
+			{
+				remove(*handler);
+				handler->handleRemoved();
+			}
+		}
+	}
+
+	TRACE_EXIT;
+}
+
+int
+EventLoop::getNumCores ()
+{
+	long cores = sysconf(_SC_NPROCESSORS_ONLN);
+	return cores > 0 ? (int) cores : 1;
+}
@@ -0,0 +1,331 @@
+#include <linux/futex.h> // FUTEX_WAIT, FUTEX_WAKE
+#include <sys/mman.h>    // memfd_create(), mmap()
+#include <sys/stat.h>    // fstat()
+#include <sys/syscall.h> // SYS_futex
+
+#include <errno.h>       // errno
+#include <fcntl.h>       // fcntl(), open()
+#include <climits>       // INT_MAX
+#include <cstring>       // memcpy(), strerror()
+#include <memory>        // shared_ptr
+#include <new>           // placement new
+#include <pthread.h>     // multithreading
+#include <stdexcept>     // exceptions
+#include <sstream>       // stringstream (used by Log.h)
+#include <time.h>        // timespec
+#include <unistd.h>      // close(), syscall()
+
+#include "FrameRing.h"
+#include "Log.h"
+#include "Thread.h"
+
+using namespace std;
+
+/// How long the reader thread sleeps between checking for a stop
+static const int FRAME_RING_POLL_MS = 50;
+
+/// Rounds up to a whole number of pages, so that every frame starts on a
+/// page boundary
+static size_t
+roundToPage (size_t length)
+{
+	size_t page = sysconf(_SC_PAGESIZE);
+	return (length + page - 1) / page * page;
+}
+
+static FrameRingSlot*
+slotFor (const FrameRingHeader* header, uint64_t seq)
+{
+	uint8_t* base = (uint8_t*) header + roundToPage(sizeof(FrameRingHeader));
+	return (FrameRingSlot*) (base + (seq % header->slotCount) * header->slotStride);
+}
+
+//--- FrameRingWriter ---//
+
+FrameRingWriter::FrameRingWriter (uint32_t slotCount, size_t slotSize):
+	fd       (-1),
+	readerFd (-1),
+	header   (NULL)
+{
+	TRACE_ENTER;
+
+	if (slotCount == 0) {
+		THROW_ERROR("A frame ring needs at least one slot");
+	}
+
+	size_t slotStride = roundToPage(sizeof(FrameRingSlot) + slotSize);
+	mappingLength = roundToPage(sizeof(FrameRingHeader)) + slotCount * slotStride;
+
+	fd = memfd_create("frame-ring", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (fd == -1) {
+		THROW_ERROR("memfd_create() failed: " << strerror(errno));
+	}
+
+	// The pages aren't allocated until they're written, so a big ring
+	// only costs as much as the frames actually published
+	if (ftruncate(fd, mappingLength))
+	{
+		int err = errno;
+		::close(fd);
+		THROW_ERROR("Unable to size frame ring: " << strerror(err));
+	}
+
+	// Readers can count on the ring staying the size it is
+	if (fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL))
+	{
+		int err = errno;
+		::close(fd);
+		THROW_ERROR("Unable to seal frame ring: " << strerror(err));
+	}
+
+	void* mapping = mmap(NULL, mappingLength, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (mapping == MAP_FAILED)
+	{
+		int err = errno;
+		::close(fd);
+		THROW_ERROR("Unable to map frame ring: " << strerror(err));
+	}
+
+	header = new (mapping) FrameRingHeader();
+	header->magic      = FRAME_RING_MAGIC;
+	header->slotCount  = slotCount;
+	header->slotSize   = slotSize;
+	header->slotStride = slotStride;
+	header->published.store(0);
+	header->futex.store(0);
+	header->reserved   = 0;
+
+	// Readers get a descriptor which can't be used to write to the ring
+	stringstream path;
+	path << "/proc/self/fd/" << fd;
+	readerFd = open(path.str().c_str(), O_RDONLY | O_CLOEXEC);
+	if (readerFd == -1)
+	{
+		int err = errno;
+		munmap(header, mappingLength);
+		::close(fd);
+		THROW_ERROR("Unable to reopen frame ring read-only: " << strerror(err));
+	}
+
+	MESSAGE("Created frame ring of " << slotCount << " slots of " << slotSize << " bytes");
+
+	TRACE_EXIT;
+}
+
+FrameRingWriter::~FrameRingWriter ()
+{
+	munmap(header, mappingLength);
+	::close(readerFd);
+	::close(fd);
+}
+
+bool
+FrameRingWriter::publish (message_t type, size_t length, void* data,
+                          const void* prefix, size_t prefixLength)
+{
+	if (prefixLength + length > header->slotSize) {
+		return false;
+	}
+
+	uint64_t seq = header->published.load(memory_order_relaxed) + 1;
+	FrameRingSlot* slot = slotFor(header, seq);
+
+	// Mark the slot as changing before touching the frame in it
+	slot->generation.store(2 * seq - 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+
+	slot->type   = type;
+	slot->length = prefixLength + length;
+	if (prefixLength != 0) {
+		memcpy(slot + 1, prefix, prefixLength);
+	}
+	memcpy(reinterpret_cast<uint8_t*>(slot + 1) + prefixLength, data, length);
+
+	slot->generation.store(2 * seq, memory_order_release);
+	header->published.store(seq, memory_order_release);
+
+	// One wakeup for however many readers are waiting
+	header->futex.fetch_add(1, memory_order_release);
+	syscall(SYS_futex, &header->futex, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+
+	return true;
+}
+
+int
+FrameRingWriter::getReaderFd ()
+{
+	return readerFd;
+}
+
+size_t
+FrameRingWriter::getSlotSize ()
+{
+	return header->slotSize;
+}
+
+//--- FrameRingReader ---//
+
+FrameRingReader::FrameRingReader (Connection::message_handler_t handler_, int fd_):
+	fd                  (fd_),
+	header              (NULL),
+	handler             (handler_),
+	readerThreadStarted (false),
+	stopFlag            (false),
+	framesRead          (0),
+	framesOverrun       (0)
+{
+	TRACE_ENTER;
+
+	// The writer must not be able to shrink the ring out from under the
+	// mapping, or reading it could fault
+	struct stat status;
+	int seals = fcntl(fd, F_GET_SEALS);
+	if (seals == -1 || !(seals & F_SEAL_SHRINK) || fstat(fd, &status) ||
+	    (size_t) status.st_size < roundToPage(sizeof(FrameRingHeader)))
+	{
+		::close(fd);
+		THROW_ERROR("Not a frame ring");
+	}
+
+	mappingLength = status.st_size;
+	void* mapping = mmap(NULL, mappingLength, PROT_READ, MAP_SHARED, fd, 0);
+	if (mapping == MAP_FAILED)
+	{
+		int err = errno;
+		::close(fd);
+		THROW_ERROR("Unable to map frame ring: " << strerror(err));
+	}
+	header = (const FrameRingHeader*) mapping;
+
+	if (header->magic != FRAME_RING_MAGIC || header->slotCount == 0 ||
+	    header->slotStride < sizeof(FrameRingSlot) + header->slotSize ||
+	    roundToPage(sizeof(FrameRingHeader)) + header->slotCount * header->slotStride > mappingLength)
+	{
+		munmap(mapping, mappingLength);
+		::close(fd);
+		THROW_ERROR("Not a frame ring");
+	}
+
+	nextSeq = header->published.load(memory_order_acquire) + 1;
+
+	MESSAGE("Reading from frame ring of " << header->slotCount << " slots of "
+	     << header->slotSize << " bytes");
+
+	TRACE_EXIT;
+}
+
+FrameRingReader::~FrameRingReader ()
+{
+	stop();
+	munmap((void*) header, mappingLength);
+	::close(fd);
+}
+
+void
+FrameRingReader::start ()
+{
+	if (readerThreadStarted) {
+		return;
+	}
+
+	stopFlag = false;
+	readerThreadHandle = pthread_create_using_method<FrameRingReader, void*>(
+		*this, &FrameRingReader::readerThread, NULL
+	);
+	readerThreadStarted = true;
+}
+
+void
+FrameRingReader::stop ()
+{
+	if (!readerThreadStarted) {
+		return;
+	}
+
+	stopFlag = true;
+	int err = pthread_join(readerThreadHandle, NULL);
+	if (err) {
+		ERROR("pthread_join() failed: " << strerror(err));
+	}
+	readerThreadStarted = false;
+}
+
+uint64_t
+FrameRingReader::getFramesRead ()
+{
+	return framesRead;
+}
+
+uint64_t
+FrameRingReader::getFramesOverrun ()
+{
+	return framesOverrun;
+}
+
+void
+FrameRingReader::readerThread (void* unused)
+{
+	TRACE_ENTER;
+
+	while (!stopFlag)
+	{
+		// Read the futex before checking for frames, so a frame published
+		// in between makes the wait return straight away
+		uint32_t futexValue = header->futex.load(memory_order_acquire);
+		if (header->published.load(memory_order_acquire) >= nextSeq)
+		{
+			readFrame();
+			continue;
+		}
+
+		timespec timeout;
+		timeout.tv_sec  = 0;
+		timeout.tv_nsec = FRAME_RING_POLL_MS * 1000000;
+		syscall(SYS_futex, (void*) &header->futex, FUTEX_WAIT, futexValue, &timeout, NULL, 0);
+	}
+
+	TRACE_EXIT;
+}
+
+void
+FrameRingReader::readFrame ()
+{
+	uint64_t published = header->published.load(memory_order_acquire);
+
+	// Lapped: everything not yet read has been overwritten. Catch up.
+	if (published - nextSeq >= header->slotCount)
+	{
+		TRACE("Frame ring overran; skipping " << published - nextSeq << " frames");
+		framesOverrun += published - nextSeq;
+		nextSeq = published;
+	}
+
+	const FrameRingSlot* slot = slotFor(header, nextSeq);
+	uint64_t generation = slot->generation.load(memory_order_acquire);
+	if (generation != 2 * nextSeq || slot->length > header->slotSize)
+	{
+		// Overwritten since `published` was read
+		framesOverrun++;
+		nextSeq++;
+		return;
+	}
+
+	message_t type = slot->type;
+	message_len_t length = slot->length;
+	handler(type, length, (void*) (slot + 1));
+
+	// If the writer got to the slot while the handler had it, the frame
+	// the handler saw may have been partly replaced
+	atomic_thread_fence(memory_order_acquire);
+	if (slot->generation.load(memory_order_relaxed) != generation)
+	{
+		TRACE("Frame " << nextSeq << " was overwritten while it was being read");
+		framesOverrun++;
+	}
+	else
+	{
+		framesRead++;
+	}
+
+	nextSeq++;
+}
@@ -0,0 +1,939 @@
+#include <arpa/inet.h>  // htons(), htonl()
+#include <netinet/in.h> // struct sockaddr_in
+#include <netinet/tcp.h> // TCP_NODELAY
+#include <sys/socket.h> // socket()
+#include <sys/uio.h>    // iovec
+
+#include <cctype>       // tolower(), isxdigit()
+#include <cstdlib>      // strtol(), strtoul()
+#include <cstring>      // strerror()
+#include <endian.h>     // htobe64()
+#include <errno.h>      // errno
+#include <memory>       // shared_ptr
+#include <pthread.h>    // multithreading
+#include <sstream>      // stringstream
+#include <stdexcept>    // exceptions
+#include <string>       // strings
+#include <unistd.h>     // close()
+
+#include "Http.h"
+#include "Log.h"
+#include "Sockets.h"    // MutexLock, ip2string()
+
+using namespace std;
+
+/// Cuts the spaces and tabs off both ends of a string
+static string
+trim (const string& s)
+{
+	size_t start = s.find_first_not_of(" \t");
+	if (start == string::npos) {
+		return "";
+	}
+	size_t end = s.find_last_not_of(" \t");
+	return s.substr(start, end - start + 1);
+}
+
+/// Undoes the %XX escapes (and '+' for space) in a query string value
+static string
+percentDecode (const string& s)
+{
+	string decoded;
+	for (size_t i = 0; i < s.length(); i++)
+	{
+		if (s[i] == '%' && i + 2 < s.length() && isxdigit(s[i + 1]) && isxdigit(s[i + 2]))
+		{
+			decoded += (char) strtol(s.substr(i + 1, 2).c_str(), NULL, 16);
+			i += 2;
+		}
+		else
+		{
+			decoded += s[i] == '+' ? ' ' : s[i];
+		}
+	}
+	return decoded;
+}
+
+/// Rotates a 32-bit word left
+static uint32_t
+rotl (uint32_t x, int n)
+{
+	return (x << n) | (x >> (32 - n));
+}
+
+/// The SHA-1 digest of some bytes (FIPS 180-4). The WebSocket handshake
+/// needs it; nothing else does, so it isn't worth a library.
+static string
+sha1 (const string& message)
+{
+	uint32_t h[5] = { 0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0 };
+
+	// Pad to a whole number of 64-byte blocks, ending with the length in bits
+	string padded = message;
+	padded += (char) 0x80;
+	while (padded.length() % 64 != 56) {
+		padded += (char) 0;
+	}
+	uint64_t bits = htobe64((uint64_t) message.length() * 8);
+	padded.append(reinterpret_cast<const char*>(&bits), sizeof(bits));
+
+	for (size_t block = 0; block < padded.length(); block += 64)
+	{
+		uint32_t w[80];
+		for (int i = 0; i < 16; i++)
+		{
+			uint32_t word;
+			memcpy(&word, &padded[block + i * 4], sizeof(word));
+			w[i] = ntohl(word);
+		}
+		for (int i = 16; i < 80; i++) {
+			w[i] = rotl(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+		}
+
+		uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+		for (int i = 0; i < 80; i++)
+		{
+			uint32_t f, k;
+			if (i < 20) {
+				f = (b & c) | (~b & d);
+				k = 0x5A827999;
+			} else if (i < 40) {
+				f = b ^ c ^ d;
+				k = 0x6ED9EBA1;
+			} else if (i < 60) {
+				f = (b & c) | (b & d) | (c & d);
+				k = 0x8F1BBCDC;
+			} else {
+				f = b ^ c ^ d;
+				k = 0xCA62C1D6;
+			}
+
+			uint32_t temp = rotl(a, 5) + f + e + k + w[i];
+			e = d;
+			d = c;
+			c = rotl(b, 30);
+			b = a;
+			a = temp;
+		}
+
+		h[0] += a;
+		h[1] += b;
+		h[2] += c;
+		h[3] += d;
+		h[4] += e;
+	}
+
+	string digest;
+	for (int i = 0; i < 5; i++)
+	{
+		uint32_t word = htonl(h[i]);
+		digest.append(reinterpret_cast<const char*>(&word), sizeof(word));
+	}
+	return digest;
+}
+
+/// Base64-encodes some bytes (RFC 4648), with padding
+static string
+base64 (const string& data)
+{
+	static const char* const alphabet =
+		"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+	string encoded;
+	for (size_t i = 0; i < data.length(); i += 3)
+	{
+		uint32_t group = (uint8_t) data[i] << 16;
+		if (i + 1 < data.length()) {
+			group |= (uint8_t) data[i + 1] << 8;
+		}
+		if (i + 2 < data.length()) {
+			group |= (uint8_t) data[i + 2];
+		}
+
+		encoded += alphabet[(group >> 18) & 0x3F];
+		encoded += alphabet[(group >> 12) & 0x3F];
+		encoded += i + 1 < data.length() ? alphabet[(group >> 6) & 0x3F] : '=';
+		encoded += i + 2 < data.length() ? alphabet[group & 0x3F] : '=';
+	}
+	return encoded;
+}
+
+/// Whether a comma-separated header value lists a token, ignoring case
+/// (e.g. "keep-alive, Upgrade" lists "upgrade")
+static bool
+headerHasToken (const string& value, const string& token)
+{
+	size_t start = 0;
+	while (start <= value.length())
+	{
+		size_t end = value.find(',', start);
+		if (end == string::npos) {
+			end = value.length();
+		}
+
+		string item = trim(value.substr(start, end - start));
+		if (item.length() == token.length())
+		{
+			bool same = true;
+			for (size_t i = 0; i < item.length() && same; i++) {
+				same = tolower(item[i]) == tolower(token[i]);
+			}
+			if (same) {
+				return true;
+			}
+		}
+
+		start = end + 1;
+	}
+	return false;
+}
+
+/// Looks up a parameter in "a=1&b=2" form, percent-decoding its value
+static bool
+findParameter (const string& parameters, const string& name, string& value)
+{
+	size_t start = 0;
+	while (start <= parameters.length())
+	{
+		size_t end = parameters.find('&', start);
+		if (end == string::npos) {
+			end = parameters.length();
+		}
+
+		string pair = parameters.substr(start, end - start);
+		size_t equals = pair.find('=');
+		if (pair.substr(0, equals) == name)
+		{
+			value = equals == string::npos ? "" : percentDecode(pair.substr(equals + 1));
+			return true;
+		}
+
+		start = end + 1;
+	}
+	return false;
+}
+
+//--- HttpRequest ---//
+
+string
+HttpRequest::getParameter (const string& name, const string& fallback) const
+{
+	string value;
+	if (findParameter(query, name, value)) {
+		return value;
+	}
+
+	map<string, string>::const_iterator type = headers.find("content-type");
+	if (type != headers.end()
+	 && type->second.compare(0, 33, "application/x-www-form-urlencoded") == 0
+	 && findParameter(body, name, value)) {
+		return value;
+	}
+	return fallback;
+}
+
+//--- HttpConnection ---//
+
+HttpConnection::HttpConnection (int fd_, in_addr_t remoteAddress_, in_port_t remotePort_,
+                                shared_ptr<HttpListener> listener_):
+	fd              (fd_),
+	remoteAddress   (remoteAddress_),
+	remotePort      (remotePort_),
+	listener        (listener_),
+	requestReceived (false),
+	outgoingOffset  (0),
+	queuedBytes     (0),
+	writeArmed      (false),
+	finishing       (false),
+	closed          (false)
+{
+	int err;
+	if ((err = pthread_mutex_init(&outgoingMutex, NULL))) {
+		THROW_ERROR("Error creating mutex: " << strerror(err));
+	}
+
+	// Responses tend to be written in pieces, which shouldn't wait on
+	// each other
+	int on = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+}
+
+HttpConnection::~HttpConnection ()
+{
+	// Nothing to close if the socket was handed over
+	if (fd != -1) {
+		::close(fd);
+	}
+	pthread_mutex_destroy(&outgoingMutex);
+}
+
+void
+HttpConnection::attach (shared_ptr<EventLoop> loop)
+{
+	eventLoop = loop;
+	loop->add(shared_from_this(), EPOLLIN | EPOLLRDHUP);
+}
+
+int
+HttpConnection::getEventFd ()
+{
+	return fd;
+}
+
+bool
+HttpConnection::handleEvents (uint32_t events)
+{
+	if (events & (EPOLLERR | EPOLLHUP)) {
+		return false;
+	}
+
+	if (events & (EPOLLIN | EPOLLRDHUP))
+	{
+		char buffer[4096];
+		ssize_t bytesRead = recv(fd, buffer, sizeof(buffer), MSG_DONTWAIT);
+		if (bytesRead == 0) {
+			return false;
+		}
+		if (bytesRead < 0)
+		{
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+				return false;
+			}
+		}
+		// Anything the client sends after its request is ignored
+		else if (!requestReceived)
+		{
+			incoming.append(buffer, bytesRead);
+
+			// Wait for the headers, then for however much body they promise
+			HttpRequest request;
+			size_t missing = 0;
+			bool headersDone = incoming.find("\r\n\r\n") != string::npos;
+			if (headersDone && !parseRequest(request, missing))
+			{
+				requestReceived = true;
+				respond(400, "text/plain", "Malformed request\n");
+				incoming.clear();
+			}
+			else if (incoming.length() + missing > MAX_REQUEST_BYTES)
+			{
+				requestReceived = true;
+				respond(431, "text/plain", "Request is too long\n");
+				incoming.clear();
+			}
+			else if (headersDone && missing == 0)
+			{
+				requestReceived = true;
+				listener->route(shared_from_this(), request);
+				incoming.clear();
+			}
+		}
+	}
+
+	MutexLock lock(outgoingMutex);
+	lock.relock();
+
+	if ((events & EPOLLOUT) && !flush()) {
+		return false;
+	}
+	if (outgoing.empty())
+	{
+		if (finishing) {
+			return false;
+		}
+		setWriteArmed(false);
+	}
+	return true;
+}
+
+void
+HttpConnection::handleRemoved ()
+{
+	MutexLock lock(outgoingMutex);
+	lock.relock();
+
+	// The descriptor stays open until we're destroyed, so a writer on
+	// another thread can't send to whatever gets it next
+	closed = true;
+	if (fd != -1) {
+		shutdown(fd, SHUT_RDWR);
+	}
+	outgoing.clear();
+	outgoingOffset = 0;
+	queuedBytes = 0;
+
+	close_handler_t handler = closeHandler;
+	closeHandler = close_handler_t();
+	lock.unlock();
+
+	if (handler) {
+		handler();
+	}
+}
+
+bool
+HttpConnection::flush ()
+{
+	while (!outgoing.empty())
+	{
+		// Everything queued goes to the kernel in one call
+		iovec iov[MAX_IOVECS];
+		int iovcnt = 0;
+		for (deque<Chunk>::iterator itr = outgoing.begin();
+		     itr != outgoing.end() && iovcnt < MAX_IOVECS;
+		     itr++)
+		{
+			size_t offset = iovcnt == 0 ? outgoingOffset : 0;
+			iov[iovcnt].iov_base = const_cast<char*>(itr->data) + offset;
+			iov[iovcnt].iov_len  = itr->length - offset;
+			iovcnt++;
+		}
+
+		msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov    = iov;
+		msg.msg_iovlen = iovcnt;
+
+		ssize_t written = sendmsg(fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (written < 0)
+		{
+			if (errno == EINTR) {
+				continue;
+			}
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				break;
+			}
+			return false;
+		}
+
+		queuedBytes -= written;
+		while (written > 0)
+		{
+			size_t left = outgoing.front().length - outgoingOffset;
+			if ((size_t) written < left)
+			{
+				outgoingOffset += written;
+				break;
+			}
+			written -= left;
+			outgoing.pop_front();
+			outgoingOffset = 0;
+		}
+	}
+	return true;
+}
+
+void
+HttpConnection::setWriteArmed (bool armed)
+{
+	if (armed == writeArmed) {
+		return;
+	}
+
+	shared_ptr<EventLoop> loop = eventLoop.lock();
+	if (loop)
+	{
+		loop->modify(*this, EPOLLIN | EPOLLRDHUP | (armed ? EPOLLOUT : 0));
+		writeArmed = armed;
+	}
+}
+
+bool
+HttpConnection::parseRequest (HttpRequest& request, size_t& missing)
+{
+	size_t lineEnd = incoming.find("\r\n");
+	string requestLine = incoming.substr(0, lineEnd);
+
+	// e.g. "GET /metrics HTTP/1.1"
+	size_t firstSpace = requestLine.find(' ');
+	size_t lastSpace = requestLine.rfind(' ');
+	if (firstSpace == string::npos || lastSpace == firstSpace) {
+		return false;
+	}
+	if (requestLine.compare(lastSpace + 1, 7, "HTTP/1.") != 0) {
+		return false;
+	}
+
+	request.method = requestLine.substr(0, firstSpace);
+	string target = requestLine.substr(firstSpace + 1, lastSpace - firstSpace - 1);
+	size_t question = target.find('?');
+	request.path = target.substr(0, question);
+	if (question != string::npos) {
+		request.query = target.substr(question + 1);
+	}
+
+	size_t lineStart = lineEnd + 2;
+	while (true)
+	{
+		lineEnd = incoming.find("\r\n", lineStart);
+		if (lineEnd == string::npos || lineEnd == lineStart) {
+			break;
+		}
+
+		string line = incoming.substr(lineStart, lineEnd - lineStart);
+		size_t colon = line.find(':');
+		if (colon == string::npos) {
+			return false;
+		}
+
+		string name = line.substr(0, colon);
+		for (size_t i = 0; i < name.length(); i++) {
+			name[i] = tolower(name[i]);
+		}
+		request.headers[name] = trim(line.substr(colon + 1));
+
+		lineStart = lineEnd + 2;
+	}
+
+	// Bodies are only ever small forms, so chunked ones aren't worth taking
+	if (request.headers.count("transfer-encoding")) {
+		return false;
+	}
+
+	size_t bodyLength = 0;
+	map<string, string>::iterator contentLength = request.headers.find("content-length");
+	if (contentLength != request.headers.end())
+	{
+		const string& value = contentLength->second;
+		if (value.empty() || value.length() > 9
+		 || value.find_first_not_of("0123456789") != string::npos) {
+			return false;
+		}
+		bodyLength = strtoul(value.c_str(), NULL, 10);
+	}
+
+	size_t bodyStart = lineEnd + 2;
+	request.body = incoming.substr(bodyStart, bodyLength);
+	missing = bodyLength - request.body.length();
+
+	return true;
+}
+
+in_addr_t
+HttpConnection::getRemoteAddress ()
+{
+	return remoteAddress;
+}
+
+in_port_t
+HttpConnection::getRemotePort ()
+{
+	return remotePort;
+}
+
+void
+HttpConnection::respond (int status, const string& contentType, const string& body)
+{
+	stringstream response;
+	response << "HTTP/1.1 " << status << " " << statusText(status) << "\r\n"
+	         << "Content-Type: " << contentType << "\r\n"
+	         << "Content-Length: " << body.length() << "\r\n"
+	         << "Connection: close\r\n"
+	         << "\r\n"
+	         << body;
+	write(response.str());
+	finish();
+}
+
+void
+HttpConnection::respondStreaming (int status, const string& headers)
+{
+	stringstream response;
+	response << "HTTP/1.1 " << status << " " << statusText(status) << "\r\n"
+	         << headers
+	         << "Connection: close\r\n"
+	         << "\r\n";
+	write(response.str());
+}
+
+void
+HttpConnection::write (const void* data, size_t length)
+{
+	shared_ptr<string> copy(new string(static_cast<const char*>(data), length));
+	writeShared(copy->data(), copy->length(), copy);
+}
+
+void
+HttpConnection::write (const string& data)
+{
+	write(data.data(), data.length());
+}
+
+void
+HttpConnection::writeShared (const void* data, size_t length, shared_ptr<const void> pin)
+{
+	if (length == 0) {
+		return;
+	}
+
+	Chunk chunk;
+	chunk.pin    = pin;
+	chunk.data   = static_cast<const char*>(data);
+	chunk.length = length;
+	enqueue(chunk);
+}
+
+void
+HttpConnection::enqueue (const Chunk& chunk)
+{
+	MutexLock lock(outgoingMutex);
+	lock.relock();
+
+	if (closed || finishing) {
+		return;
+	}
+
+	outgoing.push_back(chunk);
+	queuedBytes += chunk.length;
+	if (writeArmed) {
+		// The loop will get to it
+		return;
+	}
+
+	if (!flush())
+	{
+		// Hanging up makes the loop notice, and tidy up
+		shutdown(fd, SHUT_RDWR);
+		return;
+	}
+	if (!outgoing.empty()) {
+		setWriteArmed(true);
+	}
+}
+
+void
+HttpConnection::close ()
+{
+	shared_ptr<EventLoop> loop = eventLoop.lock();
+	if (loop) {
+		loop->remove(*this);
+	}
+	handleRemoved();
+}
+
+int
+HttpConnection::acceptWebSocket (const HttpRequest& request)
+{
+	TRACE_ENTER;
+
+	map<string, string>::const_iterator upgrade    = request.headers.find("upgrade");
+	map<string, string>::const_iterator connection = request.headers.find("connection");
+	map<string, string>::const_iterator key        = request.headers.find("sec-websocket-key");
+	map<string, string>::const_iterator version    = request.headers.find("sec-websocket-version");
+
+	if (upgrade == request.headers.end() || !headerHasToken(upgrade->second, "websocket") ||
+	    connection == request.headers.end() || !headerHasToken(connection->second, "upgrade") ||
+	    key == request.headers.end() || key->second.empty())
+	{
+		respond(400, "text/plain", "Expected a WebSocket handshake\n");
+		TRACE_EXIT;
+		return -1;
+	}
+	if (version == request.headers.end() || version->second != "13")
+	{
+		// Tells the client which version we speak
+		stringstream response;
+		response << "HTTP/1.1 426 " << statusText(426) << "\r\n"
+		         << "Sec-WebSocket-Version: 13\r\n"
+		         << "Content-Length: 0\r\n"
+		         << "Connection: close\r\n"
+		         << "\r\n";
+		write(response.str());
+		finish();
+		TRACE_EXIT;
+		return -1;
+	}
+
+	// Proves to the client that we understood the handshake (section 4.2.2)
+	string accept = base64(sha1(key->second + "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"));
+
+	stringstream response;
+	response << "HTTP/1.1 101 " << statusText(101) << "\r\n"
+	         << "Upgrade: websocket\r\n"
+	         << "Connection: Upgrade\r\n"
+	         << "Sec-WebSocket-Accept: " << accept << "\r\n"
+	         << "\r\n";
+	string text = response.str();
+
+	shared_ptr<EventLoop> loop = eventLoop.lock();
+	if (loop) {
+		loop->remove(*this);
+	}
+
+	MutexLock lock(outgoingMutex);
+	lock.relock();
+
+	if (closed || !outgoing.empty()) {
+		THROW_ERROR("Can't switch protocols once a response has started");
+	}
+
+	// The socket's fresh, so there's always room for this much
+	ssize_t written;
+	do {
+		written = send(fd, text.data(), text.length(), MSG_DONTWAIT | MSG_NOSIGNAL);
+	} while (written < 0 && errno == EINTR);
+	if (written != (ssize_t) text.length())
+	{
+		closed = true;
+		shutdown(fd, SHUT_RDWR);
+		THROW_ERROR("Unable to send WebSocket handshake: "
+		         << (written < 0 ? strerror(errno) : "short write"));
+	}
+
+	// It isn't ours any more
+	int socket = fd;
+	fd = -1;
+	closed = true;
+	closeHandler = close_handler_t();
+
+	TRACE_EXIT;
+	return socket;
+}
+
+void
+HttpConnection::finish ()
+{
+	MutexLock lock(outgoingMutex);
+	lock.relock();
+
+	finishing = true;
+
+	// The socket's bound to be writable, so the loop gets called back
+	// straight away if there's nothing left to write
+	setWriteArmed(true);
+}
+
+size_t
+HttpConnection::getQueuedBytes ()
+{
+	MutexLock lock(outgoingMutex);
+	lock.relock();
+	return queuedBytes;
+}
+
+bool
+HttpConnection::isClosed ()
+{
+	MutexLock lock(outgoingMutex);
+	lock.relock();
+	return closed;
+}
+
+void
+HttpConnection::setCloseHandler (close_handler_t closeHandler_)
+{
+	MutexLock lock(outgoingMutex);
+	lock.relock();
+
+	if (!closed)
+	{
+		closeHandler = closeHandler_;
+		return;
+	}
+	lock.unlock();
+
+	if (closeHandler_) {
+		closeHandler_();
+	}
+}
+
+string
+HttpConnection::statusText (int status)
+{
+	switch (status)
+	{
+	  case 101: return "Switching Protocols";
+	  case 200: return "OK";
+	  case 400: return "Bad Request";
+	  case 403: return "Forbidden";
+	  case 404: return "Not Found";
+	  case 405: return "Method Not Allowed";
+	  case 426: return "Upgrade Required";
+	  case 431: return "Request Header Fields Too Large";
+	  case 500: return "Internal Server Error";
+	  case 503: return "Service Unavailable";
+	  default:  return "Unknown";
+	}
+}
+
+//--- HttpListener ---//
+
+HttpListener::HttpListener (in_port_t port)
+{
+	int err;
+	if ((err = pthread_mutex_init(&connectionsMutex, NULL))) {
+		THROW_ERROR("Error creating mutex: " << strerror(err));
+	}
+
+	fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_TCP);
+	if (fd == -1) {
+		THROW_ERROR("Failed to open socket: " << strerror(errno));
+	}
+
+	// Don't wait out TIME_WAIT after a restart
+	int on = 1;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+	sockaddr_in bindAddress;
+	memset(&bindAddress, 0, sizeof(bindAddress));
+	bindAddress.sin_family      = AF_INET;
+	bindAddress.sin_port        = htons(port);
+	bindAddress.sin_addr.s_addr = htonl(INADDR_ANY);
+
+	if (::bind(fd, (sockaddr *) &bindAddress, sizeof(bindAddress)))
+	{
+		close(fd);
+		THROW_ERROR("bind() failed for HTTP port " << port << ": " << strerror(errno));
+	}
+	if (listen(fd, SOMAXCONN))
+	{
+		close(fd);
+		THROW_ERROR("listen() failed: " << strerror(errno));
+	}
+
+	MESSAGE("Listening for HTTP on port " << port);
+}
+
+HttpListener::~HttpListener ()
+{
+	close(fd);
+	pthread_mutex_destroy(&connectionsMutex);
+}
+
+void
+HttpListener::addRoute (const string& path, request_handler_t handler, bool takesChanges)
+{
+	Route route;
+	route.handler      = handler;
+	route.takesChanges = takesChanges;
+	routes[path] = route;
+}
+
+void
+HttpListener::attach (shared_ptr<EventLoop> loop)
+{
+	eventLoop = loop;
+	loop->add(shared_from_this(), EPOLLIN);
+}
+
+void
+HttpListener::detach ()
+{
+	shared_ptr<EventLoop> loop = eventLoop.lock();
+	if (loop) {
+		loop->remove(*this);
+	}
+
+	// Connections hold on to us, so the socket may not close for a while.
+	// Shutting it down stops the kernel queueing more in the meantime.
+	shutdown(fd, SHUT_RDWR);
+
+	MutexLock lock(connectionsMutex);
+	lock.relock();
+	list< weak_ptr<HttpConnection> > open;
+	open.swap(connections);
+	lock.unlock();
+
+	for (list< weak_ptr<HttpConnection> >::iterator itr = open.begin();
+	     itr != open.end();
+	     itr++)
+	{
+		shared_ptr<HttpConnection> connection = itr->lock();
+		if (connection) {
+			connection->close();
+		}
+	}
+}
+
+void
+HttpListener::route (shared_ptr<HttpConnection> connection, const HttpRequest& request)
+{
+	TRACE("HTTP " << request.method << " " << request.path
+	   << " from " << ip2string(connection->getRemoteAddress()));
+
+	map<string, Route>::iterator itr = routes.find(request.path);
+	if (itr == routes.end())
+	{
+		connection->respond(404, "text/plain", "Not found\n");
+		return;
+	}
+
+	bool isChange = request.method == "POST" || request.method == "PUT";
+	if (isChange && !itr->second.takesChanges)
+	{
+		connection->respond(405, "text/plain", "Only GET is supported here\n");
+		return;
+	}
+	if (!isChange && request.method != "GET")
+	{
+		connection->respond(405, "text/plain", "Only GET, POST and PUT are supported\n");
+		return;
+	}
+
+	try
+	{
+		itr->second.handler(connection, request);
+	}
+	catch (runtime_error e)
+	{
+		ERROR("Error handling " << request.path << ": " << e.what());
+		connection->respond(500, "text/plain", string(e.what()) + "\n");
+	}
+}
+
+int
+HttpListener::getEventFd ()
+{
+	return fd;
+}
+
+bool
+HttpListener::handleEvents (uint32_t events)
+{
+	shared_ptr<EventLoop> loop = eventLoop.lock();
+	if (!loop) {
+		return false;
+	}
+
+	while (true)
+	{
+		sockaddr_in clientAddress;
+		socklen_t clientAddressSize = sizeof(clientAddress);
+		int connFd = accept4(fd, (sockaddr *) &clientAddress, &clientAddressSize,
+		                     SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (connFd < 0)
+		{
+			if (errno == EINTR || errno == ECONNABORTED) {
+				continue;
+			}
+			if (errno != EAGAIN && errno != EWOULDBLOCK) {
+				WARNING("HTTP accept() failed: " << strerror(errno));
+			}
+			break;
+		}
+
+		shared_ptr<HttpConnection> connection(
+			new HttpConnection(connFd, clientAddress.sin_addr.s_addr, clientAddress.sin_port,
+			                   shared_from_this())
+		);
+
+		// Forget the ones which have gone while we're at it
+		MutexLock lock(connectionsMutex);
+		lock.relock();
+		for (list< weak_ptr<HttpConnection> >::iterator itr = connections.begin();
+		     itr != connections.end();)
+		{
+			if (itr->expired()) {
+				itr = connections.erase(itr);
+			} else {
+				itr++;
+			}
+		}
+		connections.push_back(connection);
+		lock.unlock();
+
+		connection->attach(loop);
+	}
+
+	return true;
+}
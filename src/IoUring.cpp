@@ -0,0 +1,494 @@
+#include <sys/mman.h>    // mmap()
+#include <sys/syscall.h> // __NR_io_uring_*
+
+#include <errno.h>       // errno
+#include <cstring>       // memset(), strerror()
+#include <memory>        // shared_ptr
+#include <pthread.h>     // multithreading
+#include <stdexcept>     // exceptions
+#include <sstream>       // stringstream (used by Log.h)
+#include <time.h>        // clock_gettime()
+#include <unistd.h>      // close(), syscall()
+#include <vector>        // vectors
+
+#ifdef USE_IO_URING
+#include <linux/io_uring.h> // io_uring_params, io_uring_sqe, etc.
+#endif
+
+#include "IoUring.h"
+#include "Log.h"
+#include "Sockets.h"     // MutexLock
+#include "Thread.h"
+
+using namespace std;
+
+/// How deeply the current thread is nested in Batches
+static thread_local int batchDepth = 0;
+
+/// Rings this thread has deferred submissions to while in a Batch
+static thread_local vector< shared_ptr<IoUring> > deferredRings;
+
+/// The ring whose completions this thread collects, if any
+static thread_local IoUring* completingRing = NULL;
+
+//--- IoUring::Batch ---//
+
+IoUring::Batch::Batch ()
+{
+	batchDepth++;
+}
+
+IoUring::Batch::~Batch ()
+{
+	if (--batchDepth > 0) {
+		return;
+	}
+
+	vector< shared_ptr<IoUring> > rings;
+	rings.swap(deferredRings);
+	for (size_t i = 0; i < rings.size(); i++)
+	{
+		try
+		{
+			rings[i]->submit();
+		}
+		catch (runtime_error e)
+		{
+			ERROR(e.what());
+		}
+	}
+}
+
+#ifdef USE_IO_URING
+
+//--- IoUring ---//
+
+IoUring::IoUring (unsigned entries):
+	fd                      (-1),
+	sqRing                  (MAP_FAILED),
+	cqRing                  (MAP_FAILED),
+	sqes                    (MAP_FAILED),
+	unsubmitted             (0),
+	waitingForRoom          (0),
+	completionsCollected    (0),
+	inFlight                (0),
+	completionThreadStarted (false),
+	stopFlag                (false),
+	submitCalls             (0),
+	submitted               (0)
+{
+	TRACE_ENTER;
+
+	io_uring_params params;
+	memset(&params, 0, sizeof(params));
+
+	fd = syscall(__NR_io_uring_setup, entries, &params);
+	if (fd == -1) {
+		THROW_ERROR("io_uring_setup() failed: " << strerror(errno));
+	}
+
+	// Without this, completions are thrown away when the completion queue
+	// overflows, and whoever was waiting for them waits forever
+	if (!(params.features & IORING_FEAT_NODROP))
+	{
+		::close(fd);
+		THROW_ERROR("Kernel's io_uring is too old (no IORING_FEAT_NODROP)");
+	}
+
+	sqRingLength = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	cqRingLength = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+	sqesLength   = params.sq_entries * sizeof(io_uring_sqe);
+
+	// Both rings may come in one mapping
+	bool singleMapping = params.features & IORING_FEAT_SINGLE_MMAP;
+	if (singleMapping)
+	{
+		sqRingLength = max(sqRingLength, cqRingLength);
+		cqRingLength = sqRingLength;
+	}
+
+	sqRing = mmap(NULL, sqRingLength, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+	              fd, IORING_OFF_SQ_RING);
+	cqRing = singleMapping ? sqRing :
+	         mmap(NULL, cqRingLength, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+	              fd, IORING_OFF_CQ_RING);
+	sqes   = mmap(NULL, sqesLength, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+	              fd, IORING_OFF_SQES);
+	if (sqRing == MAP_FAILED || cqRing == MAP_FAILED || sqes == MAP_FAILED)
+	{
+		int err = errno;
+		if (sqRing != MAP_FAILED) {
+			munmap(sqRing, sqRingLength);
+		}
+		if (cqRing != MAP_FAILED && !singleMapping) {
+			munmap(cqRing, cqRingLength);
+		}
+		if (sqes != MAP_FAILED) {
+			munmap(sqes, sqesLength);
+		}
+		::close(fd);
+		THROW_ERROR("Unable to map io_uring: " << strerror(err));
+	}
+
+	uint8_t* sq = (uint8_t*) sqRing;
+	sqHead    = (unsigned*) (sq + params.sq_off.head);
+	sqTail    = (unsigned*) (sq + params.sq_off.tail);
+	sqArray   = (unsigned*) (sq + params.sq_off.array);
+	sqMask    = *(unsigned*) (sq + params.sq_off.ring_mask);
+	sqEntries = *(unsigned*) (sq + params.sq_off.ring_entries);
+
+	uint8_t* cq = (uint8_t*) cqRing;
+	cqHead = (unsigned*) (cq + params.cq_off.head);
+	cqTail = (unsigned*) (cq + params.cq_off.tail);
+	cqMask = *(unsigned*) (cq + params.cq_off.ring_mask);
+	cqes   = cq + params.cq_off.cqes;
+
+	int err;
+	if ((err = pthread_mutex_init(&submitMutex, NULL))) {
+		THROW_ERROR("Error creating mutex: " << strerror(err));
+	}
+
+	// Waits for room are timed, on the monotonic clock
+	pthread_condattr_t condAttr;
+	pthread_condattr_init(&condAttr);
+	pthread_condattr_setclock(&condAttr, CLOCK_MONOTONIC);
+	err = pthread_cond_init(&roomCond, &condAttr);
+	pthread_condattr_destroy(&condAttr);
+	if (err) {
+		THROW_ERROR("Error creating condition variable: " << strerror(err));
+	}
+
+	MESSAGE("Created io_uring with " << sqEntries << " submission entries");
+
+	TRACE_EXIT;
+}
+
+IoUring::~IoUring ()
+{
+	stop();
+
+	munmap(sqes, sqesLength);
+	if (cqRing != sqRing) {
+		munmap(cqRing, cqRingLength);
+	}
+	munmap(sqRing, sqRingLength);
+	::close(fd);
+
+	pthread_cond_destroy(&roomCond);
+	pthread_mutex_destroy(&submitMutex);
+}
+
+shared_ptr<IoUring>
+IoUring::open (unsigned entries)
+{
+	shared_ptr<IoUring> ring;
+	try
+	{
+		ring = shared_ptr<IoUring>(new IoUring(entries));
+	}
+	catch (runtime_error e)
+	{
+		MESSAGE("io_uring is unavailable (" << e.what() << "); using epoll and sendmsg()");
+		return ring;
+	}
+
+	ring->completionKeepalive = ring;
+	ring->completionThreadHandle = pthread_create_using_method<IoUring, void*>(
+		*ring, &IoUring::completionThread, NULL
+	);
+	ring->completionThreadStarted = true;
+
+	return ring;
+}
+
+bool
+IoUring::sendmsg (int sockFd, const msghdr* msg, int flags, completion_t onComplete)
+{
+	// Waiting for room from here would be waiting for itself
+	if (completingRing == this) {
+		THROW_ERROR("io_uring sends can't be submitted from a completion");
+	}
+
+	MutexLock lock(submitMutex);
+	lock.relock();
+
+	if (stopFlag) {
+		return false;
+	}
+
+	io_uring_sqe* sqe = (io_uring_sqe*) nextSqe();
+	sqe->opcode    = IORING_OP_SENDMSG;
+	sqe->fd        = sockFd;
+	sqe->addr      = (uintptr_t) msg;
+	sqe->len       = 1;
+	sqe->msg_flags = flags;
+	sqe->user_data = (uintptr_t) new completion_t(onComplete);
+
+	inFlight++;
+	submitOrDefer();
+
+	return true;
+}
+
+void
+IoUring::submit ()
+{
+	MutexLock lock(submitMutex);
+	lock.relock();
+	submitLocked();
+}
+
+void
+IoUring::stop ()
+{
+	TRACE_ENTER;
+
+	MutexLock lock(submitMutex);
+	lock.relock();
+
+	if (stopFlag) {
+		TRACE_EXIT;
+		return;
+	}
+	stopFlag = true;
+
+	// A no-op without a completion wakes the completion thread up, in case
+	// nothing else is going to. From a completion, it's awake already.
+	if (completingRing != this)
+	{
+		io_uring_sqe* sqe = (io_uring_sqe*) nextSqe();
+		sqe->opcode    = IORING_OP_NOP;
+		sqe->user_data = 0;
+		submitLocked();
+	}
+
+	lock.unlock();
+
+	if (completionThreadStarted)
+	{
+		if (pthread_equal(completionThreadHandle, pthread_self()))
+		{
+			// Stopped from a completion. The thread exits on its own once it
+			// returns.
+			pthread_detach(completionThreadHandle);
+		}
+		else
+		{
+			int err = pthread_join(completionThreadHandle, NULL);
+			if (err) {
+				ERROR("pthread_join() failed: " << strerror(err));
+			}
+		}
+		completionThreadStarted = false;
+	}
+
+	TRACE_EXIT;
+}
+
+double
+IoUring::getAverageBatchSize ()
+{
+	uint64_t calls = submitCalls;
+	return calls ? (double) submitted / calls : 0;
+}
+
+void*
+IoUring::nextSqe ()
+{
+	unsigned tail = *sqTail;
+	if (tail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE) >= sqEntries)
+	{
+		// The kernel consumes everything it's given before
+		// io_uring_enter() returns, so this frees the whole queue
+		submitLocked();
+		if (tail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE) >= sqEntries) {
+			THROW_ERROR("io_uring submission queue is full");
+		}
+	}
+
+	unsigned index = tail & sqMask;
+	io_uring_sqe* sqe = (io_uring_sqe*) sqes + index;
+	memset(sqe, 0, sizeof(*sqe));
+	sqArray[index] = index;
+
+	// The entry doesn't belong to the kernel until it's submitted, so the
+	// caller can finish filling it in after the tail moves
+	__atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+	unsubmitted++;
+
+	return sqe;
+}
+
+void
+IoUring::submitOrDefer ()
+{
+	if (batchDepth == 0)
+	{
+		submitLocked();
+		return;
+	}
+
+	shared_ptr<IoUring> self = shared_from_this();
+	for (size_t i = 0; i < deferredRings.size(); i++)
+	{
+		if (deferredRings[i] == self) {
+			return;
+		}
+	}
+	deferredRings.push_back(self);
+}
+
+void
+IoUring::submitLocked ()
+{
+	while (unsubmitted > 0)
+	{
+		uint64_t collected = completionsCollected;
+		int count = syscall(__NR_io_uring_enter, fd, unsubmitted, 0, 0, NULL, 0);
+		if (count < 0)
+		{
+			if (errno == EINTR) {
+				continue;
+			} else if (errno == EAGAIN || errno == EBUSY) {
+				// Out of room for completions. Only the completion thread
+				// makes more, and it needs the mutex to say so, so the
+				// mutex is let go of while waiting.
+				waitForRoom(collected);
+				continue;
+			}
+			THROW_ERROR("io_uring_enter() failed: " << strerror(errno));
+		}
+
+		unsubmitted -= count;
+		submitCalls++;
+		submitted += count;
+	}
+}
+
+void
+IoUring::waitForRoom (uint64_t collected)
+{
+	timespec deadline;
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	deadline.tv_nsec += ROOM_WAIT_MS * 1000000;
+	if (deadline.tv_nsec >= 1000000000)
+	{
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000;
+	}
+
+	// The kernel can also say EAGAIN when it's short of memory, which no
+	// completion is going to fix, so this only waits so long
+	waitingForRoom++;
+	while (completionsCollected == collected)
+	{
+		int err = pthread_cond_timedwait(&roomCond, &submitMutex, &deadline);
+		if (err == ETIMEDOUT) {
+			break;
+		} else if (err) {
+			ERROR("pthread_cond_timedwait() failed: " << strerror(err));
+			break;
+		}
+	}
+	waitingForRoom--;
+}
+
+void
+IoUring::completionThread (void* unused)
+{
+	TRACE_ENTER;
+
+	completingRing = this;
+
+	vector< pair<completion_t*, int> > completions;
+	while (!stopFlag || inFlight > 0)
+	{
+		int result = syscall(__NR_io_uring_enter, fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+		if (result < 0 && errno != EINTR) {
+			ERROR("io_uring_enter() failed: " << strerror(errno));
+			break;
+		}
+
+		completions.clear();
+		unsigned head = *cqHead;
+		unsigned tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+		for (; head != tail; head++)
+		{
+			io_uring_cqe* cqe = (io_uring_cqe*) cqes + (head & cqMask);
+			completions.push_back(make_pair((completion_t*) (uintptr_t) cqe->user_data, cqe->res));
+		}
+
+		// Give the entries back before the callbacks, and let anyone
+		// waiting for room know there is some
+		__atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+		completionsCollected += completions.size();
+		if (waitingForRoom > 0)
+		{
+			MutexLock lock(submitMutex);
+			lock.relock();
+			pthread_cond_broadcast(&roomCond);
+		}
+
+		for (size_t i = 0; i < completions.size(); i++)
+		{
+			// The no-op from stop()
+			completion_t* onComplete = completions[i].first;
+			if (onComplete == NULL) {
+				continue;
+			}
+
+			try
+			{
+				(*onComplete)(completions[i].second);
+			}
+			catch (runtime_error e)
+			{
+				ERROR("Uncaught exception in io_uring completion: " << e.what());
+			}
+			delete onComplete;
+			inFlight--;
+		}
+	}
+
+	completingRing = NULL;
+
+	TRACE_EXIT;
+
+	// This may be the last reference, so it has to go last
+	shared_ptr<IoUring> keepalive;
+	keepalive.swap(completionKeepalive);
+}
+
+#else // USE_IO_URING
+
+IoUring::~IoUring ()
+{ }
+
+shared_ptr<IoUring>
+IoUring::open (unsigned entries)
+{
+	TRACE("Built without io_uring; using epoll and sendmsg()");
+	return shared_ptr<IoUring>();
+}
+
+bool
+IoUring::sendmsg (int sockFd, const msghdr* msg, int flags, completion_t onComplete)
+{
+	return false;
+}
+
+void
+IoUring::submit ()
+{ }
+
+void
+IoUring::stop ()
+{ }
+
+double
+IoUring::getAverageBatchSize ()
+{
+	return 0;
+}
+
+#endif // USE_IO_URING
@@ -0,0 +1,256 @@
+#include <errno.h>       // ETIMEDOUT
+#include <cstring>       // memcpy(), strerror()
+#include <memory>        // shared_ptr
+#include <pthread.h>     // multithreading
+#include <stdexcept>     // exceptions
+#include <sstream>       // stringstream (used by Log.h)
+
+#include "JitterBuffer.h"
+#include "Log.h"
+#include "Sockets.h"     // MutexLock
+#include "Thread.h"
+
+using namespace std;
+
+//--- JitterBuffer ---//
+
+JitterBuffer::JitterBuffer (present_t present_, int targetLatencyMs, bool latestWins_):
+	present                (present_),
+	targetLatency          ((int64_t) targetLatencyMs * 1000),
+	latestWins             (latestWins_),
+	clockOffset            (0),
+	haveClockOffset        (false),
+	lastPresented          (0),
+	presentedAny           (false),
+	pool                   (new BufferPool(MAX_PENDING_FRAMES + 1)),
+	presenterThreadStarted (false),
+	stopFlag               (false),
+	framesPresented        (0),
+	framesLate             (0),
+	framesDropped          (0)
+{
+	int err;
+	if ((err = pthread_mutex_init(&mutex, NULL))) {
+		THROW_ERROR("Error creating mutex: " << strerror(err));
+	}
+
+	// Waits are until a frame is due, which is on the monotonic clock
+	pthread_condattr_t condAttr;
+	pthread_condattr_init(&condAttr);
+	pthread_condattr_setclock(&condAttr, CLOCK_MONOTONIC);
+	err = pthread_cond_init(&frameArrivedCond, &condAttr);
+	pthread_condattr_destroy(&condAttr);
+	if (err) {
+		THROW_ERROR("Error creating condition variable: " << strerror(err));
+	}
+}
+
+JitterBuffer::~JitterBuffer ()
+{
+	stop();
+	pthread_cond_destroy(&frameArrivedCond);
+	pthread_mutex_destroy(&mutex);
+}
+
+void
+JitterBuffer::start ()
+{
+	if (presenterThreadStarted) {
+		return;
+	}
+
+	stopFlag = false;
+	presenterThreadHandle = pthread_create_using_method<JitterBuffer, void*>(
+		*this, &JitterBuffer::presenterThread, NULL
+	);
+	presenterThreadStarted = true;
+}
+
+void
+JitterBuffer::stop ()
+{
+	if (!presenterThreadStarted) {
+		return;
+	}
+
+	MutexLock lock(mutex);
+	lock.relock();
+	stopFlag = true;
+	pthread_cond_broadcast(&frameArrivedCond);
+	lock.unlock();
+
+	int err = pthread_join(presenterThreadHandle, NULL);
+	if (err) {
+		ERROR("pthread_join() failed: " << strerror(err));
+	}
+	presenterThreadStarted = false;
+
+	lock.relock();
+	pending.clear();
+}
+
+BufferPool::buffer_ptr
+JitterBuffer::acquireSlot (size_t length)
+{
+	return pool->acquire(length);
+}
+
+void
+JitterBuffer::push (uint64_t timestamp, const void* data, size_t length)
+{
+	BufferPool::buffer_ptr buffer = pool->acquire(length);
+	memcpy(&(*buffer)[0], data, length);
+	push(timestamp, &(*buffer)[0], length, buffer);
+}
+
+void
+JitterBuffer::push (uint64_t timestamp, void* data, size_t length, shared_ptr<void> pin)
+{
+	int64_t now = monotonicUs();
+
+	MutexLock lock(mutex);
+	lock.relock();
+
+	// The frame which got here fastest says the most about the clocks
+	int64_t offset = now - (int64_t) timestamp;
+	if (!haveClockOffset || offset < clockOffset + CLOCK_OFFSET_DRIFT_US) {
+		clockOffset = offset;
+	} else {
+		clockOffset += CLOCK_OFFSET_DRIFT_US;
+	}
+	haveClockOffset = true;
+
+	// Too late to go out in order
+	if (presentedAny && timestamp <= lastPresented)
+	{
+		TRACE("Dropping frame which arrived after a newer one was presented");
+		framesLate++;
+		framesDropped++;
+		return;
+	}
+
+	if (now > dueTime(timestamp)) {
+		framesLate++;
+	}
+
+	PendingFrame &frame = pending[timestamp];
+	frame.data   = data;
+	frame.length = length;
+	frame.pin    = pin;
+
+	if (pending.size() > MAX_PENDING_FRAMES)
+	{
+		pending.erase(pending.begin());
+		framesDropped++;
+	}
+
+	pthread_cond_signal(&frameArrivedCond);
+}
+
+void
+JitterBuffer::setTargetLatency (int targetLatencyMs)
+{
+	MutexLock lock(mutex);
+	lock.relock();
+	targetLatency = (int64_t) targetLatencyMs * 1000;
+
+	// Frames may be due sooner now
+	pthread_cond_signal(&frameArrivedCond);
+}
+
+void
+JitterBuffer::setLatestWins (bool latestWins_)
+{
+	MutexLock lock(mutex);
+	lock.relock();
+	latestWins = latestWins_;
+}
+
+uint64_t
+JitterBuffer::getFramesPresented ()
+{
+	return framesPresented;
+}
+
+uint64_t
+JitterBuffer::getFramesLate ()
+{
+	return framesLate;
+}
+
+uint64_t
+JitterBuffer::getFramesDropped ()
+{
+	return framesDropped;
+}
+
+int64_t
+JitterBuffer::dueTime (uint64_t timestamp)
+{
+	return (int64_t) timestamp + clockOffset + targetLatency;
+}
+
+void
+JitterBuffer::presenterThread (void* unused)
+{
+	TRACE_ENTER;
+
+	MutexLock lock(mutex);
+	lock.relock();
+
+	while (!stopFlag)
+	{
+		if (pending.empty())
+		{
+			pthread_cond_wait(&frameArrivedCond, &mutex);
+			continue;
+		}
+
+		int64_t now = monotonicUs();
+		int64_t due = dueTime(pending.begin()->first);
+		if (now < due)
+		{
+			// Wait for it to come due, or for an earlier frame to arrive
+			timespec deadline;
+			deadline.tv_sec  = due / 1000000;
+			deadline.tv_nsec = due % 1000000 * 1000;
+			int err = pthread_cond_timedwait(&frameArrivedCond, &mutex, &deadline);
+			if (err && err != ETIMEDOUT) {
+				ERROR("pthread_cond_timedwait() failed: " << strerror(err));
+			}
+			continue;
+		}
+
+		// Skip whatever's been overtaken by a frame which is also due
+		if (latestWins)
+		{
+			map<uint64_t, PendingFrame>::iterator next = pending.begin();
+			while (++next != pending.end() && dueTime(next->first) <= now)
+			{
+				pending.erase(pending.begin());
+				framesDropped++;
+			}
+		}
+
+		uint64_t timestamp = pending.begin()->first;
+		PendingFrame frame = pending.begin()->second;
+		pending.erase(pending.begin());
+		lastPresented = timestamp;
+		presentedAny = true;
+
+		// Whoever's presenting may take a while, and frames keep arriving
+		lock.unlock();
+		try
+		{
+			present(frame.data, frame.length);
+		}
+		catch (runtime_error e)
+		{
+			ERROR("Unable to present frame: " << e.what());
+		}
+		framesPresented++;
+		lock.relock();
+	}
+
+	TRACE_EXIT;
+}
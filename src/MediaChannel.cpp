@@ -0,0 +1,679 @@
+
+#include <arpa/inet.h>   // htonl(), htons(), etc.
+#include <netinet/in.h>  // sockaddr_in
+#include <sys/socket.h>  // socket(), sendmmsg(), recvmmsg()
+
+#include <errno.h>       // errno
+#include <cstring>       // memcpy(), memset(), strerror()
+#include <memory>        // shared_ptr
+#include <poll.h>        // poll()
+#include <pthread.h>     // multithreading
+#include <stdexcept>     // exceptions
+#include <sstream>       // stringstream (used by Log.h)
+#include <unistd.h>      // close()
+
+#include "Log.h"
+#include "MediaChannel.h"
+#include "Thread.h"
+
+using namespace std;
+
+/// Socket buffer size to ask for, so a whole frame's burst of datagrams fits
+static const int MEDIA_SOCKET_BUFFER = 4 * 1024 * 1024;
+
+/// How long the receiver thread sleeps between checking for a stop
+static const int MEDIA_POLL_MS = 50;
+
+/// Most datagrams handed to sendmmsg() at once
+static const size_t MEDIA_SEND_BATCH = 1024;
+
+/// Whether sequence number a comes after b, allowing for wraparound
+static bool
+seqAfter (uint32_t a, uint32_t b)
+{
+	return (int32_t) (a - b) > 0;
+}
+
+//--- MediaSender ---//
+
+MediaSender::MediaSender (in_addr_t address, in_port_t port, int fecGroupSize_,
+                          in_addr_t multicastInterface):
+	nextFrameSeq     (0),
+	fecGroupSize     (fecGroupSize_),
+	datagramsDropped (0)
+{
+	TRACE_ENTER;
+
+	if (fecGroupSize < 0 || fecGroupSize > 255) {
+		THROW_ERROR("FEC group size must be between 0 and 255, not " << fecGroupSize);
+	}
+
+	int err;
+	if ((err = pthread_mutex_init(&sendMutex, NULL))) {
+		THROW_ERROR("Error creating mutex: " << strerror(err));
+	}
+
+	fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd == -1) {
+		THROW_ERROR("Unable to create UDP socket: " << strerror(errno));
+	}
+
+	int size = MEDIA_SOCKET_BUFFER;
+	if (setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size))) {
+		WARNING("Unable to set SO_SNDBUF: " << strerror(errno));
+	}
+
+	if (IN_MULTICAST(ntohl(address)))
+	{
+		// Keep it on the local network, and let viewers on this machine
+		// (including over loopback) see it too
+		unsigned char ttl = 1;
+		if (setsockopt(fd, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl))) {
+			WARNING("Unable to set IP_MULTICAST_TTL: " << strerror(errno));
+		}
+
+		unsigned char loop = 1;
+		if (setsockopt(fd, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop))) {
+			WARNING("Unable to set IP_MULTICAST_LOOP: " << strerror(errno));
+		}
+
+		if (multicastInterface != htonl(INADDR_ANY))
+		{
+			in_addr iface;
+			iface.s_addr = multicastInterface;
+			if (setsockopt(fd, IPPROTO_IP, IP_MULTICAST_IF, &iface, sizeof(iface))) {
+				WARNING("Unable to send multicast from " << ip2string(multicastInterface)
+				     << ": " << strerror(errno));
+			}
+		}
+	}
+
+	// Connecting a UDP socket just fixes where datagrams go
+	sockaddr_in peer;
+	memset(&peer, 0, sizeof(peer));
+	peer.sin_family      = AF_INET;
+	peer.sin_addr.s_addr = address;
+	peer.sin_port        = port;
+	if (connect(fd, (sockaddr*) &peer, sizeof(peer))) {
+		int connectErrno = errno;
+		::close(fd);
+		THROW_ERROR("Unable to connect UDP socket to " << ip2string(address)
+		         << ", port " << ntohs(port) << ": " << strerror(connectErrno));
+	}
+
+	MESSAGE("Sending media to " << ip2string(address) << ", port " << ntohs(port)
+	     << (fecGroupSize ? " with parity" : ""));
+
+	TRACE_EXIT;
+}
+
+MediaSender::~MediaSender ()
+{
+	::close(fd);
+	pthread_mutex_destroy(&sendMutex);
+}
+
+void
+MediaSender::sendFrame (message_t type, size_t length, void* data,
+                        const void* prefix, size_t prefixLength)
+{
+	TRACE_ENTER;
+
+	if (prefixLength > MEDIA_MAX_PAYLOAD) {
+		THROW_ERROR("Prefix of " << prefixLength << " bytes doesn't fit in a datagram");
+	}
+
+	// The prefix is sent as the start of the frame
+	length += prefixLength;
+
+	size_t fragCount = (length + MEDIA_MAX_PAYLOAD - 1) / MEDIA_MAX_PAYLOAD;
+	if (fragCount == 0) {
+		fragCount = 1;
+	} else if (length > MEDIA_MAX_FRAME_LENGTH) {
+		THROW_ERROR("Frame of " << length << " bytes is too big to send over UDP");
+	}
+
+	size_t groupCount = fecGroupSize ? (fragCount + fecGroupSize - 1) / fecGroupSize : 0;
+	size_t datagramCount = fragCount + groupCount;
+
+	MutexLock lock(sendMutex);
+	lock.relock();
+
+	uint32_t seq = nextFrameSeq++;
+	const uint8_t* prefix_p = static_cast<const uint8_t*>(prefix);
+	uint8_t* data_p = static_cast<uint8_t*>(data);
+
+	// Three iovecs per datagram: header, and the payload's share of the
+	// prefix and of the frame (either of which may be empty). Everything is
+	// sized up front, since the iovecs point into these vectors.
+	headers.resize(datagramCount);
+	iovs.resize(datagramCount * 3);
+	messages.resize(datagramCount);
+	if (parity.size() < groupCount) {
+		parity.resize(groupCount);
+	}
+
+	size_t d = 0;
+	for (size_t frag = 0; frag < fragCount; frag++)
+	{
+		size_t offset = frag * MEDIA_MAX_PAYLOAD;
+		size_t payload = min(MEDIA_MAX_PAYLOAD, length - offset);
+
+		// Only the first fragment can take in any of the prefix
+		size_t fromPrefix = offset < prefixLength ? min(payload, prefixLength - offset) : 0;
+		size_t bodyOffset = offset + fromPrefix - prefixLength;
+		size_t fromBody   = payload - fromPrefix;
+
+		MediaDatagramHeader &header = headers[d];
+		header.frameSeq     = htonl(seq);
+		header.frameLength  = htonl(length);
+		header.type         = htonl(type);
+		header.fragIndex    = htons(frag);
+		header.fragCount    = htons(fragCount);
+		header.flags        = 0;
+		header.fecGroupSize = fecGroupSize;
+		header.reserved     = 0;
+
+		iovs[d * 3].iov_base     = &header;
+		iovs[d * 3].iov_len      = sizeof(header);
+		iovs[d * 3 + 1].iov_base = const_cast<uint8_t*>(prefix_p) + (fromPrefix ? offset : 0);
+		iovs[d * 3 + 1].iov_len  = fromPrefix;
+		iovs[d * 3 + 2].iov_base = data_p + (fromBody ? bodyOffset : 0);
+		iovs[d * 3 + 2].iov_len  = fromBody;
+		d++;
+
+		if (!fecGroupSize) {
+			continue;
+		}
+
+		// Fold the fragment into its group's parity. Short fragments are
+		// treated as zero-padded.
+		size_t group = frag / fecGroupSize;
+		vector<uint8_t> &groupParity = parity[group];
+		if (frag % fecGroupSize == 0) {
+			groupParity.assign(MEDIA_MAX_PAYLOAD, 0);
+		}
+		for (size_t i = 0; i < fromPrefix; i++) {
+			groupParity[i] ^= prefix_p[offset + i];
+		}
+		for (size_t i = 0; i < fromBody; i++) {
+			groupParity[fromPrefix + i] ^= data_p[bodyOffset + i];
+		}
+
+		// Send the parity right after the last fragment it covers
+		if (frag % fecGroupSize == (size_t) fecGroupSize - 1 || frag == fragCount - 1)
+		{
+			MediaDatagramHeader &parityHeader = headers[d];
+			parityHeader = header;
+			parityHeader.fragIndex = htons(group * fecGroupSize);
+			parityHeader.flags     = MEDIA_FLAG_PARITY;
+
+			iovs[d * 3].iov_base     = &parityHeader;
+			iovs[d * 3].iov_len      = sizeof(parityHeader);
+			iovs[d * 3 + 1].iov_base = &groupParity[0];
+			iovs[d * 3 + 1].iov_len  = MEDIA_MAX_PAYLOAD;
+			iovs[d * 3 + 2].iov_base = NULL;
+			iovs[d * 3 + 2].iov_len  = 0;
+			d++;
+		}
+	}
+
+	for (size_t i = 0; i < datagramCount; i++)
+	{
+		memset(&messages[i], 0, sizeof(messages[i]));
+		messages[i].msg_hdr.msg_iov    = &iovs[i * 3];
+		messages[i].msg_hdr.msg_iovlen = 3;
+	}
+
+	size_t sent = 0;
+	while (sent < datagramCount)
+	{
+		int count = sendmmsg(fd, &messages[sent], min(datagramCount - sent, MEDIA_SEND_BATCH), 0);
+		if (count < 0)
+		{
+			if (errno == EINTR) {
+				continue;
+			} else if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS) {
+				// No room. The receiver will give up on this frame.
+				TRACE("Dropping " << datagramCount - sent << " datagrams of frame " << seq);
+				datagramsDropped += datagramCount - sent;
+				break;
+			} else if (errno == ECONNREFUSED) {
+				// An earlier datagram bounced. The peer may just not be
+				// listening yet, so keep going.
+				continue;
+			}
+			THROW_ERROR("Failed to send datagram: " << strerror(errno));
+		}
+		sent += count;
+	}
+
+	TRACE_EXIT;
+}
+
+uint64_t
+MediaSender::getDatagramsDropped ()
+{
+	return datagramsDropped;
+}
+
+//--- MediaReceiver ---//
+
+MediaReceiver::MediaReceiver (Connection::message_handler_t handler_, in_addr_t source,
+                              int deadlineMs_):
+	sourceAddress         (source),
+	handler               (handler_),
+	deadlineMs            (deadlineMs_),
+	lastDeliveredSeq      (0),
+	deliveredAny          (false),
+	pool                  (BufferPool::getSharedPool()),
+	receiverThreadStarted (false),
+	stopFlag              (false),
+	framesDelivered       (0),
+	framesDropped         (0),
+	fragmentsRecovered    (0)
+{
+	TRACE_ENTER;
+
+	openSocket(htonl(INADDR_ANY), 0);
+
+	MESSAGE("Receiving media on port " << port);
+
+	TRACE_EXIT;
+}
+
+MediaReceiver::MediaReceiver (Connection::message_handler_t handler_, in_addr_t group,
+                              in_port_t port_, in_addr_t interfaceAddress, in_addr_t source,
+                              int deadlineMs_):
+	sourceAddress         (source),
+	handler               (handler_),
+	deadlineMs            (deadlineMs_),
+	lastDeliveredSeq      (0),
+	deliveredAny          (false),
+	pool                  (BufferPool::getSharedPool()),
+	receiverThreadStarted (false),
+	stopFlag              (false),
+	framesDelivered       (0),
+	framesDropped         (0),
+	fragmentsRecovered    (0)
+{
+	TRACE_ENTER;
+
+	if (!IN_MULTICAST(ntohl(group))) {
+		THROW_ERROR(ip2string(group) << " is not a multicast address");
+	}
+
+	// Binding to the group address filters out everything but the group.
+	// Other viewers on this machine may be in the same group.
+	openSocket(group, port_);
+
+	ip_mreq membership;
+	membership.imr_multiaddr.s_addr = group;
+	membership.imr_interface.s_addr = interfaceAddress;
+	if (setsockopt(fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &membership, sizeof(membership))) {
+		int joinErrno = errno;
+		::close(fd);
+		THROW_ERROR("Unable to join multicast group " << ip2string(group) << ": "
+		         << strerror(joinErrno));
+	}
+
+	MESSAGE("Receiving media from multicast group " << ip2string(group)
+	     << ", port " << port);
+
+	TRACE_EXIT;
+}
+
+void
+MediaReceiver::openSocket (in_addr_t address, in_port_t port_)
+{
+	fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if (fd == -1) {
+		THROW_ERROR("Unable to create UDP socket: " << strerror(errno));
+	}
+
+	int size = MEDIA_SOCKET_BUFFER;
+	if (setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size))) {
+		WARNING("Unable to set SO_RCVBUF: " << strerror(errno));
+	}
+
+	int one = 1;
+	if (port_ != 0 && setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one))) {
+		WARNING("Unable to set SO_REUSEADDR: " << strerror(errno));
+	}
+
+	sockaddr_in bindAddress;
+	memset(&bindAddress, 0, sizeof(bindAddress));
+	bindAddress.sin_family      = AF_INET;
+	bindAddress.sin_addr.s_addr = address;
+	bindAddress.sin_port        = port_;
+	if (bind(fd, (sockaddr*) &bindAddress, sizeof(bindAddress))) {
+		int bindErrno = errno;
+		::close(fd);
+		THROW_ERROR("Unable to bind UDP socket: " << strerror(bindErrno));
+	}
+
+	socklen_t addressLength = sizeof(bindAddress);
+	getsockname(fd, (sockaddr*) &bindAddress, &addressLength);
+	port = ntohs(bindAddress.sin_port);
+}
+
+MediaReceiver::~MediaReceiver ()
+{
+	stop();
+	::close(fd);
+}
+
+in_port_t
+MediaReceiver::getPort ()
+{
+	return port;
+}
+
+void
+MediaReceiver::start ()
+{
+	if (receiverThreadStarted) {
+		return;
+	}
+
+	stopFlag = false;
+	receiverThreadHandle = pthread_create_using_method<MediaReceiver, void*>(
+		*this, &MediaReceiver::receiverThread, NULL
+	);
+	receiverThreadStarted = true;
+}
+
+void
+MediaReceiver::stop ()
+{
+	if (!receiverThreadStarted) {
+		return;
+	}
+
+	stopFlag = true;
+	int err = pthread_join(receiverThreadHandle, NULL);
+	if (err) {
+		ERROR("pthread_join() failed: " << strerror(err));
+	}
+	receiverThreadStarted = false;
+}
+
+uint64_t
+MediaReceiver::getFramesDelivered ()
+{
+	return framesDelivered;
+}
+
+uint64_t
+MediaReceiver::getFramesDropped ()
+{
+	return framesDropped;
+}
+
+uint64_t
+MediaReceiver::getFragmentsRecovered ()
+{
+	return fragmentsRecovered;
+}
+
+void
+MediaReceiver::receiverThread (void* unused)
+{
+	TRACE_ENTER;
+
+	// One datagram-sized buffer per slot in the batch
+	vector<uint8_t> buffers(BATCH_SIZE * MEDIA_MAX_DATAGRAM);
+	iovec iovs[BATCH_SIZE];
+	sockaddr_in senders[BATCH_SIZE];
+	mmsghdr messages[BATCH_SIZE];
+
+	while (!stopFlag)
+	{
+		pollfd pfd;
+		pfd.fd = fd;
+		pfd.events = POLLIN;
+		int ready = poll(&pfd, 1, partials.empty() ? MEDIA_POLL_MS : min(MEDIA_POLL_MS, deadlineMs));
+		if (ready < 0 && errno != EINTR) {
+			ERROR("poll() failed: " << strerror(errno));
+			break;
+		}
+
+		if (ready > 0)
+		{
+			for (int i = 0; i < BATCH_SIZE; i++)
+			{
+				iovs[i].iov_base = &buffers[i * MEDIA_MAX_DATAGRAM];
+				iovs[i].iov_len  = MEDIA_MAX_DATAGRAM;
+				memset(&messages[i], 0, sizeof(messages[i]));
+				messages[i].msg_hdr.msg_iov    = &iovs[i];
+				messages[i].msg_hdr.msg_iovlen = 1;
+				messages[i].msg_hdr.msg_name    = &senders[i];
+				messages[i].msg_hdr.msg_namelen = sizeof(senders[i]);
+			}
+
+			int count = recvmmsg(fd, messages, BATCH_SIZE, MSG_DONTWAIT, NULL);
+			if (count < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+				ERROR("recvmmsg() failed: " << strerror(errno));
+				break;
+			}
+
+			for (int i = 0; i < count; i++)
+			{
+				if (messages[i].msg_hdr.msg_flags & MSG_TRUNC) {
+					TRACE("Ignoring oversized datagram");
+					continue;
+				}
+				// Anyone can send to the port, and the group can be joined by
+				// anyone on the network
+				if (messages[i].msg_hdr.msg_namelen < sizeof(sockaddr_in)
+				 || senders[i].sin_addr.s_addr != sourceAddress) {
+					TRACE("Ignoring datagram from " << ip2string(senders[i].sin_addr.s_addr));
+					continue;
+				}
+				handleDatagram(&buffers[i * MEDIA_MAX_DATAGRAM], messages[i].msg_len);
+			}
+		}
+
+		expireFrames();
+	}
+
+	TRACE_EXIT;
+}
+
+void
+MediaReceiver::handleDatagram (uint8_t* datagram, size_t length)
+{
+	if (length < sizeof(MediaDatagramHeader)) {
+		TRACE("Ignoring runt datagram of " << length << " bytes");
+		return;
+	}
+
+	MediaDatagramHeader header;
+	memcpy(&header, datagram, sizeof(header));
+	uint32_t seq         = ntohl(header.frameSeq);
+	uint32_t frameLength = ntohl(header.frameLength);
+	uint16_t fragIndex   = ntohs(header.fragIndex);
+	uint16_t fragCount   = ntohs(header.fragCount);
+	uint8_t* payload     = datagram + sizeof(header);
+	size_t payloadLength = length - sizeof(header);
+
+	// An empty frame isn't worth a buffer, and a huge one isn't worth
+	// trusting a single datagram to allocate
+	if (frameLength == 0 || frameLength > MEDIA_MAX_FRAME_LENGTH) {
+		TRACE("Ignoring datagram for a frame of " << frameLength << " bytes");
+		return;
+	}
+
+	if (fragCount == 0 || fragIndex >= fragCount
+	 || (size_t) fragCount != max((size_t) 1, (frameLength + MEDIA_MAX_PAYLOAD - 1) / MEDIA_MAX_PAYLOAD)) {
+		TRACE("Ignoring datagram with inconsistent fragment numbering");
+		return;
+	}
+
+	// Too late: a newer frame has already been shown
+	if (deliveredAny && !seqAfter(seq, lastDeliveredSeq)) {
+		return;
+	}
+
+	map<uint32_t, PartialFrame>::iterator itr = partials.find(seq);
+	if (itr == partials.end())
+	{
+		PartialFrame frame;
+		frame.type          = ntohl(header.type);
+		frame.buffer        = pool->acquire(frameLength);
+		frame.length        = frameLength;
+		frame.received.assign(fragCount, false);
+		frame.receivedCount = 0;
+		frame.fecGroupSize  = header.fecGroupSize;
+		frame.deadline      = monotonicMs() + deadlineMs;
+		itr = partials.insert(make_pair(seq, frame)).first;
+	}
+	PartialFrame &frame = itr->second;
+
+	// Everything below trusts the frame's first datagram, so the rest have
+	// to agree with it
+	if (frame.length != frameLength || frame.received.size() != fragCount
+	 || frame.type != ntohl(header.type) || frame.fecGroupSize != header.fecGroupSize) {
+		TRACE("Ignoring datagram which doesn't match the rest of frame " << seq);
+		return;
+	}
+
+	if (header.flags & MEDIA_FLAG_PARITY)
+	{
+		if (frame.fecGroupSize == 0 || fragIndex % frame.fecGroupSize != 0
+		 || payloadLength != MEDIA_MAX_PAYLOAD) {
+			return;
+		}
+		frame.parity[fragIndex].assign(payload, payload + payloadLength);
+		recoverFragment(frame, fragIndex);
+	}
+	else
+	{
+		size_t offset = (size_t) fragIndex * MEDIA_MAX_PAYLOAD;
+		if (payloadLength != min(MEDIA_MAX_PAYLOAD, frameLength - offset) || frame.received[fragIndex]) {
+			return;
+		}
+		memcpy(&(*frame.buffer)[offset], payload, payloadLength);
+		frame.received[fragIndex] = true;
+		frame.receivedCount++;
+
+		if (frame.fecGroupSize) {
+			recoverFragment(frame, fragIndex - fragIndex % frame.fecGroupSize);
+		}
+	}
+
+	if (frame.receivedCount == frame.received.size()) {
+		deliverFrame(seq);
+	}
+}
+
+void
+MediaReceiver::recoverFragment (PartialFrame& frame, uint16_t groupStart)
+{
+	map< uint16_t, vector<uint8_t> >::iterator parityItr = frame.parity.find(groupStart);
+	if (parityItr == frame.parity.end()) {
+		return;
+	}
+
+	// Parity can only fill in one gap per group
+	size_t groupEnd = min(frame.received.size(), (size_t) groupStart + frame.fecGroupSize);
+	int missing = -1;
+	for (size_t i = groupStart; i < groupEnd; i++)
+	{
+		if (!frame.received[i])
+		{
+			if (missing != -1) {
+				return;
+			}
+			missing = i;
+		}
+	}
+
+	if (missing == -1) {
+		return;
+	}
+
+	// XOR every other fragment out of the parity, leaving the missing one
+	vector<uint8_t> &recovered = parityItr->second;
+	for (size_t i = groupStart; i < groupEnd; i++)
+	{
+		if ((int) i == missing) {
+			continue;
+		}
+		size_t offset = i * MEDIA_MAX_PAYLOAD;
+		size_t payload = min(MEDIA_MAX_PAYLOAD, (size_t) frame.length - offset);
+		for (size_t j = 0; j < payload; j++) {
+			recovered[j] ^= (*frame.buffer)[offset + j];
+		}
+	}
+
+	size_t offset = missing * MEDIA_MAX_PAYLOAD;
+	size_t payload = min(MEDIA_MAX_PAYLOAD, (size_t) frame.length - offset);
+	memcpy(&(*frame.buffer)[offset], &recovered[0], payload);
+	frame.received[missing] = true;
+	frame.receivedCount++;
+	frame.parity.erase(parityItr);
+	fragmentsRecovered++;
+
+	TRACE("Recovered fragment " << missing << " from parity");
+}
+
+void
+MediaReceiver::deliverFrame (uint32_t seq)
+{
+	map<uint32_t, PartialFrame>::iterator itr = partials.find(seq);
+	PartialFrame frame = itr->second;
+
+	// Anything older is never going to be shown now
+	itr = partials.begin();
+	while (itr != partials.end())
+	{
+		if (seqAfter(itr->first, seq)) {
+			itr++;
+			continue;
+		}
+
+		if (itr->first != seq) {
+			framesDropped++;
+		}
+		partials.erase(itr++);
+	}
+
+	lastDeliveredSeq = seq;
+	deliveredAny = true;
+	framesDelivered++;
+
+	message_t type = frame.type;
+	message_len_t length = frame.length;
+	try
+	{
+		handler(type, length, &(*frame.buffer)[0]);
+	}
+	catch (runtime_error e)
+	{
+		ERROR("Uncaught exception in media handler: " << e.what());
+	}
+}
+
+void
+MediaReceiver::expireFrames ()
+{
+	uint64_t now = monotonicMs();
+
+	map<uint32_t, PartialFrame>::iterator itr = partials.begin();
+	while (itr != partials.end())
+	{
+		if (itr->second.deadline <= now)
+		{
+			TRACE("Giving up on frame " << itr->first << " with "
+			   << itr->second.receivedCount << " of " << itr->second.received.size()
+			   << " fragments");
+			partials.erase(itr++);
+			framesDropped++;
+		}
+		else
+		{
+			itr++;
+		}
+	}
+}
@@ -0,0 +1,155 @@
+#include <iomanip>      // setprecision()
+#include <sstream>      // stringstream
+#include <stdexcept>    // exceptions
+#include <string>       // strings
+#include <vector>       // vectors
+
+#include "Log.h"
+#include "Metrics.h"
+
+using namespace std;
+
+//--- Histogram ---//
+
+Histogram::Histogram (const vector<uint64_t>& bounds_):
+	bounds (bounds_),
+	counts (new atomic<uint64_t>[bounds_.size() + 1]),
+	sum    (0)
+{
+	for (size_t i = 0; i < bounds.size(); i++)
+	{
+		if (i > 0 && bounds[i] <= bounds[i - 1]) {
+			THROW_ERROR("Histogram bounds must increase");
+		}
+	}
+	for (size_t i = 0; i <= bounds.size(); i++) {
+		counts[i] = 0;
+	}
+}
+
+vector<uint64_t>
+Histogram::latencyBounds ()
+{
+	vector<uint64_t> bounds;
+	for (uint64_t decade = 10; decade < 1000000; decade *= 10)
+	{
+		bounds.push_back(decade);
+		bounds.push_back(decade * 2);
+		bounds.push_back(decade * 5);
+	}
+	bounds.push_back(1000000);
+	return bounds;
+}
+
+void
+Histogram::observe (uint64_t us)
+{
+	// There are only a dozen or so buckets, so a scan beats a search
+	size_t i = 0;
+	while (i < bounds.size() && us > bounds[i]) {
+		i++;
+	}
+	counts[i].fetch_add(1, memory_order_relaxed);
+	sum.fetch_add(us, memory_order_relaxed);
+}
+
+const vector<uint64_t>&
+Histogram::getBounds ()
+{
+	return bounds;
+}
+
+uint64_t
+Histogram::getCumulativeCount (size_t i)
+{
+	uint64_t count = 0;
+	for (size_t j = 0; j <= i && j <= bounds.size(); j++) {
+		count += counts[j].load(memory_order_relaxed);
+	}
+	return count;
+}
+
+uint64_t
+Histogram::getSum ()
+{
+	return sum.load(memory_order_relaxed);
+}
+
+//--- Metrics ---//
+
+Histogram&
+Metrics::lockWait ()
+{
+	static Histogram histogram(Histogram::latencyBounds());
+	return histogram;
+}
+
+Histogram&
+Metrics::sendQueueWait ()
+{
+	static Histogram histogram(Histogram::latencyBounds());
+	return histogram;
+}
+
+//--- MetricsWriter ---//
+
+const char* const MetricsWriter::CONTENT_TYPE = "text/plain; version=0.0.4; charset=utf-8";
+
+string
+MetricsWriter::label (const string& name, const string& value)
+{
+	string escaped;
+	for (size_t i = 0; i < value.length(); i++)
+	{
+		switch (value[i])
+		{
+		  case '\\': escaped += "\\\\"; break;
+		  case '"':  escaped += "\\\""; break;
+		  case '\n': escaped += "\\n";  break;
+		  default:   escaped += value[i];
+		}
+	}
+	return name + "=\"" + escaped + "\"";
+}
+
+void
+MetricsWriter::family (const string& name, const string& type, const string& help)
+{
+	out << "# HELP " << name << " " << help << "\n"
+	    << "# TYPE " << name << " " << type << "\n";
+}
+
+void
+MetricsWriter::sample (const string& name, const string& labels, double value)
+{
+	// Enough digits that byte counters come out exact
+	out << name;
+	if (!labels.empty()) {
+		out << "{" << labels << "}";
+	}
+	out << " " << setprecision(15) << value << "\n";
+}
+
+void
+MetricsWriter::histogram (const string& name, const string& labels, Histogram& histogram)
+{
+	string prefix = labels.empty() ? "" : labels + ",";
+
+	const vector<uint64_t>& bounds = histogram.getBounds();
+	for (size_t i = 0; i < bounds.size(); i++)
+	{
+		stringstream le;
+		le << bounds[i] / 1e6;
+		sample(name + "_bucket", prefix + label("le", le.str()), histogram.getCumulativeCount(i));
+	}
+	uint64_t count = histogram.getCumulativeCount(bounds.size());
+	sample(name + "_bucket", prefix + label("le", "+Inf"), count);
+	sample(name + "_sum", labels, histogram.getSum() / 1e6);
+	sample(name + "_count", labels, count);
+}
+
+string
+MetricsWriter::str ()
+{
+	return out.str();
+}
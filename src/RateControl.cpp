@@ -0,0 +1,472 @@
+#include <linux/tcp.h>   // struct tcp_info (the kernel's, which has the rate fields)
+#include <netinet/in.h>  // IPPROTO_TCP
+#include <sys/socket.h>  // getsockopt()
+
+#include <cstring>       // memset(), strerror()
+#include <stddef.h>      // offsetof()
+#include <stdexcept>     // exceptions
+#include <sstream>       // stringstream (used by Log.h)
+
+#include "Log.h"
+#include "RateControl.h"
+
+using namespace std;
+
+/// Weight given to each new measurement in the running estimates
+static const double SMOOTHING = 0.25;
+
+/// Shortest span of receive reports worth measuring a rate over
+static const uint64_t MIN_REPORT_SPAN_MS = 100;
+
+//--- BandwidthEstimator ---//
+
+BandwidthEstimator::BandwidthEstimator ():
+	throughput       (0),
+	rtt              (0),
+	backlog          (0),
+	framesSent       (0),
+	bytesSent        (0),
+	haveReport       (false),
+	reportFrames     (0),
+	reportBytes      (0),
+	reportTime       (0),
+	reportFramesSent (0),
+	losing           (false)
+{
+	int err;
+	if ((err = pthread_mutex_init(&mutex, NULL))) {
+		THROW_ERROR("Error creating mutex: " << strerror(err));
+	}
+}
+
+BandwidthEstimator::~BandwidthEstimator ()
+{
+	pthread_mutex_destroy(&mutex);
+}
+
+void
+BandwidthEstimator::updateThroughput (double bytesPerSecond)
+{
+	if (throughput == 0) {
+		throughput = bytesPerSecond;
+	} else {
+		throughput += SMOOTHING * (bytesPerSecond - throughput);
+	}
+}
+
+void
+BandwidthEstimator::recordSent (size_t length)
+{
+	MutexLock lock(mutex);
+	lock.relock();
+
+	framesSent++;
+	bytesSent += length;
+}
+
+void
+BandwidthEstimator::recordReport (uint32_t framesReceived, uint64_t bytesReceived)
+{
+	MutexLock lock(mutex);
+	lock.relock();
+
+	uint64_t now = monotonicMs();
+
+	if (haveReport)
+	{
+		uint64_t span = now - reportTime;
+		if (span < MIN_REPORT_SPAN_MS) {
+			return;
+		}
+
+		uint32_t framesArrived = framesReceived - reportFrames;
+		uint64_t framesGone    = framesSent - reportFramesSent;
+
+		// Nothing sent means nothing learned; an idle link isn't a slow one
+		if (framesGone > 0)
+		{
+			updateThroughput((double) (bytesReceived - reportBytes) * 1000 / span);
+
+			// A frame or two in flight at either end is to be expected
+			losing = framesGone > 4 && framesArrived + 2 < framesGone * 0.8;
+		}
+	}
+
+	haveReport       = true;
+	reportFrames     = framesReceived;
+	reportBytes      = bytesReceived;
+	reportTime       = now;
+	reportFramesSent = framesSent;
+}
+
+void
+BandwidthEstimator::sample (Connection& connection)
+{
+	size_t queued = connection.getQueuedFrameBytes();
+
+	// Older kernels fill in less of the struct; the rest stays zero
+	struct tcp_info info;
+	memset(&info, 0, sizeof(info));
+	socklen_t length = sizeof(info);
+	bool haveInfo = !connection.isLocal() &&
+		getsockopt(connection.getEventFd(), IPPROTO_TCP, TCP_INFO, &info, &length) == 0;
+
+	MutexLock lock(mutex);
+	lock.relock();
+
+	backlog = queued;
+	if (!haveInfo) {
+		return;
+	}
+
+	if (info.tcpi_rtt > 0)
+	{
+		double sampleRtt = info.tcpi_rtt / 1000.0;
+		rtt = rtt == 0 ? sampleRtt : rtt + SMOOTHING * (sampleRtt - rtt);
+	}
+
+	if (length >= offsetof(struct tcp_info, tcpi_notsent_bytes) + sizeof(info.tcpi_notsent_bytes)) {
+		backlog += info.tcpi_notsent_bytes;
+	}
+
+	if (length >= offsetof(struct tcp_info, tcpi_delivery_rate) + sizeof(info.tcpi_delivery_rate) &&
+	    info.tcpi_delivery_rate > 0)
+	{
+		// When we're the bottleneck, the rate only says the link is at
+		// least that fast
+		if (!info.tcpi_delivery_rate_app_limited || info.tcpi_delivery_rate > throughput) {
+			updateThroughput(info.tcpi_delivery_rate);
+		}
+	}
+}
+
+double
+BandwidthEstimator::getThroughput ()
+{
+	MutexLock lock(mutex);
+	lock.relock();
+	return throughput;
+}
+
+double
+BandwidthEstimator::getRtt ()
+{
+	MutexLock lock(mutex);
+	lock.relock();
+	return rtt;
+}
+
+double
+BandwidthEstimator::getLatency ()
+{
+	MutexLock lock(mutex);
+	lock.relock();
+
+	double latency = rtt / 2;
+	if (throughput > 0) {
+		latency += backlog * 1000 / throughput;
+	}
+	return latency;
+}
+
+bool
+BandwidthEstimator::isLosing ()
+{
+	MutexLock lock(mutex);
+	lock.relock();
+	return losing;
+}
+
+//--- RateController ---//
+
+RateController::RateController (int targetLatency_):
+	targetLatency     (targetLatency_),
+	interval          (1),
+	framesOffered     (0),
+	lastSampleTime    (0),
+	lastRaiseTime     (0),
+	calmSince         (monotonicMs()),
+	lastFramesDropped (0),
+	offerInterval     (0),
+	lastOfferTime     (0)
+{
+	int err;
+	if ((err = pthread_mutex_init(&mutex, NULL))) {
+		THROW_ERROR("Error creating mutex: " << strerror(err));
+	}
+}
+
+RateController::~RateController ()
+{
+	pthread_mutex_destroy(&mutex);
+}
+
+bool
+RateController::admitFrame (Connection& connection, size_t length)
+{
+	MutexLock lock(mutex);
+	lock.relock();
+
+	// Pauses in the stream aren't part of the frame rate
+	uint64_t offerTime = monotonicUs();
+	uint64_t sinceLast = offerTime - lastOfferTime;
+	if (lastOfferTime != 0 && sinceLast < 1000000) {
+		offerInterval = offerInterval == 0 ? sinceLast
+		              : offerInterval + SMOOTHING * (sinceLast - offerInterval);
+	}
+	lastOfferTime = offerTime;
+
+	uint64_t now = monotonicMs();
+	if (now - lastSampleTime >= (uint64_t) SAMPLE_PERIOD_MS)
+	{
+		lastSampleTime = now;
+		estimator.sample(connection);
+		adjust(connection, now);
+	}
+
+	bool send = framesOffered++ % interval == 0;
+	lock.unlock();
+
+	if (send) {
+		estimator.recordSent(length);
+	}
+	return send;
+}
+
+void
+RateController::adjust (Connection& connection, uint64_t now)
+{
+	uint64_t dropped = connection.getFramesDropped();
+	bool dropping = dropped > lastFramesDropped;
+	lastFramesDropped = dropped;
+
+	double latency = estimator.getLatency();
+
+	if (latency > targetLatency || dropping || estimator.isLosing())
+	{
+		calmSince = now;
+
+		// Give the last step a chance to drain the backlog first
+		if (interval < MAX_INTERVAL && now - lastRaiseTime >= 2 * (uint64_t) SAMPLE_PERIOD_MS)
+		{
+			interval = interval * 2 < MAX_INTERVAL ? interval * 2 : MAX_INTERVAL;
+			lastRaiseTime = now;
+			MESSAGE("Link to " << ip2string(connection.getRemoteAddress()) << " is congested"
+			     << " (about " << (int) latency << " ms behind); sending 1 in "
+			     << interval << " frames");
+		}
+	}
+	else if (latency > targetLatency / 2)
+	{
+		// Fine, but not enough room to send more
+		calmSince = now;
+	}
+	else if (interval > 1 && now - calmSince >= (uint64_t) STEP_DOWN_HOLD_MS)
+	{
+		interval--;
+		calmSince = now;
+		MESSAGE("Link to " << ip2string(connection.getRemoteAddress()) << " has room; sending 1 in "
+		     << interval << " frames");
+	}
+}
+
+void
+RateController::recordReport (uint32_t framesReceived, uint64_t bytesReceived)
+{
+	estimator.recordReport(framesReceived, bytesReceived);
+}
+
+int
+RateController::getInterval ()
+{
+	MutexLock lock(mutex);
+	lock.relock();
+	return interval;
+}
+
+uint64_t
+RateController::getPacingRate (size_t length)
+{
+	MutexLock lock(mutex);
+	lock.relock();
+
+	if (offerInterval == 0) {
+		return 0;
+	}
+
+	// The client gets one frame in every `interval`
+	double spreadUs = offerInterval * interval * PACING_SPREAD_PERCENT / 100;
+	uint64_t rate = length * 1e6 / spreadUs;
+	return rate > MIN_PACING_RATE ? rate : MIN_PACING_RATE;
+}
+
+BandwidthEstimator&
+RateController::getEstimator ()
+{
+	return estimator;
+}
+
+//--- TokenBucket ---//
+
+TokenBucket::TokenBucket ():
+	tokens     (0),
+	lastRefill (0)
+{ }
+
+bool
+TokenBucket::admit (size_t length, uint64_t rate)
+{
+	uint64_t now = monotonicUs();
+	if (rate == 0)
+	{
+		// Start afresh if a limit comes back
+		tokens = 0;
+		lastRefill = now;
+		return true;
+	}
+
+	double burst = (double) rate * BURST_MS / 1000;
+	tokens += (double) rate * (now - lastRefill) / 1e6;
+	if (tokens > burst) {
+		tokens = burst;
+	}
+	lastRefill = now;
+
+	if (tokens < 0) {
+		return false;
+	}
+	tokens -= length;
+	return true;
+}
+
+//--- BandwidthLimits ---//
+
+BandwidthLimits::BandwidthLimits ():
+	clientLimit (0),
+	globalLimit (0),
+	lastPruned  (0)
+{
+	int err;
+	if ((err = pthread_mutex_init(&mutex, NULL))) {
+		THROW_ERROR("Error creating mutex: " << strerror(err));
+	}
+}
+
+BandwidthLimits::~BandwidthLimits ()
+{
+	pthread_mutex_destroy(&mutex);
+}
+
+void
+BandwidthLimits::setClientLimit (uint64_t bytesPerSecond)
+{
+	MutexLock lock(mutex);
+	lock.relock();
+	clientLimit = bytesPerSecond;
+}
+
+uint64_t
+BandwidthLimits::getClientLimit ()
+{
+	MutexLock lock(mutex);
+	lock.relock();
+	return clientLimit;
+}
+
+void
+BandwidthLimits::setGlobalLimit (uint64_t bytesPerSecond)
+{
+	MutexLock lock(mutex);
+	lock.relock();
+	globalLimit = bytesPerSecond;
+}
+
+uint64_t
+BandwidthLimits::getGlobalLimit ()
+{
+	MutexLock lock(mutex);
+	lock.relock();
+	return globalLimit;
+}
+
+void
+BandwidthLimits::setOverride (in_addr_t address, uint64_t bytesPerSecond)
+{
+	MutexLock lock(mutex);
+	lock.relock();
+	overrides[address] = bytesPerSecond;
+}
+
+void
+BandwidthLimits::clearOverride (in_addr_t address)
+{
+	MutexLock lock(mutex);
+	lock.relock();
+	overrides.erase(address);
+}
+
+map<in_addr_t, uint64_t>
+BandwidthLimits::getOverrides ()
+{
+	MutexLock lock(mutex);
+	lock.relock();
+	return overrides;
+}
+
+uint64_t
+BandwidthLimits::getLimit (const void* client, in_addr_t address)
+{
+	uint64_t now = monotonicMs();
+
+	MutexLock lock(mutex);
+	lock.relock();
+
+	lastActive[client] = now;
+
+	// Clients which stopped streaming without saying so stop counting
+	if (now - lastPruned >= (uint64_t) ACTIVE_WINDOW_MS)
+	{
+		lastPruned = now;
+		map<const void*, uint64_t>::iterator itr = lastActive.begin();
+		while (itr != lastActive.end())
+		{
+			if (now - itr->second > (uint64_t) ACTIVE_WINDOW_MS) {
+				lastActive.erase(itr++);
+			} else {
+				itr++;
+			}
+		}
+	}
+
+	uint64_t limit = clientLimit;
+	map<in_addr_t, uint64_t>::iterator override = overrides.find(address);
+	if (override != overrides.end()) {
+		limit = override->second;
+	}
+
+	if (globalLimit != 0)
+	{
+		uint64_t share = globalLimit / lastActive.size();
+		if (limit == 0 || share < limit) {
+			limit = share;
+		}
+	}
+
+	return limit;
+}
+
+void
+BandwidthLimits::forget (const void* client)
+{
+	MutexLock lock(mutex);
+	lock.relock();
+	lastActive.erase(client);
+}
+
+size_t
+BandwidthLimits::getActiveClients ()
+{
+	MutexLock lock(mutex);
+	lock.relock();
+	return lastActive.size();
+}
@@ -6,20 +6,35 @@
 #include <netinet/in.h> // struct sockaddr_in, in_port_t
 
 #include <sys/ioctl.h>  // ioctl()
+#include <sys/mman.h>   // memfd_create(), mmap()
 #include <sys/socket.h> // socket()
+#include <sys/stat.h>   // fstat()
+#include <sys/un.h>     // struct sockaddr_un
+
+#include <linux/errqueue.h> // sock_extended_err, SO_EE_ORIGIN_ZEROCOPY
+#include <endian.h>     // htobe64()
+
+#include <netinet/tcp.h> // TCP_NODELAY
 
 #include <errno.h>      // errno
+#include <fcntl.h>      // fcntl(), O_NONBLOCK
+#include <limits.h>     // IOV_MAX
+#include <poll.h>       // poll()
 #include <cstring>      // strerror()
+#include <future>       // promise, for request()
 #include <iostream>     // cout
 #include <pthread.h>    // multithreading
 #include <memory>       // shared_ptr
 #include <stdexcept>    // exceptions
 #include <sstream>      // stringstream (used by Log.h)
 #include <string>       // strings
+#include <time.h>       // clock_gettime()
 #include <vector>       // vector
-#include <unistd.h>     // close()
+#include <unistd.h>     // close(), usleep()
 
+#include "IoUring.h"
 #include "Log.h"
+#include "Metrics.h"
 #include "Sockets.h"
 #include "Thread.h"
 
@@ -28,6 +43,143 @@ using namespace std;
 const unsigned char _localhostIp[4] = { 127, 0, 0, 1 };
 const in_addr_t LOCALHOST_IP_ADDR = *((in_addr_t*) _localhostIp);
 
+/**
+ * Takes ownership of the first of the descriptors passed with a message,
+ * closing the rest. The descriptor is closed when the last copy of the
+ * returned pointer goes, unless someone has taken it (setting it to -1).
+ */
+static shared_ptr<int>
+adoptDescriptor (vector<int>& fds)
+{
+	shared_ptr<int> passedFd;
+	if (!fds.empty())
+	{
+		passedFd = shared_ptr<int>(new int(fds[0]), [] (int* fd_p)
+		{
+			if (*fd_p != -1) {
+				::close(*fd_p);
+			}
+			delete fd_p;
+		});
+	}
+
+	for (size_t i = 1; i < fds.size(); i++) {
+		::close(fds[i]);
+	}
+	fds.clear();
+
+	return passedFd;
+}
+
+/// Converts a message header between host and network byte order (it's
+/// the same conversion both ways)
+static MessageHeader
+swapHeader (const MessageHeader& header)
+{
+	MessageHeader swapped;
+	swapped.type   = htonl(header.type);
+	swapped.length = htonl(header.length);
+	swapped.requestId = htonl(header.requestId);
+	return swapped;
+}
+
+/**
+ * Describes what's left of some pieces of memory once the first offset
+ * bytes are skipped
+ *
+ * @param out  Room for numParts pieces
+ * @return How many pieces are left, in out
+ */
+static int
+skipParts (const iovec* parts, int numParts, size_t offset, iovec* out)
+{
+	int count = 0;
+	for (int i = 0; i < numParts; i++)
+	{
+		if (offset >= parts[i].iov_len) {
+			offset -= parts[i].iov_len;
+			continue;
+		}
+		out[count].iov_base = static_cast<uint8_t*>(parts[i].iov_base) + offset;
+		out[count].iov_len  = parts[i].iov_len - offset;
+		offset = 0;
+		count++;
+	}
+	return count;
+}
+
+/// Copies bytes into the start of some pieces of memory, in order
+static void
+copyToParts (const iovec* parts, int numParts, const uint8_t* data, size_t length)
+{
+	for (int i = 0; i < numParts && length > 0; i++)
+	{
+		size_t chunk = length < parts[i].iov_len ? length : parts[i].iov_len;
+		memcpy(parts[i].iov_base, data, chunk);
+		data   += chunk;
+		length -= chunk;
+	}
+}
+
+/// WebSocket frame opcodes (RFC 6455, section 5.2)
+static const uint8_t WS_CONTINUATION = 0x0;
+static const uint8_t WS_TEXT         = 0x1;
+static const uint8_t WS_BINARY       = 0x2;
+static const uint8_t WS_CLOSE        = 0x8;
+static const uint8_t WS_PING         = 0x9;
+static const uint8_t WS_PONG         = 0xA;
+
+/// WebSocket frame header bits
+static const uint8_t WS_FIN    = 0x80;
+static const uint8_t WS_MASKED = 0x80;
+
+/// Opcodes with this bit set are control frames (RFC 6455 section 5.5)
+static const uint8_t WS_CONTROL = 0x8;
+
+/// Longest payload a control frame may have
+static const size_t WS_MAX_CONTROL_PAYLOAD = 125;
+
+/// Close status codes (RFC 6455 section 7.4.1)
+static const uint16_t WS_STATUS_PROTOCOL_ERROR = 1002;
+static const uint16_t WS_STATUS_UNSUPPORTED    = 1003;
+static const uint16_t WS_STATUS_TOO_BIG        = 1009;
+
+/**
+ * Writes the header of an unmasked, unfragmented WebSocket frame
+ *
+ * @param opcode   One of the WS_ opcodes
+ * @param length   Length of the payload
+ * @param framing  Room for at least 10 bytes
+ * @return Bytes written to framing
+ */
+static size_t
+encodeWebSocketFrame (uint8_t opcode, uint64_t length, uint8_t* framing)
+{
+	framing[0] = WS_FIN | opcode;
+	if (length < 126)
+	{
+		framing[1] = length;
+		return 2;
+	}
+	if (length <= 0xFFFF)
+	{
+		framing[1] = 126;
+		uint16_t length16 = htons(length);
+		memcpy(&framing[2], &length16, sizeof(length16));
+		return 4;
+	}
+	framing[1] = 127;
+	uint64_t length64 = htobe64(length);
+	memcpy(&framing[2], &length64, sizeof(length64));
+	return 10;
+}
+
+/// The connection whose message the calling thread is handling, if any
+static thread_local Connection* dispatchingConnection = NULL;
+
+/// Id of the request being handled on the calling thread, or 0
+static thread_local uint32_t dispatchingRequestId = 0;
+
 string
 ip2string (in_addr_t ipAddr)
 {
@@ -41,11 +193,21 @@ ip2string (in_addr_t ipAddr)
 	return ss.str();
 }
 
-struct MessageHeader
+uint64_t
+monotonicMs ()
+{
+	timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+uint64_t
+monotonicUs ()
 {
-	message_t type;
-	message_len_t length;
-};
+	timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
 
 //--- MutexLock ---//
 
@@ -82,23 +244,99 @@ MutexLock::relock ()
 		if ((status = pthread_mutex_trylock(mutex_p))) {
 			TRACE("Mutex is already locked. Going to wait in line...");
 
+			// Only the waits are timed, so uncontended locks stay cheap
+			uint64_t waitStart = monotonicUs();
 			if ((status = pthread_mutex_lock(mutex_p))) {
 				THROW_ERROR("Unable to lock mutex: " << strerror(status));
 			}
+			Metrics::lockWait().observe(monotonicUs() - waitStart);
 		}
 
 		locked = true;
 	}
 }
 
+//--- SharedFrame ---//
+
+SharedFrame::SharedFrame (const void* data, size_t length_,
+                          const void* prefix, size_t prefixLength):
+	length (prefixLength + length_)
+{
+	fd = memfd_create("frame", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (fd == -1) {
+		THROW_ERROR("memfd_create() failed: " << strerror(errno));
+	}
+
+	// write() rather than mmap(), since the write seal can't be added while
+	// there's a writable mapping
+	iovec parts[2];
+	parts[0].iov_base = const_cast<void*>(prefix);
+	parts[0].iov_len  = prefixLength;
+	parts[1].iov_base = const_cast<void*>(data);
+	parts[1].iov_len  = length_;
+
+	size_t written = 0;
+	while (written < length)
+	{
+		// Skip whatever was written last time
+		iovec remaining[2];
+		int count = 0;
+		size_t skip = written;
+		for (int i = 0; i < 2; i++)
+		{
+			if (skip >= parts[i].iov_len) {
+				skip -= parts[i].iov_len;
+				continue;
+			}
+			remaining[count].iov_base = static_cast<uint8_t*>(parts[i].iov_base) + skip;
+			remaining[count].iov_len  = parts[i].iov_len - skip;
+			count++;
+			skip = 0;
+		}
+
+		ssize_t bytesWritten = writev(fd, remaining, count);
+		if (bytesWritten < 0)
+		{
+			if (errno == EINTR) {
+				continue;
+			}
+			int err = errno;
+			::close(fd);
+			THROW_ERROR("Unable to write frame to memfd: " << strerror(err));
+		}
+		written += bytesWritten;
+	}
+
+	if (fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL))
+	{
+		int err = errno;
+		::close(fd);
+		THROW_ERROR("Unable to seal memfd: " << strerror(err));
+	}
+}
+
+SharedFrame::~SharedFrame ()
+{
+	::close(fd);
+}
+
+int
+SharedFrame::getFd ()
+{
+	return fd;
+}
+
+size_t
+SharedFrame::getLength ()
+{
+	return length;
+}
+
 //--- Connection ---//
 
 Connection::Connection (int fd_, in_addr_t remoteAddress_, in_port_t remotePort_):
-	fd                   (fd_),
 	remoteAddress        (remoteAddress_),
 	remotePort           (remotePort_),
-	stopReadingFlag      (true),
-	connectionClosedFlag (false),
 	handleDefault (
 		[this] (message_t type, message_len_t length, void*buffer)
 	{
@@ -106,7 +344,37 @@ Connection::Connection (int fd_, in_addr_t remoteAddress_, in_port_t remotePort_
 		MESSAGE("Unhandled message type " << std::dec << type
 		     << ". (Length = " << length << ")");
 		TRACE_EXIT;
-	})
+	}),
+	fd                   (fd_),
+	local                (false),
+	webSocket            (false),
+	useIoUring           (false),
+	uringSendInFlight    (false),
+	queuedControlBytes   (0),
+	writeArmed           (false),
+	framesDropped        (0),
+	zeroCopyEnabled      (false),
+	zeroCopyAllowed      (true),
+	zeroCopyNextSeq      (0),
+	zeroCopyCompletedSeq (0),
+	readerThreadStarted  (false),
+	incomingBytes        (0),
+	receiveStart         (0),
+	receiveEnd           (0),
+	dispatchScheduled    (false),
+	receivePool          (BufferPool::getSharedPool()),
+	dispatchingReply     (false),
+	bytesIn              (0),
+	messagesIn           (0),
+	bytesOut             (0),
+	messagesOut          (0),
+	framesSent           (0),
+	sendLatency          (0),
+	pacingRate           (0),
+	stopReadingFlag      (true),
+	connectionClosedFlag (false),
+	readerThreadExited   (false),
+	nextRequestId        (1)
 {
 	TRACE_ENTER;
 
@@ -114,13 +382,88 @@ Connection::Connection (int fd_, in_addr_t remoteAddress_, in_port_t remotePort_
 	if ((err = pthread_mutex_init(&writerMutex, NULL))) {
 		THROW_ERROR("Error creating mutex: " << strerror(err));
 	}
+	if ((err = pthread_mutex_init(&dispatchMutex, NULL))) {
+		THROW_ERROR("Error creating mutex: " << strerror(err));
+	}
+	if ((err = pthread_mutex_init(&zeroCopyMutex, NULL))) {
+		THROW_ERROR("Error creating mutex: " << strerror(err));
+	}
+	if ((err = pthread_cond_init(&uringSendCond, NULL))) {
+		THROW_ERROR("Error creating condition variable: " << strerror(err));
+	}
+	if ((err = pthread_mutex_init(&closeHandlerMutex, NULL))) {
+		THROW_ERROR("Error creating mutex: " << strerror(err));
+	}
+	if ((err = pthread_mutex_init(&requestsMutex, NULL))) {
+		THROW_ERROR("Error creating mutex: " << strerror(err));
+	}
+	if ((err = pthread_mutex_init(&receiveTargetsMutex, NULL))) {
+		THROW_ERROR("Error creating mutex: " << strerror(err));
+	}
+
+	configureSocket();
 
 	TRACE_EXIT;
 }
 
+void
+Connection::configureSocket ()
+{
+	sockaddr_storage localAddress;
+	socklen_t addressLength = sizeof(localAddress);
+	if (getsockname(fd, (sockaddr*) &localAddress, &addressLength) == 0) {
+		local = localAddress.ss_family == AF_UNIX;
+	}
+
+	// A new socket isn't paced until it's told to be
+	pacingRate = 0;
+
+	// The rest only applies to TCP
+	if (local) {
+		return;
+	}
+
+	// Every message goes out in a single sendmsg(), so there's nothing for
+	// Nagle's algorithm to coalesce. All it would do is hold small control
+	// replies back waiting for the peer's delayed ACK.
+	int one = 1;
+	if (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one))) {
+		WARNING("Unable to set TCP_NODELAY: " << strerror(errno));
+	}
+
+	// Keep unsent data in our queue, where stale frames can be dropped,
+	// instead of the kernel's
+	int lowat = NOTSENT_LOWAT;
+	if (setsockopt(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &lowat, sizeof(lowat))) {
+		WARNING("Unable to set TCP_NOTSENT_LOWAT: " << strerror(errno));
+	}
+}
+
+size_t
+Connection::encodeHeader (const MessageHeader& header, uint8_t* wire)
+{
+	size_t framingLength = 0;
+	if (webSocket) {
+		framingLength = encodeWebSocketFrame(WS_BINARY, sizeof(header) + header.length, wire);
+	}
+
+	MessageHeader wireHeader = swapHeader(header);
+	memcpy(wire + framingLength, &wireHeader, sizeof(wireHeader));
+	return framingLength + sizeof(wireHeader);
+}
+
 Connection::~Connection ()
 {
 	close();
+	for (size_t i = 0; i < incomingFds.size(); i++) {
+		::close(incomingFds[i]);
+	}
+	pthread_cond_destroy(&uringSendCond);
+	pthread_mutex_destroy(&receiveTargetsMutex);
+	pthread_mutex_destroy(&requestsMutex);
+	pthread_mutex_destroy(&closeHandlerMutex);
+	pthread_mutex_destroy(&zeroCopyMutex);
+	pthread_mutex_destroy(&dispatchMutex);
 	pthread_mutex_destroy(&writerMutex);
 }
 
@@ -133,6 +476,13 @@ Connection::close ()
 	// Signal the reader thread to stop
 	stopReadingFlag = true;
 
+	// Stop the event loop from watching the socket before it's closed, so
+	// that the descriptor can't be reused out from under it.
+	shared_ptr<EventLoop> loop = eventLoop.lock();
+	if (loop) {
+		loop->remove(*this);
+	}
+
 	if (fd != -1)
 	{
 		// Reader thread is probably still waiting on read()/recv().
@@ -142,8 +492,26 @@ Connection::close ()
 
 		::close(fd);
 		fd = -1;
+		connectionClosedFlag = true;
 	}
 
+	// Nothing queued is going anywhere now
+	MutexLock lock(writerMutex);
+	lock.relock();
+	sendQueue.clear();
+	queuedControlBytes = 0;
+	lock.unlock();
+
+	// Nothing more is coming back on the error queue, either
+	MutexLock zlock(zeroCopyMutex);
+	zlock.relock();
+	zeroCopyPending.clear();
+	zlock.unlock();
+
+	// Nor are any replies
+	failRequests();
+	connectionClosed();
+
 	TRACE_EXIT;
 }
 
@@ -151,33 +519,112 @@ void
 Connection::startReaderThread ()
 {
 	TRACE_ENTER;
+	if (webSocket) {
+		THROW_ERROR("WebSocket connections need an event loop");
+	}
 	stopReadingFlag = false;
 	readerThreadHandle = pthread_create_using_method<Connection, void*>(
 		*this, &Connection::readerThread, NULL
 	);
+	readerThreadStarted = true;
 	TRACE_EXIT;
 }
 
 void
 Connection::joinReaderThread ()
 {
+	if (!readerThreadStarted) {
+		THROW_ERROR("No reader thread was started for this connection.");
+	}
+
 	int err = pthread_join(readerThreadHandle, NULL);
 	if (err)
 	{
 		THROW_ERROR("pthread_join() failed: " << strerror(err));
 	}
+	readerThreadStarted = false;
+}
+
+bool
+Connection::isFinished ()
+{
+	if (readerThreadStarted) {
+		return readerThreadExited;
+	}
+	return connectionClosedFlag;
+}
+
+bool
+Connection::hasReaderThread ()
+{
+	return readerThreadStarted;
 }
 
 void
-Connection::sendMessage (message_t type, size_t length, void* data)
+Connection::setCloseHandler (close_handler_t handler)
+{
+	MutexLock lock(closeHandlerMutex);
+	lock.relock();
+	closeHandler = handler;
+}
+
+void
+Connection::reconnect (int fd_)
 {
 	TRACE_ENTER;
 
-	int bytesWritten;
+	// Makes the reader thread return, if it hasn't already
+	close();
+	if (readerThreadStarted) {
+		joinReaderThread();
+	}
+
+	MutexLock lock(writerMutex);
+	lock.relock();
+	MutexLock zlock(zeroCopyMutex);
+	zlock.relock();
+
+	fd = fd_;
+	configureSocket();
+
+	// Zero-copy sends are numbered per socket
+	zeroCopyEnabled      = false;
+	zeroCopyAllowed      = true;
+	zeroCopyNextSeq      = 0;
+	zeroCopyCompletedSeq = 0;
+
+	connectionClosedFlag = false;
+	readerThreadExited   = false;
+
+	// Nothing read ahead from the old socket belongs to the new one
+	receiveStart = 0;
+	receiveEnd   = 0;
+
+	zlock.unlock();
+	lock.unlock();
+
+	startReaderThread();
+
+	TRACE_EXIT;
+}
+
+void
+Connection::sendMessage (message_t type, size_t length, void* data)
+{
+	sendControl(type, length, data, replyRequestId());
+}
+
+void
+Connection::sendControl (message_t type, size_t length, void* data, uint32_t requestId)
+{
+	TRACE_ENTER;
 
 	MessageHeader header;
 	header.type = type;
 	header.length = length;
+	header.requestId = requestId;
+	uint8_t wire[MAX_FRAMING_BYTES + sizeof(MessageHeader)];
+	size_t wireLength = encodeHeader(header, wire);
 
 	if (connectionClosedFlag) {
 		THROW_ERROR("Connection has closed.");
@@ -194,353 +641,2633 @@ Connection::sendMessage (message_t type, size_t length, void* data)
 	TRACE("Writing message of type " << type << " and length " << length
 	   << " to socket " << fd);
 
-	bytesWritten = send(fd, &header, sizeof(header), 0);
-	if (bytesWritten < 0) {
-		THROW_ERROR("Failed to write message header to socket: " << strerror(errno)
-			     << " (error code " << errno << ")");
-	} else if (bytesWritten != sizeof(header)) {
-		THROW_ERROR("Size mismatch writing message header to socket: Wrote "
-			     << bytesWritten << " bytes, but message header is "
-			     << sizeof(header) << " bytes instead.");
-	}
+	size_t written = 0;
 
-	if (data != NULL && length != 0)
+	if (sendQueue.empty())
 	{
-		bytesWritten = send(fd, data, length, 0);
-		if (bytesWritten < 0) {
-			THROW_ERROR("Failed to write data to socket: " << strerror(errno));
-		} else if (bytesWritten != length) {
-			THROW_ERROR("Size mismatch writing data to socket: Wrote "
-			     	 << bytesWritten << " bytes, but data is "
-			     	 << length << " bytes instead.");
+		// Nothing to wait behind, so try sending straight out of the
+		// caller's buffer and only copy whatever doesn't fit.
+		iovec iov[2];
+		iov[0].iov_base = wire;
+		iov[0].iov_len  = wireLength;
+		iov[1].iov_base = data;
+		iov[1].iov_len  = length;
+
+		msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov    = iov;
+		msg.msg_iovlen = length != 0 ? 2 : 1;
+
+		ssize_t bytesWritten;
+		do {
+			bytesWritten = sendmsg(fd, &msg, MSG_NOSIGNAL);
+		} while (bytesWritten < 0 && errno == EINTR);
+
+		if (bytesWritten < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+			THROW_ERROR("Failed to write to socket: " << strerror(errno)
+			         << " (error code " << errno << ")");
+		}
+
+		written = bytesWritten > 0 ? bytesWritten : 0;
+		bytesOut += written;
+		if (written == wireLength + length) {
+			messagesOut++;
 		}
 	}
 
-	TRACE_EXIT;
-}
+	if (written < wireLength + length)
+	{
+		enqueueControl(type, length, data, written, requestId);
+		flushOrArm();
+	}
 
-void
-Connection::sendMessage (message_t type, string text)
-{
-	sendMessage(type, text.length(), (void*) text.c_str());
-}
+	lock.unlock();
 
-void
-Connection::sendMessage (message_t type)
-{
-	sendMessage(type, 0, NULL);
+	waitForControlBacklog();
+
+	TRACE_EXIT;
 }
 
 void
-Connection::addMessageHandler (message_t type, const message_handler_t& handler)
+Connection::sendFrame (message_t type, size_t length, void* data, shared_ptr<void> pin,
+                       const void* prefix, size_t prefixLength)
 {
 	TRACE_ENTER;
 
-	//shared_ptr<message_handler_set> hs = handlers[type];
-	message_handler_set &hs = handlers[type];
-	//handlers[type] = hs; // Inserts it if it doesn't already exist
+	if (connectionClosedFlag) {
+		THROW_ERROR("Connection has closed.");
+	}
 
-	// Abort insertion if the handler is already present
-	for (message_handler_set::iterator itr = hs.begin();
-	     itr != hs.end();
-	     itr++)
+	if (data == NULL && length != 0) {
+		THROW_ERROR("Null data pointer given with nonzero length = " << length
+		         << " (message type = " << type << ")");
+	}
+
+	// A local peer can map the frame instead of reading it out of the socket
+	if (local && length >= SHARED_FRAME_MIN_LENGTH)
 	{
-		if (*itr == &handler)
-		{
-			TRACE("Handler 0x" << hex << &handler << " already exists for message type " << dec << type);
-			return;
-		}
+		sendSharedFrame(type, shared_ptr<SharedFrame>(
+			new SharedFrame(data, length, prefix, prefixLength)
+		));
+		TRACE_EXIT;
+		return;
 	}
 
-	TRACE("Adding handler 0x" << hex << &handler << " for message type " << dec << type);
-	TRACE("# of handlers was: " << hs.size());
-	hs.push_back(&handler);
-	TRACE("# of handlers is: " << hs.size());
+	shared_ptr<OutgoingMessage> frame(new OutgoingMessage());
+	frame->header.type   = type;
+	frame->header.length = prefixLength + length;
+	frame->header.requestId = 0;
+	frame->wireLength    = encodeHeader(frame->header, frame->wire);
+	frame->data          = data;
+	frame->pin           = pin;
+	frame->isFrame       = true;
+	frame->passFd        = -1;
+	frame->zeroCopy      = length >= ZEROCOPY_MIN_LENGTH && !useIoUring && enableZeroCopy();
+	frame->offset        = 0;
+	frame->zeroCopySent  = false;
+	frame->lastSeq       = 0;
+	frame->inFlight      = false;
+	frame->queuedAt      = monotonicUs();
+
+	if (prefixLength != 0) {
+		const uint8_t* prefix_p = static_cast<const uint8_t*>(prefix);
+		frame->prefix.assign(prefix_p, prefix_p + prefixLength);
+	}
+
+	queueFrame(frame);
 
 	TRACE_EXIT;
 }
 
 void
-Connection::addDefaultMessageHandler (const message_handler_t& handler)
+Connection::sendSharedFrame (message_t type, shared_ptr<SharedFrame> frame)
 {
 	TRACE_ENTER;
 
-	// Abort insertion if the handler is already present
-	for (message_handler_set::iterator itr = defaultHandlers.begin();
-	     itr != defaultHandlers.end();
-	     itr++)
-	{
-		if (*itr == &handler)
-		{
-			TRACE("Default handler 0x" << hex << &handler << " already exists");
-			return;
-		}
+	if (connectionClosedFlag) {
+		THROW_ERROR("Connection has closed.");
 	}
 
-	TRACE("Adding default message handler 0x" << hex << &handler);
-	defaultHandlers.push_back(&handler);
+	if (!local) {
+		THROW_ERROR("Frames can only be passed by reference over a unix domain socket");
+	}
+
+	shared_ptr<OutgoingMessage> message(new OutgoingMessage());
+	message->header.type   = SHARED_FRAME_MESSAGE;
+	message->header.length = sizeof(SharedFrameHeader);
+	message->header.requestId = 0;
+	message->wireLength    = encodeHeader(message->header, message->wire);
+	message->isFrame       = true;
+	message->passFd        = frame->getFd();
+	message->pin           = frame;
+	message->zeroCopy      = false;
+	message->offset        = 0;
+	message->zeroCopySent  = false;
+	message->lastSeq       = 0;
+	message->inFlight      = false;
+	message->queuedAt      = monotonicUs();
+
+	SharedFrameHeader body;
+	body.type   = type;
+	body.length = frame->getLength();
+	uint8_t* body_p = reinterpret_cast<uint8_t*>(&body);
+	message->copy.assign(body_p, body_p + sizeof(body));
+	message->data = &message->copy[0];
+
+	queueFrame(message);
 
 	TRACE_EXIT;
 }
 
 void
-Connection::removeMessageHandler (message_t type, const message_handler_t& handler)
+Connection::sendDescriptor (message_t type, size_t length, void* data, int passFd)
 {
 	TRACE_ENTER;
 
-	message_handler_set &hs = handlers[type];
+	if (connectionClosedFlag) {
+		THROW_ERROR("Connection has closed.");
+	}
 
-	// Search for the handler in the list
-	for (message_handler_set::iterator itr = hs.begin();
-	     itr != hs.end();
-	     /* increment manually */)
-	{
-		if (*itr == &handler)
-		{
-			TRACE("Removing message handler 0x" << hex << &handler << " for message type " << dec << type);
-			itr = hs.erase(itr);
-			break;
-		}
-		else
-		{
-			itr++;
-		}
+	if (!local) {
+		THROW_ERROR("Descriptors can only be passed over a unix domain socket");
 	}
 
-	// Remove key if no values are left
-	if (handlers[type].size() == 0)
-	{
-		TRACE("Last handler of type " << dec << type << " removed; removing key from handler map");
-		handlers.erase(type);
+	if (data == NULL && length != 0) {
+		THROW_ERROR("Null data pointer given with nonzero length = " << length
+		         << " (message type = " << type << ")");
+	}
+
+	// Our own copy, which stays open until the message has gone out
+	int copy = fcntl(passFd, F_DUPFD_CLOEXEC, 0);
+	if (copy == -1) {
+		THROW_ERROR("Unable to duplicate descriptor: " << strerror(errno));
 	}
+	shared_ptr<int> pin(new int(copy), [] (int* fd_p)
+	{
+		::close(*fd_p);
+		delete fd_p;
+	});
+
+	uint32_t requestId = replyRequestId();
+
+	MutexLock lock(writerMutex);
+	lock.relock();
+
+	enqueueControl(type, length, data, 0, requestId);
+	sendQueue.back()->passFd = copy;
+	sendQueue.back()->pin    = pin;
+	flushOrArm();
+
+	lock.unlock();
+
+	waitForControlBacklog();
 
 	TRACE_EXIT;
 }
 
 void
-Connection::removeDefaultMessageHandler (const message_handler_t& handler)
+Connection::queueFrame (shared_ptr<OutgoingMessage> frame)
 {
-	TRACE_ENTER;
+	MutexLock lock(writerMutex);
+	lock.relock();
 
-	// Search for the handler in the list
-	for (message_handler_set::iterator itr = defaultHandlers.begin();
-	     itr != defaultHandlers.end();
-	     /* increment manually */)
+	// Latest frame wins: if the last frame hasn't even started going out,
+	// the peer is behind, and there's no point sending it now.
+	for (outgoing_list::iterator itr = sendQueue.begin();
+	     itr != sendQueue.end();
+	     itr++)
 	{
-		if (*itr == &handler)
+		if ((*itr)->isFrame && (*itr)->offset == 0 && !(*itr)->inFlight)
 		{
-			TRACE("Removing default message handler 0x" << hex << &handler);
-			itr = defaultHandlers.erase(itr);
+			TRACE("Dropping stale frame in favor of a newer one");
+			sendQueue.erase(itr);
+			framesDropped++;
+			break;
+		}
+	}
+
+	sendQueue.push_back(frame);
+
+	// Release whatever earlier frames are done, so the camera gets its
+	// buffers back as soon as possible
+	reapZeroCopyCompletions();
+
+	flushOrArm();
+}
+
+void
+Connection::queueMessage (message_t type, size_t length, void* data)
+{
+	TRACE_ENTER;
+
+	if (data == NULL && length != 0) {
+		THROW_ERROR("Null data pointer given with nonzero length = " << length
+		         << " (message type = " << type << ")");
+	}
+
+	uint32_t requestId = replyRequestId();
+
+	MutexLock lock(writerMutex);
+	lock.relock();
+
+	enqueueControl(type, length, data, 0, requestId);
+
+	TRACE_EXIT;
+}
+
+void
+Connection::queueMessage (message_t type)
+{
+	queueMessage(type, 0, NULL);
+}
+
+void
+Connection::flushMessages ()
+{
+	TRACE_ENTER;
+
+	if (connectionClosedFlag) {
+		THROW_ERROR("Connection has closed.");
+	}
+
+	MutexLock lock(writerMutex);
+	lock.relock();
+
+	TRACE("Flushing " << sendQueue.size() << " queued messages to socket " << fd);
+	flushOrArm();
+
+	lock.unlock();
+
+	waitForControlBacklog();
+
+	TRACE_EXIT;
+}
+
+Connection::Stats
+Connection::getStats ()
+{
+	Stats stats;
+	stats.bytesIn    = bytesIn;
+	stats.messagesIn = messagesIn;
+
+	MutexLock lock(writerMutex);
+	lock.relock();
+
+	stats.bytesOut      = bytesOut;
+	stats.messagesOut   = messagesOut;
+	stats.framesSent    = framesSent;
+	stats.framesDropped = framesDropped;
+	stats.queueDepth    = sendQueue.size();
+	stats.queuedBytes   = 0;
+	for (outgoing_list::iterator itr = sendQueue.begin();
+	     itr != sendQueue.end();
+	     itr++)
+	{
+		stats.queuedBytes += (*itr)->wireLength + (*itr)->header.length - (*itr)->offset;
+	}
+	stats.sendLatency   = sendLatency;
+	stats.pacingRate    = pacingRate;
+
+	return stats;
+}
+
+void
+Connection::countIncoming (const MessageHeader& header)
+{
+	messagesIn++;
+	bytesIn += sizeof(header) + header.length;
+}
+
+uint64_t
+Connection::getFramesDropped ()
+{
+	return framesDropped;
+}
+
+void
+Connection::setPacingRate (uint64_t bytesPerSecond)
+{
+	if (local || bytesPerSecond == pacingRate) {
+		return;
+	}
+
+	// Older kernels only take 32 bits, and ~0U means no limit
+	uint32_t rate = bytesPerSecond == 0 || bytesPerSecond >= UINT32_MAX
+	              ? ~0U : (uint32_t) bytesPerSecond;
+	if (setsockopt(fd, SOL_SOCKET, SO_MAX_PACING_RATE, &rate, sizeof(rate)))
+	{
+		WARNING("Unable to set SO_MAX_PACING_RATE: " << strerror(errno));
+		return;
+	}
+	pacingRate = bytesPerSecond;
+}
+
+uint64_t
+Connection::getPacingRate ()
+{
+	return pacingRate;
+}
+
+size_t
+Connection::getQueuedFrameBytes ()
+{
+	MutexLock lock(writerMutex);
+	lock.relock();
+
+	size_t bytes = 0;
+	for (outgoing_list::iterator itr = sendQueue.begin();
+	     itr != sendQueue.end();
+	     itr++)
+	{
+		if ((*itr)->isFrame) {
+			bytes += (*itr)->wireLength + (*itr)->header.length - (*itr)->offset;
+		}
+	}
+	return bytes;
+}
+
+in_addr_t
+Connection::getRemoteAddress ()
+{
+	return remoteAddress;
+}
+
+in_port_t
+Connection::getRemotePort ()
+{
+	return remotePort;
+}
+
+in_addr_t
+Connection::getLocalAddress ()
+{
+	if (local) {
+		return LOCALHOST_IP_ADDR;
+	}
+
+	sockaddr_in localAddress;
+	socklen_t addressLength = sizeof(localAddress);
+	if (getsockname(fd, (sockaddr*) &localAddress, &addressLength)) {
+		THROW_ERROR("getsockname() failed: " << strerror(errno));
+	}
+	return localAddress.sin_addr.s_addr;
+}
+
+bool
+Connection::isLocal ()
+{
+	return local;
+}
+
+void
+Connection::dropQueuedFrames ()
+{
+	TRACE_ENTER;
+
+	MutexLock lock(writerMutex);
+	lock.relock();
+
+	outgoing_list::iterator itr = sendQueue.begin();
+	while (itr != sendQueue.end())
+	{
+		if ((*itr)->isFrame && (*itr)->offset == 0 && !(*itr)->inFlight) {
+			itr = sendQueue.erase(itr);
+			framesDropped++;
+		} else {
+			itr++;
+		}
+	}
+
+	TRACE_EXIT;
+}
+
+void
+Connection::enqueueControl (message_t type, size_t length, void* data, size_t offset,
+                            uint32_t requestId)
+{
+	shared_ptr<OutgoingMessage> message(new OutgoingMessage());
+	message->header.type   = type;
+	message->header.length = length;
+	message->header.requestId = requestId;
+	message->wireLength    = encodeHeader(message->header, message->wire);
+	message->isFrame       = false;
+	message->passFd        = -1;
+	message->zeroCopy      = false;
+	message->offset        = offset;
+	message->zeroCopySent  = false;
+	message->lastSeq       = 0;
+	message->inFlight      = false;
+	message->queuedAt      = monotonicUs();
+
+	if (length != 0) {
+		uint8_t* data_p = static_cast<uint8_t*>(data);
+		message->copy.assign(data_p, data_p + length);
+		message->data = &message->copy[0];
+	} else {
+		message->data = NULL;
+	}
+
+	sendQueue.push_back(message);
+	queuedControlBytes += message->wireLength + length - offset;
+}
+
+bool
+Connection::flushSendQueue ()
+{
+	while (!sendQueue.empty())
+	{
+		bool zeroCopy = sendQueue.front()->zeroCopy;
+		gatherSendQueue();
+
+		ssize_t bytesWritten = sendmsg(fd, &flushMsg, MSG_NOSIGNAL | (zeroCopy ? MSG_ZEROCOPY : 0));
+		if (bytesWritten < 0)
+		{
+			if (errno == EINTR) {
+				continue;
+			} else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				return false;
+			} else if (errno == ENOBUFS && zeroCopy) {
+				// Out of memory for pinning pages. Copy this one instead.
+				TRACE("Zero-copy send refused; copying instead");
+				sendQueue.front()->zeroCopy = false;
+				continue;
+			}
+			THROW_ERROR("Failed to write to socket: " << strerror(errno)
+			         << " (error code " << errno << ")");
+		}
+
+		if (zeroCopy)
+		{
+			MutexLock zlock(zeroCopyMutex);
+			zlock.relock();
+			sendQueue.front()->zeroCopySent = true;
+			sendQueue.front()->lastSeq = zeroCopyNextSeq++;
+		}
+
+		creditWritten(bytesWritten);
+	}
+
+	// The completions may have been collected before the messages were
+	// added to the pending list
+	reapZeroCopyCompletions();
+
+	return true;
+}
+
+size_t
+Connection::gatherSendQueue ()
+{
+	// Gather as many messages as possible into one call. A zero-copy
+	// frame goes out on its own, though, since everything in a
+	// MSG_ZEROCOPY call has to stay put until the kernel's done with it.
+	bool zeroCopy = sendQueue.front()->zeroCopy;
+	size_t count = 0;
+
+	flushIov.clear();
+	for (outgoing_list::iterator itr = sendQueue.begin();
+	     itr != sendQueue.end();
+	     itr++)
+	{
+		OutgoingMessage &message = **itr;
+		if (message.zeroCopy != zeroCopy || flushIov.size() + 3 > IOV_MAX) {
+			break;
+		}
+
+		// A descriptor goes with the first byte of the sendmsg() it's
+		// given to, so a message carrying one has to start a call
+		if (message.passFd != -1 && message.offset == 0 && !flushIov.empty()) {
 			break;
 		}
+
+		// Skip whatever was written last time
+		iovec part;
+		size_t offset = message.offset;
+		if (offset < message.wireLength)
+		{
+			part.iov_base = message.wire + offset;
+			part.iov_len  = message.wireLength - offset;
+			flushIov.push_back(part);
+			offset = 0;
+		}
 		else
 		{
-			itr++;
+			offset -= message.wireLength;
+		}
+
+		if (message.prefix.size() > offset)
+		{
+			part.iov_base = &message.prefix[offset];
+			part.iov_len  = message.prefix.size() - offset;
+			flushIov.push_back(part);
+			offset = 0;
+		}
+		else
+		{
+			offset -= message.prefix.size();
+		}
+
+		size_t bodyLength = message.header.length - message.prefix.size();
+		if (bodyLength > offset)
+		{
+			part.iov_base = static_cast<uint8_t*>(message.data) + offset;
+			part.iov_len  = bodyLength - offset;
+			flushIov.push_back(part);
+		}
+
+		count++;
+
+		if (zeroCopy) {
+			break;
+		}
+	}
+
+	memset(&flushMsg, 0, sizeof(flushMsg));
+	flushMsg.msg_iov    = &flushIov[0];
+	flushMsg.msg_iovlen = flushIov.size();
+
+	OutgoingMessage &first = *sendQueue.front();
+	if (first.passFd != -1 && first.offset == 0)
+	{
+		flushMsg.msg_control    = flushControl.buffer;
+		flushMsg.msg_controllen = sizeof(flushControl.buffer);
+
+		cmsghdr* cmsg = CMSG_FIRSTHDR(&flushMsg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type  = SCM_RIGHTS;
+		cmsg->cmsg_len   = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(cmsg), &first.passFd, sizeof(int));
+	}
+
+	return count;
+}
+
+void
+Connection::creditWritten (size_t written)
+{
+	bytesOut += written;
+	uint64_t now = monotonicUs();
+
+	while (!sendQueue.empty())
+	{
+		shared_ptr<OutgoingMessage> message = sendQueue.front();
+		size_t remaining = message->wireLength + message->header.length - message->offset;
+
+		if (written < remaining)
+		{
+			message->offset += written;
+			if (!message->isFrame) {
+				queuedControlBytes -= written;
+			}
+			break;
+		}
+
+		written -= remaining;
+		message->offset += remaining;
+		if (!message->isFrame) {
+			queuedControlBytes -= remaining;
+		}
+		sendQueue.pop_front();
+
+		messagesOut++;
+		if (message->isFrame) {
+			framesSent++;
+		}
+
+		// Smoothed the same way TCP smooths its round trip time
+		uint64_t waited = now - message->queuedAt;
+		sendLatency = sendLatency == 0 ? waited : (sendLatency * 7 + waited) / 8;
+		Metrics::sendQueueWait().observe(waited);
+
+		// The kernel may still be reading a zero-copy message
+		if (message->zeroCopySent)
+		{
+			MutexLock zlock(zeroCopyMutex);
+			zlock.relock();
+			zeroCopyPending.push_back(message);
 		}
 	}
+}
+
+void
+Connection::submitSendQueue ()
+{
+	if (uringSendInFlight || sendQueue.empty() || fd == -1) {
+		return;
+	}
+
+	shared_ptr<EventLoop> loop = eventLoop.lock();
+	shared_ptr<IoUring> uring = loop ? loop->getIoUring() : shared_ptr<IoUring>();
+
+	size_t count = gatherSendQueue();
+
+	// The kernel reads the messages some time after this returns, so the
+	// completion holds on to them (and to the connection, which owns the
+	// message header and iovecs) even if the queue is cleared first
+	shared_ptr<Connection> self = shared_from_this();
+	outgoing_list batch;
+	outgoing_list::iterator itr = sendQueue.begin();
+	for (size_t i = 0; i < count; i++, itr++)
+	{
+		(*itr)->inFlight = true;
+		batch.push_back(*itr);
+	}
+
+	IoUring::completion_t onComplete = [self, batch] (int result)
+	{
+		self->handleSendCompletion(result);
+	};
+
+	if (uring && uring->sendmsg(fd, &flushMsg, MSG_NOSIGNAL, onComplete))
+	{
+		uringSendInFlight = true;
+		return;
+	}
+
+	// The ring's gone; carry on without it
+	for (itr = batch.begin(); itr != batch.end(); itr++) {
+		(*itr)->inFlight = false;
+	}
+	useIoUring = false;
+	setWriteArmed(!flushSendQueue());
+}
+
+void
+Connection::handleSendCompletion (int result)
+{
+	MutexLock lock(writerMutex);
+	lock.relock();
+
+	uringSendInFlight = false;
+	for (outgoing_list::iterator itr = sendQueue.begin();
+	     itr != sendQueue.end() && (*itr)->inFlight;
+	     itr++)
+	{
+		(*itr)->inFlight = false;
+	}
+	pthread_cond_broadcast(&uringSendCond);
+
+	if (result == -EAGAIN || result == -EINTR)
+	{
+		// Nothing went out; try again once there's room
+		setWriteArmed(true);
+		return;
+	}
+	else if (result == -EINVAL || result == -EOPNOTSUPP)
+	{
+		// The kernel's io_uring doesn't do sendmsg()
+		MESSAGE("io_uring refused a send (" << strerror(-result) << "); using sendmsg()");
+		useIoUring = false;
+		setWriteArmed(!flushSendQueue());
+		return;
+	}
+	else if (result < 0)
+	{
+		// The event loop will notice the connection is gone and close it
+		TRACE("Failed to write to socket: " << strerror(-result));
+		sendQueue.clear();
+		queuedControlBytes = 0;
+		return;
+	}
+
+	creditWritten(result);
+	if (sendQueue.empty()) {
+		return;
+	}
+
+	// The ring can't take a submission from its completion thread, so the
+	// rest of the queue goes from a worker
+	shared_ptr<EventLoop> loop = eventLoop.lock();
+	if (!loop)
+	{
+		flushOrArm();
+		return;
+	}
+
+	shared_ptr<Connection> self = shared_from_this();
+	loop->post([self] ()
+	{
+		MutexLock lock(self->writerMutex);
+		lock.relock();
+		self->flushOrArm();
+	});
+}
+
+void
+Connection::flushOrArm ()
+{
+	if (useIoUring)
+	{
+		// The ring waits for room in the socket itself, so the event loop
+		// only needs to watch for it after a send came back empty-handed
+		setWriteArmed(false);
+		submitSendQueue();
+		return;
+	}
+
+	setWriteArmed(!flushSendQueue());
+}
+
+void
+Connection::setWriteArmed (bool armed)
+{
+	if (armed == writeArmed) {
+		return;
+	}
+
+	shared_ptr<EventLoop> loop = eventLoop.lock();
+	if (loop)
+	{
+		TRACE((armed ? "Waiting" : "No longer waiting") << " for room in socket " << fd);
+		loop->modify(*this, EPOLLIN | EPOLLRDHUP | (armed ? EPOLLOUT : 0));
+		writeArmed = armed;
+	}
+}
+
+void
+Connection::waitForControlBacklog ()
+{
+	while (queuedControlBytes > MAX_QUEUED_CONTROL_BYTES && !connectionClosedFlag)
+	{
+		TRACE("Too many control messages queued; waiting for room in socket " << fd);
+
+		MutexLock lock(writerMutex);
+		if (useIoUring)
+		{
+			// The socket may have room already; what matters is the ring
+			// getting through what's been submitted
+			lock.relock();
+			while (uringSendInFlight && !connectionClosedFlag) {
+				pthread_cond_wait(&uringSendCond, &writerMutex);
+			}
+		}
+		else
+		{
+			waitUntilWritable();
+			lock.relock();
+		}
+
+		flushOrArm();
+	}
+}
+
+void
+Connection::waitUntilWritable ()
+{
+	pollfd pfd;
+	pfd.fd = fd;
+	pfd.events = POLLOUT;
+	pfd.revents = 0;
+	if (poll(&pfd, 1, -1) < 0 && errno != EINTR) {
+		THROW_ERROR("poll() failed: " << strerror(errno));
+	}
+
+	// Pending zero-copy completions also wake poll() up, and keep on doing
+	// so until they're collected
+	if (pfd.revents & POLLERR) {
+		reapZeroCopyCompletions();
+	}
+}
+
+bool
+Connection::enableZeroCopy ()
+{
+	if (zeroCopyEnabled || !zeroCopyAllowed) {
+		return zeroCopyEnabled && zeroCopyAllowed;
+	}
+
+	int one = 1;
+	if (setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)))
+	{
+		MESSAGE("Zero-copy sends are unavailable: " << strerror(errno));
+		zeroCopyAllowed = false;
+		return false;
+	}
+
+	zeroCopyEnabled = true;
+	return true;
+}
+
+void
+Connection::reapZeroCopyCompletions ()
+{
+	if (!zeroCopyEnabled) {
+		return;
+	}
+
+	MutexLock lock(zeroCopyMutex);
+	lock.relock();
+
+	while (true)
+	{
+		char control[128];
+		msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_control    = control;
+		msg.msg_controllen = sizeof(control);
+
+		if (recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+			// EAGAIN means the queue is empty; anything else will turn up
+			// again on the next ordinary read or write.
+			break;
+		}
+
+		for (cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+		     cmsg != NULL;
+		     cmsg = CMSG_NXTHDR(&msg, cmsg))
+		{
+			if (!(cmsg->cmsg_level == SOL_IP   && cmsg->cmsg_type == IP_RECVERR) &&
+			    !(cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR))
+			{
+				continue;
+			}
+
+			sock_extended_err* serr = reinterpret_cast<sock_extended_err*>(CMSG_DATA(cmsg));
+			if (serr->ee_errno != 0 || serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+				continue;
+			}
+
+			// Sends numbered ee_info through ee_data (inclusive) are done
+			TRACE("Zero-copy sends " << serr->ee_info << " to " << serr->ee_data
+			   << " have completed");
+			if (serr->ee_data + 1 > zeroCopyCompletedSeq) {
+				zeroCopyCompletedSeq = serr->ee_data + 1;
+			}
+
+			if (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+			{
+				// The kernel had to copy the data after all (e.g. over the
+				// loopback device), so pinning the pages only cost extra.
+				MESSAGE("Kernel is copying zero-copy sends; falling back to ordinary sends");
+				zeroCopyAllowed = false;
+			}
+		}
+	}
+
+	// TCP completes sends in order
+	while (!zeroCopyPending.empty() &&
+	       zeroCopyPending.front()->lastSeq < zeroCopyCompletedSeq)
+	{
+		zeroCopyPending.pop_front();
+	}
+}
+
+void
+Connection::sendMessage (message_t type, string text)
+{
+	sendMessage(type, text.length(), (void*) text.c_str());
+}
+
+void
+Connection::sendMessage (message_t type)
+{
+	sendMessage(type, 0, NULL);
+}
+
+void
+Connection::request (message_t type, size_t length, void* data, const response_handler_t& handler)
+{
+	TRACE_ENTER;
+
+	MutexLock lock(requestsMutex);
+	lock.relock();
+
+	// Checked with the lock held, so that failRequests() can't miss it
+	if (connectionClosedFlag) {
+		THROW_ERROR("Connection has closed.");
+	}
+
+	uint32_t requestId = nextRequestId;
+	nextRequestId = nextRequestId + 1 < REPLY_FLAG ? nextRequestId + 1 : 1;
+
+	// Registered before it's sent, since the reply may beat us back
+	PendingRequest& pending = pendingRequests[requestId];
+	pending.handler = handler;
+	pending.replied = false;
+
+	lock.unlock();
+
+	try
+	{
+		sendControl(type, length, data, requestId);
+	}
+	catch (runtime_error e)
+	{
+		MutexLock relock(requestsMutex);
+		relock.relock();
+
+		// If it's gone already, failRequests() has told the handler
+		if (pendingRequests.erase(requestId) != 0) {
+			throw;
+		}
+	}
+
+	TRACE_EXIT;
+}
+
+future<Connection::Reply>
+Connection::request (message_t type, size_t length, void* data)
+{
+	shared_ptr< promise<Reply> > reply(new promise<Reply>());
+	future<Reply> result = reply->get_future();
+
+	request(type, length, data, [reply] (message_t type, message_len_t length, void* buffer)
+	{
+		if (type == CONNECTION_CLOSED_MESSAGE)
+		{
+			reply->set_exception(make_exception_ptr(runtime_error(
+				"Connection closed before the request was complete."
+			)));
+			return;
+		}
+
+		uint8_t* buffer_p = static_cast<uint8_t*>(buffer);
+		Reply value;
+		value.type = type;
+		value.body.assign(buffer_p, buffer_p + length);
+		reply->set_value(value);
+	});
+
+	return result;
+}
+
+future<Connection::Reply>
+Connection::request (message_t type, string text)
+{
+	return request(type, text.length(), (void*) text.c_str());
+}
+
+uint32_t
+Connection::replyRequestId ()
+{
+	if (dispatchingConnection != this || dispatchingRequestId == 0) {
+		return 0;
+	}
+	return dispatchingRequestId | REPLY_FLAG;
+}
+
+void
+Connection::recordReply (const MessageHeader& header, void* buffer)
+{
+	MutexLock lock(requestsMutex);
+	lock.relock();
+
+	map<uint32_t, PendingRequest>::iterator itr =
+		pendingRequests.find(header.requestId & ~REPLY_FLAG);
+	if (itr == pendingRequests.end()) {
+		return;
+	}
+
+	uint8_t* buffer_p = static_cast<uint8_t*>(buffer);
+	itr->second.replied   = true;
+	itr->second.replyType = header.type;
+	itr->second.replyBody.assign(buffer_p, buffer_p + header.length);
+}
+
+void
+Connection::completeRequest (uint32_t requestId)
+{
+	MutexLock lock(requestsMutex);
+	lock.relock();
+
+	map<uint32_t, PendingRequest>::iterator itr = pendingRequests.find(requestId);
+	if (itr == pendingRequests.end())
+	{
+		TRACE("Request " << requestId << " isn't pending");
+		return;
+	}
+
+	PendingRequest request;
+	swap(request, itr->second);
+	pendingRequests.erase(itr);
+
+	lock.unlock();
+
+	// Handlers get a buffer even for an empty reply, as they do for an
+	// empty message
+	message_t type = request.replied ? request.replyType : REQUEST_COMPLETE_MESSAGE;
+	message_len_t length = request.replyBody.size();
+	request.replyBody.push_back(0);
+	request.handler(type, length, &request.replyBody[0]);
+}
+
+void
+Connection::failRequests ()
+{
+	MutexLock lock(requestsMutex);
+	lock.relock();
+	map<uint32_t, PendingRequest> failed;
+	failed.swap(pendingRequests);
+	lock.unlock();
+
+	uint8_t nothing = 0;
+	for (map<uint32_t, PendingRequest>::iterator itr = failed.begin();
+	     itr != failed.end();
+	     itr++)
+	{
+		try
+		{
+			itr->second.handler(CONNECTION_CLOSED_MESSAGE, 0, &nothing);
+		}
+		catch (runtime_error e)
+		{
+			ERROR("Response handler failed: " << e.what());
+		}
+	}
+}
+
+void
+Connection::addMessageHandler (message_t type, const message_handler_t& handler)
+{
+	TRACE_ENTER;
+
+	//shared_ptr<message_handler_set> hs = handlers[type];
+	message_handler_set &hs = handlers[type];
+	//handlers[type] = hs; // Inserts it if it doesn't already exist
+
+	// Abort insertion if the handler is already present
+	for (message_handler_set::iterator itr = hs.begin();
+	     itr != hs.end();
+	     itr++)
+	{
+		if (*itr == &handler)
+		{
+			TRACE("Handler 0x" << hex << &handler << " already exists for message type " << dec << type);
+			return;
+		}
+	}
+
+	TRACE("Adding handler 0x" << hex << &handler << " for message type " << dec << type);
+	TRACE("# of handlers was: " << hs.size());
+	hs.push_back(&handler);
+	TRACE("# of handlers is: " << hs.size());
+
+	TRACE_EXIT;
+}
+
+void
+Connection::addDefaultMessageHandler (const message_handler_t& handler)
+{
+	TRACE_ENTER;
+
+	// Abort insertion if the handler is already present
+	for (message_handler_set::iterator itr = defaultHandlers.begin();
+	     itr != defaultHandlers.end();
+	     itr++)
+	{
+		if (*itr == &handler)
+		{
+			TRACE("Default handler 0x" << hex << &handler << " already exists");
+			return;
+		}
+	}
+
+	TRACE("Adding default message handler 0x" << hex << &handler);
+	defaultHandlers.push_back(&handler);
+
+	TRACE_EXIT;
+}
+
+void
+Connection::removeMessageHandler (message_t type, const message_handler_t& handler)
+{
+	TRACE_ENTER;
+
+	message_handler_set &hs = handlers[type];
+
+	// Search for the handler in the list
+	for (message_handler_set::iterator itr = hs.begin();
+	     itr != hs.end();
+	     /* increment manually */)
+	{
+		if (*itr == &handler)
+		{
+			TRACE("Removing message handler 0x" << hex << &handler << " for message type " << dec << type);
+			itr = hs.erase(itr);
+			break;
+		}
+		else
+		{
+			itr++;
+		}
+	}
+
+	// Remove key if no values are left
+	if (handlers[type].size() == 0)
+	{
+		TRACE("Last handler of type " << dec << type << " removed; removing key from handler map");
+		handlers.erase(type);
+	}
+
+	TRACE_EXIT;
+}
+
+void
+Connection::removeDefaultMessageHandler (const message_handler_t& handler)
+{
+	TRACE_ENTER;
+
+	// Search for the handler in the list
+	for (message_handler_set::iterator itr = defaultHandlers.begin();
+	     itr != defaultHandlers.end();
+	     /* increment manually */)
+	{
+		if (*itr == &handler)
+		{
+			TRACE("Removing default message handler 0x" << hex << &handler);
+			itr = defaultHandlers.erase(itr);
+			break;
+		}
+		else
+		{
+			itr++;
+		}
+	}
+
+	TRACE_EXIT;
+}
+
+void
+Connection::readerThread (void* unused)
+{
+	TRACE_ENTER;
+	try
+	{
+		while (!stopReadingFlag)
+		{
+			MessageHeader header;
+			ReceiveTarget target;
+			vector<int> fds;
+
+			TRACE("Awaiting incoming message");
+			if (!receiveMessage(header, target, fds)) {
+				MESSAGE("Peer has closed the connection; Terminating thread.");
+				break;
+			}
+			TRACE("Received message type " << header.type << ", " << header.length << " bytes.");
+
+			countIncoming(header);
+
+			void* data = target.parts[0].iov_base;
+			shared_ptr<void> keepalive = target.pin;
+			target.pin.reset();
+			if (openSharedFrame(header, data, keepalive, fds)) {
+				dispatchMessage(header, data, adoptDescriptor(fds), keepalive);
+			}
+		}
+	}
+	catch (runtime_error e)
+	{
+		cerr << "!! Caught exception in reader thread:" << endl
+			 << "!! " << e.what() << endl;
+	}
+	catch (bad_function_call e)
+	{
+		cerr << "!! Caught exception in reader thread:" << endl
+			 << "!! " << e.what() << endl;
+	}
+
+	connectionClosedFlag = true;
+
+	// Nothing more is coming back for any requests
+	failRequests();
+	connectionClosed();
+
+	// Nobody asked for it to close, so somebody may want to know
+	if (!stopReadingFlag)
+	{
+		MutexLock lock(closeHandlerMutex);
+		lock.relock();
+		if (closeHandler) {
+			closeHandler();
+		}
+	}
+
+	readerThreadExited = true;
+
+	TRACE_EXIT;
+}
+
+void
+Connection::dispatchMessage (MessageHeader& header, void* buffer, shared_ptr<int> passedFd,
+                             shared_ptr<void> keepalive)
+{
+	// The peer is done replying to one of our requests
+	if (header.type == REQUEST_COMPLETE_MESSAGE)
+	{
+		completeRequest(header.requestId & ~REPLY_FLAG);
+		return;
+	}
+
+	// Handlers collect the descriptor with takeDescriptor(). Whatever they
+	// leave is closed once the last reference goes.
+	dispatchFd = passedFd;
+	passedFd.reset();
+	dispatchPin = keepalive;
+	keepalive.reset();
+	dispatchingReply = (header.requestId & REPLY_FLAG) != 0;
+
+	// Whatever the handlers send back from this thread answers the request
+	// (a reply doesn't get replies of its own)
+	uint32_t requestId = (header.requestId & REPLY_FLAG) ? 0 : header.requestId;
+	Connection* outerConnection = dispatchingConnection;
+	uint32_t outerRequestId = dispatchingRequestId;
+	dispatchingConnection = this;
+	dispatchingRequestId  = requestId;
+
+	// Once the handlers are done, however they finish, the peer is told
+	// it's had all the replies it's getting
+	auto finish = [&] ()
+	{
+		dispatchingConnection = outerConnection;
+		dispatchingRequestId  = outerRequestId;
+		dispatchFd.reset();
+		dispatchPin.reset();
+		dispatchingReply = false;
+
+		if (requestId != 0 && !connectionClosedFlag) {
+			sendControl(REQUEST_COMPLETE_MESSAGE, 0, NULL, requestId | REPLY_FLAG);
+		}
+	};
+
+	try
+	{
+		// Call the handlers for the given message type, or the default
+		// handlers if none exist.
+
+		// First, figure out if any handlers exist which match the message
+		// type.
+		message_handler_map::iterator handlersItr = handlers.find(header.type);
+
+		if (handlersItr != handlers.end() && handlersItr->second.size() >= 0)
+		{
+			TRACE("There are " << handlersItr->second.size()
+			   << " handlers for message type " << header.type);
+			for (message_handler_set::iterator itr = handlersItr->second.begin();
+			     itr != handlersItr->second.end();
+			     itr++)
+			{
+				TRACE("Calling handler");
+				// Call the handler
+				(**itr)(header.type, header.length, buffer);
+			}
+		}
+		else
+		{
+			TRACE("There are " << defaultHandlers.size() << " default handlers");
+			// If no handlers exist, process the default handlers
+			for (message_handler_set::iterator itr = defaultHandlers.begin();
+			     itr != defaultHandlers.end();
+			     itr++)
+			{
+				TRACE("Calling default handler");
+				(**itr)(header.type, header.length, buffer);
+			}
+		}
+	}
+	catch (...)
+	{
+		try
+		{
+			finish();
+		}
+		catch (runtime_error e)
+		{
+			// The handler's exception is the one worth reporting
+		}
+		throw;
+	}
+
+	finish();
+
+	if (header.requestId & REPLY_FLAG) {
+		recordReply(header, buffer);
+	}
+}
+
+bool
+Connection::handlingReply ()
+{
+	return dispatchingReply;
+}
+
+void
+Connection::connectionClosed ()
+{ }
+
+int
+Connection::takeDescriptor ()
+{
+	if (!dispatchFd) {
+		return -1;
+	}
+
+	int passedFd = *dispatchFd;
+	*dispatchFd = -1;
+	return passedFd;
+}
+
+void
+Connection::setReceiveTarget (message_t type, const receive_target_provider_t& provider)
+{
+	if (type == SHARED_FRAME_MESSAGE || type == REQUEST_COMPLETE_MESSAGE) {
+		THROW_ERROR("Message type " << type << " is reserved");
+	}
+
+	MutexLock lock(receiveTargetsMutex);
+	lock.relock();
+	if (provider) {
+		receiveTargets[type] = provider;
+	} else {
+		receiveTargets.erase(type);
+	}
+}
+
+shared_ptr<void>
+Connection::getMessagePin ()
+{
+	if (dispatchingConnection != this) {
+		return shared_ptr<void>();
+	}
+	return dispatchPin;
+}
+
+Connection::ReceiveTarget
+Connection::chooseReceiveTarget (const MessageHeader& header)
+{
+	ReceiveTarget target;
+
+	// Providers are called outside the lock, in case one wants to change
+	// the providers
+	receive_target_provider_t provider;
+	{
+		MutexLock lock(receiveTargetsMutex);
+		lock.relock();
+		map<message_t, receive_target_provider_t>::iterator itr = receiveTargets.find(header.type);
+		if (itr != receiveTargets.end()) {
+			provider = itr->second;
+		}
+	}
+
+	if (provider)
+	{
+		try
+		{
+			target = provider(header);
+		}
+		catch (runtime_error e)
+		{
+			ERROR("Unable to choose where message type " << header.type
+			   << " goes: " << e.what());
+			target = ReceiveTarget();
+		}
+
+		size_t length = 0;
+		for (int i = 0; i < target.numParts && i < ReceiveTarget::MAX_PARTS; i++) {
+			length += target.parts[i].iov_len;
+		}
+		if (target.numParts > ReceiveTarget::MAX_PARTS ||
+		    (target.numParts > 0 && length != header.length))
+		{
+			WARNING("Receive target for message type " << header.type << " holds "
+			     << length << " bytes rather than " << header.length << "; ignoring it");
+			target = ReceiveTarget();
+		}
+
+		if (target.numParts > 0) {
+			return target;
+		}
+	}
+
+	BufferPool::buffer_ptr buffer = receivePool->acquire(header.length);
+	target.parts[0].iov_base = &(*buffer)[0];
+	target.parts[0].iov_len  = header.length;
+	target.numParts = 1;
+	target.pin = buffer;
+	return target;
+}
+
+void
+Connection::attachToEventLoop (shared_ptr<EventLoop> loop)
+{
+	TRACE_ENTER;
+
+	int flags = fcntl(fd, F_GETFL);
+	if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK)) {
+		THROW_ERROR("Unable to make socket non-blocking: " << strerror(errno));
+	}
+
+	stopReadingFlag = false;
+	eventLoop = loop;
+	useIoUring = (bool) loop->getIoUring();
+	loop->add(shared_from_this(), EPOLLIN | EPOLLRDHUP);
+
+	TRACE_EXIT;
+}
+
+void
+Connection::enableWebSocket ()
+{
+	webSocket = true;
+}
+
+bool
+Connection::isWebSocket ()
+{
+	return webSocket;
+}
+
+int
+Connection::getEventFd ()
+{
+	return fd;
+}
+
+bool
+Connection::handleEvents (uint32_t events)
+{
+	if (stopReadingFlag) {
+		return false;
+	}
+
+	if (!(webSocket ? readWebSocket() : readMessages())) {
+		return false;
+	}
+
+	if (events & EPOLLOUT)
+	{
+		// There's room in the socket for whatever's left in the queue
+		MutexLock lock(writerMutex);
+		lock.relock();
+		try
+		{
+			flushOrArm();
+		}
+		catch (runtime_error e)
+		{
+			ERROR(e.what());
+			return false;
+		}
+	}
+
+	if (events & EPOLLERR)
+	{
+		// Zero-copy completions are delivered through the error queue, so
+		// this isn't necessarily a real error.
+		reapZeroCopyCompletions();
+
+		int err = 0;
+		socklen_t errLength = sizeof(err);
+		if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &errLength) || err)
+		{
+			MESSAGE("Connection was reset: " << strerror(err));
+			return false;
+		}
+	}
+
+	if (events & EPOLLHUP) {
+		MESSAGE("Connection was reset.");
+		return false;
+	}
+
+	return true;
+}
+
+bool
+Connection::readMessages ()
+{
+	// Read until the socket runs dry. A single wakeup may carry several
+	// messages, or only part of one.
+	while (true)
+	{
+		iovec parts[ReceiveTarget::MAX_PARTS];
+		int   numParts = 1;
+		bool  readAhead = false;
+
+		if (incomingBytes == 0 && !local)
+		{
+			// Between messages, so take as much as there is
+			compactReceiveBuffer();
+			parts[0].iov_base = &receiveBuffer[receiveEnd];
+			parts[0].iov_len  = receiveBuffer.size() - receiveEnd;
+			readAhead = true;
+		}
+		else if (incomingBytes < sizeof(incomingHeader))
+		{
+			parts[0].iov_base = reinterpret_cast<uint8_t*>(&incomingHeader) + incomingBytes;
+			parts[0].iov_len  = sizeof(incomingHeader) - incomingBytes;
+		}
+		else
+		{
+			numParts = skipParts(incomingTarget.parts, incomingTarget.numParts,
+			                     incomingBytes - sizeof(incomingHeader), parts);
+		}
+
+		ssize_t bytesReceived = receive(parts, numParts, 0, incomingFds);
+		if (bytesReceived < 0)
+		{
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				break;
+			} else if (errno == EINTR) {
+				continue;
+			}
+			ERROR("Error reading from socket: " << strerror(errno)
+			   << " (error code " << errno << ")");
+			return false;
+		}
+		else if (bytesReceived == 0)
+		{
+			MESSAGE("Peer has closed the connection.");
+			return false;
+		}
+
+		if (readAhead)
+		{
+			receiveEnd += bytesReceived;
+			takeBufferedMessages();
+			continue;
+		}
+
+		incomingBytes += bytesReceived;
+
+		if (incomingBytes == sizeof(incomingHeader))
+		{
+			incomingHeader = swapHeader(incomingHeader);
+			TRACE("Received message type " << incomingHeader.type << ", "
+			   << incomingHeader.length << " bytes.");
+
+			incomingTarget = chooseReceiveTarget(incomingHeader);
+		}
+
+		if (incomingBytes >= sizeof(incomingHeader) &&
+		    incomingBytes == sizeof(incomingHeader) + incomingHeader.length)
+		{
+			finishIncoming();
+		}
+	}
+
+	return true;
+}
+
+void
+Connection::takeBufferedMessages ()
+{
+	while (receiveEnd - receiveStart >= sizeof(incomingHeader))
+	{
+		memcpy(&incomingHeader, &receiveBuffer[receiveStart], sizeof(incomingHeader));
+		incomingHeader = swapHeader(incomingHeader);
+		receiveStart += sizeof(incomingHeader);
+		TRACE("Received message type " << incomingHeader.type << ", "
+		   << incomingHeader.length << " bytes.");
+
+		incomingTarget = chooseReceiveTarget(incomingHeader);
+
+		size_t buffered = receiveEnd - receiveStart;
+		if (buffered > incomingHeader.length) {
+			buffered = incomingHeader.length;
+		}
+		if (buffered > 0) {
+			copyToParts(incomingTarget.parts, incomingTarget.numParts,
+			            &receiveBuffer[receiveStart], buffered);
+			receiveStart += buffered;
+		}
+		incomingBytes = sizeof(incomingHeader) + buffered;
+
+		// The rest of the body goes straight into its target
+		if (buffered < incomingHeader.length) {
+			return;
+		}
+
+		finishIncoming();
+	}
+}
+
+void
+Connection::finishIncoming ()
+{
+	countIncoming(incomingHeader);
+
+	void* data = incomingTarget.parts[0].iov_base;
+	shared_ptr<void> keepalive = incomingTarget.pin;
+	incomingTarget = ReceiveTarget();
+	if (openSharedFrame(incomingHeader, data, keepalive, incomingFds)) {
+		queueDispatch(incomingHeader, data, keepalive, adoptDescriptor(incomingFds));
+	}
+	incomingBytes = 0;
+}
+
+void
+Connection::compactReceiveBuffer ()
+{
+	if (receiveBuffer.empty()) {
+		receiveBuffer.resize(RECEIVE_BUFFER_SIZE);
+	}
+
+	// Only ever part of a header is left over, so this is cheap
+	if (receiveStart == receiveEnd) {
+		receiveStart = receiveEnd = 0;
+	} else if (receiveStart > 0) {
+		memmove(&receiveBuffer[0], &receiveBuffer[receiveStart], receiveEnd - receiveStart);
+		receiveEnd -= receiveStart;
+		receiveStart = 0;
+	}
+}
+
+bool
+Connection::receiveMessage (MessageHeader& header, ReceiveTarget& target, vector<int>& fds)
+{
+	ssize_t bytesReceived;
+	size_t buffered = 0;
+
+	if (local)
+	{
+		bytesReceived = receive(&header, sizeof(header), MSG_WAITALL, fds);
+		if (bytesReceived < 0) {
+			THROW_ERROR("Error reading from socket: " << strerror(errno)
+			         << " (error code " << errno << ")");
+		} else if (bytesReceived == 0) {
+			return false;
+		}
+
+		header = swapHeader(header);
+		target = chooseReceiveTarget(header);
+	}
+	else
+	{
+		while (receiveEnd - receiveStart < sizeof(header))
+		{
+			compactReceiveBuffer();
+			bytesReceived = recv(fd, &receiveBuffer[receiveEnd],
+			                     receiveBuffer.size() - receiveEnd, 0);
+			if (bytesReceived < 0 && errno == EINTR) {
+				continue;
+			} else if (bytesReceived < 0) {
+				THROW_ERROR("Error reading from socket: " << strerror(errno)
+				         << " (error code " << errno << ")");
+			} else if (bytesReceived == 0) {
+				return false;
+			}
+			receiveEnd += bytesReceived;
+		}
+
+		memcpy(&header, &receiveBuffer[receiveStart], sizeof(header));
+		header = swapHeader(header);
+		receiveStart += sizeof(header);
+
+		target = chooseReceiveTarget(header);
+
+		buffered = receiveEnd - receiveStart;
+		if (buffered > header.length) {
+			buffered = header.length;
+		}
+		if (buffered > 0) {
+			copyToParts(target.parts, target.numParts, &receiveBuffer[receiveStart], buffered);
+			receiveStart += buffered;
+		}
+	}
+
+	// Whatever's left of the body goes straight into its target
+	if (header.length > buffered)
+	{
+		iovec parts[ReceiveTarget::MAX_PARTS];
+		int numParts = skipParts(target.parts, target.numParts, buffered, parts);
+		bytesReceived = receive(parts, numParts, MSG_WAITALL, fds);
+		if (bytesReceived < 0) {
+			THROW_ERROR("Error reading from socket: " << strerror(errno)
+			         << " (error code " << errno << ")");
+		} else if (bytesReceived == 0) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+bool
+Connection::readWebSocket ()
+{
+	// Peers may split messages across frames, or put several in one, so
+	// unwrapped frames go into a stream which messages are cut out of
+	while (true)
+	{
+		size_t used = webSocketFrames.size();
+		webSocketFrames.resize(used + 16384);
+
+		ssize_t bytesReceived = recv(fd, &webSocketFrames[used], 16384, 0);
+		webSocketFrames.resize(used + (bytesReceived > 0 ? bytesReceived : 0));
+		if (bytesReceived < 0)
+		{
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				break;
+			} else if (errno == EINTR) {
+				continue;
+			}
+			ERROR("Error reading from socket: " << strerror(errno)
+			   << " (error code " << errno << ")");
+			return false;
+		}
+		else if (bytesReceived == 0)
+		{
+			MESSAGE("Peer has closed the connection.");
+			return false;
+		}
+
+		// Unwrap every frame which has arrived in full
+		size_t consumed = 0;
+		while (webSocketFrames.size() - consumed >= 2)
+		{
+			uint8_t* frame = &webSocketFrames[consumed];
+			size_t available = webSocketFrames.size() - consumed;
+
+			uint8_t opcode = frame[0] & 0x0F;
+			if (!(frame[1] & WS_MASKED))
+			{
+				ERROR("WebSocket peer sent an unmasked frame");
+				failWebSocket(WS_STATUS_PROTOCOL_ERROR);
+				return false;
+			}
+
+			uint64_t length = frame[1] & 0x7F;
+			size_t headerLength = 2;
+			if (length == 126)
+			{
+				uint16_t length16;
+				if (available < 4) {
+					break;
+				}
+				memcpy(&length16, &frame[2], sizeof(length16));
+				length = ntohs(length16);
+				headerLength = 4;
+			}
+			else if (length == 127)
+			{
+				uint64_t length64;
+				if (available < 10) {
+					break;
+				}
+				memcpy(&length64, &frame[2], sizeof(length64));
+				length = be64toh(length64);
+				headerLength = 10;
+			}
+
+			// Control frames can't be fragmented, and are short enough to
+			// answer straight from the buffer
+			if ((opcode & WS_CONTROL)
+			 && (length > WS_MAX_CONTROL_PAYLOAD || !(frame[0] & WS_FIN)))
+			{
+				ERROR("WebSocket peer sent a " << (frame[0] & WS_FIN ? "" : "fragmented ")
+				   << length << " byte control frame");
+				failWebSocket(WS_STATUS_PROTOCOL_ERROR);
+				return false;
+			}
+			if (length > MAX_WEBSOCKET_MESSAGE)
+			{
+				ERROR("WebSocket peer sent a " << length << " byte frame");
+				failWebSocket(WS_STATUS_TOO_BIG);
+				return false;
+			}
+			if (available < headerLength + 4 + length) {
+				break;
+			}
+
+			uint8_t* mask    = &frame[headerLength];
+			uint8_t* payload = mask + 4;
+			for (size_t i = 0; i < length; i++) {
+				payload[i] ^= mask[i % 4];
+			}
+			consumed += headerLength + 4 + length;
+
+			switch (opcode)
+			{
+			  case WS_CONTINUATION:
+			  case WS_BINARY:
+				webSocketMessages.insert(webSocketMessages.end(), payload, payload + length);
+				break;
+
+			  case WS_PING:
+				sendWebSocketControl(WS_PONG, payload, length);
+				break;
+
+			  case WS_PONG:
+				break;
+
+			  case WS_CLOSE:
+				// Echo the status code back, as the closing handshake asks
+				MESSAGE("WebSocket peer has closed the connection.");
+				sendWebSocketControl(WS_CLOSE, payload, length < 2 ? length : 2);
+				return false;
+
+			  case WS_TEXT:
+				ERROR("WebSocket peer sent a text frame; only binary frames carry messages");
+				failWebSocket(WS_STATUS_UNSUPPORTED);
+				return false;
+
+			  default:
+				ERROR("WebSocket peer sent a frame with opcode " << (int) opcode);
+				failWebSocket(WS_STATUS_PROTOCOL_ERROR);
+				return false;
+			}
+		}
+		webSocketFrames.erase(webSocketFrames.begin(), webSocketFrames.begin() + consumed);
+
+		// Hand over every message which is complete
+		size_t offset = 0;
+		while (webSocketMessages.size() - offset >= sizeof(MessageHeader))
+		{
+			MessageHeader header;
+			memcpy(&header, &webSocketMessages[offset], sizeof(header));
+			header = swapHeader(header);
+			if (header.length > MAX_WEBSOCKET_MESSAGE - sizeof(header))
+			{
+				ERROR("WebSocket peer sent a " << header.length << " byte message");
+				failWebSocket(WS_STATUS_TOO_BIG);
+				return false;
+			}
+			if (webSocketMessages.size() - offset < sizeof(header) + header.length) {
+				break;
+			}
+
+			shared_ptr< vector<uint8_t> > buffer = receivePool->acquire(header.length);
+			if (header.length > 0) {
+				memcpy(&(*buffer)[0], &webSocketMessages[offset + sizeof(header)], header.length);
+			}
+			offset += sizeof(header) + header.length;
+
+			countIncoming(header);
+
+			// Nothing comes with descriptors over a WebSocket, so shared
+			// frames are refused
+			vector<int> noFds;
+			void* data = &(*buffer)[0];
+			shared_ptr<void> keepalive = buffer;
+			if (openSharedFrame(header, data, keepalive, noFds)) {
+				queueDispatch(header, data, keepalive, shared_ptr<int>());
+			}
+		}
+		webSocketMessages.erase(webSocketMessages.begin(), webSocketMessages.begin() + offset);
+	}
+
+	return true;
+}
+
+void
+Connection::sendWebSocketControl (uint8_t opcode, const uint8_t* payload, size_t length)
+{
+	shared_ptr<OutgoingMessage> message(new OutgoingMessage());
+	message->header.type   = 0;
+	message->header.length = length;
+	message->header.requestId = 0;
+	message->wireLength    = encodeWebSocketFrame(opcode, length, message->wire);
+	message->isFrame       = false;
+	message->passFd        = -1;
+	message->zeroCopy      = false;
+	message->offset        = 0;
+	message->zeroCopySent  = false;
+	message->lastSeq       = 0;
+	message->inFlight      = false;
+	message->queuedAt      = monotonicUs();
+	message->copy.assign(payload, payload + length);
+	message->data          = length != 0 ? &message->copy[0] : NULL;
+
+	MutexLock lock(writerMutex);
+	lock.relock();
+
+	sendQueue.push_back(message);
+	queuedControlBytes += message->wireLength + length;
+	try
+	{
+		flushOrArm();
+	}
+	catch (runtime_error e)
+	{
+		ERROR(e.what());
+	}
+}
+
+void
+Connection::failWebSocket (uint16_t status)
+{
+	uint16_t wireStatus = htons(status);
+	sendWebSocketControl(WS_CLOSE, (const uint8_t*) &wireStatus, sizeof(wireStatus));
+}
+
+void
+Connection::handleRemoved ()
+{
+	connectionClosedFlag = true;
+	failRequests();
+	connectionClosed();
+}
+
+void
+Connection::queueDispatch (const MessageHeader& header, void* data, shared_ptr<void> keepalive,
+                           shared_ptr<int> passedFd)
+{
+	MutexLock lock(dispatchMutex);
+	lock.relock();
+
+	ReceivedMessage message;
+	message.header    = header;
+	message.data      = data;
+	message.keepalive = keepalive;
+	message.passedFd  = passedFd;
+	dispatchQueue.push_back(message);
+
+	if (!dispatchScheduled)
+	{
+		shared_ptr<EventLoop> loop = eventLoop.lock();
+		if (loop)
+		{
+			dispatchScheduled = true;
+
+			// The task keeps the connection alive until it's done
+			shared_ptr<Connection> self = shared_from_this();
+			loop->post([self] () { self->drainDispatchQueue(); });
+		}
+	}
+}
+
+void
+Connection::drainDispatchQueue ()
+{
+	MutexLock lock(dispatchMutex);
+
+	while (true)
+	{
+		lock.relock();
+		if (dispatchQueue.empty()) {
+			dispatchScheduled = false;
+			break;
+		}
+		ReceivedMessage message = dispatchQueue.front();
+		dispatchQueue.pop_front();
+		lock.unlock();
+
+		try
+		{
+			dispatchMessage(message.header, message.data, message.passedFd, message.keepalive);
+		}
+		catch (runtime_error e)
+		{
+			cerr << "!! Caught exception in message handler:" << endl
+			     << "!! " << e.what() << endl;
+		}
+		catch (bad_function_call e)
+		{
+			cerr << "!! Caught exception in message handler:" << endl
+			     << "!! " << e.what() << endl;
+		}
+	}
+}
+
+ssize_t
+Connection::receive (void* buffer, size_t length, int flags, vector<int>& fds)
+{
+	if (!local) {
+		return recv(fd, buffer, length, flags);
+	}
+
+	iovec part;
+	part.iov_base = buffer;
+	part.iov_len  = length;
+	return receive(&part, 1, flags, fds);
+}
+
+ssize_t
+Connection::receive (const iovec* parts, int numParts, int flags, vector<int>& fds)
+{
+	size_t length = 0;
+	for (int i = 0; i < numParts; i++) {
+		length += parts[i].iov_len;
+	}
+
+	if (!local)
+	{
+		msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov    = const_cast<iovec*>(parts);
+		msg.msg_iovlen = numParts;
+		return recvmsg(fd, &msg, flags);
+	}
+
+	// Reads stop short where descriptors were passed, even with
+	// MSG_WAITALL, so keep going until everything's here
+	size_t total = 0;
+	do
+	{
+		iovec iov[ReceiveTarget::MAX_PARTS];
+		int iovcnt = skipParts(parts, numParts, total, iov);
+
+		union
+		{
+			char buffer[CMSG_SPACE(MAX_RECEIVED_FDS * sizeof(int))];
+			cmsghdr align;
+		} control;
+
+		msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov        = iov;
+		msg.msg_iovlen     = iovcnt;
+		msg.msg_control    = control.buffer;
+		msg.msg_controllen = sizeof(control.buffer);
+
+		ssize_t bytesReceived = recvmsg(fd, &msg, flags | MSG_CMSG_CLOEXEC);
+		if (bytesReceived <= 0) {
+			return total > 0 ? total : bytesReceived;
+		}
+		total += bytesReceived;
+
+		if (msg.msg_flags & MSG_CTRUNC) {
+			WARNING("Too many descriptors were passed with a message; some were dropped");
+		}
+
+		for (cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+		     cmsg != NULL;
+		     cmsg = CMSG_NXTHDR(&msg, cmsg))
+		{
+			if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+				continue;
+			}
+
+			size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+			for (size_t i = 0; i < count; i++)
+			{
+				int passedFd;
+				memcpy(&passedFd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+				fds.push_back(passedFd);
+			}
+		}
+	} while ((flags & MSG_WAITALL) && total < length);
+
+	return total;
+}
+
+bool
+Connection::openSharedFrame (MessageHeader& header, void*& data, shared_ptr<void>& keepalive,
+                             vector<int>& fds)
+{
+	if (header.type != SHARED_FRAME_MESSAGE) {
+		return true;
+	}
+
+	if (fds.empty() || header.length < sizeof(SharedFrameHeader))
+	{
+		ERROR("Received a shared frame without its memfd; dropping it");
+		for (size_t i = 0; i < fds.size(); i++) {
+			::close(fds[i]);
+		}
+		fds.clear();
+		return false;
+	}
+
+	SharedFrameHeader frame;
+	memcpy(&frame, data, sizeof(frame));
+
+	int frameFd = fds[0];
+	for (size_t i = 1; i < fds.size(); i++) {
+		::close(fds[i]);
+	}
+	fds.clear();
+
+	// The frame has to stay the same size for as long as it's mapped, or
+	// reading it could fault
+	const int requiredSeals = F_SEAL_SHRINK | F_SEAL_WRITE;
+	struct stat status;
+	int seals = fcntl(frameFd, F_GET_SEALS);
+	if (seals == -1 || (seals & requiredSeals) != requiredSeals ||
+	    fstat(frameFd, &status) || (size_t) status.st_size < frame.length)
+	{
+		ERROR("Received a shared frame which isn't sealed; dropping it");
+		::close(frameFd);
+		return false;
+	}
+
+	header.type   = frame.type;
+	header.length = frame.length;
+
+	if (frame.length == 0)
+	{
+		::close(frameFd);
+		shared_ptr< vector<uint8_t> > buffer = receivePool->acquire(0);
+		data = &(*buffer)[0];
+		keepalive = buffer;
+		return true;
+	}
+
+	// A private mapping, so a handler which scribbles on its buffer only
+	// changes its own copy of the page
+	void* mapping = mmap(NULL, frame.length, PROT_READ | PROT_WRITE, MAP_PRIVATE, frameFd, 0);
+	::close(frameFd);
+	if (mapping == MAP_FAILED)
+	{
+		ERROR("Unable to map shared frame: " << strerror(errno));
+		return false;
+	}
+
+	size_t length = frame.length;
+	data = mapping;
+	keepalive = shared_ptr<void>(mapping, [length] (void* p) { munmap(p, length); });
+	return true;
+}
+
+//--- Server ---//
+
+Server::Server (bool useEventLoop_):
+	stopAcceptingFlag   (true),
+	useEventLoop        (useEventLoop_),
+	numAcceptors        (1),
+	backlog             (DEFAULT_BACKLOG),
+	reaperThreadStarted (false),
+	stopReapingFlag     (false)
+{
+	TRACE_ENTER;
+
+	int err;
+	if ((err = pthread_mutex_init(&connectionsMutex, NULL))) {
+		THROW_ERROR("Error creating mutex: " << strerror(err));
+	}
+	if ((err = pthread_mutex_init(&listenFdsMutex, NULL))) {
+		THROW_ERROR("Error creating mutex: " << strerror(err));
+	}
+
+	// The reaper waits out its interval on the monotonic clock
+	pthread_condattr_t condAttr;
+	pthread_condattr_init(&condAttr);
+	pthread_condattr_setclock(&condAttr, CLOCK_MONOTONIC);
+	err = pthread_cond_init(&reaperCond, &condAttr);
+	pthread_condattr_destroy(&condAttr);
+	if (err) {
+		THROW_ERROR("Error creating condition variable: " << strerror(err));
+	}
+
+	TRACE_EXIT;
+}
+
+Server::~Server ()
+{
+	stop();
+	pthread_cond_destroy(&reaperCond);
+	pthread_mutex_destroy(&listenFdsMutex);
+	pthread_mutex_destroy(&connectionsMutex);
+}
+
+int
+Server::listenTcp (in_port_t port)
+{
+	int fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	if (fd == -1) {
+		THROW_ERROR("Failed to open socket.");
+	}
+	MESSAGE("Opened socket with descriptor " << fd);
+
+	// Every acceptor binds the same port, and the kernel balances
+	// connections between them
+	int on = 1;
+	if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)))
+	{
+		close(fd);
+		THROW_ERROR("Unable to set SO_REUSEPORT: " << strerror(errno));
+	}
+
+	// Prepare the arguments for bind()
+	sockaddr_in bindAddress;
+	memset(&bindAddress, 0, sizeof(bindAddress));
+	bindAddress.sin_family      = AF_INET;
+	bindAddress.sin_port        = htons(port);
+	bindAddress.sin_addr.s_addr = htonl(INADDR_ANY);
+
+	// Associate the socket with a port and (any) IP address
+	MESSAGE("Binding to socket with IP address "
+	     << ip2string(ntohl(bindAddress.sin_addr.s_addr))
+	     << ", port " << ntohs(bindAddress.sin_port));
+	if (::bind(fd, (sockaddr *) &bindAddress, sizeof(bindAddress))) {
+		close(fd);
+		THROW_ERROR("bind() failed: " << strerror(errno));
+	}
+
+	// Start listening for connections.
+	MESSAGE("Listening for connections...");
+	if (listen(fd, backlog)) {
+		close(fd);
+		THROW_ERROR("listen() failed: " << strerror(errno));
+	}
+
+	return fd;
+}
+
+void
+Server::start (in_port_t port)
+{
+	TRACE_ENTER;
+
+	vector<int> fds;
+	try
+	{
+		for (int i = 0; i < numAcceptors; i++) {
+			fds.push_back(listenTcp(port));
+		}
+	}
+	catch (runtime_error e)
+	{
+		for (size_t i = 0; i < fds.size(); i++) {
+			close(fds[i]);
+		}
+		throw;
+	}
+
+	MutexLock lock(listenFdsMutex);
+	lock.relock();
+	listenFds = fds;
+	lock.unlock();
+
+	serve();
+
+	TRACE_EXIT;
+}
+
+void
+Server::startUnix (string path)
+{
+	TRACE_ENTER;
+
+	sockaddr_un bindAddress;
+	memset(&bindAddress, 0, sizeof(bindAddress));
+	bindAddress.sun_family = AF_UNIX;
+	if (path.length() >= sizeof(bindAddress.sun_path)) {
+		THROW_ERROR("Socket path is too long: " << path);
+	}
+	strncpy(bindAddress.sun_path, path.c_str(), sizeof(bindAddress.sun_path) - 1);
+
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd == -1) {
+		THROW_ERROR("Failed to open socket.");
+	}
+	MESSAGE("Opened socket with descriptor " << fd);
+
+	// A socket left behind by an earlier run would make bind() fail
+	unlink(path.c_str());
+
+	MESSAGE("Binding to socket at " << path);
+	if (::bind(fd, (sockaddr *) &bindAddress, sizeof(bindAddress))) {
+		close(fd);
+		THROW_ERROR("bind() failed: " << strerror(errno));
+	}
+	socketPath = path;
+
+	MESSAGE("Listening for connections...");
+	if (listen(fd, backlog)) {
+		close(fd);
+		THROW_ERROR("listen() failed: " << strerror(errno));
+	}
+
+	// SO_REUSEPORT doesn't apply to unix domain sockets, so the acceptors
+	// all wait on this one
+	MutexLock lock(listenFdsMutex);
+	lock.relock();
+	listenFds.assign(1, fd);
+	lock.unlock();
+
+	serve();
+
+	TRACE_EXIT;
+}
+
+void
+Server::serve ()
+{
+	TRACE_ENTER;
+
+	if (useEventLoop)
+	{
+		eventLoop = shared_ptr<EventLoop>(new EventLoop());
+		eventLoop->start();
+	}
+
+	stopAcceptingFlag = false;
+
+	stopReapingFlag = false;
+	reaperThreadHandle = pthread_create_using_method<Server, void*>(
+		*this, &Server::reaperThread, NULL
+	);
+	reaperThreadStarted = true;
+
+	// Nothing else touches listenFds until stop(), which only shuts them down
+	vector<pthread_t> acceptors;
+	for (int i = 1; i < numAcceptors; i++)
+	{
+		acceptors.push_back(pthread_create_using_method<Server, int>(
+			*this, &Server::acceptorThread, listenFds[i % listenFds.size()]
+		));
+	}
+
+	// If this acceptor fails, the others are stopped before it's passed on
+	bool failed = false;
+	runtime_error failure("");
+	try
+	{
+		started(eventLoop);
+		acceptConnections(listenFds[0]);
+	}
+	catch (runtime_error e)
+	{
+		failed = true;
+		failure = e;
+		stop();
+	}
+
+	for (size_t i = 0; i < acceptors.size(); i++) {
+		pthread_join(acceptors[i], NULL);
+	}
+
+	MutexLock lock(listenFdsMutex);
+	lock.relock();
+	for (size_t i = 0; i < listenFds.size(); i++) {
+		close(listenFds[i]);
+	}
+	listenFds.clear();
+	lock.unlock();
+
+	if (failed) {
+		throw failure;
+	}
+
+	TRACE_EXIT;
+}
+
+void
+Server::acceptConnections (int listenFd)
+{
+	TRACE_ENTER;
+
+	while(!stopAcceptingFlag)
+	{
+		// Wait for new connections. This will hang until a connection is made,
+		// or the process is killed.
+		MESSAGE("Awaiting new connections...");
+		sockaddr_storage clientAddress;
+		socklen_t        clientAddressSize = sizeof(clientAddress);
+		int connFd = accept(listenFd, (sockaddr *) &clientAddress, &clientAddressSize);
+		if (connFd < 0)
+		{
+			if (stopAcceptingFlag) {
+				break;
+			}
+
+			switch (errno)
+			{
+			  // The peer gave up while waiting in line
+			  case EINTR:
+			  case ECONNABORTED:
+			  case EPROTO:
+				continue;
+
+			  // Out of descriptors or memory. Throw away whatever's
+			  // finished, and give the rest a moment to close.
+			  case EMFILE:
+			  case ENFILE:
+			  case ENOBUFS:
+			  case ENOMEM:
+				WARNING("accept() failed: " << strerror(errno) << "; retrying");
+				reapConnections();
+				usleep(100000);
+				continue;
+
+			  default:
+				THROW_ERROR("accept() failed: " << strerror(errno));
+			}
+		}
+
+		// Local peers don't have an address, but they're on this host
+		in_addr_t remoteAddress = LOCALHOST_IP_ADDR;
+		in_port_t remotePort    = 0;
+		if (clientAddress.ss_family == AF_INET)
+		{
+			sockaddr_in* inetAddress = (sockaddr_in*) &clientAddress;
+			remoteAddress = inetAddress->sin_addr.s_addr;
+			remotePort    = inetAddress->sin_port;
+		}
+
+		MESSAGE("Received connection from client at "
+		     << ip2string(remoteAddress)
+	         // I'm not sure if the port number needs to be reversed or not:
+		     // try "ntohs(clientAddress.sin_port)" if this is wrong
+		     << ", port " << remotePort);
+
+		MutexLock lock(connectionsMutex);
+		lock.relock();
+
+		shared_ptr<Connection> conn = newConnection(connFd, remoteAddress, remotePort);
+		if (eventLoop) {
+			conn->attachToEventLoop(eventLoop);
+		} else {
+			conn->startReaderThread();
+		}
+		connections.push_back(conn);
+
+		lock.unlock();
+	}
+
+	MESSAGE("Socket closed.");
+
+	TRACE_EXIT;
+}
 
-	TRACE_EXIT;
+void
+Server::acceptorThread (int listenFd)
+{
+	try
+	{
+		acceptConnections(listenFd);
+	}
+	catch (runtime_error e)
+	{
+		ERROR("Acceptor failed; stopping the server: " << e.what());
+		stop();
+	}
 }
 
 void
-Connection::readerThread (void* unused)
+Server::reaperThread (void* unused)
 {
 	TRACE_ENTER;
-	try
+
+	MutexLock lock(connectionsMutex);
+	lock.relock();
+
+	while (!stopReapingFlag)
 	{
-		while (!stopReadingFlag)
+		timespec deadline;
+		clock_gettime(CLOCK_MONOTONIC, &deadline);
+		deadline.tv_sec  += REAP_INTERVAL_MS / 1000;
+		deadline.tv_nsec += REAP_INTERVAL_MS % 1000 * 1000000;
+		if (deadline.tv_nsec >= 1000000000)
 		{
-			MessageHeader header;
-			int bytesReceived;
-			shared_ptr< vector<uint8_t> > buffer;
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000;
+		}
 
-			// Read in a message header
-			TRACE("Awaiting incoming message");
-			bytesReceived = recv(fd, &header, sizeof(header), MSG_WAITALL);
-			if (bytesReceived < 0) {
-				THROW_ERROR("Error reading from socket: " << strerror(errno)
-			             << " (error code " << errno << ")");
-			} else if (bytesReceived == 0) {
-				MESSAGE("Peer has closed the connection; Terminating thread.");
-				break;
-			}
+		int err = pthread_cond_timedwait(&reaperCond, &connectionsMutex, &deadline);
+		if (err && err != ETIMEDOUT) {
+			ERROR("pthread_cond_timedwait() failed: " << strerror(err));
+		}
+		if (stopReapingFlag) {
+			break;
+		}
 
-			TRACE("Received message type " << header.type << ", " << header.length << " bytes.");
-			
-			// Read in the message body if it exists
-			if (header.length > 0)
-			{
-				buffer = shared_ptr< vector<uint8_t> >(new vector<uint8_t>(header.length));
-
-				bytesReceived = recv(fd, &(*buffer)[0], header.length, MSG_WAITALL);
-				if (bytesReceived < 0) {
-					THROW_ERROR("Error reading from socket: " << strerror(errno)
-			                 << " (error code " << errno << ")");
-				} else if (bytesReceived == 0) {
-					MESSAGE("Peer has closed the connection. Terminating thread.");
-					break;
-				}
-			}
-			else
-			{
-				// If no data was expected, allocate a blank, single-byte
-				// buffer in case a handler accidentally dereferences it.
-				buffer = shared_ptr< vector<uint8_t> >(new vector<uint8_t>(1));
-				(*buffer)[0] = 0;
-			}
+		lock.unlock();
+		reapConnections();
+		lock.relock();
+	}
 
-			// Call the handlers for the given message type, or the default
-			// handlers if none exist.
+	TRACE_EXIT;
+}
 
-			// First, figure out if any handlers exist which match the message
-			// type.
-			message_handler_map::iterator handlersItr = handlers.find(header.type);
+void
+Server::stop ()
+{
+	stopAcceptingFlag = true;
 
-			if (handlersItr != handlers.end() && handlersItr->second.size() >= 0)
-			{
-				TRACE("There are " << handlersItr->second.size()
-				   << " handlers for message type " << header.type);
-				for (message_handler_set::iterator itr = handlersItr->second.begin();
-			     	 itr != handlersItr->second.end();
-			     	 itr++)
-				{
-					TRACE("Calling handler");
-					// Call the handler
-					(**itr)(header.type, header.length, (void*) &(*buffer)[0]);
-				}
-			}
-			else
-			{
-				TRACE("There are " << defaultHandlers.size() << " default handlers");
-				// If no handlers exist, process the default handlers
-				for (message_handler_set::iterator itr = defaultHandlers.begin();
-			     	 itr != defaultHandlers.end();
-			     	 itr++)
-				{
-					TRACE("Calling default handler");
-					(**itr)(header.type, header.length, (void*) &(*buffer)[0]);
-				}
-			}
-		}
+	// Closing a listening socket doesn't wake a thread blocked in accept(),
+	// but shutting it down does. serve() closes them once the acceptors
+	// have all returned.
+	MutexLock fdsLock(listenFdsMutex);
+	fdsLock.relock();
+	for (size_t i = 0; i < listenFds.size(); i++) {
+		shutdown(listenFds[i], SHUT_RDWR);
 	}
-	catch (runtime_error e)
-	{
-		cerr << "!! Caught exception in reader thread:" << endl
-			 << "!! " << e.what() << endl;
+	fdsLock.unlock();
+
+	if (!socketPath.empty()) {
+		unlink(socketPath.c_str());
+		socketPath.clear();
 	}
-	catch (bad_function_call e)
+
+	if (reaperThreadStarted && !pthread_equal(reaperThreadHandle, pthread_self()))
 	{
-		cerr << "!! Caught exception in reader thread:" << endl
-			 << "!! " << e.what() << endl;
+		MutexLock lock(connectionsMutex);
+		lock.relock();
+		stopReapingFlag = true;
+		pthread_cond_broadcast(&reaperCond);
+		lock.unlock();
+
+		int err = pthread_join(reaperThreadHandle, NULL);
+		if (err) {
+			ERROR("pthread_join() failed: " << strerror(err));
+		}
+		reaperThreadStarted = false;
 	}
 
-	connectionClosedFlag = true;
+	forEachConnection([] (Connection &c) { c.close(); });
 
-	TRACE_EXIT;
+	stopped();
+
+	if (eventLoop) {
+		eventLoop->stop();
+	}
 }
 
-//--- Server ---//
+void
+Server::started (shared_ptr<EventLoop> loop)
+{ }
 
-Server::Server ():
-	fd                (-1),
-	stopAcceptingFlag (true)
+void
+Server::stopped ()
+{ }
+
+void
+Server::adoptConnection (shared_ptr<Connection> conn, shared_ptr<EventLoop> loop)
 {
 	TRACE_ENTER;
 
-	int err;
-	if ((err = pthread_mutex_init(&connectionsMutex, NULL))) {
-		THROW_ERROR("Error creating mutex: " << strerror(err));
+	MESSAGE("Adopting connection from client at " << ip2string(conn->getRemoteAddress())
+	     << ", port " << ntohs(conn->getRemotePort()));
+
+	MutexLock lock(connectionsMutex);
+	lock.relock();
+
+	if (!loop) {
+		loop = eventLoop;
+	}
+	if (loop) {
+		conn->attachToEventLoop(loop);
+	} else {
+		conn->startReaderThread();
 	}
+	connections.push_back(conn);
+
+	lock.unlock();
 
 	TRACE_EXIT;
 }
 
-Server::~Server ()
+void
+Server::setAcceptors (int numAcceptors_)
 {
-	stop();
-	pthread_mutex_destroy(&connectionsMutex);
+	if (numAcceptors_ < 1) {
+		THROW_ERROR("A server needs at least one acceptor, not " << numAcceptors_);
+	}
+	numAcceptors = numAcceptors_;
 }
 
 void
-Server::start (in_port_t port)
+Server::setBacklog (int backlog_)
+{
+	backlog = backlog_;
+}
+
+void
+Server::reapConnections ()
 {
 	TRACE_ENTER;
 
-	fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-	if (fd == -1) {
-		THROW_ERROR("Failed to open socket.");
-	}
-	MESSAGE("Opened socket with descriptor " << fd);
+	connection_list_t finished;
 
-	// Prepare the arguments for bind()
-	sockaddr_in bindAddress;
-	memset(&bindAddress, 0, sizeof(bindAddress));
-	bindAddress.sin_family      = AF_INET;
-	bindAddress.sin_port        = htons(port);
-	bindAddress.sin_addr.s_addr = htonl(INADDR_ANY);
+	MutexLock lock(connectionsMutex);
+	lock.relock();
 
-	// Associate the socket with a port and (any) IP address
-	MESSAGE("Binding to socket with IP address "
-	     << ip2string(ntohl(bindAddress.sin_addr.s_addr))
-	     << ", port " << ntohs(bindAddress.sin_port));
-	if (::bind(fd, (sockaddr *) &bindAddress, sizeof(bindAddress))) {
-		close(fd);
-		fd = -1;
-		THROW_ERROR("bind() failed: " << strerror(errno));
+	connection_list_t::iterator itr = connections.begin();
+	while (itr != connections.end())
+	{
+		connection_list_t::iterator next = itr;
+		next++;
+		if ((*itr)->isFinished()) {
+			finished.splice(finished.end(), connections, itr);
+		}
+		itr = next;
 	}
 
-	// Start listening for connections.
-	MESSAGE("Listening for connections...");
-	if (listen(fd, INCOMING_CONNECTION_QUEUE_SIZE)) {
-		close(fd);
-		fd = -1;
-		THROW_ERROR("listen() failed: " << strerror(errno));
-	}
+	lock.unlock();
 
-	stopAcceptingFlag = false;
-	while(!stopAcceptingFlag)
+	// The reader threads have already returned, so these don't wait.
+	// Whatever the connections close on the way out happens here, too,
+	// rather than under the lock.
+	for (itr = finished.begin(); itr != finished.end(); itr++)
 	{
-		// Wait for new connections. This will hang until a connection is made,
-		// or the process is killed.
-		MESSAGE("Awaiting new connections...");
-		sockaddr_in clientAddress;
-		socklen_t   clientAddressSize = sizeof(clientAddress);
-		int connFd = accept(fd, (sockaddr *) &clientAddress, &clientAddressSize);
-		if (connFd < 0) {
-			close(fd);
-			fd = -1;
-			THROW_ERROR("accept() failed: " << strerror(errno));
+		if ((*itr)->hasReaderThread())
+		{
+			try
+			{
+				(*itr)->joinReaderThread();
+			}
+			catch (runtime_error e)
+			{
+				ERROR("Unable to join reader thread: " << e.what());
+			}
 		}
-
-		MESSAGE("Received connection from client at "
-		     << ip2string(clientAddress.sin_addr.s_addr)
-	         // I'm not sure if the port number needs to be reversed or not:
-		     // try "ntohs(clientAddress.sin_port)" if this is wrong
-		     << ", port " << clientAddress.sin_port);
-
-		MutexLock lock(connectionsMutex);
-		lock.relock();
-
-		shared_ptr<Connection> conn = newConnection(
-				connFd, clientAddress.sin_addr.s_addr, clientAddress.sin_port
-		);
-		conn->startReaderThread();
-		connections.push_back(conn);
-
-		lock.unlock();
 	}
 
-	MESSAGE("Socket closed.");
+	if (!finished.empty()) {
+		MESSAGE("Reaped " << finished.size() << " finished connection(s)");
+	}
 
 	TRACE_EXIT;
 }
 
-void
-Server::stop ()
+size_t
+Server::getConnectionCount ()
 {
-	stopAcceptingFlag = true;
-	close(fd);
-	forEachConnection([] (Connection &c) { c.close(); });
+	MutexLock lock(connectionsMutex);
+	lock.relock();
+	return connections.size();
 }
 
 void
@@ -559,12 +3286,38 @@ Server::forEachConnection (function<void(Connection&)> f)
 
 //--- Client ---//
 
-Client::Client ()
-{ }
+Client::Client ():
+	serverAddressLength    (0),
+	reconnectThreadStarted (false),
+	stopReconnectingFlag   (false),
+	connectionLost         (false)
+{
+	int err;
+	if ((err = pthread_mutex_init(&reconnectMutex, NULL))) {
+		THROW_ERROR("Error creating mutex: " << strerror(err));
+	}
+
+	// Backing off is timed on the monotonic clock
+	pthread_condattr_t condAttr;
+	pthread_condattr_init(&condAttr);
+	pthread_condattr_setclock(&condAttr, CLOCK_MONOTONIC);
+	err = pthread_cond_init(&reconnectCond, &condAttr);
+	pthread_condattr_destroy(&condAttr);
+	if (err) {
+		THROW_ERROR("Error creating condition variable: " << strerror(err));
+	}
+}
 
 Client::~Client ()
 {
-	//TODO
+	// The connection may outlive us, so it mustn't call back in here
+	if (connection) {
+		connection->setCloseHandler(Connection::close_handler_t());
+	}
+	setAutoReconnect(false);
+
+	pthread_cond_destroy(&reconnectCond);
+	pthread_mutex_destroy(&reconnectMutex);
 }
 
 shared_ptr<Connection>
@@ -579,36 +3332,189 @@ Client::connect (string ipAddress, in_port_t port)
 			      << ". Is the address bad?");
 	}
 
-	int fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-	if (fd == -1) {
-		THROW_ERROR("Failed to open socket.");
-	}
-	MESSAGE("Opened socket with descriptor " << fd);
-
 	// Prepare the arguments for connect()
-	sockaddr_in serverAddress;
-	socklen_t   serverAddressLength = sizeof(serverAddress);
+	sockaddr_in* inetAddress = (sockaddr_in*) &serverAddress;
 	memset(&serverAddress, 0, sizeof(serverAddress));
+	serverAddressLength = sizeof(sockaddr_in);
 
-	serverAddress.sin_family = AF_INET;
-	serverAddress.sin_port = htons(port);
+	inetAddress->sin_family = AF_INET;
+	inetAddress->sin_port = htons(port);
 
-	//serverAddress.sin_addr.s_addr = ntohl(address);
-	serverAddress.sin_addr.s_addr = address;
+	//inetAddress->sin_addr.s_addr = ntohl(address);
+	inetAddress->sin_addr.s_addr = address;
 
 	MESSAGE("Connecting to server with IP address "
-	     << ip2string(serverAddress.sin_addr.s_addr)
-	     << ", port " << ntohs(serverAddress.sin_port))
+	     << ip2string(inetAddress->sin_addr.s_addr)
+	     << ", port " << ntohs(inetAddress->sin_port))
+
+	attach(dial(), inetAddress->sin_addr.s_addr, inetAddress->sin_port);
+
+	TRACE_EXIT;
+	return connection;
+}
+
+shared_ptr<Connection>
+Client::connectUnix (string path)
+{
+	TRACE_ENTER;
+
+	sockaddr_un* unixAddress = (sockaddr_un*) &serverAddress;
+	if (path.length() >= sizeof(unixAddress->sun_path)) {
+		THROW_ERROR("Socket path is too long: " << path);
+	}
+	memset(&serverAddress, 0, sizeof(serverAddress));
+	serverAddressLength = sizeof(sockaddr_un);
+	unixAddress->sun_family = AF_UNIX;
+	strncpy(unixAddress->sun_path, path.c_str(), sizeof(unixAddress->sun_path) - 1);
+
+	MESSAGE("Connecting to server at " << path);
+	attach(dial(), LOCALHOST_IP_ADDR, 0);
+
+	TRACE_EXIT;
+	return connection;
+}
+
+int
+Client::dial ()
+{
+	int fd;
+	if (serverAddress.ss_family == AF_UNIX) {
+		fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	} else {
+		fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	}
+	if (fd == -1) {
+		THROW_ERROR("Failed to open socket.");
+	}
+	MESSAGE("Opened socket with descriptor " << fd);
 
 	// Connect to the server
-	if (::connect(fd, (sockaddr *) &serverAddress, sizeof(serverAddress))) {
+	if (::connect(fd, (sockaddr *) &serverAddress, serverAddressLength)) {
 		close(fd);
 		THROW_ERROR("connect() failed: " << strerror(errno));
 	}
 
-	connection = newConnection(fd, serverAddress.sin_addr.s_addr, serverAddress.sin_port);
+	return fd;
+}
+
+void
+Client::attach (int fd, in_addr_t remoteAddress, in_port_t remotePort)
+{
+	if (connection) {
+		connection->setCloseHandler(Connection::close_handler_t());
+	}
+
+	connection = newConnection(fd, remoteAddress, remotePort);
+	connection->setCloseHandler([this] ()
+	{
+		MutexLock lock(reconnectMutex);
+		lock.relock();
+		connectionLost = true;
+		pthread_cond_signal(&reconnectCond);
+	});
 	connection->startReaderThread();
+}
 
-	return connection;
+void
+Client::reconnected (shared_ptr<Connection> connection)
+{ }
+
+void
+Client::setAutoReconnect (bool autoReconnect)
+{
+	if (autoReconnect && !reconnectThreadStarted)
+	{
+		stopReconnectingFlag = false;
+		reconnectThreadHandle = pthread_create_using_method<Client, void*>(
+			*this, &Client::reconnectThread, NULL
+		);
+		reconnectThreadStarted = true;
+	}
+	else if (!autoReconnect && reconnectThreadStarted)
+	{
+		MutexLock lock(reconnectMutex);
+		lock.relock();
+		stopReconnectingFlag = true;
+		pthread_cond_broadcast(&reconnectCond);
+		lock.unlock();
+
+		int err = pthread_join(reconnectThreadHandle, NULL);
+		if (err) {
+			ERROR("pthread_join() failed: " << strerror(err));
+		}
+		reconnectThreadStarted = false;
+	}
 }
 
+void
+Client::reconnectThread (void* unused)
+{
+	TRACE_ENTER;
+
+	MutexLock lock(reconnectMutex);
+	lock.relock();
+
+	// The first attempt goes straight away; after that, they back off
+	int delay = 0;
+
+	while (!stopReconnectingFlag)
+	{
+		if (!connectionLost)
+		{
+			pthread_cond_wait(&reconnectCond, &reconnectMutex);
+			continue;
+		}
+
+		if (delay > 0)
+		{
+			timespec deadline;
+			clock_gettime(CLOCK_MONOTONIC, &deadline);
+			deadline.tv_sec  += delay / 1000;
+			deadline.tv_nsec += delay % 1000 * 1000000;
+			if (deadline.tv_nsec >= 1000000000)
+			{
+				deadline.tv_sec++;
+				deadline.tv_nsec -= 1000000000;
+			}
+			int err = pthread_cond_timedwait(&reconnectCond, &reconnectMutex, &deadline);
+			if (err && err != ETIMEDOUT) {
+				ERROR("pthread_cond_timedwait() failed: " << strerror(err));
+			}
+			if (stopReconnectingFlag) {
+				break;
+			}
+		}
+
+		// If the new connection is lost as well, it's flagged again
+		connectionLost = false;
+		shared_ptr<Connection> conn = connection;
+		lock.unlock();
+
+		bool succeeded = false;
+		try
+		{
+			conn->reconnect(dial());
+			MESSAGE("Reconnected to the server.");
+			reconnected(conn);
+			succeeded = true;
+		}
+		catch (runtime_error e)
+		{
+			WARNING("Unable to reconnect: " << e.what());
+		}
+
+		lock.relock();
+		if (succeeded)
+		{
+			delay = 0;
+		}
+		else
+		{
+			connectionLost = true;
+			delay = delay == 0 ? RECONNECT_MIN_DELAY_MS :
+			        delay * 2 < RECONNECT_MAX_DELAY_MS ? delay * 2 : RECONNECT_MAX_DELAY_MS;
+		}
+	}
+
+	TRACE_EXIT;
+}
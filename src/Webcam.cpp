@@ -153,11 +153,17 @@ xioctl (int fd, int request, void *arg) {
 ///// MappedBuffer /////
 
 	MappedBuffer::MappedBuffer (int _fd, int _index) :
-		fd     (_fd),
-		index  (_index),
-		data   (NULL),
-		length (0)
+		fd        (_fd),
+		index     (_index),
+		data      (NULL),
+		length    (0),
+		streaming (true),
+		flags     (0),
+		sequence  (0)
 	{
+		timestamp.tv_sec  = 0;
+		timestamp.tv_usec = 0;
+
 		_buffer = {0};
 		_buffer.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
 		_buffer.memory = V4L2_MEMORY_MMAP;
@@ -189,6 +195,11 @@ xioctl (int fd, int request, void *arg) {
 	void
 	MappedBuffer::enqueue ()
 	{
+		if (!streaming) {
+			TRACE("Not enqueing buffer " << index << " because capture has stopped");
+			return;
+		}
+
 		TRACE("Enqueing buffer " << index);
 		if (xioctl(fd, VIDIOC_QBUF, &_buffer)) {
 			THROW_ERROR("Error enqueing buffer " << index << ": " << strerror(errno));
@@ -210,7 +221,8 @@ xioctl (int fd, int request, void *arg) {
 
 	Webcam::Webcam (string filename) :
 		device(shared_ptr<File>(new File(filename, O_RDWR))),
-		v4l2_buf_type_video_capture(V4L2_BUF_TYPE_VIDEO_CAPTURE)
+		v4l2_buf_type_video_capture(V4L2_BUF_TYPE_VIDEO_CAPTURE),
+		capturing(false)
 	{
 		int input_num = 0;
 		cout << "Selecting input " << input_num << "\n";
@@ -232,6 +244,12 @@ xioctl (int fd, int request, void *arg) {
 		return device->filename;
 	}
 
+	int
+	Webcam::getNumFramebuffers ()
+	{
+		return capturing ? framebuffers.size() : NUM_FRAMEBUFFERS;
+	}
+
 	shared_ptr<Webcam::fmtdesc_v>
 	Webcam::getSupportedFormats ()
 	{
@@ -368,6 +386,34 @@ xioctl (int fd, int request, void *arg) {
 		return resolution_t(fmt_get.fmt.pix.width, fmt_get.fmt.pix.height);
 	}
 
+	size_t
+	Webcam::getFrameSize ()
+	{
+		struct v4l2_format fmt_get;
+        memset(&fmt_get, 0, sizeof(v4l2_format));
+		fmt_get.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+
+		if (xioctl(device->fd, VIDIOC_G_FMT, &fmt_get)) {
+			THROW_ERROR("Unable to get the current image format: " << strerror(errno));
+		}
+
+		return fmt_get.fmt.pix.sizeimage;
+	}
+
+	size_t
+	Webcam::getStride ()
+	{
+		struct v4l2_format fmt_get;
+		memset(&fmt_get, 0, sizeof(v4l2_format));
+		fmt_get.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+
+		if (xioctl(device->fd, VIDIOC_G_FMT, &fmt_get)) {
+			THROW_ERROR("Unable to get the current image format: " << strerror(errno));
+		}
+
+		return fmt_get.fmt.pix.bytesperline;
+	}
+
 	void
 	Webcam::setResolution (uint32_t width, uint32_t height)
 	{
@@ -514,7 +560,7 @@ xioctl (int fd, int request, void *arg) {
 		if (!capturing)
 		{
 			struct v4l2_requestbuffers req = {0};
-			req.count = 2;
+			req.count = NUM_FRAMEBUFFERS;
 			req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
 			req.memory = V4L2_MEMORY_MMAP;
 
@@ -533,39 +579,17 @@ xioctl (int fd, int request, void *arg) {
 				framebuffers.push_back(shared_ptr<MappedBuffer>(new MappedBuffer(device->fd, i)));
 			}
 
-			// Code for multi-buffer streaming. I don't know how to do this, and so far
-			// I've been limited by the image sensor, so I figure two buffers are enough.
-	/*		fd_set fds;
-			FD_ZERO(&fds);
-			for (int i = 0; i < req.count
-			FD_SET(device->fd, &fds);
-			struct timeval timeout = {0};
-			timeout.tv_sec = 2;
-			int r = select(device->fd+1, &fds, NULL, NULL, &timeout);
-			cout << "Waiting for frame...\n";
-			if (r == -1) {
-				cout << "Error waiting for frame\n";
-				return 1;
+			// Give all the buffers to the camera to fill. getFrame() takes them
+			// back one at a time.
+			for (int i = 0; i < framebuffers.size(); i++) {
+				framebuffers[i]->enqueue();
 			}
 
-			cout << "Retrieving frame...\n";
-			//if (xioctl(device->fd, VIDIOC_DQBUF, &data)) {
-			if (xioctl(device->fd, VIDIOC_DQBUF, &framebuffers[0]->data)) {
-				THROW_ERROR("Error retrieving frame: " << strerror(errno));
-			} else {
-				cout << "Frame retrieved.\n";
-			}
-			// */
-
 			cout << "Starting capture...\n";
 			if (xioctl(device->fd, VIDIOC_STREAMON, &(req.type))) {
 				THROW_ERROR("Error starting capture: " << strerror(errno));
 			}
 
-			// Get the camera started on its first frame
-			currentBuffer = 0;
-			framebuffers[1 - currentBuffer]->enqueue();
-
 			capturing = true;
 		}
 		else
@@ -579,6 +603,12 @@ xioctl (int fd, int request, void *arg) {
 	{
 		if (capturing)
 		{
+			// Frames still held by someone else shouldn't be given back to
+			// a driver that's no longer streaming
+			for (int i = 0; i < framebuffers.size(); i++) {
+				framebuffers[i]->streaming = false;
+			}
+
 			// Tell the webcam to stop
 			cout << "Stopping capture...\n";
 			if (xioctl(device->fd, VIDIOC_STREAMOFF, &v4l2_buf_type_video_capture)) {
@@ -602,10 +632,35 @@ xioctl (int fd, int request, void *arg) {
 	Webcam::getFrame() {
 		if (capturing)
 		{
-			currentBuffer = 1 - currentBuffer;
-			framebuffers[currentBuffer]->dequeue();
-			framebuffers[1 - currentBuffer]->enqueue();
-			return framebuffers[0];
+			// The driver decides which buffer comes back
+			struct v4l2_buffer buffer = {0};
+			buffer.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+			buffer.memory = V4L2_MEMORY_MMAP;
+
+			TRACE("Waiting for a frame");
+			if (xioctl(device->fd, VIDIOC_DQBUF, &buffer)) {
+				THROW_ERROR("Error retrieving frame: " << strerror(errno));
+			}
+			TRACE("Frame retrieved from buffer " << buffer.index);
+
+			// Share ownership with the framebuffer list, but requeue the
+			// buffer instead of deleting it when the last user lets go.
+			shared_ptr<MappedBuffer> mapped = framebuffers[buffer.index];
+			mapped->timestamp = buffer.timestamp;
+			mapped->flags     = buffer.flags;
+			mapped->sequence  = buffer.sequence;
+
+			return shared_ptr<MappedBuffer>(mapped.get(), [mapped] (MappedBuffer*)
+			{
+				try
+				{
+					mapped->enqueue();
+				}
+				catch (runtime_error e)
+				{
+					WARNING(e.what());
+				}
+			});
 		}
 		else
 		{
@@ -0,0 +1,1131 @@
+#include <endian.h>     // htobe64()
+#include <limits.h>     // PATH_MAX
+#include <stdlib.h>     // realpath()
+#include <time.h>       // clock_gettime()
+#include <unistd.h>     // usleep()
+
+#include <atomic>       // atomic counters
+#include <cstring>      // memcpy(), strerror()
+#include <memory>       // shared_ptr
+#include <sstream>      // stringstream
+#include <stdexcept>    // exceptions
+#include <string>       // strings
+#include <vector>       // vectors
+
+#include "IoUring.h"
+#include "Log.h"
+#include "Thread.h"
+#include "WebcamBroadcaster.h"
+#include "webcam_stream_common.h"
+
+using namespace std;
+
+/// How long a spec change waits for the driver's buffers to come back
+static const int FRAMEBUFFER_RETURN_TIMEOUT_MS = 1000;
+
+static uint64_t
+clockUs (clockid_t clock)
+{
+	timespec now;
+	clock_gettime(clock, &now);
+	return (uint64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+/**
+ * When the camera captured a frame, in microseconds since the epoch. Most
+ * drivers stamp frames with the monotonic clock, which means nothing off
+ * this host, so the stamp is moved over to the realtime clock.
+ */
+static uint64_t
+captureTime (const MappedBuffer& frame)
+{
+	uint64_t realtime = clockUs(CLOCK_REALTIME);
+
+	uint64_t stamp = (uint64_t) frame.timestamp.tv_sec * 1000000 + frame.timestamp.tv_usec;
+	if (stamp == 0 ||
+	    (frame.flags & V4L2_BUF_FLAG_TIMESTAMP_MASK) != V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC)
+	{
+		// No telling when it was captured; when it was handed over will do
+		return realtime;
+	}
+
+	uint64_t monotonic = monotonicUs();
+	uint64_t age = monotonic > stamp ? monotonic - stamp : 0;
+	return realtime - age;
+}
+
+///// WebcamBroadcaster /////
+
+	map< string, weak_ptr<WebcamBroadcaster> > WebcamBroadcaster::registry;
+
+	pthread_mutex_t WebcamBroadcaster::registryMutex = PTHREAD_MUTEX_INITIALIZER;
+
+	uint32_t  WebcamBroadcaster::multicastBaseGroup    = DEFAULT_MULTICAST_GROUP;
+	in_port_t WebcamBroadcaster::multicastPort         = DEFAULT_MULTICAST_PORT;
+	in_addr_t WebcamBroadcaster::multicastInterface    = INADDR_ANY;
+	int       WebcamBroadcaster::multicastFecGroupSize = 0;
+	uint32_t  WebcamBroadcaster::nextMulticastOffset   = 0;
+
+	atomic<uint32_t> WebcamBroadcaster::nextStreamId(1);
+
+	const char* const WebcamBroadcaster::MJPEG_BOUNDARY = "webcamframe";
+
+	WebcamBroadcaster::WebcamBroadcaster (string filename):
+		webcam               (new Webcam(filename)),
+		captureThreadStarted (false),
+		captureActiveFlag    (false),
+		frameSeq             (0),
+		streamId             (nextStreamId++),
+		framesOut            (new atomic<int>(0)),
+		framesCaptured       (0),
+		framesSkipped        (0),
+		framesCopied         (0),
+		frameInterval        (0),
+		frameIntervals       (Histogram::latencyBounds()),
+		multicastGroup       (0),
+		multicastSource      (0)
+	{
+		TRACE_ENTER;
+
+		int err;
+		if ((err = pthread_mutex_init(&webcamMutex, NULL))) {
+			THROW_ERROR("Error creating webcam mutex: " << strerror(err));
+		}
+		if ((err = pthread_mutex_init(&subscribersMutex, NULL))) {
+			THROW_ERROR("Error creating subscribers mutex: " << strerror(err));
+		}
+		if ((err = pthread_mutex_init(&controlMutex, NULL))) {
+			THROW_ERROR("Error creating control mutex: " << strerror(err));
+		}
+		if ((err = pthread_cond_init(&captureStoppedCond, NULL))) {
+			THROW_ERROR("Error creating condition variable: " << strerror(err));
+		}
+
+		TRACE_EXIT;
+	}
+
+	WebcamBroadcaster::~WebcamBroadcaster ()
+	{
+		TRACE_ENTER;
+
+		// The capture thread holds a reference to us while it runs, so it's
+		// already gone by now. All that's left is the registry entry, unless
+		// someone has already replaced it.
+		MutexLock lock(registryMutex);
+		lock.relock();
+		map< string, weak_ptr<WebcamBroadcaster> >::iterator itr = registry.find(webcam->getFilename());
+		if (itr != registry.end() && itr->second.expired()) {
+			registry.erase(itr);
+		}
+		lock.unlock();
+
+		MESSAGE("Nobody is using " << webcam->getFilename() << " anymore; closing it");
+
+		pthread_cond_destroy(&captureStoppedCond);
+		pthread_mutex_destroy(&controlMutex);
+		pthread_mutex_destroy(&subscribersMutex);
+		pthread_mutex_destroy(&webcamMutex);
+
+		TRACE_EXIT;
+	}
+
+	shared_ptr<WebcamBroadcaster>
+	WebcamBroadcaster::open (string filename)
+	{
+		TRACE_ENTER;
+
+		// Different paths to the same device should find the same broadcaster
+		char resolved[PATH_MAX];
+		if (realpath(filename.c_str(), resolved) != NULL) {
+			filename = resolved;
+		}
+
+		MutexLock lock(registryMutex);
+		lock.relock();
+
+		shared_ptr<WebcamBroadcaster> broadcaster = registry[filename].lock();
+		if (broadcaster)
+		{
+			TRACE("Sharing the already-open " << filename);
+		}
+		else
+		{
+			broadcaster = shared_ptr<WebcamBroadcaster>(new WebcamBroadcaster(filename));
+			registry[filename] = broadcaster;
+		}
+
+		TRACE_EXIT;
+		return broadcaster;
+	}
+
+	vector< shared_ptr<WebcamBroadcaster> >
+	WebcamBroadcaster::getOpen ()
+	{
+		MutexLock lock(registryMutex);
+		lock.relock();
+
+		vector< shared_ptr<WebcamBroadcaster> > open;
+		for (map< string, weak_ptr<WebcamBroadcaster> >::iterator itr = registry.begin();
+		     itr != registry.end();
+		     itr++)
+		{
+			shared_ptr<WebcamBroadcaster> broadcaster = itr->second.lock();
+			if (broadcaster) {
+				open.push_back(broadcaster);
+			}
+		}
+		return open;
+	}
+
+	WebcamBroadcaster::Stats
+	WebcamBroadcaster::getStats ()
+	{
+		Stats stats;
+		stats.filename        = webcam->getFilename();
+		stats.streamId        = streamId;
+		stats.framesCaptured  = framesCaptured;
+		stats.framesDropped   = framesSkipped;
+		stats.framesCopied    = framesCopied;
+		stats.buffersInFlight = *framesOut;
+		stats.numBuffers      = webcam->getNumFramebuffers();
+
+		MutexLock lock(subscribersMutex);
+		lock.relock();
+		uint64_t interval = frameInterval;
+		stats.captureFps  = captureActiveFlag && interval != 0 ? 1000000.0 / interval : 0;
+		stats.subscribers = subscribers.size();
+		stats.streaming   = countStreaming();
+		stats.viewers     = viewers.size();
+
+		return stats;
+	}
+
+	Histogram&
+	WebcamBroadcaster::getFrameIntervals ()
+	{
+		return frameIntervals;
+	}
+
+	string
+	WebcamBroadcaster::getFilename ()
+	{
+		return webcam->getFilename();
+	}
+
+	void
+	WebcamBroadcaster::attach (shared_ptr<Connection> connection)
+	{
+		MutexLock lock(subscribersMutex);
+		lock.relock();
+
+		Subscriber& subscriber = subscribers[connection.get()];
+		subscriber.connection = connection;
+		subscriber.streaming = false;
+		subscriber.multicast = false;
+		subscriber.ring = false;
+		subscriber.cursor = frameSeq;
+	}
+
+	void
+	WebcamBroadcaster::detach (Connection& connection)
+	{
+		TRACE_ENTER;
+
+		// This may be called from a destructor running on the capture thread,
+		// so it must not wait for the capture thread.
+		MutexLock lock(subscribersMutex);
+		lock.relock();
+
+		subscribers.erase(&connection);
+		if (countStreaming() == 0) {
+			captureActiveFlag = false;
+		}
+
+		TRACE_EXIT;
+	}
+
+	void
+	WebcamBroadcaster::subscribe (Connection& connection)
+	{
+		TRACE_ENTER;
+
+		MutexLock control(controlMutex);
+		control.relock();
+
+		MutexLock lock(subscribersMutex);
+		lock.relock();
+
+		subscriber_map::iterator itr = subscribers.find(&connection);
+		if (itr == subscribers.end()) {
+			THROW_ERROR("Connection must be attached before subscribing");
+		}
+
+		// Start from the next frame
+		itr->second.streaming = true;
+		itr->second.cursor = frameSeq;
+
+		lock.unlock();
+
+		ensureCapturing();
+
+		TRACE_EXIT;
+	}
+
+	void
+	WebcamBroadcaster::ensureCapturing ()
+	{
+		MutexLock lock(subscribersMutex);
+		lock.relock();
+		bool start = !captureActiveFlag;
+		lock.unlock();
+
+		if (start) {
+			startCaptureThread();
+		}
+	}
+
+	struct multicast_spec
+	WebcamBroadcaster::joinMulticast (Connection& connection)
+	{
+		TRACE_ENTER;
+
+		MutexLock control(controlMutex);
+		control.relock();
+
+		if (!multicastSender)
+		{
+			// Give this webcam a group of its own
+			MutexLock registryLock(registryMutex);
+			registryLock.relock();
+			multicastGroup = multicastBaseGroup + nextMulticastOffset++;
+			in_addr_t iface = multicastInterface;
+			in_port_t port = multicastPort;
+			int fecGroupSize = multicastFecGroupSize;
+			registryLock.unlock();
+
+			// Without anything better to go on, publish on whichever network
+			// the first member is on
+			if (iface == htonl(INADDR_ANY)) {
+				iface = connection.getLocalAddress();
+			}
+
+			multicastSender = shared_ptr<MediaSender>(new MediaSender(
+				htonl(multicastGroup), htons(port), fecGroupSize, iface
+			));
+			multicastSource = ntohl(iface);
+		}
+
+		MutexLock lock(subscribersMutex);
+		lock.relock();
+
+		subscriber_map::iterator itr = subscribers.find(&connection);
+		if (itr == subscribers.end()) {
+			THROW_ERROR("Connection must be attached before joining the multicast group");
+		}
+		itr->second.multicast = true;
+
+		struct multicast_spec spec;
+		memset(&spec, 0, sizeof(spec));
+		spec.group = multicastGroup;
+		spec.source = multicastSource;
+		lock.unlock();
+
+		MutexLock registryLock(registryMutex);
+		registryLock.relock();
+		spec.port = multicastPort;
+		spec.fecGroupSize = multicastFecGroupSize;
+		registryLock.unlock();
+
+		Webcam::resolution_t res = getResolution();
+		spec.image.width = res.first;
+		spec.image.height = res.second;
+		spec.image.fmt = getImageFormat();
+
+		ensureCapturing();
+
+		TRACE_EXIT;
+		return spec;
+	}
+
+	void
+	WebcamBroadcaster::leaveMulticast (Connection& connection)
+	{
+		TRACE_ENTER;
+
+		MutexLock lock(subscribersMutex);
+		lock.relock();
+
+		subscriber_map::iterator itr = subscribers.find(&connection);
+		if (itr != subscribers.end()) {
+			itr->second.multicast = false;
+		}
+
+		if (countStreaming() == 0) {
+			captureActiveFlag = false;
+		}
+
+		TRACE_EXIT;
+	}
+
+	bool
+	WebcamBroadcaster::isMulticastMember (Connection& connection)
+	{
+		MutexLock lock(subscribersMutex);
+		lock.relock();
+
+		subscriber_map::iterator itr = subscribers.find(&connection);
+		return itr != subscribers.end() && itr->second.multicast;
+	}
+
+	shared_ptr<FrameRingWriter>
+	WebcamBroadcaster::openRing (Connection& connection)
+	{
+		TRACE_ENTER;
+
+		MutexLock control(controlMutex);
+		control.relock();
+
+		if (!frameRing)
+		{
+			MutexLock webcamLock(webcamMutex);
+			webcamLock.relock();
+			size_t frameSize = webcam->getFrameSize();
+			webcamLock.unlock();
+
+			frameRing = shared_ptr<FrameRingWriter>(new FrameRingWriter(
+				FRAME_RING_SLOTS, frameSize + sizeof(frame_header)
+			));
+		}
+
+		MutexLock lock(subscribersMutex);
+		lock.relock();
+
+		subscriber_map::iterator itr = subscribers.find(&connection);
+		if (itr == subscribers.end()) {
+			THROW_ERROR("Connection must be attached before opening the frame ring");
+		}
+		itr->second.ring = true;
+		shared_ptr<FrameRingWriter> ring = frameRing;
+		lock.unlock();
+
+		ensureCapturing();
+
+		TRACE_EXIT;
+		return ring;
+	}
+
+	void
+	WebcamBroadcaster::closeRing (Connection& connection)
+	{
+		TRACE_ENTER;
+
+		MutexLock lock(subscribersMutex);
+		lock.relock();
+
+		subscriber_map::iterator itr = subscribers.find(&connection);
+		if (itr != subscribers.end()) {
+			itr->second.ring = false;
+		}
+
+		if (countStreaming() == 0) {
+			captureActiveFlag = false;
+		}
+
+		TRACE_EXIT;
+	}
+
+	void
+	WebcamBroadcaster::addViewer (shared_ptr<HttpConnection> viewer)
+	{
+		TRACE_ENTER;
+
+		// Holding this keeps the spec from changing until the viewer's
+		// counted
+		MutexLock control(controlMutex);
+		control.relock();
+
+		Webcam::video_fmt_enum_t fmt = getImageFormat();
+		if (fmt != V4L2_PIX_FMT_MJPEG && fmt != V4L2_PIX_FMT_JPEG) {
+			THROW_ERROR(webcam->getFilename() << " is capturing "
+			         << Webcam::fmt2string(fmt) << ", not MJPEG");
+		}
+
+		viewer->respondStreaming(200,
+			string("Content-Type: multipart/x-mixed-replace; boundary=") + MJPEG_BOUNDARY + "\r\n"
+			"Cache-Control: no-cache\r\n");
+
+		MutexLock lock(subscribersMutex);
+		lock.relock();
+		viewers.push_back(viewer);
+		lock.unlock();
+
+		// The viewer keeps us open, until it hangs up
+		shared_ptr<WebcamBroadcaster> self = shared_from_this();
+		HttpConnection* viewer_p = viewer.get();
+		viewer->setCloseHandler([self, viewer_p] ()
+		{
+			self->removeViewer(*viewer_p);
+		});
+
+		ensureCapturing();
+
+		TRACE_EXIT;
+	}
+
+	void
+	WebcamBroadcaster::removeViewer (HttpConnection& viewer)
+	{
+		TRACE_ENTER;
+
+		MutexLock lock(subscribersMutex);
+		lock.relock();
+
+		for (vector< shared_ptr<HttpConnection> >::iterator itr = viewers.begin();
+		     itr != viewers.end();
+		     itr++)
+		{
+			if (itr->get() == &viewer)
+			{
+				viewers.erase(itr);
+				break;
+			}
+		}
+
+		if (countStreaming() == 0) {
+			captureActiveFlag = false;
+		}
+
+		TRACE_EXIT;
+	}
+
+	bool
+	WebcamBroadcaster::isRingReader (Connection& connection)
+	{
+		MutexLock lock(subscribersMutex);
+		lock.relock();
+
+		subscriber_map::iterator itr = subscribers.find(&connection);
+		return itr != subscribers.end() && itr->second.ring;
+	}
+
+	void
+	WebcamBroadcaster::configureMulticast (uint32_t baseGroup, in_port_t port,
+	                                       in_addr_t interfaceAddress, int fecGroupSize)
+	{
+		MutexLock lock(registryMutex);
+		lock.relock();
+
+		multicastBaseGroup = baseGroup;
+		multicastPort = port;
+		multicastInterface = interfaceAddress;
+		multicastFecGroupSize = fecGroupSize;
+		nextMulticastOffset = 0;
+	}
+
+	void
+	WebcamBroadcaster::unsubscribe (Connection& connection)
+	{
+		TRACE_ENTER;
+
+		MutexLock lock(subscribersMutex);
+		lock.relock();
+
+		subscriber_map::iterator itr = subscribers.find(&connection);
+		if (itr != subscribers.end()) {
+			itr->second.streaming = false;
+		}
+
+		// Let the capture thread wind down on its own. A frame which was
+		// already being handed out may still arrive after this.
+		if (countStreaming() == 0) {
+			captureActiveFlag = false;
+		}
+
+		TRACE_EXIT;
+	}
+
+	bool
+	WebcamBroadcaster::isSubscribed (Connection& connection)
+	{
+		MutexLock lock(subscribersMutex);
+		lock.relock();
+
+		subscriber_map::iterator itr = subscribers.find(&connection);
+		return itr != subscribers.end() && itr->second.streaming;
+	}
+
+	int
+	WebcamBroadcaster::countStreaming ()
+	{
+		int count = 0;
+		for (subscriber_map::iterator itr = subscribers.begin();
+		     itr != subscribers.end();
+		     itr++)
+		{
+			if (itr->second.streaming || itr->second.multicast || itr->second.ring) {
+				count++;
+			}
+		}
+		return count + viewers.size();
+	}
+
+	void
+	WebcamBroadcaster::startCaptureThread ()
+	{
+		TRACE_ENTER;
+
+		// A capture thread that's been told to stop may not have finished
+		// yet, and the driver won't hand out new buffers while anyone is
+		// still holding the old ones
+		waitForCaptureThread();
+		reclaimFramebuffers();
+
+		MutexLock lock(subscribersMutex);
+		lock.relock();
+		captureActiveFlag = true;
+		captureThreadStarted = true;
+		captureKeepalive = shared_from_this();
+		lock.unlock();
+
+		try
+		{
+			pthread_t handle = pthread_create_using_method<WebcamBroadcaster, void*>(
+				*this, &WebcamBroadcaster::captureThread, NULL
+			);
+			pthread_detach(handle);
+		}
+		catch (runtime_error e)
+		{
+			lock.relock();
+			captureActiveFlag = false;
+			captureThreadStarted = false;
+			captureKeepalive.reset();
+			throw;
+		}
+
+		TRACE_EXIT;
+	}
+
+	void
+	WebcamBroadcaster::waitForCaptureThread ()
+	{
+		MutexLock lock(subscribersMutex);
+		lock.relock();
+		while (captureThreadStarted) {
+			pthread_cond_wait(&captureStoppedCond, &subscribersMutex);
+		}
+	}
+
+	void
+	WebcamBroadcaster::reclaimFramebuffers ()
+	{
+		if (*framesOut == 0) {
+			return;
+		}
+
+		// Frames that haven't started going out can just be dropped...
+		vector< shared_ptr<Connection> > attached;
+		MutexLock lock(subscribersMutex);
+		lock.relock();
+		for (subscriber_map::iterator itr = subscribers.begin();
+		     itr != subscribers.end();
+		     itr++)
+		{
+			shared_ptr<Connection> connection = itr->second.connection.lock();
+			if (connection) {
+				attached.push_back(connection);
+			}
+		}
+		lock.unlock();
+
+		for (size_t i = 0; i < attached.size(); i++) {
+			attached[i]->dropQueuedFrames();
+		}
+		attached.clear();
+
+		// ...but the rest have to finish
+		for (int ms = 0; *framesOut > 0 && ms < FRAMEBUFFER_RETURN_TIMEOUT_MS; ms++) {
+			usleep(1000);
+		}
+
+		if (*framesOut > 0) {
+			WARNING(*framesOut << " frames from " << webcam->getFilename()
+			     << " are still out; restarting capture anyway");
+		}
+	}
+
+	shared_ptr<void>
+	WebcamBroadcaster::pinFrame (shared_ptr<MappedBuffer> frame, void*& data)
+	{
+		if (*framesOut + 1 > webcam->getNumFramebuffers() - MIN_FREE_FRAMEBUFFERS)
+		{
+			// Someone's slow, and they're holding on to the driver's buffers.
+			// Copy this one out and give the buffer straight back.
+			TRACE("Only " << webcam->getNumFramebuffers() - *framesOut
+			   << " buffers left for the driver; copying frame " << frameSeq);
+			BufferPool::buffer_ptr copy = copyPool.acquire(frame->length);
+			memcpy(&(*copy)[0], frame->data, frame->length);
+			data = &(*copy)[0];
+			framesCopied++;
+			return copy;
+		}
+
+		// Count the buffer as out until every subscriber is done with it
+		shared_ptr< atomic<int> > counter = framesOut;
+		(*counter)++;
+		data = frame->data;
+		return shared_ptr<void>(frame.get(), [frame, counter] (void*)
+		{
+			(*counter)--;
+		});
+	}
+
+	void
+	WebcamBroadcaster::captureThread (void* unused)
+	{
+		TRACE_ENTER;
+
+		// Stay alive until the thread is done, even if every connection
+		// lets go of us in the meantime
+		MutexLock lock(subscribersMutex);
+		lock.relock();
+		shared_ptr<WebcamBroadcaster> self;
+		self.swap(captureKeepalive);
+		lock.unlock();
+
+		MutexLock webcamLock(webcamMutex);
+
+		try
+		{
+			webcamLock.relock();
+			webcam->startCapture();
+
+			// The spec can't change without stopping capture, so every frame
+			// this time around looks the same
+			Webcam::resolution_t res = webcam->getResolution();
+			Webcam::video_fmt_enum_t fmt = webcam->getImageFormat();
+			uint32_t stride = webcam->getStride();
+			bool compressed = false;
+			shared_ptr<Webcam::fmtdesc_v> formats = webcam->getSupportedFormats();
+			for (size_t i = 0; i < formats->size(); i++)
+			{
+				if ((*formats)[i].pixelformat == fmt) {
+					compressed = (*formats)[i].flags & V4L2_FMT_FLAG_COMPRESSED;
+				}
+			}
+			webcamLock.unlock();
+
+			struct frame_header header;
+			memset(&header, 0, sizeof(header));
+			header.version      = FRAME_HEADER_VERSION;
+			header.headerLength = sizeof(header);
+			header.streamId     = htonl(streamId);
+			header.width        = htonl(res.first);
+			header.height       = htonl(res.second);
+			header.fmt          = htonl(fmt);
+			header.stride       = htonl(compressed ? 0 : stride);
+
+			vector< shared_ptr<Connection> > recipients;
+			vector< shared_ptr<HttpConnection> > watching;
+
+			// Viewers can only be sent frames which are JPEGs already
+			bool jpeg = fmt == V4L2_PIX_FMT_MJPEG || fmt == V4L2_PIX_FMT_JPEG;
+
+			// For the counters; the driver starts counting again with each
+			// capture
+			bool firstFrame = true;
+			uint32_t lastDriverSeq = 0;
+			uint64_t lastCaptured = 0;
+			frameInterval = 0;
+
+			while (captureActiveFlag)
+			{
+				webcamLock.relock();
+				shared_ptr<MappedBuffer> frame = webcam->getFrame();
+				webcamLock.unlock();
+
+				uint64_t now = monotonicUs();
+				framesCaptured++;
+				if (!firstFrame)
+				{
+					framesSkipped += frame->sequence - lastDriverSeq > 1 ?
+					                 frame->sequence - lastDriverSeq - 1 : 0;
+					uint64_t interval = now - lastCaptured;
+					frameInterval = frameInterval == 0 ? interval :
+					                (frameInterval * 7 + interval) / 8;
+					frameIntervals.observe(interval);
+				}
+				firstFrame = false;
+				lastDriverSeq = frame->sequence;
+				lastCaptured = now;
+
+				// Work out who gets this frame, advancing their cursors. Every
+				// connection locked here has to outlive the lock, since
+				// destroying one calls back into detach().
+				lock.relock();
+				frameSeq++;
+				bool publish = false;
+				bool publishRing = false;
+				for (subscriber_map::iterator itr = subscribers.begin();
+				     itr != subscribers.end();
+				     itr++)
+				{
+					// Multicast members get their frames from the group, and
+					// ring readers from the ring
+					if (itr->second.multicast || itr->second.ring) {
+						itr->second.cursor = frameSeq;
+						publish = publish || itr->second.multicast;
+						publishRing = publishRing || itr->second.ring;
+						continue;
+					}
+
+					if (!itr->second.streaming || itr->second.cursor >= frameSeq) {
+						continue;
+					}
+
+					shared_ptr<Connection> connection = itr->second.connection.lock();
+					if (connection)
+					{
+						itr->second.cursor = frameSeq;
+						recipients.push_back(connection);
+					}
+				}
+				watching = viewers;
+				lock.unlock();
+
+				if (recipients.empty() && !publish && !publishRing && watching.empty()) {
+					continue;
+				}
+
+				// Every recipient gets the same header, copied in ahead of
+				// the frame
+				uint16_t flags = frame->flags & (V4L2_BUF_FLAG_PFRAME | V4L2_BUF_FLAG_BFRAME) ?
+				                 FRAME_FLAG_DELTA : FRAME_FLAG_KEY;
+				if (compressed) {
+					flags |= FRAME_FLAG_COMPRESSED;
+				}
+				header.flags     = htons(flags);
+				header.sequence  = htobe64(frameSeq);
+				header.timestamp = htobe64(captureTime(*frame));
+
+				size_t length = frame->length;
+				void* data;
+				shared_ptr<void> pin = pinFrame(frame, data);
+				frame.reset();
+
+				// Local subscribers all share one copy of the frame, which
+				// they're passed by reference
+				shared_ptr<SharedFrame> sharedFrame;
+
+				// One capture, many sends. None of these wait on the client:
+				// a slow one just has its older frames dropped. Sends through
+				// io_uring all go to the kernel together when the batch ends.
+				{
+					IoUring::Batch batch;
+					for (size_t i = 0; i < recipients.size(); i++)
+					{
+						try
+						{
+							if (recipients[i]->isLocal())
+							{
+								if (!sharedFrame) {
+									sharedFrame = shared_ptr<SharedFrame>(
+										new SharedFrame(data, length, &header, sizeof(header))
+									);
+								}
+								recipients[i]->sendSharedFrame(SERVER_MSG_FRAME, sharedFrame);
+							}
+							else
+							{
+								recipients[i]->sendFrame(SERVER_MSG_FRAME, length, data, pin,
+								                         &header, sizeof(header));
+							}
+						}
+						catch (runtime_error e)
+						{
+							TRACE("Not sending to a subscriber: " << e.what());
+						}
+					}
+				}
+
+				// However many are in the group, it's sent once
+				if (publish && multicastSender)
+				{
+					try
+					{
+						multicastSender->sendFrame(SERVER_MSG_FRAME, length, data,
+						                           &header, sizeof(header));
+					}
+					catch (runtime_error e)
+					{
+						ERROR("Unable to publish frame: " << e.what());
+					}
+				}
+
+				// Likewise for the ring, which every local reader maps
+				if (publishRing && frameRing &&
+				    !frameRing->publish(SERVER_MSG_FRAME, length, data, &header, sizeof(header)))
+				{
+					WARNING("Frame of " << length << " bytes doesn't fit in the frame ring ("
+					     << frameRing->getSlotSize() << " bytes)");
+				}
+
+				// Viewers all share the frame too, along with one copy of the
+				// part header which goes in front of it
+				if (!watching.empty())
+				{
+					stringstream part;
+					part << "--" << MJPEG_BOUNDARY << "\r\n"
+					     << "Content-Type: image/jpeg\r\n"
+					     << "Content-Length: " << length << "\r\n"
+					     << "\r\n";
+					shared_ptr<string> partHeader(new string(part.str()));
+
+					for (size_t i = 0; i < watching.size(); i++)
+					{
+						// The spec changed under them
+						if (!jpeg)
+						{
+							watching[i]->finish();
+							continue;
+						}
+
+						// Still working through an earlier frame
+						if (watching[i]->getQueuedBytes() > length) {
+							continue;
+						}
+
+						watching[i]->writeShared(partHeader->data(), partHeader->length(), partHeader);
+						watching[i]->writeShared(data, length, pin);
+						watching[i]->writeShared("\r\n", 2, shared_ptr<const void>());
+					}
+				}
+
+				// Let go of the connections here, without holding any locks,
+				// in case this was the last reference to one of them
+				recipients.clear();
+				watching.clear();
+			}
+		}
+		catch (runtime_error e)
+		{
+			ERROR("Capture failed on " << webcam->getFilename() << ": " << e.what());
+
+			// Nobody is getting frames anymore. Let them know.
+			vector< shared_ptr<Connection> > stranded;
+			lock.relock();
+			for (subscriber_map::iterator itr = subscribers.begin();
+			     itr != subscribers.end();
+			     itr++)
+			{
+				if (!itr->second.streaming && !itr->second.multicast && !itr->second.ring) {
+					continue;
+				}
+
+				itr->second.streaming = false;
+				itr->second.multicast = false;
+				itr->second.ring = false;
+				shared_ptr<Connection> connection = itr->second.connection.lock();
+				if (connection) {
+					stranded.push_back(connection);
+				}
+			}
+			vector< shared_ptr<HttpConnection> > strandedViewers;
+			strandedViewers.swap(viewers);
+			lock.unlock();
+
+			// Viewers' streams just end
+			for (size_t i = 0; i < strandedViewers.size(); i++) {
+				strandedViewers[i]->finish();
+			}
+
+			for (size_t i = 0; i < stranded.size(); i++)
+			{
+				try
+				{
+					stranded[i]->sendMessage(SERVER_ERR_RUNTIME_ERROR, e.what());
+					stranded[i]->sendMessage(SERVER_MSG_STREAM_IS_STOPPED);
+				}
+				catch (runtime_error e2)
+				{
+					TRACE("Unable to notify a subscriber: " << e2.what());
+				}
+			}
+		}
+
+		try
+		{
+			webcamLock.relock();
+			webcam->stopCapture();
+			webcamLock.unlock();
+		}
+		catch (runtime_error e)
+		{
+			ERROR("Unable to stop capture on " << webcam->getFilename() << ": " << e.what());
+		}
+
+		lock.relock();
+		captureActiveFlag = false;
+		captureThreadStarted = false;
+		pthread_cond_broadcast(&captureStoppedCond);
+		lock.unlock();
+
+		TRACE_EXIT;
+
+		// `self` may be the last reference, so nothing can touch `this` after
+		// this function returns
+	}
+
+	void
+	WebcamBroadcaster::setImageFormat (Connection& requester, Webcam::video_fmt_enum_t fmt,
+	                                   uint32_t width, uint32_t height)
+	{
+		TRACE_ENTER;
+
+		MutexLock control(controlMutex);
+		control.relock();
+
+		// The driver won't change formats mid-stream, so pause everyone
+		MutexLock lock(subscribersMutex);
+		lock.relock();
+		bool wasCapturing = captureActiveFlag;
+		captureActiveFlag = false;
+		lock.unlock();
+
+		waitForCaptureThread();
+
+		MutexLock webcamLock(webcamMutex);
+		webcamLock.relock();
+		try
+		{
+			webcam->setImageFormat(fmt, width, height);
+		}
+		catch (runtime_error e)
+		{
+			webcamLock.unlock();
+			if (wasCapturing) {
+				startCaptureThread();
+			}
+			throw;
+		}
+		size_t frameSize = webcam->getFrameSize();
+		webcamLock.unlock();
+
+		// Bigger frames need a bigger ring. Capture is stopped, so nothing
+		// is publishing to the old one.
+		bool ringReplaced = false;
+		if (frameRing && frameRing->getSlotSize() < frameSize + sizeof(frame_header))
+		{
+			try
+			{
+				frameRing = shared_ptr<FrameRingWriter>(new FrameRingWriter(
+					FRAME_RING_SLOTS, frameSize + sizeof(frame_header)
+				));
+				ringReplaced = true;
+			}
+			catch (runtime_error e)
+			{
+				ERROR("Unable to replace frame ring: " << e.what());
+			}
+		}
+
+		if (wasCapturing) {
+			startCaptureThread();
+		}
+
+		// Everyone else needs to know what the frames look like now
+		struct image_spec spec;
+		Webcam::resolution_t res = getResolution();
+		spec.width = res.first;
+		spec.height = res.second;
+		spec.fmt = getImageFormat();
+		swapByteOrder(spec);
+
+		vector< shared_ptr<Connection> > others;
+		vector< shared_ptr<Connection> > ringReaders;
+		lock.relock();
+		shared_ptr<FrameRingWriter> ring = frameRing;
+		for (subscriber_map::iterator itr = subscribers.begin();
+		     itr != subscribers.end();
+		     itr++)
+		{
+			shared_ptr<Connection> connection = itr->second.connection.lock();
+			if (!connection) {
+				continue;
+			}
+
+			// Readers of the old ring need the new one, requester included
+			if (ringReplaced && itr->second.ring) {
+				ringReaders.push_back(connection);
+			}
+
+			if (itr->first != &requester) {
+				others.push_back(connection);
+			}
+		}
+		lock.unlock();
+
+		for (size_t i = 0; i < ringReaders.size(); i++)
+		{
+			try
+			{
+				ringReaders[i]->sendDescriptor(SERVER_MSG_FRAME_RING, sizeof(spec), &spec,
+				                               ring->getReaderFd());
+			}
+			catch (runtime_error e)
+			{
+				TRACE("Unable to send a reader the new frame ring: " << e.what());
+			}
+		}
+		ringReaders.clear();
+
+		for (size_t i = 0; i < others.size(); i++)
+		{
+			try
+			{
+				others[i]->sendMessage(SERVER_MSG_IMAGE_SPEC, sizeof(spec), &spec);
+			}
+			catch (runtime_error e)
+			{
+				TRACE("Unable to notify a subscriber: " << e.what());
+			}
+		}
+
+		TRACE_EXIT;
+	}
+
+	Webcam::video_fmt_enum_t
+	WebcamBroadcaster::getImageFormat ()
+	{
+		MutexLock lock(webcamMutex);
+		lock.relock();
+		return webcam->getImageFormat();
+	}
+
+	Webcam::resolution_t
+	WebcamBroadcaster::getResolution ()
+	{
+		MutexLock lock(webcamMutex);
+		lock.relock();
+		return webcam->getResolution();
+	}
+
+	shared_ptr< vector<struct image_spec> >
+	WebcamBroadcaster::getSupportedSpecs ()
+	{
+		shared_ptr< vector<struct image_spec> > specs(new vector<struct image_spec>());
+
+		MutexLock lock(webcamMutex);
+		lock.relock();
+
+		Webcam::fmtdesc_v fmts = *(webcam->getSupportedFormats());
+		for (size_t i = 0; i < fmts.size(); i++)
+		{
+			Webcam::resolution_set rezes = *(webcam->getSupportedResolutions(fmts[i].pixelformat));
+			for (size_t j = 0; j < rezes.size(); j++) {
+				specs->push_back({ rezes[j].first, rezes[j].second, fmts[i].pixelformat });
+			}
+		}
+
+		return specs;
+	}
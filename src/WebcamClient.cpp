@@ -1,3 +1,7 @@
+#include <endian.h>     // be64toh()
+#include <future>       // future
+#include <unistd.h>     // close()
+
 #include "Log.h"
 #include "Sockets.h"
 #include "WebcamClient.h"
@@ -9,13 +13,54 @@ using namespace std;
 
 ///// WebcamClientConnection /////
 
+	struct WebcamClientConnection::CanvasFrame
+	{
+		/// The frame's header, which is read in ahead of its image
+		struct frame_header header;
+
+		/// Whose canvas the image is being read into
+		shared_ptr<WebcamViewer> viewer;
+
+		void* pixels;
+
+		/// Bytes per row of the canvas
+		int pitch;
+
+		/// Whether the canvas has been given back already
+		bool returned;
+
+		CanvasFrame (shared_ptr<WebcamViewer> viewer_):
+			viewer   (viewer_),
+			pixels   (NULL),
+			pitch    (0),
+			returned (false)
+		{ }
+
+		/// A frame which is never shown (the connection dropped partway
+		/// through, say) still has to let go of the canvas
+		~CanvasFrame ()
+		{
+			if (!returned) {
+				viewer->returnCanvas(false);
+			}
+		}
+	};
+
 	WebcamClientConnection::WebcamClientConnection (int fd, in_addr_t remoteAddress, in_port_t remotePort):
-		Connection (fd, remoteAddress, remotePort)
+		Connection     (fd, remoteAddress, remotePort),
+		framesReceived (0),
+		bytesReceived  (0),
+		lastReportTime (0),
+		streaming      (false),
+		mediaChannelFecGroupSize (-1),
+		haveSession    (false)
 	{
 		TRACE_ENTER;
 
 		// Extra initialization: zero out the structs
 		memset(&viewerMutex, 0, sizeof(viewerMutex));
+		memset(&viewerSpec, 0, sizeof(viewerSpec));
+		memset(&sessionToken, 0, sizeof(sessionToken));
 
 		TRACE("Creating webcam viewer mutex...");
 		int err = pthread_mutex_init(&viewerMutex, NULL);
@@ -23,6 +68,11 @@ using namespace std;
 			THROW_ERROR("Error creating webcam viewer mutex: " << strerror(err));
 		}
 
+		err = pthread_mutex_init(&sessionMutex, NULL);
+		if (err) {
+			THROW_ERROR("Error creating session mutex: " << strerror(err));
+		}
+
 		boundHandlers.push_back(
 			[this] (message_t type, message_len_t length, void* buffer)
 			{
@@ -57,9 +107,18 @@ using namespace std;
 			)
 
 			AUTO_ADD_HANDLER ( SERVER_MSG_FRAME                 );
+			AUTO_ADD_HANDLER ( SERVER_MSG_FRAME_RING            );
+			AUTO_ADD_HANDLER ( SERVER_MSG_FRAME_RING_IS_CLOSED  );
 			AUTO_ADD_HANDLER ( SERVER_MSG_IMAGE_SPEC            );
+			AUTO_ADD_HANDLER ( SERVER_MSG_MEDIA_CHANNEL_IS_CLOSED );
+			AUTO_ADD_HANDLER ( SERVER_MSG_MEDIA_CHANNEL_IS_OPENED );
+			AUTO_ADD_HANDLER ( SERVER_MSG_MULTICAST_GROUP       );
+			AUTO_ADD_HANDLER ( SERVER_MSG_MULTICAST_IS_LEFT     );
+			AUTO_ADD_HANDLER ( SERVER_MSG_SESSION               );
+			AUTO_ADD_HANDLER ( SERVER_MSG_SESSION_RESUMED       );
 			AUTO_ADD_HANDLER ( SERVER_MSG_STREAM_IS_STARTED     );
-			AUTO_ADD_HANDLER ( SERVER_MSG_STREAM_IS_STARTED     );
+			AUTO_ADD_HANDLER ( SERVER_MSG_STREAM_IS_STOPPED     );
+			AUTO_ADD_HANDLER ( SERVER_ERR_NO_SUCH_SESSION       );
 			AUTO_ADD_HANDLER ( SERVER_MSG_WEBCAM_IS_CLOSED      );
 			AUTO_ADD_HANDLER ( SERVER_MSG_WEBCAM_IS_OPENED      );
 
@@ -88,30 +147,408 @@ using namespace std;
 			AUTO_ADD_HANDLER ( ERROR_MSG_INVALID_MSG            );
 		#undef AUTO_ADD_HANDLER
 
+		setReceiveTarget(SERVER_MSG_FRAME,
+			[this] (const MessageHeader& header)
+			{
+				return chooseFrameTarget(header);
+			}
+		);
+
+		setJitterBuffer(JitterBuffer::DEFAULT_TARGET_LATENCY_MS);
+
 		TRACE_EXIT;
 	}
 
 	WebcamClientConnection::~WebcamClientConnection ()
 	{
+		setReceiveTarget(SERVER_MSG_FRAME, receive_target_provider_t());
+
+		// Stop delivering frames before anything they're delivered to goes
+		mediaReceiver = shared_ptr<MediaReceiver>();
+		multicastReceiver = shared_ptr<MediaReceiver>();
+		frameRingReader = shared_ptr<FrameRingReader>();
+		jitterBuffer = shared_ptr<JitterBuffer>();
+
+		pthread_mutex_destroy(&sessionMutex);
 		pthread_mutex_destroy(&viewerMutex);
 	}
 
+	void
+	WebcamClientConnection::openMediaChannel (int fecGroupSize)
+	{
+		TRACE_ENTER;
+
+		if (!mediaReceiver)
+		{
+			mediaReceiver = shared_ptr<MediaReceiver>(new MediaReceiver(
+				[this] (message_t& type, message_len_t& length, void* data)
+				{
+					handle_SERVER_MSG_FRAME(type, length, data);
+				},
+				getRemoteAddress()
+			));
+			mediaReceiver->start();
+		}
+
+		struct media_channel_spec spec;
+		spec.port = mediaReceiver->getPort();
+		spec.fecGroupSize = fecGroupSize;
+		spec.reserved = 0;
+		swapByteOrder(spec);
+		sendMessage(CLIENT_MSG_OPEN_MEDIA_CHANNEL, sizeof(spec), &spec);
+		mediaChannelFecGroupSize = fecGroupSize;
+
+		TRACE_EXIT;
+	}
+
+	void
+	WebcamClientConnection::closeMediaChannel ()
+	{
+		TRACE_ENTER;
+		// The receiver stays up, in case frames already on their way arrive
+		sendMessage(CLIENT_MSG_CLOSE_MEDIA_CHANNEL);
+		mediaChannelFecGroupSize = -1;
+		TRACE_EXIT;
+	}
+
+	void
+	WebcamClientConnection::sendReceiveReport ()
+	{
+		// Frames can arrive on more than one thread; only one of them reports
+		uint64_t now = monotonicMs();
+		uint64_t last = lastReportTime;
+		if (now - last < (uint64_t) RECEIVE_REPORT_INTERVAL_MS ||
+		    !lastReportTime.compare_exchange_strong(last, now))
+		{
+			return;
+		}
+
+		struct receive_report report;
+		memset(&report, 0, sizeof(report));
+		report.framesReceived = framesReceived;
+		report.bytesReceived  = bytesReceived;
+		swapByteOrder(report);
+
+		try
+		{
+			sendMessage(CLIENT_MSG_RECEIVE_REPORT, sizeof(report), &report);
+		}
+		catch (runtime_error e)
+		{
+			ERROR(e.what());
+		}
+	}
+
+	void
+	WebcamClientConnection::resumeSession ()
+	{
+		TRACE_ENTER;
+
+		MutexLock lock(sessionMutex);
+		lock.relock();
+		bool resumable = haveSession;
+		struct session_token token = sessionToken;
+		lock.unlock();
+
+		if (resumable) {
+			sendMessage(CLIENT_MSG_RESUME_SESSION, sizeof(token), &token);
+		} else {
+			restoreSession();
+		}
+
+		TRACE_EXIT;
+	}
+
+	void
+	WebcamClientConnection::restoreSession ()
+	{
+		TRACE_ENTER;
+
+		MutexLock lock(viewerMutex);
+		lock.relock();
+		string name = cameraName;
+		struct image_spec spec = viewerSpec;
+		lock.unlock();
+
+		// Nothing was open, so there's nothing to get back
+		if (name.empty())
+		{
+			TRACE_EXIT;
+			return;
+		}
+
+		// These are handled in order, so each one finds the last one done
+		sendMessage(CLIENT_MSG_OPEN_WEBCAM, name);
+		if (spec.width != 0) {
+			swapByteOrder(spec);
+			sendMessage(CLIENT_MSG_SET_CURRENT_SPEC, sizeof(spec), &spec);
+		}
+		int fecGroupSize = mediaChannelFecGroupSize;
+		if (fecGroupSize >= 0) {
+			openMediaChannel(fecGroupSize);
+		}
+		if (streaming) {
+			sendMessage(CLIENT_MSG_START_STREAM);
+		}
+
+		TRACE_EXIT;
+	}
+
 	void
 	WebcamClientConnection::handle_SERVER_MSG_FRAME
 		(message_t type, message_len_t length, void* data)
 	{
 		TRACE_ENTER;
 
+		framesReceived++;
+		bytesReceived += length;
+		sendReceiveReport();
+
 		try
 		{
-			if (viewer)
+			if (length < sizeof(struct frame_header)) {
+				THROW_ERROR("Frame of " << length << " bytes is too short to have a header");
+			}
+
+			struct frame_header header;
+			memcpy(&header, data, sizeof(header));
+			if (header.version < FRAME_HEADER_VERSION ||
+			    header.headerLength < sizeof(header) || header.headerLength > length)
+			{
+				THROW_ERROR("Unexpected frame header from server (version "
+				         << (int) header.version << ", " << (int) header.headerLength
+				         << " bytes)");
+			}
+
+			MutexLock lock(viewerMutex);
+			lock.relock();
+			shared_ptr<JitterBuffer> buffer = jitterBuffer;
+			shared_ptr<CanvasFrame> canvasFrame = lentCanvas.lock();
+			lock.unlock();
+
+			// Frames which came over this connection can be kept where they
+			// were received; ones from the media channel or the frame ring
+			// have to be copied
+			shared_ptr<void> pin = getMessagePin();
+
+			if (canvasFrame && data == &canvasFrame->header) {
+				presentCanvasFrame(canvasFrame, length);
+			} else if (buffer && pin) {
+				buffer->push(be64toh(header.timestamp), data, length, pin);
+			} else if (buffer) {
+				buffer->push(be64toh(header.timestamp), data, length);
+			} else {
+				presentFrame(data, length);
+			}
+		}
+		catch (runtime_error e)
+		{
+			ERROR(e.what());
+		}
+
+		TRACE_EXIT;
+	}
+
+	void
+	WebcamClientConnection::presentFrame (void* data, size_t length)
+	{
+		struct frame_header header;
+		memcpy(&header, data, sizeof(header));
+
+		struct image_spec spec;
+		spec.width  = ntohl(header.width);
+		spec.height = ntohl(header.height);
+		spec.fmt    = ntohl(header.fmt);
+
+		uint8_t* image = static_cast<uint8_t*>(data) + header.headerLength;
+		size_t imageLength = length - header.headerLength;
+
+		MutexLock lock(viewerMutex);
+		lock.relock();
+
+		// Go by the frame's own spec. The last SERVER_MSG_IMAGE_SPEC may
+		// not describe it: frames from before a spec change can arrive
+		// after it, and frames from after it can arrive before.
+		if (!viewer || memcmp(&spec, &viewerSpec, sizeof(spec))) {
+			updateViewer(spec);
+		}
+
+		viewer->showFrame(image, imageLength, ntohl(header.stride));
+	}
+
+	Connection::ReceiveTarget
+	WebcamClientConnection::chooseFrameTarget (const MessageHeader& header)
+	{
+		ReceiveTarget target;
+		if (header.length <= sizeof(struct frame_header)) {
+			return target;
+		}
+
+		// This runs on the thread reading the socket, so rather than wait
+		// for the frame before to finish being shown, read this one into
+		// a buffer
+		if (pthread_mutex_trylock(&viewerMutex)) {
+			return target;
+		}
+
+		// A frame going through the jitter buffer waits there until it's
+		// due, and there's only one canvas to lend, so it's read into one
+		// of the jitter buffer's slots instead (and queued from there)
+		shared_ptr<JitterBuffer> buffer = jitterBuffer;
+		shared_ptr<CanvasFrame> frame;
+		if (!buffer && viewer)
+		{
+			try
 			{
-				viewer->showFrame(data, length);
+				frame = shared_ptr<CanvasFrame>(new CanvasFrame(viewer));
+				frame->pixels = viewer->borrowCanvas(header.length - sizeof(frame->header),
+				                                     frame->pitch);
+				if (frame->pixels) {
+					lentCanvas = frame;
+				} else {
+					frame->returned = true;
+					frame = shared_ptr<CanvasFrame>();
+				}
 			}
-			else
+			catch (runtime_error e)
 			{
-				MESSAGE("Dropping frame because the viewer isn't initialized");
+				ERROR(e.what());
+				frame = shared_ptr<CanvasFrame>();
+			}
+		}
+		pthread_mutex_unlock(&viewerMutex);
+
+		if (buffer)
+		{
+			BufferPool::buffer_ptr slot = buffer->acquireSlot(header.length);
+			target.parts[0].iov_base = &(*slot)[0];
+			target.parts[0].iov_len  = header.length;
+			target.numParts = 1;
+			target.pin = slot;
+			return target;
+		}
+
+		if (!frame) {
+			return target;
+		}
+
+		target.parts[0].iov_base = &frame->header;
+		target.parts[0].iov_len  = sizeof(frame->header);
+		target.parts[1].iov_base = frame->pixels;
+		target.parts[1].iov_len  = header.length - sizeof(frame->header);
+		target.numParts = 2;
+		target.pin = frame;
+		return target;
+	}
+
+	void
+	WebcamClientConnection::presentCanvasFrame (shared_ptr<CanvasFrame> frame, size_t length)
+	{
+		struct image_spec spec;
+		spec.width  = ntohl(frame->header.width);
+		spec.height = ntohl(frame->header.height);
+		spec.fmt    = ntohl(frame->header.fmt);
+		size_t stride = ntohl(frame->header.stride);
+
+		MutexLock lock(viewerMutex);
+		lock.relock();
+
+		// It's already where it needs to be, if it's laid out as expected
+		if (frame->header.headerLength == sizeof(frame->header) && frame->viewer == viewer &&
+		    !memcmp(&spec, &viewerSpec, sizeof(spec)) &&
+		    (stride == 0 || stride == (size_t) frame->pitch))
+		{
+			frame->returned = true;
+			viewer->returnCanvas(true);
+			return;
+		}
+		lock.unlock();
+
+		vector<uint8_t> copy(length);
+		memcpy(&copy[0], &frame->header, sizeof(frame->header));
+		memcpy(&copy[sizeof(frame->header)], frame->pixels, length - sizeof(frame->header));
+		frame->returned = true;
+		frame->viewer->returnCanvas(false);
+
+		presentFrame(&copy[0], length);
+	}
+
+	void
+	WebcamClientConnection::setJitterBuffer (int targetLatencyMs, bool latestWins)
+	{
+		MutexLock lock(viewerMutex);
+		lock.relock();
+
+		if (targetLatencyMs > 0 && jitterBuffer)
+		{
+			jitterBuffer->setTargetLatency(targetLatencyMs);
+			jitterBuffer->setLatestWins(latestWins);
+			return;
+		}
+
+		shared_ptr<JitterBuffer> old = jitterBuffer;
+		jitterBuffer = shared_ptr<JitterBuffer>();
+		if (targetLatencyMs > 0)
+		{
+			jitterBuffer = shared_ptr<JitterBuffer>(new JitterBuffer(
+				[this] (void* data, size_t length)
+				{
+					presentFrame(data, length);
+				},
+				targetLatencyMs, latestWins
+			));
+			jitterBuffer->start();
+		}
+		lock.unlock();
+
+		// The old one's thread may be waiting on the viewer mutex, so it
+		// has to be let go of without it
+		old = shared_ptr<JitterBuffer>();
+	}
+
+	shared_ptr<JitterBuffer>
+	WebcamClientConnection::getJitterBuffer ()
+	{
+		MutexLock lock(viewerMutex);
+		lock.relock();
+		return jitterBuffer;
+	}
+
+	void
+	WebcamClientConnection::handle_SERVER_MSG_FRAME_RING
+		(message_t type, message_len_t length, void* data)
+	{
+		TRACE_ENTER;
+
+		int ringFd = takeDescriptor();
+		try
+		{
+			if (ringFd == -1) {
+				THROW_ERROR("Server sent a frame ring without its descriptor");
 			}
+
+			if (length != sizeof(struct image_spec)) {
+				::close(ringFd);
+				THROW_ERROR("Unexpected data chunk size from server. Expected "
+				         << sizeof(struct image_spec) << " bytes, but received "
+				         << length << " bytes.");
+			}
+
+			// Get the viewer ready for what's coming
+			handle_SERVER_MSG_IMAGE_SPEC(SERVER_MSG_IMAGE_SPEC, length, data);
+
+			// This may be a bigger ring replacing the old one
+			frameRingReader = shared_ptr<FrameRingReader>();
+			frameRingReader = shared_ptr<FrameRingReader>(new FrameRingReader(
+				[this] (message_t& type, message_len_t& length, void* data)
+				{
+					handle_SERVER_MSG_FRAME(type, length, data);
+				},
+				ringFd
+			));
+			frameRingReader->start();
+
+			MESSAGE("Reading frames from the server's frame ring.");
 		}
 		catch (runtime_error e)
 		{
@@ -121,6 +558,16 @@ using namespace std;
 		TRACE_EXIT;
 	}
 
+	void
+	WebcamClientConnection::handle_SERVER_MSG_FRAME_RING_IS_CLOSED
+		(message_t type, message_len_t length, void* data)
+	{
+		TRACE_ENTER;
+		MESSAGE("Frame ring is closed.");
+		frameRingReader = shared_ptr<FrameRingReader>();
+		TRACE_EXIT;
+	}
+
 	void
 	WebcamClientConnection::handle_SERVER_MSG_IMAGE_SPEC
 		(message_t type, message_len_t length, void* data)
@@ -138,25 +585,98 @@ using namespace std;
 
 			// Cast data chunk to struct
 			struct image_spec spec = *reinterpret_cast<struct image_spec*>(data);
+			swapByteOrder(spec);
 
-			MESSAGE("Image format set to " << Webcam::fmt2string << ", "
+			MESSAGE("Image format set to " << Webcam::fmt2string(spec.fmt) << ", "
 			     << spec.width << "x" << spec.height << "px");
 
-			if (!viewer) {
-				// Initialize viewer if it hasn't been done already.
-				// (It isn't initialized when the webcam is opened -- opening
-				// automatically asks what the specification is, which calls
-				// this function.)
-				viewer = shared_ptr<WebcamViewer>(new WebcamViewer(
-					spec.width, spec.height, "Viewing: " + cameraName, spec.fmt
-				));
-			}
-			else
-			{
-				// Update already-open viewer
-				viewer->setImageFormat(spec.fmt);
-				viewer->setImageSize(spec.width, spec.height);
+			MutexLock lock(viewerMutex);
+			lock.relock();
+			updateViewer(spec);
+		}
+		catch (runtime_error e)
+		{
+			ERROR(e.what());
+		}
+
+		TRACE_EXIT;
+	}
+
+	void
+	WebcamClientConnection::updateViewer (const struct image_spec& spec)
+	{
+		if (!viewer) {
+			// Initialize viewer if it hasn't been done already.
+			// (It isn't initialized when the webcam is opened -- opening
+			// automatically asks what the specification is, which calls
+			// this function.)
+			viewer = shared_ptr<WebcamViewer>(new WebcamViewer(
+				spec.width, spec.height, "Viewing: " + cameraName, spec.fmt
+			));
+		}
+		else
+		{
+			// Update already-open viewer
+			viewer->setImageFormat(spec.fmt);
+			viewer->setImageSize(spec.width, spec.height);
+		}
+
+		viewerSpec = spec;
+	}
+
+	void
+	WebcamClientConnection::handle_SERVER_MSG_MEDIA_CHANNEL_IS_CLOSED
+		(message_t type, message_len_t length, void* data)
+	{
+		TRACE_ENTER;
+		MESSAGE("Server is sending frames over TCP.");
+		TRACE_EXIT;
+	}
+
+	void
+	WebcamClientConnection::handle_SERVER_MSG_MEDIA_CHANNEL_IS_OPENED
+		(message_t type, message_len_t length, void* data)
+	{
+		TRACE_ENTER;
+		MESSAGE("Server is sending frames over UDP.");
+		TRACE_EXIT;
+	}
+
+	void
+	WebcamClientConnection::handle_SERVER_MSG_MULTICAST_GROUP
+		(message_t type, message_len_t length, void* data)
+	{
+		TRACE_ENTER;
+
+		try
+		{
+			if (length != sizeof(struct multicast_spec)) {
+				THROW_ERROR("Unexpected data chunk size from server. Expected "
+				         << sizeof(struct multicast_spec) << " bytes, but received "
+				         << length << " bytes.");
 			}
+
+			struct multicast_spec spec = *reinterpret_cast<struct multicast_spec*>(data);
+
+			// Get the viewer ready for what's coming. The handler swaps the
+			// image spec itself, so it gets it as it came.
+			message_len_t specLength = sizeof(spec.image);
+			handle_SERVER_MSG_IMAGE_SPEC(SERVER_MSG_IMAGE_SPEC, specLength, &spec.image);
+			swapByteOrder(spec);
+
+			// Join on the interface the server is reachable through, which
+			// is what makes this work over loopback too
+			multicastReceiver = shared_ptr<MediaReceiver>(new MediaReceiver(
+				[this] (message_t& type, message_len_t& length, void* data)
+				{
+					handle_SERVER_MSG_FRAME(type, length, data);
+				},
+				htonl(spec.group), htons(spec.port), getLocalAddress(), htonl(spec.source)
+			));
+			multicastReceiver->start();
+
+			MESSAGE("Joined multicast group " << ip2string(htonl(spec.group))
+			     << ", port " << spec.port);
 		}
 		catch (runtime_error e)
 		{
@@ -166,12 +686,95 @@ using namespace std;
 		TRACE_EXIT;
 	}
 
+	void
+	WebcamClientConnection::handle_SERVER_MSG_MULTICAST_IS_LEFT
+		(message_t type, message_len_t length, void* data)
+	{
+		TRACE_ENTER;
+		MESSAGE("Left the multicast group.");
+		multicastReceiver = shared_ptr<MediaReceiver>();
+		TRACE_EXIT;
+	}
+
+	void
+	WebcamClientConnection::handle_SERVER_MSG_SESSION
+		(message_t type, message_len_t length, void* data)
+	{
+		TRACE_ENTER;
+
+		if (length != sizeof(struct session_token))
+		{
+			ERROR("Unexpected data chunk size from server. Expected "
+			   << sizeof(struct session_token) << " bytes, but received "
+			   << length << " bytes.");
+			TRACE_EXIT;
+			return;
+		}
+
+		MutexLock lock(sessionMutex);
+		lock.relock();
+		memcpy(&sessionToken, data, sizeof(sessionToken));
+		haveSession = true;
+
+		TRACE_EXIT;
+	}
+
+	void
+	WebcamClientConnection::handle_SERVER_MSG_SESSION_RESUMED
+		(message_t type, message_len_t length, void* data)
+	{
+		TRACE_ENTER;
+
+		if (length != sizeof(struct session_state))
+		{
+			ERROR("Unexpected data chunk size from server. Expected "
+			   << sizeof(struct session_state) << " bytes, but received "
+			   << length << " bytes.");
+			TRACE_EXIT;
+			return;
+		}
+
+		struct session_state state = *reinterpret_cast<struct session_state*>(data);
+		swapByteOrder(state);
+		streaming = state.flags & SESSION_FLAG_STREAMING;
+		MESSAGE("Resumed session" << (streaming ? "; the stream carries on." : "."));
+
+		// The spec may have changed while we were away
+		if (state.image.width != 0)
+		{
+			MutexLock lock(viewerMutex);
+			lock.relock();
+			if (viewer && memcmp(&state.image, &viewerSpec, sizeof(state.image))) {
+				updateViewer(state.image);
+			}
+		}
+
+		TRACE_EXIT;
+	}
+
+	void
+	WebcamClientConnection::handle_SERVER_ERR_NO_SUCH_SESSION
+		(message_t type, message_len_t length, void* data)
+	{
+		TRACE_ENTER;
+		MESSAGE("Server no longer has our session; starting over.");
+
+		MutexLock lock(sessionMutex);
+		lock.relock();
+		haveSession = false;
+		lock.unlock();
+
+		restoreSession();
+		TRACE_EXIT;
+	}
+
 	void
 	WebcamClientConnection::handle_SERVER_MSG_STREAM_IS_STARTED
 		(message_t type, message_len_t length, void* data)
 	{
 		TRACE_ENTER;
 		MESSAGE("Server has started streaming.");
+		streaming = true;
 	}
 
 	void
@@ -180,6 +783,7 @@ using namespace std;
 	{
 		TRACE_ENTER;
 		MESSAGE("Server has stopped streaming.");
+		streaming = false;
 	}
 
 	void
@@ -189,7 +793,10 @@ using namespace std;
 		TRACE_ENTER;
 		// Close viewer via garbage collection
 		MESSAGE("Server has closed the webcam.");
+		MutexLock lock(viewerMutex);
+		lock.relock();
 		viewer = shared_ptr<WebcamViewer>();
+		cameraName.clear();
 		TRACE_EXIT;
 	}
 
@@ -198,9 +805,19 @@ using namespace std;
 		(message_t type, message_len_t length, void* data)
 	{
 		TRACE_ENTER;
+
+		MutexLock lock(viewerMutex);
+		lock.relock();
+		cameraName = string(reinterpret_cast<char*>(data), length);
+		lock.unlock();
+
 		// We can't initialize the viewer yet because we don't know the image
 		// format or dimensions. Get them from the server.
 		sendMessage(CLIENT_MSG_GET_CURRENT_SPEC);
+
+		// Holds on to the webcam for us if the connection drops
+		sendMessage(CLIENT_MSG_GET_SESSION);
+
 		TRACE_EXIT;
 	}
 
@@ -251,44 +868,64 @@ using namespace std;
 
 */
 
-	/*void
-	startStreamMacro ()
+	/// Waits for a reply, and logs it if it isn't the one expected
+	static bool
+	expectReply (future<Connection::Reply>& reply, message_t expected)
 	{
-		//sendMessage(CLIENT_MSG_GET_WEBCAM_LIST);
-
-		sendMessage(CLIENT_MSG_OPEN_WEBCAM, "/dev/video0");
-		addOneTimeHandler(SERVER_MSG_WEBCAM_OPENED,
-			[this] (message_t type, message_len_t length, void* data)
+		Connection::Reply value = reply.get();
+		if (value.type != expected)
 		{
-			sendMessage(CLIENT_MSG_GET_SUPPORTED_SPECS);
-			addOneTimeHandler(SERVER_MSG_SUPPORTED_SPECS,
-				[this] (message_t type, message_len_t length, void* data)
-			{
-				struct image_spec *availableSpecs = reinterpret_cast<struct image_spec*>(data);
-				message_len_t numSpecs = length / sizeof(struct image_spec);
-				if (length % sizeof(struct image_spec) != 0)
-				{
-					ERROR("length not a multiple of expected struct size.");
-					return;
-				}
-				else if (length < 1)
-				{
-					ERROR("no supported image formats found :(");
-				}
+			ERROR("Expected " << webcamSocketMsgToString(expected)
+			   << ", got " << webcamSocketMsgToString(value.type)
+			   << (value.type == REQUEST_COMPLETE_MESSAGE ? "" :
+			       ": " + string(value.body.begin(), value.body.end())));
+			return false;
+		}
+		return true;
+	}
 
-				sendMessage(CLIENT_MSG_SET_CURRENT_SPEC);
-				addOneTimeMessageHandler(SERVER_MSG_IMAGE_SPEC,
-					[this] (message_t type, message_len_t length, void* data)
-				{
-					// Another handler ought to take care of updating the viewer
-				});
-			});
-		});
+	bool
+	WebcamClientConnection::startStream (string device)
+	{
+		TRACE_ENTER;
 
-	}*/
+		// The server handles them in the order they're sent, so they can
+		// all go out at once instead of one round trip each. The handlers
+		// see the replies as usual (the viewer's set up from the spec).
+		future<Reply> opened  = request(CLIENT_MSG_OPEN_WEBCAM, device);
+		future<Reply> spec    = request(CLIENT_MSG_GET_CURRENT_SPEC);
+		future<Reply> started = request(CLIENT_MSG_START_STREAM);
+
+		bool succeeded;
+		try
+		{
+			succeeded = expectReply(opened,  SERVER_MSG_WEBCAM_IS_OPENED)
+			         && expectReply(spec,    SERVER_MSG_IMAGE_SPEC)
+			         && expectReply(started, SERVER_MSG_STREAM_IS_STARTED);
+		}
+		catch (runtime_error e)
+		{
+			ERROR("Unable to start the stream: " << e.what());
+			succeeded = false;
+		}
+
+		TRACE_EXIT;
+		return succeeded;
+	}
 
 ///// WebcamClient /////
 
+	WebcamClient::WebcamClient ()
+	{
+		setAutoReconnect(true);
+	}
+
+	WebcamClient::~WebcamClient ()
+	{
+		// The reconnect thread calls back in here, so it has to stop first
+		setAutoReconnect(false);
+	}
+
 	shared_ptr<Connection>
 	WebcamClient::newConnection (int fd, in_addr_t remoteAddress, in_port_t remotePort)
 	{
@@ -297,3 +934,12 @@ using namespace std;
 		TRACE_EXIT;
 	}
 
+	void
+	WebcamClient::reconnected (shared_ptr<Connection> connection)
+	{
+		shared_ptr<WebcamClientConnection> webcamConnection =
+			dynamic_pointer_cast<WebcamClientConnection, Connection>(connection);
+		if (webcamConnection) {
+			webcamConnection->resumeSession();
+		}
+	}
@@ -1,10 +1,18 @@
-#include <algorithm>    // for_each
+#include <sys/random.h> // getrandom()
+
+#include <endian.h>     // htobe64()
+
+#include <climits>      // PATH_MAX
+#include <cstring>      // memset(), strerror()
 #include <iostream>     // cout
 #include <functional>   // bind()
+#include <sstream>      // stringstream
+#include <stdlib.h>     // realpath()
 #include <string>       // strings
+#include <vector>       // vectors
 
 #include "Log.h"
-#include "Thread.h"
+#include "Metrics.h"
 #include "WebcamServer.h"
 #include "webcam_stream_common.h"
 
@@ -12,15 +20,16 @@ using namespace std;
 
 ///// WebcamServerConnection /////
 
-	WebcamServerConnection::WebcamServerConnection (int fd, in_addr_t remoteAddress, in_port_t remotePort):
+	WebcamServerConnection::WebcamServerConnection (WebcamServer& server_, int fd,
+	                                                in_addr_t remoteAddress, in_port_t remotePort):
 		Connection         (fd, remoteAddress, remotePort),
-		streamIsActiveFlag (false)
+		server             (server_)
 	{
 		TRACE_ENTER;
 
 		// Extra initialization: zero out the structs
 		memset(&webcamMutex, 0, sizeof(webcamMutex));
-		memset(&streamerThreadHandle, 0, sizeof(streamerThreadHandle));
+		memset(&mediaChannelSpec, 0, sizeof(mediaChannelSpec));
 
 		TRACE("Creating webcam mutex...");
 		int err = pthread_mutex_init(&webcamMutex, NULL);
@@ -28,6 +37,11 @@ using namespace std;
 			THROW_ERROR("Error creating webcam mutex: " << strerror(err));
 		}
 
+		err = pthread_mutex_init(&mediaChannelMutex, NULL);
+		if (err) {
+			THROW_ERROR("Error creating media channel mutex: " << strerror(err));
+		}
+
 		addDefaultMessageHandler([this] (message_t type, message_len_t length, void* buffer)
 		{
 			MESSAGE("Received invalid message: " << webcamSocketMsgToString(type));
@@ -59,13 +73,23 @@ using namespace std;
 			AUTO_ADD_HANDLER ( ERROR_MSG_INVALID_MSG            ); // DONE
 			AUTO_ADD_HANDLER ( ERROR_MSG_TERMINATING_CONNECTION ); // DONE
 
+			AUTO_ADD_HANDLER ( CLIENT_MSG_CLOSE_FRAME_RING      ); // DONE
+			AUTO_ADD_HANDLER ( CLIENT_MSG_CLOSE_MEDIA_CHANNEL   ); // DONE
 			AUTO_ADD_HANDLER ( CLIENT_MSG_CLOSE_WEBCAM          ); // DONE
 			AUTO_ADD_HANDLER ( CLIENT_MSG_GET_CURRENT_SPEC      ); // DONE
+			AUTO_ADD_HANDLER ( CLIENT_MSG_GET_SESSION           ); // DONE
+			AUTO_ADD_HANDLER ( CLIENT_MSG_GET_STATS             ); // DONE
 			AUTO_ADD_HANDLER ( CLIENT_MSG_GET_STREAM_STATUS     ); // DONE
 			AUTO_ADD_HANDLER ( CLIENT_MSG_GET_SUPPORTED_SPECS   ); // DONE
 			AUTO_ADD_HANDLER ( CLIENT_MSG_GET_WEBCAM_STATUS     ); // DONE
 			AUTO_ADD_HANDLER ( CLIENT_MSG_GET_WEBCAM_LIST       ); //      TODO
+			AUTO_ADD_HANDLER ( CLIENT_MSG_JOIN_MULTICAST        ); // DONE
+			AUTO_ADD_HANDLER ( CLIENT_MSG_LEAVE_MULTICAST       ); // DONE
+			AUTO_ADD_HANDLER ( CLIENT_MSG_OPEN_FRAME_RING       ); // DONE
+			AUTO_ADD_HANDLER ( CLIENT_MSG_OPEN_MEDIA_CHANNEL    ); // DONE
 			AUTO_ADD_HANDLER ( CLIENT_MSG_OPEN_WEBCAM           ); // DONE
+			AUTO_ADD_HANDLER ( CLIENT_MSG_RECEIVE_REPORT        ); // DONE
+			AUTO_ADD_HANDLER ( CLIENT_MSG_RESUME_SESSION        ); // DONE
 			AUTO_ADD_HANDLER ( CLIENT_MSG_STOP_STREAM           ); // DONE
 			AUTO_ADD_HANDLER ( CLIENT_MSG_SET_CURRENT_SPEC      ); // DONE
 			AUTO_ADD_HANDLER ( CLIENT_MSG_START_STREAM          ); // DONE
@@ -79,73 +103,85 @@ using namespace std;
 	{
 		TRACE_ENTER;
 
-		// Attempt to stop the streamer thread if it's running
+		// Attempt to stop the stream if it's running. There's nobody to tell
+		// if the connection has already gone.
 		try
 		{
 			stopStream();
+			if (!isFinished()) {
+				flushMessages();
+			}
 		}
 		catch (runtime_error e)
 		{
 			ERROR(e.what());
 		}
 
-		// Attempt to destroy the mutex
+		// Let go of the webcam. If nobody else has it open, it gets closed.
+		if (webcam) {
+			webcam->detach(*this);
+		}
+
+		// Attempt to destroy the mutexes
 		int status = pthread_mutex_destroy(&webcamMutex);
 		if (status) {
 			ERROR("Unable to destroy webcamMutex: " << strerror(status));
 		}
+		status = pthread_mutex_destroy(&mediaChannelMutex);
+		if (status) {
+			ERROR("Unable to destroy mediaChannelMutex: " << strerror(status));
+		}
 
 		TRACE_EXIT;
 	}
 
 	void
-	WebcamServerConnection::streamerThread (void* unused)
+	WebcamServerConnection::sendFrame (message_t type, size_t length, void* data, shared_ptr<void> pin,
+	                                   const void* prefix, size_t prefixLength)
 	{
-		TRACE_ENTER;
-		try
-		{
-			MutexLock lock(webcamMutex);
-			lock.relock();
-			webcam->startCapture();
-			lock.unlock();
+		// Skip frames the link doesn't have room for, rather than letting
+		// them pile up ahead of newer ones
+		if (!rateController.admitFrame(*this, prefixLength + length)) {
+			return;
+		}
 
-			//TODO: Look into signals for a better way of getting the
-			// thread to terminate. In particular, I don't want to wait
-			// for a frame from the webcam before I realize I should
-			// shut down.
-			while (streamIsActiveFlag)
-			{
-				lock.relock();
-				shared_ptr<MappedBuffer> frame = webcam->getFrame();
-				lock.unlock();
+		// Local clients aren't short of bandwidth
+		uint64_t limit = isLocal() ? 0
+		               : server.getBandwidthLimits().getLimit(this, getRemoteAddress());
 
-				sendMessage(SERVER_MSG_FRAME, frame->length, frame->data);
-			}
+		// Datagrams can't be paced by the kernel without the fq qdisc, so
+		// over the media channel the limit is kept by skipping frames
+		MutexLock lock(mediaChannelMutex);
+		lock.relock();
+		shared_ptr<MediaSender> channel = mediaChannel;
+		bool admitted = !channel || mediaChannelBucket.admit(prefixLength + length, limit);
+		lock.unlock();
 
+		if (!admitted) {
 			return;
 		}
-		catch (runtime_error e)
-		{
-			cerr << "!! Caught exception in reader thread:" << endl
-			     << "!! " << e.what() << endl;
+
+		if (channel) {
+			// The datagrams are copied out before this returns, so the pin
+			// can go right away
+			channel->sendFrame(type, length, data, prefix, prefixLength);
 			return;
 		}
 
-		// Attempt to stop the webcam video capture. Do it in a try/catch block
-		// in case something happened to the webcam and this throws and error.
-		try
-		{
-			MutexLock lock(webcamMutex);
-			lock.relock();
-			webcam->stopCapture();
-			lock.unlock();
+		uint64_t rate = rateController.getPacingRate(prefixLength + length);
+		if (limit != 0 && (rate == 0 || rate > limit)) {
+			rate = limit;
 		}
-		catch (runtime_error e)
+
+		// Only bother the kernel when the rate has changed noticeably
+		uint64_t current = getPacingRate();
+		if (rate == 0 || current == 0 || rate > current + current / 8 ||
+		    rate < current - current / 8)
 		{
-			cerr << "!! Caught exception in reader thread:" << endl
-			     << "!! " << e.what() << endl;
-			return;
+			setPacingRate(rate);
 		}
+
+		Connection::sendFrame(type, length, data, pin, prefix, prefixLength);
 	}
 
 	void
@@ -173,6 +209,12 @@ using namespace std;
 	{
 		TRACE_ENTER;
 		MESSAGE("Client is terminating the connection.");
+
+		// It's not coming back
+		if (!sessionToken.empty()) {
+			server.endSession(sessionToken);
+		}
+
 		close();
 		TRACE_EXIT;
 	}
@@ -212,12 +254,13 @@ using namespace std;
 		// against that list and not, oh, say, inject shell code !!?!
 		// At least validate the filename!
 		string newFilename = string(reinterpret_cast<char*>(buffer), length);
-		shared_ptr<Webcam> newcam;
+		shared_ptr<WebcamBroadcaster> newcam;
 
 		try
 		{
-			// Attempt to open new webcam
-			newcam = shared_ptr<Webcam>(new Webcam(newFilename));
+			// Attempt to open new webcam, or share it if someone else has
+			// already opened it
+			newcam = WebcamBroadcaster::open(newFilename);
 		}
 		catch (runtime_error e)
 		{
@@ -235,6 +278,8 @@ using namespace std;
 			handle_CLIENT_MSG_CLOSE_WEBCAM(CLIENT_MSG_CLOSE_WEBCAM, 0, NULL);
 		}
 
+		newcam->attach(shared_from_this());
+
 		MutexLock lock(webcamMutex);
 		lock.relock();
 		webcam = newcam;
@@ -245,20 +290,189 @@ using namespace std;
 		TRACE_EXIT;
 	}
 
+	void
+	WebcamServerConnection::handle_CLIENT_MSG_OPEN_MEDIA_CHANNEL
+		(message_t type, message_len_t length, void* buffer)
+	{
+		TRACE_ENTER;
+
+		if (length != sizeof(struct media_channel_spec))
+		{
+			sendMessage(SERVER_ERR_RUNTIME_ERROR, "Malformed media channel request");
+			TRACE_EXIT;
+			return;
+		}
+
+		struct media_channel_spec spec = *reinterpret_cast<struct media_channel_spec*>(buffer);
+		swapByteOrder(spec);
+
+		try
+		{
+			// Frames go back to wherever this connection came from
+			shared_ptr<MediaSender> channel(new MediaSender(
+				getRemoteAddress(), htons(spec.port), spec.fecGroupSize
+			));
+
+			MutexLock lock(mediaChannelMutex);
+			lock.relock();
+			mediaChannel = channel;
+			mediaChannelSpec = spec;
+			lock.unlock();
+
+			sendMessage(SERVER_MSG_MEDIA_CHANNEL_IS_OPENED);
+		}
+		catch (runtime_error e)
+		{
+			ERROR(e.what());
+			sendMessage(SERVER_ERR_RUNTIME_ERROR, e.what());
+		}
+
+		TRACE_EXIT;
+	}
+
+	void
+	WebcamServerConnection::handle_CLIENT_MSG_JOIN_MULTICAST
+		(message_t type, message_len_t length, void* buffer)
+	{
+		TRACE_ENTER;
+		if (!webcam)
+		{
+			sendMessage(SERVER_ERR_NO_WEBCAM_OPENED);
+		}
+		else
+		{
+			try
+			{
+				// Frames come from the group from now on, so stop sending
+				// them directly
+				if (webcam->isSubscribed(*this)) {
+					webcam->unsubscribe(*this);
+				}
+
+				struct multicast_spec spec = webcam->joinMulticast(*this);
+				swapByteOrder(spec);
+				sendMessage(SERVER_MSG_MULTICAST_GROUP, sizeof(spec), &spec);
+			}
+			catch (runtime_error e)
+			{
+				ERROR(e.what());
+				sendMessage(SERVER_ERR_RUNTIME_ERROR, e.what());
+			}
+		}
+		TRACE_EXIT;
+	}
+
+	void
+	WebcamServerConnection::handle_CLIENT_MSG_LEAVE_MULTICAST
+		(message_t type, message_len_t length, void* buffer)
+	{
+		TRACE_ENTER;
+		if (webcam) {
+			webcam->leaveMulticast(*this);
+		}
+		sendMessage(SERVER_MSG_MULTICAST_IS_LEFT);
+		TRACE_EXIT;
+	}
+
+	void
+	WebcamServerConnection::handle_CLIENT_MSG_OPEN_FRAME_RING
+		(message_t type, message_len_t length, void* buffer)
+	{
+		TRACE_ENTER;
+		if (!webcam)
+		{
+			sendMessage(SERVER_ERR_NO_WEBCAM_OPENED);
+		}
+		else if (!isLocal())
+		{
+			sendMessage(SERVER_ERR_RUNTIME_ERROR,
+			            "Frame rings are only available over a unix domain socket");
+		}
+		else
+		{
+			try
+			{
+				// Frames come from the ring from now on, so stop sending
+				// them directly
+				if (webcam->isSubscribed(*this)) {
+					webcam->unsubscribe(*this);
+				}
+
+				shared_ptr<FrameRingWriter> ring = webcam->openRing(*this);
+
+				struct image_spec spec;
+				Webcam::resolution_t res = webcam->getResolution();
+				spec.width = res.first;
+				spec.height = res.second;
+				spec.fmt = webcam->getImageFormat();
+				swapByteOrder(spec);
+				sendDescriptor(SERVER_MSG_FRAME_RING, sizeof(spec), &spec, ring->getReaderFd());
+			}
+			catch (runtime_error e)
+			{
+				ERROR(e.what());
+				sendMessage(SERVER_ERR_RUNTIME_ERROR, e.what());
+			}
+		}
+		TRACE_EXIT;
+	}
+
+	void
+	WebcamServerConnection::handle_CLIENT_MSG_CLOSE_FRAME_RING
+		(message_t type, message_len_t length, void* buffer)
+	{
+		TRACE_ENTER;
+		if (webcam) {
+			webcam->closeRing(*this);
+		}
+		sendMessage(SERVER_MSG_FRAME_RING_IS_CLOSED);
+		TRACE_EXIT;
+	}
+
+	void
+	WebcamServerConnection::handle_CLIENT_MSG_CLOSE_MEDIA_CHANNEL
+		(message_t type, message_len_t length, void* buffer)
+	{
+		TRACE_ENTER;
+
+		MutexLock lock(mediaChannelMutex);
+		lock.relock();
+		mediaChannel = shared_ptr<MediaSender>();
+		lock.unlock();
+
+		sendMessage(SERVER_MSG_MEDIA_CHANNEL_IS_CLOSED);
+
+		TRACE_EXIT;
+	}
+
 	void
 	WebcamServerConnection::handle_CLIENT_MSG_CLOSE_WEBCAM
 		(message_t type, message_len_t length, void* buffer)
 	{
 		TRACE_ENTER;
 
-		if (streamIsActiveFlag) {
-			handle_CLIENT_MSG_STOP_STREAM(CLIENT_MSG_STOP_STREAM, 0, NULL);
+		// Stopping the stream queues SERVER_MSG_STREAM_IS_STOPPED, which
+		// goes out in the same system call as SERVER_MSG_WEBCAM_IS_CLOSED.
+		if (webcam && webcam->isSubscribed(*this))
+		{
+			try
+			{
+				stopStream();
+			}
+			catch (runtime_error e)
+			{
+				ERROR(e.what());
+			}
 		}
 
-		// Release the webcam through garbage collection
+		// Release the webcam through garbage collection. It's only closed
+		// once every connection sharing it has let go.
 		MutexLock lock(webcamMutex);
 		lock.relock();
-		webcam = shared_ptr<Webcam>();
+		if (webcam) {
+			webcam->detach(*this);
+		}
+		webcam = shared_ptr<WebcamBroadcaster>();
 		lock.unlock();
 
 		sendMessage(SERVER_MSG_WEBCAM_IS_CLOSED);
@@ -279,26 +493,17 @@ using namespace std;
 		{
 			try
 			{
-				vector<struct image_spec> specs;
+				shared_ptr< vector<struct image_spec> > specs = webcam->getSupportedSpecs();
 
-				MutexLock lock(webcamMutex);
-				lock.relock();
-
-				Webcam::fmtdesc_v fmts = *(webcam->getSupportedFormats());
-				for_each(fmts.begin(), fmts.end(), [&specs, this] (struct v4l2_fmtdesc fmt)
-				{
-					Webcam::resolution_set rezes = *(webcam->getSupportedResolutions(fmt.pixelformat));
-					for_each(rezes.begin(), rezes.end(), [&specs, &fmt] (Webcam::resolution_t res)
-					{
-						specs.push_back({ res.first, res.second, fmt.pixelformat });
-					});
-				});
-
-				lock.unlock();
+				// Copied, since the webcam may hand the same list to others
+				vector<struct image_spec> wire(*specs);
+				for (size_t i = 0; i < wire.size(); ++i) {
+					swapByteOrder(wire[i]);
+				}
 
 				sendMessage(SERVER_MSG_SUPPORTED_SPECS,
-			            	specs.size() * sizeof(struct image_spec),
-			            	&(specs[0]));
+			            	wire.size() * sizeof(struct image_spec),
+			            	&wire[0]);
 			}
 			catch (runtime_error e)
 			{
@@ -322,17 +527,13 @@ using namespace std;
 		{
 			try
 			{
-				MutexLock lock(webcamMutex);
-				lock.relock();
-
 				struct image_spec spec;
 				Webcam::resolution_t res = webcam->getResolution();
 				spec.width = res.first;
 				spec.height = res.second;
 				spec.fmt = webcam->getImageFormat();
+				swapByteOrder(spec);
 
-				lock.unlock();
-				
 				sendMessage(SERVER_MSG_IMAGE_SPEC, sizeof(struct image_spec), &spec);
 			}
 			catch (runtime_error e)
@@ -360,14 +561,12 @@ using namespace std;
 		else
 		{
 			struct image_spec spec = *reinterpret_cast<struct image_spec*>(buffer);
+			swapByteOrder(spec);
 			try
 			{
-				MutexLock lock(webcamMutex);
-				lock.relock();
-
-				webcam->setImageFormat(spec.fmt, spec.width, spec.height);
-
-				lock.unlock();
+				// This changes it for everyone sharing the webcam. They're
+				// told about it by the broadcaster.
+				webcam->setImageFormat(*this, spec.fmt, spec.width, spec.height);
 
 				// If the above hasn't thrown an exception, tell the client it worked.
 				handle_CLIENT_MSG_GET_CURRENT_SPEC(CLIENT_MSG_GET_CURRENT_SPEC, 0, NULL);
@@ -386,8 +585,11 @@ using namespace std;
 		(message_t type, message_len_t length, void* buffer)
 	{
 		TRACE_ENTER;
-		sendMessage(streamIsActiveFlag ? SERVER_MSG_STREAM_IS_STARTED :
-		                                 SERVER_MSG_STREAM_IS_STOPPED);
+		bool streaming = webcam && (webcam->isSubscribed(*this) ||
+		                            webcam->isMulticastMember(*this) ||
+		                            webcam->isRingReader(*this));
+		sendMessage(streaming ? SERVER_MSG_STREAM_IS_STARTED :
+		                        SERVER_MSG_STREAM_IS_STOPPED);
 		TRACE_EXIT;
 	}
 
@@ -420,7 +622,7 @@ using namespace std;
 		{
 			throw NoWebcamOpenException("Unable to start stream: No webcam is open.");
 		}
-		else if (streamIsActiveFlag)
+		else if (webcam->isSubscribed(*this))
 		{
 			MESSAGE("Client tried to start a stream when it's already started");
 			sendMessage(SERVER_MSG_STREAM_IS_STARTED);
@@ -429,13 +631,9 @@ using namespace std;
 		{
 			MESSAGE("Starting stream");
 
-			// Without this flag set, the streamer thread will think it's
-			// being told to stop.
-			streamIsActiveFlag = true;
-
-			streamerThreadHandle = pthread_create_using_method<WebcamServerConnection, void*>(
-					*this, &WebcamServerConnection::streamerThread, NULL
-			);
+			// Capture starts with the webcam's first subscriber. Everyone
+			// after that just gets the same frames.
+			webcam->subscribe(*this);
 
 			sendMessage(SERVER_MSG_STREAM_IS_STARTED);
 		}
@@ -449,53 +647,813 @@ using namespace std;
 		try
 		{
 			stopStream();
-			sendMessage(SERVER_MSG_STREAM_IS_STOPPED);
+			flushMessages();
+		}
+		catch (runtime_error e)
+		{
+			ERROR(e.what());
+			sendMessage(SERVER_ERR_RUNTIME_ERROR, e.what());
+		}
+		TRACE_EXIT;
+	}
+
+	void
+	WebcamServerConnection::handle_CLIENT_MSG_RECEIVE_REPORT
+		(message_t type, message_len_t length, void* buffer)
+	{
+		TRACE_ENTER;
+
+		if (length != sizeof(struct receive_report))
+		{
+			sendMessage(SERVER_ERR_RUNTIME_ERROR, "Malformed receive report");
+			TRACE_EXIT;
+			return;
+		}
+
+		struct receive_report report = *reinterpret_cast<struct receive_report*>(buffer);
+		swapByteOrder(report);
+		rateController.recordReport(report.framesReceived, report.bytesReceived);
+
+		TRACE_EXIT;
+	}
+
+	void
+	WebcamServerConnection::handle_CLIENT_MSG_GET_SESSION
+		(message_t type, message_len_t length, void* buffer)
+	{
+		TRACE_ENTER;
+
+		if (sessionToken.empty())
+		{
+			sessionToken = server.openSession(
+				dynamic_pointer_cast<WebcamServerConnection, Connection>(shared_from_this())
+			);
+		}
+
+		struct session_token token;
+		memcpy(token.bytes, sessionToken.data(), sizeof(token.bytes));
+		sendMessage(SERVER_MSG_SESSION, sizeof(token), &token);
+
+		TRACE_EXIT;
+	}
+
+	void
+	WebcamServerConnection::handle_CLIENT_MSG_GET_STATS
+		(message_t type, message_len_t length, void* buffer)
+	{
+		TRACE_ENTER;
+		sendMessage(SERVER_MSG_STATS, server.getStats());
+		TRACE_EXIT;
+	}
+
+	void
+	WebcamServerConnection::handle_CLIENT_MSG_RESUME_SESSION
+		(message_t type, message_len_t length, void* buffer)
+	{
+		TRACE_ENTER;
+
+		if (length != sizeof(struct session_token))
+		{
+			sendMessage(SERVER_ERR_RUNTIME_ERROR, "Malformed session token");
+			TRACE_EXIT;
+			return;
+		}
+
+		string token(reinterpret_cast<char*>(buffer), sizeof(struct session_token));
+		shared_ptr<WebcamServerConnection> self =
+			dynamic_pointer_cast<WebcamServerConnection, Connection>(shared_from_this());
+
+		shared_ptr<WebcamServerConnection> lost = server.claimSession(token, self);
+		if (!lost)
+		{
+			MESSAGE("Client tried to resume a session which doesn't exist");
+			sendMessage(SERVER_ERR_NO_SUCH_SESSION);
+			TRACE_EXIT;
+			return;
+		}
+
+		// The client is carrying on with the old session, not its own
+		if (!sessionToken.empty() && sessionToken != token) {
+			server.endSession(sessionToken);
+		}
+		sessionToken = token;
+
+		try
+		{
+			if (lost != self) {
+				takeOver(*lost);
+			}
+
+			struct session_state state = getSessionState();
+			swapByteOrder(state);
+			sendMessage(SERVER_MSG_SESSION_RESUMED, sizeof(state), &state);
+			MESSAGE("Resumed session for client at " << ip2string(getRemoteAddress()));
 		}
 		catch (runtime_error e)
 		{
 			ERROR(e.what());
 			sendMessage(SERVER_ERR_RUNTIME_ERROR, e.what());
 		}
+
+		TRACE_EXIT;
+	}
+
+	void
+	WebcamServerConnection::takeOver (WebcamServerConnection& lost)
+	{
+		TRACE_ENTER;
+
+		MutexLock lostLock(lost.webcamMutex);
+		lostLock.relock();
+		shared_ptr<WebcamBroadcaster> cam = lost.webcam;
+		lostLock.unlock();
+
+		MutexLock lostChannelLock(lost.mediaChannelMutex);
+		lostChannelLock.relock();
+		bool hadChannel = (bool) lost.mediaChannel;
+		struct media_channel_spec spec = lost.mediaChannelSpec;
+		lostChannelLock.unlock();
+
+		// The client's receiver is still on the same port, but it may have
+		// come back from a different address
+		if (hadChannel)
+		{
+			shared_ptr<MediaSender> channel(new MediaSender(
+				getRemoteAddress(), htons(spec.port), spec.fecGroupSize
+			));
+
+			MutexLock lock(mediaChannelMutex);
+			lock.relock();
+			mediaChannel = channel;
+			mediaChannelSpec = spec;
+			lock.unlock();
+		}
+
+		if (cam)
+		{
+			if (webcam && webcam != cam) {
+				webcam->detach(*this);
+			}
+			cam->attach(shared_from_this());
+
+			// Join in before the lost connection leaves, so that capture
+			// carries straight on
+			if (cam->isSubscribed(lost)) {
+				cam->subscribe(*this);
+			}
+			if (cam->isMulticastMember(lost)) {
+				cam->joinMulticast(*this);
+			}
+			if (cam->isRingReader(lost) && isLocal()) {
+				cam->openRing(*this);
+			}
+
+			MutexLock lock(webcamMutex);
+			lock.relock();
+			webcam = cam;
+			lock.unlock();
+
+			cam->detach(lost);
+			lostLock.relock();
+			lost.webcam = shared_ptr<WebcamBroadcaster>();
+			lostLock.unlock();
+		}
+
+		// In case the server hadn't noticed it was gone
+		lost.close();
+
 		TRACE_EXIT;
 	}
 
+	struct session_state
+	WebcamServerConnection::getSessionState ()
+	{
+		struct session_state state;
+		memset(&state, 0, sizeof(state));
+
+		MutexLock channelLock(mediaChannelMutex);
+		channelLock.relock();
+		if (mediaChannel) {
+			state.flags |= SESSION_FLAG_MEDIA_CHANNEL;
+		}
+		channelLock.unlock();
+
+		MutexLock lock(webcamMutex);
+		lock.relock();
+		shared_ptr<WebcamBroadcaster> cam = webcam;
+		lock.unlock();
+
+		if (cam)
+		{
+			Webcam::resolution_t res = cam->getResolution();
+			state.image.width  = res.first;
+			state.image.height = res.second;
+			state.image.fmt    = cam->getImageFormat();
+
+			if (cam->isSubscribed(*this)) {
+				state.flags |= SESSION_FLAG_STREAMING;
+			}
+			if (cam->isMulticastMember(*this)) {
+				state.flags |= SESSION_FLAG_MULTICAST;
+			}
+			if (cam->isRingReader(*this)) {
+				state.flags |= SESSION_FLAG_FRAME_RING;
+			}
+		}
+
+		return state;
+	}
+
 	void
 	WebcamServerConnection::stopStream()
 	{
-		if (streamIsActiveFlag)
+		if (webcam && webcam->isSubscribed(*this))
 		{
 			MESSAGE("Stopping stream");
 
-			// Allow the streamer thread to end itself naturally
-			streamIsActiveFlag = false;
+			// Capture stops with the webcam's last subscriber
+			webcam->unsubscribe(*this);
 
-			// Wait for the streamer thread to stop
-			int err = pthread_join(streamerThreadHandle, NULL);
-			if (err)
-			{
-				THROW_ERROR("Unable to terminate streamer thread: " << strerror(err));
-			}
+			// Leave the other clients the whole of the global limit
+			server.getBandwidthLimits().forget(this);
 		}
 		else
 		{
 			MESSAGE("Stream is already stopped");
 		}
 
-		// Notify the client, if connected.
-		try {
-			sendMessage(SERVER_MSG_STREAM_IS_STOPPED);
-		} catch (runtime_error e) {
-			ERROR(e.what());
-		}
+		// Notify the client, if connected. This goes out with whatever the
+		// caller sends next (or flushes).
+		queueMessage(SERVER_MSG_STREAM_IS_STOPPED);
 	}
 
 
 ///// WebcamServer /////
+
+	WebcamServer::WebcamServer (bool useEventLoop_):
+		Server      (useEventLoop_),
+		startedAt   (monotonicMs()),
+		httpPort    (0)
+	{
+		int err = pthread_mutex_init(&sessionsMutex, NULL);
+		if (err) {
+			THROW_ERROR("Error creating sessions mutex: " << strerror(err));
+		}
+	}
+
+	WebcamServer::~WebcamServer ()
+	{
+		// The reaper calls back in here, so it has to stop first
+		stop();
+
+		sessions.clear();
+		pthread_mutex_destroy(&sessionsMutex);
+	}
+
 	shared_ptr<Connection>
 	WebcamServer::newConnection (int fd, in_addr_t remoteAddress, in_port_t remotePort)
 	{
 		TRACE_ENTER;
-		return shared_ptr<Connection>(new WebcamServerConnection(fd, remoteAddress, remotePort));
+		return shared_ptr<Connection>(new WebcamServerConnection(*this, fd, remoteAddress, remotePort));
 		TRACE_EXIT;
 	}
 
+	string
+	WebcamServer::openSession (shared_ptr<WebcamServerConnection> connection)
+	{
+		MutexLock lock(sessionsMutex);
+		lock.relock();
+
+		string token;
+		do
+		{
+			struct session_token bytes;
+			if (getrandom(bytes.bytes, sizeof(bytes.bytes), 0) != sizeof(bytes.bytes)) {
+				THROW_ERROR("Unable to make a session token: " << strerror(errno));
+			}
+			token = string(reinterpret_cast<char*>(bytes.bytes), sizeof(bytes.bytes));
+		}
+		while (sessions.count(token));
+
+		Session& session = sessions[token];
+		session.connection = connection;
+		session.finishedAt = 0;
+
+		return token;
+	}
+
+	shared_ptr<WebcamServerConnection>
+	WebcamServer::claimSession (const string& token, shared_ptr<WebcamServerConnection> claimant)
+	{
+		MutexLock lock(sessionsMutex);
+		lock.relock();
+
+		map<string, Session>::iterator itr = sessions.find(token);
+		if (itr == sessions.end()) {
+			return shared_ptr<WebcamServerConnection>();
+		}
+
+		shared_ptr<WebcamServerConnection> previous = itr->second.connection;
+		itr->second.connection = claimant;
+		itr->second.finishedAt = 0;
+		return previous;
+	}
+
+	void
+	WebcamServer::endSession (const string& token)
+	{
+		MutexLock lock(sessionsMutex);
+		lock.relock();
+
+		map<string, Session>::iterator itr = sessions.find(token);
+		if (itr == sessions.end()) {
+			return;
+		}
+
+		// Whatever the connection lets go of on the way out, it does
+		// without the lock
+		shared_ptr<WebcamServerConnection> connection = itr->second.connection;
+		sessions.erase(itr);
+		lock.unlock();
+	}
+
+	string
+	WebcamServer::getStats ()
+	{
+		TRACE_ENTER;
+
+		vector<struct connection_stats> connectionStats;
+		forEachConnection([&connectionStats] (Connection& connection)
+		{
+			if (connection.isFinished()) {
+				return;
+			}
+
+			Connection::Stats stats = connection.getStats();
+			struct connection_stats entry;
+			memset(&entry, 0, sizeof(entry));
+			entry.remoteAddress = connection.getRemoteAddress();
+			entry.remotePort    = connection.getRemotePort();
+			entry.local         = connection.isLocal() ? 1 : 0;
+			entry.bytesIn       = htobe64(stats.bytesIn);
+			entry.bytesOut      = htobe64(stats.bytesOut);
+			entry.messagesIn    = htobe64(stats.messagesIn);
+			entry.messagesOut   = htobe64(stats.messagesOut);
+			entry.framesSent    = htobe64(stats.framesSent);
+			entry.framesDropped = htobe64(stats.framesDropped);
+			entry.queuedBytes   = htobe64(stats.queuedBytes);
+			entry.queueDepth    = htonl(stats.queueDepth);
+			entry.sendLatencyUs = htonl(stats.sendLatency);
+			connectionStats.push_back(entry);
+		});
+
+		vector< shared_ptr<WebcamBroadcaster> > webcams = WebcamBroadcaster::getOpen();
+		vector<struct webcam_stats> webcamStats;
+		for (size_t i = 0; i < webcams.size(); i++)
+		{
+			WebcamBroadcaster::Stats stats = webcams[i]->getStats();
+			struct webcam_stats entry;
+			memset(&entry, 0, sizeof(entry));
+			strncpy(entry.device, stats.filename.c_str(), sizeof(entry.device) - 1);
+			entry.streamId        = htonl(stats.streamId);
+			entry.subscribers     = htonl(stats.subscribers);
+			entry.streaming       = htonl(stats.streaming);
+			entry.captureMilliFps = htonl((uint32_t) (stats.captureFps * 1000));
+			entry.framesCaptured  = htobe64(stats.framesCaptured);
+			entry.framesDropped   = htobe64(stats.framesDropped);
+			entry.framesCopied    = htobe64(stats.framesCopied);
+			entry.buffersInFlight = htonl(stats.buffersInFlight);
+			entry.numBuffers      = htonl(stats.numBuffers);
+			webcamStats.push_back(entry);
+		}
+
+		struct stats_header header;
+		memset(&header, 0, sizeof(header));
+		header.version               = STATS_VERSION;
+		header.headerLength          = sizeof(header);
+		header.connectionStatsLength = htons(sizeof(struct connection_stats));
+		header.webcamStatsLength     = htons(sizeof(struct webcam_stats));
+		header.numConnections        = htonl(connectionStats.size());
+		header.numWebcams            = htonl(webcamStats.size());
+		header.uptimeMs              = htobe64(monotonicMs() - startedAt);
+
+		string body(reinterpret_cast<char*>(&header), sizeof(header));
+		if (!connectionStats.empty()) {
+			body.append(reinterpret_cast<char*>(&connectionStats[0]),
+			            connectionStats.size() * sizeof(struct connection_stats));
+		}
+		if (!webcamStats.empty()) {
+			body.append(reinterpret_cast<char*>(&webcamStats[0]),
+			            webcamStats.size() * sizeof(struct webcam_stats));
+		}
+
+		TRACE_EXIT;
+		return body;
+	}
+
+	void
+	WebcamServer::setHttpPort (in_port_t port)
+	{
+		httpPort = port;
+	}
+
+	void
+	WebcamServer::setHttpDevices (const vector<string>& devices)
+	{
+		httpDevices = devices;
+	}
+
+	void
+	WebcamServer::started (shared_ptr<EventLoop> loop)
+	{
+		if (httpPort == 0) {
+			return;
+		}
+
+		// HTTP clients are few, and their frames are written from the
+		// capture threads, so one loop thread will do
+		if (!loop)
+		{
+			httpLoop = shared_ptr<EventLoop>(new EventLoop(1, 1));
+			httpLoop->start();
+			loop = httpLoop;
+		}
+
+		httpListener = shared_ptr<HttpListener>(new HttpListener(httpPort));
+		httpListener->addRoute("/metrics",
+			[this] (shared_ptr<HttpConnection> connection, const HttpRequest& request)
+		{
+			connection->respond(200, MetricsWriter::CONTENT_TYPE, getMetrics());
+		});
+
+		// Opening the webcam can take a while, which the loop can't wait for
+		httpListener->addRoute("/mjpeg",
+			[this, loop] (shared_ptr<HttpConnection> connection, const HttpRequest& request)
+		{
+			loop->post([this, connection, request] ()
+			{
+				serveMjpeg(connection, request);
+			});
+		});
+
+		// Browsers can't open a plain socket, so they speak the protocol
+		// over a WebSocket instead. Past the handshake it's a connection
+		// like any other.
+		httpListener->addRoute("/ws",
+			[this, loop] (shared_ptr<HttpConnection> connection, const HttpRequest& request)
+		{
+			int fd = connection->acceptWebSocket(request);
+			if (fd == -1) {
+				return;
+			}
+
+			shared_ptr<Connection> conn = newConnection(fd, connection->getRemoteAddress(),
+			                                            connection->getRemotePort());
+			conn->enableWebSocket();
+			adoptConnection(conn, loop);
+		});
+
+		httpListener->addRoute("/limits",
+			[this] (shared_ptr<HttpConnection> connection, const HttpRequest& request)
+		{
+			serveLimits(connection, request);
+		}, true);
+
+		httpListener->attach(loop);
+	}
+
+	void
+	WebcamServer::stopped ()
+	{
+		if (httpListener)
+		{
+			httpListener->detach();
+			httpListener.reset();
+		}
+		if (httpLoop)
+		{
+			httpLoop->stop();
+			httpLoop.reset();
+		}
+	}
+
+	void
+	WebcamServer::serveMjpeg (shared_ptr<HttpConnection> connection, const HttpRequest& request)
+	{
+		TRACE_ENTER;
+
+		string requested = request.getParameter("device", "/dev/video0");
+		string device;
+		if (!resolveHttpDevice(requested, device))
+		{
+			WARNING(ip2string(connection->getRemoteAddress()) << " asked for MJPEG from "
+			     << requested << ", which isn't served");
+			connection->respond(404, "text/plain", "No such webcam\n");
+			TRACE_EXIT;
+			return;
+		}
+
+		try
+		{
+			shared_ptr<WebcamBroadcaster> webcam = WebcamBroadcaster::open(device);
+			webcam->addViewer(connection);
+			MESSAGE("Sending MJPEG from " << device << " to "
+			     << ip2string(connection->getRemoteAddress()));
+		}
+		catch (runtime_error e)
+		{
+			ERROR("Unable to send MJPEG from " << device << ": " << e.what());
+			connection->respond(503, "text/plain", string(e.what()) + "\n");
+		}
+
+		TRACE_EXIT;
+	}
+
+	bool
+	WebcamServer::resolveHttpDevice (const string& device, string& resolved)
+	{
+		char path[PATH_MAX];
+		if (realpath(device.c_str(), path) == NULL) {
+			return false;
+		}
+		resolved = path;
+
+		if (httpDevices.empty())
+		{
+			// Only V4L2 capture devices, whatever links led there
+			return resolved.length() > 10 && resolved.compare(0, 10, "/dev/video") == 0
+			    && resolved.find_first_not_of("0123456789", 10) == string::npos;
+		}
+
+		for (size_t i = 0; i < httpDevices.size(); i++)
+		{
+			if (realpath(httpDevices[i].c_str(), path) != NULL && resolved == path) {
+				return true;
+			}
+		}
+		return false;
+	}
+
+	/// Reads a rate from a query parameter, in bytes per second
+	static bool
+	parseRate (const string& text, uint64_t& rate)
+	{
+		if (text.empty() || text.find_first_not_of("0123456789") != string::npos) {
+			return false;
+		}
+		istringstream iss(text);
+		return (bool) (iss >> rate);
+	}
+
+	void
+	WebcamServer::serveLimits (shared_ptr<HttpConnection> connection, const HttpRequest& request)
+	{
+		string client  = request.getParameter("client");
+		string global  = request.getParameter("global");
+		string address = request.getParameter("address");
+		string limit   = request.getParameter("limit");
+
+		// Anyone can GET the limits, but only an admin on this machine can
+		// change them, with a POST or PUT. Any link or <img> can make a
+		// browser send a GET, and a form on any web page can make it POST,
+		// though it says so in the Origin.
+		if (request.method == "GET")
+		{
+			if (!client.empty() || !global.empty() || !address.empty())
+			{
+				connection->respond(405, "text/plain", "Limits can only be changed with POST or PUT\n");
+				return;
+			}
+		}
+		else
+		{
+			if ((ntohl(connection->getRemoteAddress()) >> 24) != 127)
+			{
+				connection->respond(403, "text/plain", "Limits can only be changed from this machine\n");
+				return;
+			}
+			if (request.headers.count("origin"))
+			{
+				connection->respond(403, "text/plain", "Limits can't be changed from a web page\n");
+				return;
+			}
+
+			uint64_t clientRate = 0, globalRate = 0, addressRate = 0;
+			in_addr_t addressIp = 0;
+			if ((!client.empty() && !parseRate(client, clientRate)) ||
+			    (!global.empty() && !parseRate(global, globalRate)) ||
+			    (!address.empty() && inet_pton(AF_INET, address.c_str(), &addressIp) != 1) ||
+			    (!address.empty() && limit != "default" && !parseRate(limit, addressRate)))
+			{
+				connection->respond(400, "text/plain",
+					"Rates are whole numbers of bytes per second, and addresses IPv4\n");
+				return;
+			}
+
+			if (!client.empty()) {
+				bandwidthLimits.setClientLimit(clientRate);
+			}
+			if (!global.empty()) {
+				bandwidthLimits.setGlobalLimit(globalRate);
+			}
+			if (!address.empty() && limit == "default") {
+				bandwidthLimits.clearOverride(addressIp);
+			} else if (!address.empty()) {
+				bandwidthLimits.setOverride(addressIp, addressRate);
+			}
+			MESSAGE("Bandwidth limits changed by " << ip2string(connection->getRemoteAddress())
+			     << ": client " << bandwidthLimits.getClientLimit()
+			     << ", global " << bandwidthLimits.getGlobalLimit());
+		}
+
+		stringstream body;
+		body << "client " << bandwidthLimits.getClientLimit() << "\n"
+		     << "global " << bandwidthLimits.getGlobalLimit() << "\n"
+		     << "active " << bandwidthLimits.getActiveClients() << "\n";
+		map<in_addr_t, uint64_t> overrides = bandwidthLimits.getOverrides();
+		for (map<in_addr_t, uint64_t>::iterator itr = overrides.begin();
+		     itr != overrides.end();
+		     itr++)
+		{
+			body << "override " << ip2string(itr->first) << " " << itr->second << "\n";
+		}
+		connection->respond(200, "text/plain", body.str());
+	}
+
+	BandwidthLimits&
+	WebcamServer::getBandwidthLimits ()
+	{
+		return bandwidthLimits;
+	}
+
+	string
+	WebcamServer::getMetrics ()
+	{
+		TRACE_ENTER;
+
+		struct ConnectionEntry
+		{
+			string labels;
+			Connection::Stats stats;
+		};
+
+		vector<ConnectionEntry> connections;
+		forEachConnection([&connections] (Connection& connection)
+		{
+			if (connection.isFinished()) {
+				return;
+			}
+
+			// Local clients all have the same address and port
+			stringstream client;
+			if (connection.isLocal()) {
+				client << "unix:" << connection.getEventFd();
+			} else {
+				client << ip2string(connection.getRemoteAddress()) << ":"
+				       << ntohs(connection.getRemotePort());
+			}
+
+			ConnectionEntry entry;
+			entry.labels = MetricsWriter::label("client", client.str());
+			entry.stats = connection.getStats();
+			connections.push_back(entry);
+		});
+
+		vector< shared_ptr<WebcamBroadcaster> > webcams = WebcamBroadcaster::getOpen();
+		vector<WebcamBroadcaster::Stats> webcamStats;
+		vector<string> webcamLabels;
+		for (size_t i = 0; i < webcams.size(); i++)
+		{
+			webcamStats.push_back(webcams[i]->getStats());
+			webcamLabels.push_back(MetricsWriter::label("device", webcamStats[i].filename));
+		}
+
+		MetricsWriter metrics;
+
+		metrics.family("webcam_server_uptime_seconds", "gauge", "Time since the server started.");
+		metrics.sample("webcam_server_uptime_seconds", "", (monotonicMs() - startedAt) / 1000.0);
+
+		metrics.family("webcam_server_connections", "gauge", "Connections open.");
+		metrics.sample("webcam_server_connections", "", connections.size());
+
+		// Every sample of a family has to come together
+		#define CONNECTION_METRIC(name, type, help, value)                  \
+			metrics.family(name, type, help);                               \
+			for (size_t i = 0; i < connections.size(); i++) {               \
+				const Connection::Stats& stats = connections[i].stats;      \
+				metrics.sample(name, connections[i].labels, value);         \
+			}
+
+			CONNECTION_METRIC("webcam_connection_received_bytes_total", "counter",
+				"Bytes read from the client.", stats.bytesIn);
+			CONNECTION_METRIC("webcam_connection_sent_bytes_total", "counter",
+				"Bytes written to the client.", stats.bytesOut);
+			CONNECTION_METRIC("webcam_connection_received_messages_total", "counter",
+				"Messages read from the client.", stats.messagesIn);
+			CONNECTION_METRIC("webcam_connection_sent_messages_total", "counter",
+				"Messages written to the client.", stats.messagesOut);
+			CONNECTION_METRIC("webcam_connection_frames_sent_total", "counter",
+				"Frames written to the client.", stats.framesSent);
+			CONNECTION_METRIC("webcam_connection_frames_dropped_total", "counter",
+				"Frames dropped because the client wasn't keeping up.", stats.framesDropped);
+			CONNECTION_METRIC("webcam_connection_send_queue_messages", "gauge",
+				"Messages waiting to be sent.", stats.queueDepth);
+			CONNECTION_METRIC("webcam_connection_send_queue_bytes", "gauge",
+				"Bytes waiting to be sent.", stats.queuedBytes);
+			CONNECTION_METRIC("webcam_connection_send_latency_seconds", "gauge",
+				"Smoothed time messages spend in the send queue.", stats.sendLatency / 1e6);
+			CONNECTION_METRIC("webcam_connection_pacing_rate_bytes", "gauge",
+				"Bytes per second the socket is paced to, or 0 if it isn't.", stats.pacingRate);
+
+		#undef CONNECTION_METRIC
+
+		#define WEBCAM_METRIC(name, type, help, value)                      \
+			metrics.family(name, type, help);                               \
+			for (size_t i = 0; i < webcamStats.size(); i++) {               \
+				const WebcamBroadcaster::Stats& stats = webcamStats[i];     \
+				metrics.sample(name, webcamLabels[i], value);               \
+			}
+
+			WEBCAM_METRIC("webcam_capture_fps", "gauge",
+				"Smoothed capture rate, or 0 while capture is stopped.", stats.captureFps);
+			WEBCAM_METRIC("webcam_frames_captured_total", "counter",
+				"Frames captured since the webcam was opened.", stats.framesCaptured);
+			WEBCAM_METRIC("webcam_frames_dropped_total", "counter",
+				"Frames the driver dropped because nothing took them in time.", stats.framesDropped);
+			WEBCAM_METRIC("webcam_frames_copied_total", "counter",
+				"Frames copied out of driver buffers to free them up.", stats.framesCopied);
+			WEBCAM_METRIC("webcam_buffers_in_flight", "gauge",
+				"Driver buffers held by connections.", stats.buffersInFlight);
+			WEBCAM_METRIC("webcam_buffers", "gauge",
+				"Driver buffers.", stats.numBuffers);
+			WEBCAM_METRIC("webcam_subscribers", "gauge",
+				"Connections with the webcam open.", stats.subscribers);
+			WEBCAM_METRIC("webcam_streaming_subscribers", "gauge",
+				"Connections being sent frames.", stats.streaming);
+			WEBCAM_METRIC("webcam_http_viewers", "gauge",
+				"HTTP clients being sent MJPEG.", stats.viewers);
+
+		#undef WEBCAM_METRIC
+
+		metrics.family("webcam_bandwidth_limit_bytes", "gauge",
+			"Bandwidth limits in bytes per second, or 0 for none.");
+		metrics.sample("webcam_bandwidth_limit_bytes", MetricsWriter::label("scope", "client"),
+		               bandwidthLimits.getClientLimit());
+		metrics.sample("webcam_bandwidth_limit_bytes", MetricsWriter::label("scope", "global"),
+		               bandwidthLimits.getGlobalLimit());
+
+		metrics.family("webcam_frame_interval_seconds", "histogram", "Time between captured frames.");
+		for (size_t i = 0; i < webcams.size(); i++) {
+			metrics.histogram("webcam_frame_interval_seconds", webcamLabels[i],
+			                  webcams[i]->getFrameIntervals());
+		}
+
+		metrics.family("webcam_send_queue_wait_seconds", "histogram",
+			"Time messages waited in send queues before going out.");
+		metrics.histogram("webcam_send_queue_wait_seconds", "", Metrics::sendQueueWait());
+
+		metrics.family("webcam_lock_wait_seconds", "histogram",
+			"Time spent waiting for mutexes which were already locked.");
+		metrics.histogram("webcam_lock_wait_seconds", "", Metrics::lockWait());
+
+		TRACE_EXIT;
+		return metrics.str();
+	}
+
+	void
+	WebcamServer::reapConnections ()
+	{
+		Server::reapConnections();
+
+		uint64_t now = monotonicMs();
+		list< shared_ptr<WebcamServerConnection> > expired;
+
+		MutexLock lock(sessionsMutex);
+		lock.relock();
+
+		map<string, Session>::iterator itr = sessions.begin();
+		while (itr != sessions.end())
+		{
+			map<string, Session>::iterator next = itr;
+			next++;
+
+			Session& session = itr->second;
+			if (!session.connection->isFinished()) {
+				session.finishedAt = 0;
+			} else if (session.finishedAt == 0) {
+				session.finishedAt = now;
+			} else if (now - session.finishedAt >= (uint64_t) SESSION_LINGER_MS) {
+				expired.push_back(session.connection);
+				sessions.erase(itr);
+			}
+
+			itr = next;
+		}
+
+		lock.unlock();
+
+		// The server has already let go of them, and joined their threads
+		if (!expired.empty()) {
+			MESSAGE("Expired " << expired.size() << " session(s)");
+		}
+	}
@@ -6,6 +6,7 @@
 #include <string>
 
 #include "Log.h"
+#include "Sockets.h"      // MutexLock
 #include "WebcamViewer.h"
 
 #include <linux/videodev2.h>
@@ -29,8 +30,10 @@ WebcamViewer::WebcamViewer(
 		string title,
 		Webcam::video_fmt_enum_t v4lImageFormat
 ):
-	width  (width_),
-	height (height_)
+	width       (width_),
+	height      (height_),
+	canvasLent  (false),
+	canvasPitch (0)
 {
 	TRACE_ENTER;
 
@@ -38,6 +41,11 @@ WebcamViewer::WebcamViewer(
 		THROW_ERROR("Cannot start multiple instances of SDL, and by extension, WebcamViewer.");
 	}
 
+	int err = pthread_mutex_init(&canvasMutex, NULL);
+	if (err) {
+		THROW_ERROR("Error creating canvas mutex: " << strerror(err));
+	}
+
 	// Attempt to convert the format right away
 	sdlImageFormat = v4l2sdl_fmt(v4lImageFormat);
 
@@ -96,6 +104,8 @@ WebcamViewer::~WebcamViewer()
 
 	SDL_Quit();
 
+	pthread_mutex_destroy(&canvasMutex);
+
 	initiated = false;
 
 	TRACE_EXIT;
@@ -117,6 +127,12 @@ WebcamViewer::setImageSize (uint32_t newWidth, uint32_t newHeight)
 {
 	TRACE_ENTER;
 
+	MutexLock lock(canvasMutex);
+	lock.relock();
+	if (canvasLent) {
+		THROW_ERROR("Can't resize the canvas while a frame is being written to it");
+	}
+
 	SDL_Texture *newCanvas = SDL_CreateTexture(
 		renderer,
 		sdlImageFormat,
@@ -131,6 +147,7 @@ WebcamViewer::setImageSize (uint32_t newWidth, uint32_t newHeight)
 
 	SDL_DestroyTexture(canvas);
 	canvas = newCanvas;
+	canvasPitch = 0;
 
 	width = newWidth;
 	height = newHeight;
@@ -153,6 +170,12 @@ WebcamViewer::setImageFormat (Webcam::video_fmt_enum_t v4lImageFormat)
 
 	uint32_t newFormat = v4l2sdl_fmt(v4lImageFormat);
 
+	MutexLock lock(canvasMutex);
+	lock.relock();
+	if (canvasLent) {
+		THROW_ERROR("Can't change the canvas's format while a frame is being written to it");
+	}
+
 	SDL_Texture *newCanvas = SDL_CreateTexture(
 		renderer,
 		newFormat,
@@ -167,6 +190,7 @@ WebcamViewer::setImageFormat (Webcam::video_fmt_enum_t v4lImageFormat)
 
 	SDL_DestroyTexture(canvas);
 	canvas = newCanvas;
+	canvasPitch = 0;
 
 	sdlImageFormat = newFormat;
 
@@ -174,34 +198,105 @@ WebcamViewer::setImageFormat (Webcam::video_fmt_enum_t v4lImageFormat)
 }
 
 void
-WebcamViewer::showFrame (void* sourceBuffer, size_t sourceLength)
+WebcamViewer::showFrame (void* sourceBuffer, size_t sourceLength, size_t sourcePitch)
 {
 	TRACE_ENTER;
 
 	void* targetBuffer;
 	int   targetPitch;
 
+	MutexLock lock(canvasMutex);
+	lock.relock();
+	if (canvasLent) {
+		THROW_ERROR("Can't show a frame while another is being written to the canvas");
+	}
+
 	if (SDL_LockTexture(canvas, NULL, &targetBuffer, &targetPitch)) {
 		THROW_ERROR("SDL_LockTexture Error: " << SDL_GetError());
 	}
+	canvasPitch = targetPitch;
+
+	// Rows padded differently from SDL's are copied one at a time
+	if (sourcePitch != 0 && sourcePitch != (size_t) targetPitch &&
+	    sourceLength == height * sourcePitch)
+	{
+		size_t rowLength = sourcePitch < (size_t) targetPitch ? sourcePitch : targetPitch;
+		for (uint32_t row = 0; row < height; row++)
+		{
+			memcpy(static_cast<uint8_t*>(targetBuffer) + row * targetPitch,
+			       static_cast<uint8_t*>(sourceBuffer) + row * sourcePitch,
+			       rowLength);
+		}
+	}
+	else
+	{
+		if (sourceLength != height * targetPitch) {
+			SDL_UnlockTexture(canvas);
+			THROW_ERROR("Image data size mismatch: Source buffer is " << sourceLength
+				<< " bytes; destination buffer is " << (height * targetPitch) << " bytes"
+				<< " (image height = " << height << "; bytes/row = " << targetPitch << ")"
+			);
+		}
+
+		memcpy(targetBuffer, sourceBuffer, sourceLength);
+	}
+
+	SDL_UnlockTexture(canvas);
+
+	present();
+
+	TRACE_EXIT;
+}
+
+void*
+WebcamViewer::borrowCanvas (size_t length, int& pitch)
+{
+	MutexLock lock(canvasMutex);
+	lock.relock();
+
+	// Don't bother locking a canvas the frame's already known not to fit
+	if (canvasLent || (canvasPitch != 0 && length != height * canvasPitch)) {
+		return NULL;
+	}
 
-	if (sourceLength != height * targetPitch) {
+	void* pixels;
+	if (SDL_LockTexture(canvas, NULL, &pixels, &canvasPitch)) {
+		THROW_ERROR("SDL_LockTexture Error: " << SDL_GetError());
+	}
+	if (length != height * canvasPitch)
+	{
 		SDL_UnlockTexture(canvas);
-		THROW_ERROR("Image data size mismatch: Source buffer is " << sourceLength
-			<< " bytes; destination buffer is " << (height * targetPitch) << " bytes"
-			<< " (image height = " << height << "; bytes/row = " << targetPitch << ")"
-		);
+		return NULL;
 	}
 
-	memcpy(targetBuffer, sourceBuffer, sourceLength);
+	canvasLent = true;
+	pitch = canvasPitch;
+	return pixels;
+}
 
+void
+WebcamViewer::returnCanvas (bool show)
+{
+	MutexLock lock(canvasMutex);
+	lock.relock();
+
+	if (!canvasLent) {
+		return;
+	}
 	SDL_UnlockTexture(canvas);
+	canvasLent = false;
+
+	if (show) {
+		present();
+	}
+}
 
+void
+WebcamViewer::present ()
+{
 	SDL_RenderClear(renderer);
 	SDL_RenderCopy(renderer, canvas, NULL, NULL);
 	SDL_RenderPresent(renderer);
-
-	TRACE_EXIT;
 }
 
 uint32_t
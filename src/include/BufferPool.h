@@ -0,0 +1,76 @@
+#ifndef BUFFER_POOL_H
+#define BUFFER_POOL_H
+
+#include <map>          // maps
+#include <memory>       // shared_ptr
+#include <pthread.h>    // multithreading
+#include <stdint.h>     // uint8_t
+#include <vector>       // vectors
+
+/**
+ * A cache of byte buffers for incoming messages, so that receiving a
+ * steady stream of similarly-sized messages (i.e. frames) doesn't mean
+ * allocating, page-faulting and freeing a fresh buffer every time.
+ *
+ * Buffers are sorted into size classes. There's no explicit release: the
+ * pool keeps its own reference to every buffer it hands out, and a buffer
+ * becomes available again as soon as everyone else has let go of it.
+ */
+class BufferPool
+{
+  public:
+	typedef std::vector<uint8_t> buffer_t;
+
+	typedef std::shared_ptr<buffer_t> buffer_ptr;
+
+  private:
+	/// Buffers belonging to each size class, keyed by the class's size
+	std::map< size_t, std::vector<buffer_ptr> > classes;
+
+	/// Mutex for the size classes
+	pthread_mutex_t classesMutex;
+
+	/// How many buffers each size class holds on to
+	size_t maxBuffersPerClass;
+
+	/// Handed out for empty messages, so they don't cost anything at all
+	buffer_ptr emptyBuffer;
+
+  public:
+
+	/**
+	 * @param maxBuffersPerClass_  How many buffers of each size to keep
+	 *                             around. If more than this are in use at
+	 *                             once, the extras are freed after use.
+	 */
+	BufferPool (size_t maxBuffersPerClass_ = 8);
+
+	~BufferPool ();
+
+	/**
+	 * Finds an unused buffer of at least the given size, or allocates one.
+	 *
+	 * The buffer may be larger than requested (it's the size of its size
+	 * class), and it may contain leftover data from a previous message.
+	 * A zero-length request returns a shared single-byte buffer holding a
+	 * zero, in case someone accidentally dereferences it.
+	 *
+	 * @param size  Number of bytes needed
+	 * @return      A buffer, which returns to the pool once released
+	 */
+	buffer_ptr
+	acquire (size_t size);
+
+	/**
+	 * Rounds a size up to its size class. Classes go in quarter steps
+	 * between powers of two, so no more than a fifth of a buffer is wasted.
+	 */
+	static size_t
+	getSizeClass (size_t size);
+
+	/// The pool shared by every connection which hasn't been given its own
+	static std::shared_ptr<BufferPool>
+	getSharedPool ();
+};
+
+#endif // BUFFER_POOL_H
@@ -0,0 +1,397 @@
+#ifndef COROUTINES_H
+#define COROUTINES_H
+
+// This is the one part of the tree that needs C++20 (see COROUTINE_FLAGS in
+// the Makefile); everything else still builds as C++0x.
+#if __cplusplus < 202002L
+#error "Coroutines.h needs C++20"
+#endif
+
+#include <coroutine>    // coroutine_handle, suspend_always
+#include <deque>        // double-ended queues
+#include <exception>    // exception_ptr
+#include <memory>       // shared_ptr
+#include <optional>     // optional
+#include <pthread.h>    // multithreading
+#include <stdint.h>     // uint8_t
+#include <string>       // strings
+#include <utility>      // move
+#include <vector>       // vectors
+
+#include "EventLoop.h"
+#include "Sockets.h"
+
+template <typename T>
+class Task;
+
+/// What the promises of every kind of Task have in common
+class TaskPromiseBase
+{
+  public:
+
+	/// The coroutine awaiting this one, resumed when it finishes
+	std::coroutine_handle<> continuation;
+
+	/// Whatever the task threw, rethrown to whoever awaits it
+	std::exception_ptr exception;
+
+	/// Resumes the awaiting coroutine straight from the finished one
+	struct FinalAwaiter
+	{
+		bool
+		await_ready () noexcept
+		{
+			return false;
+		}
+
+		template <typename Promise>
+		std::coroutine_handle<>
+		await_suspend (std::coroutine_handle<Promise> finished) noexcept
+		{
+			std::coroutine_handle<> next = finished.promise().continuation;
+			return next ? next : std::noop_coroutine();
+		}
+
+		void
+		await_resume () noexcept
+		{ }
+	};
+
+	/// Tasks don't start until they're awaited
+	std::suspend_always
+	initial_suspend () noexcept
+	{
+		return std::suspend_always();
+	}
+
+	FinalAwaiter
+	final_suspend () noexcept
+	{
+		return FinalAwaiter();
+	}
+
+	void
+	unhandled_exception ()
+	{
+		exception = std::current_exception();
+	}
+};
+
+template <typename T>
+class TaskPromise: public TaskPromiseBase
+{
+	std::optional<T> value;
+
+  public:
+
+	Task<T>
+	get_return_object ();
+
+	void
+	return_value (T value_)
+	{
+		value = std::move(value_);
+	}
+
+	/// The value the task returned, or what it threw
+	T
+	result ()
+	{
+		if (exception) {
+			std::rethrow_exception(exception);
+		}
+		return std::move(*value);
+	}
+};
+
+template <>
+class TaskPromise<void>: public TaskPromiseBase
+{
+  public:
+
+	Task<void>
+	get_return_object ();
+
+	void
+	return_void ()
+	{ }
+
+	void
+	result ()
+	{
+		if (exception) {
+			std::rethrow_exception(exception);
+		}
+	}
+};
+
+/**
+ * Return type for coroutines written against this layer. A task doesn't
+ * run until it's awaited: co_await runs it to completion, on whichever
+ * thread it happens to resume on, and gives back its result (or rethrows
+ * what it threw). To set one going on its own, use spawn().
+ */
+template <typename T = void>
+class Task
+{
+  public:
+
+	typedef TaskPromise<T> promise_type;
+
+  private:
+
+	std::coroutine_handle<promise_type> handle;
+
+  public:
+
+	explicit
+	Task (std::coroutine_handle<promise_type> handle_):
+		handle (handle_)
+	{ }
+
+	Task (Task&& other) noexcept:
+		handle (other.handle)
+	{
+		other.handle = nullptr;
+	}
+
+	Task (const Task&) = delete;
+
+	Task&
+	operator= (const Task&) = delete;
+
+	~Task ()
+	{
+		if (handle) {
+			handle.destroy();
+		}
+	}
+
+	bool
+	await_ready ()
+	{
+		return false;
+	}
+
+	/// Runs the task, which resumes the awaiting coroutine when it's done
+	std::coroutine_handle<>
+	await_suspend (std::coroutine_handle<> awaiting)
+	{
+		handle.promise().continuation = awaiting;
+		return handle;
+	}
+
+	T
+	await_resume ()
+	{
+		return handle.promise().result();
+	}
+};
+
+template <typename T>
+Task<T>
+TaskPromise<T>::get_return_object ()
+{
+	return Task<T>(std::coroutine_handle< TaskPromise<T> >::from_promise(*this));
+}
+
+inline Task<void>
+TaskPromise<void>::get_return_object ()
+{
+	return Task<void>(std::coroutine_handle< TaskPromise<void> >::from_promise(*this));
+}
+
+/**
+ * Awaiting this moves the coroutine onto the event loop's worker pool (see
+ * schedule())
+ */
+class ScheduleAwaiter
+{
+	std::shared_ptr<EventLoop> executor;
+
+  public:
+
+	ScheduleAwaiter (std::shared_ptr<EventLoop> executor_);
+
+	bool
+	await_ready ();
+
+	void
+	await_suspend (std::coroutine_handle<> awaiting);
+
+	void
+	await_resume ();
+};
+
+/**
+ * Suspends the calling coroutine and resumes it on one of the event loop's
+ * worker threads.
+ */
+ScheduleAwaiter
+schedule (std::shared_ptr<EventLoop> executor);
+
+/**
+ * Starts a task on the event loop's worker pool and lets it run by itself.
+ * It's freed when it finishes; exceptions it lets out are logged.
+ *
+ * Tasks are resumed by posting to the worker pool, so one which is still
+ * suspended when the loop is destroyed is never finished.
+ */
+void
+spawn (std::shared_ptr<EventLoop> executor, Task<void> task);
+
+/**
+ * A connection which coroutines can wait on instead of registering
+ * handlers. roundTrip() sends a request and waits for its reply (see
+ * Connection::request()). Anything else with no handler of its own goes
+ * into an inbox, which recv() takes messages from in order.
+ *
+ * Coroutines waiting on the connection are resumed on the executor's
+ * worker pool rather than on the thread the message arrived on, so no
+ * thread is tied up while they wait, and any number of connections can be
+ * served by the handful of threads in the pool.
+ */
+class CoConnection: public Connection
+{
+  public:
+
+	/// A message as recv() gives it
+	struct Message
+	{
+		message_t type;
+
+		/// Copy of the body
+		std::vector<uint8_t> body;
+	};
+
+	class ReceiveAwaiter;
+	class RoundTripAwaiter;
+
+  private:
+
+	std::shared_ptr<EventLoop> executor;
+
+	/// Messages which have arrived but haven't been taken by recv()
+	std::deque<Message> inbox;
+
+	/// The coroutine waiting in recv(), if any
+	std::coroutine_handle<> receiver;
+
+	/// Where the waiting coroutine wants its message put
+	ReceiveAwaiter* receiverAwaiter;
+
+	/// Set once the connection has closed, after which recv() fails
+	bool closed;
+
+	/// Mutex for the inbox, the receiver and closed
+	pthread_mutex_t inboxMutex;
+
+	/// Puts unhandled messages in the inbox, or hands them to the receiver
+	const message_handler_t handleIncoming;
+
+	/// Resumes a coroutine on the executor
+	void
+	resume (std::coroutine_handle<> handle);
+
+  protected:
+
+	void
+	connectionClosed ();
+
+  public:
+
+	/**
+	 * @param executor  Event loop whose worker pool runs the coroutines.
+	 *                  The connection itself may use the same loop, or a
+	 *                  reader thread.
+	 */
+	CoConnection (int fd, in_addr_t remoteAddress, in_port_t remotePort,
+	              std::shared_ptr<EventLoop> executor);
+
+	~CoConnection ();
+
+	std::shared_ptr<EventLoop>
+	getExecutor ();
+
+	/// Awaiting this gives the next message from the inbox (see recv())
+	class ReceiveAwaiter
+	{
+		friend class CoConnection;
+
+		CoConnection& connection;
+
+		Message message;
+
+		bool failed;
+
+	  public:
+
+		ReceiveAwaiter (CoConnection& connection_);
+
+		bool
+		await_ready ();
+
+		bool
+		await_suspend (std::coroutine_handle<> awaiting);
+
+		Message
+		await_resume ();
+	};
+
+	/// Awaiting this sends a request and gives back its reply (see roundTrip())
+	class RoundTripAwaiter
+	{
+		CoConnection& connection;
+
+		message_t type;
+		std::vector<uint8_t> body;
+
+		Reply reply;
+
+		bool failed;
+
+	  public:
+
+		RoundTripAwaiter (CoConnection& connection_, message_t type_, size_t length,
+		                  const void* data);
+
+		bool
+		await_ready ();
+
+		void
+		await_suspend (std::coroutine_handle<> awaiting);
+
+		Reply
+		await_resume ();
+	};
+
+	/**
+	 * Waits for the next message which has no handler registered for its
+	 * type. Only one coroutine may wait at a time.
+	 *
+	 * @throws runtime_error  Once the connection has closed and the inbox
+	 *                        is empty
+	 */
+	ReceiveAwaiter
+	recv ();
+
+	/**
+	 * Sends a control message as a request and waits for the peer to
+	 * finish handling it (see Connection::request()). Any number of
+	 * coroutines may have requests in flight at once.
+	 *
+	 * @param type    Integer indicating the type of the message
+	 * @param length  Number of bytes to send from *data
+	 * @param data    Data to send (copied)
+	 * @return The last reply, or REQUEST_COMPLETE_MESSAGE if there wasn't one
+	 * @throws runtime_error  If the connection closes first
+	 */
+	RoundTripAwaiter
+	roundTrip (message_t type, size_t length = 0, const void* data = NULL);
+
+	/// Wrapper that calls roundTrip(message_t, size_t, const void*) on a string
+	RoundTripAwaiter
+	roundTrip (message_t type, const std::string& data);
+};
+
+#endif // COROUTINES_H
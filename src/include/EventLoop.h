@@ -0,0 +1,209 @@
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+#include <sys/epoll.h>  // EPOLLIN, EPOLLOUT, etc.
+
+#include <functional>   // lambdas
+#include <list>         // doubly-linked lists
+#include <map>          // maps
+#include <memory>       // shared_ptr
+#include <pthread.h>    // multithreading
+#include <vector>       // vectors
+
+class IoUring;
+
+/**
+ * Anything with a file descriptor which wants to be told when that
+ * descriptor is ready for reading or writing.
+ */
+class EventHandler
+{
+  public:
+	virtual
+	~EventHandler ()
+	{ }
+
+	/// The file descriptor to watch
+	virtual int
+	getEventFd () = 0;
+
+	/**
+	 * Called from one of the loop threads when epoll reports activity on the
+	 * file descriptor. A given handler is only ever watched by one loop
+	 * thread, so this is never called concurrently for the same handler.
+	 *
+	 * Handlers should never block in here; anything slow belongs on the
+	 * worker pool (see EventLoop::post()).
+	 *
+	 * @param events  Bitmask of EPOLL* flags
+	 * @return        false if the handler is finished and should be removed
+	 *                from the loop
+	 */
+	virtual bool
+	handleEvents (uint32_t events) = 0;
+
+	/**
+	 * Called once the handler has been removed from the loop because
+	 * handleEvents() returned false.
+	 */
+	virtual void
+	handleRemoved ()
+	{ }
+};
+
+/**
+ * A fixed set of threads which run tasks off of a shared queue.
+ */
+class WorkerPool
+{
+	typedef std::function<void()> task_t;
+
+	std::vector<pthread_t> threads;
+
+	std::list<task_t> tasks;
+
+	pthread_mutex_t tasksMutex;
+
+	/// Signalled when a task is added or the pool is stopping
+	pthread_cond_t tasksCond;
+
+	/// Flag telling the worker threads to exit
+	bool stopFlag;
+
+	void
+	workerThread (void* unused);
+
+  public:
+
+	/**
+	 * @param numThreads  How many worker threads to start
+	 */
+	WorkerPool (int numThreads);
+
+	/// Stops the workers, abandoning any tasks which haven't started yet
+	~WorkerPool ();
+
+	/// Queues a task to run on one of the worker threads
+	void
+	post (task_t task);
+
+	/// Tells the workers to exit once they finish what they're doing
+	void
+	stop ();
+};
+
+/**
+ * An epoll-based reactor. Instead of parking a blocked thread on every
+ * socket, a handful of loop threads (one per core, by default) each watch
+ * their own epoll set and call the EventHandler when something happens.
+ * Handlers hand longer-running work off to a shared WorkerPool.
+ */
+class EventLoop
+{
+	struct Registration
+	{
+		std::shared_ptr<EventHandler> handler;
+
+		/// Index of the loop thread watching the handler
+		int loopIndex;
+	};
+
+	/// One epoll descriptor per loop thread
+	std::vector<int> epollFds;
+
+	/// eventfd per loop thread, used to wake it up when stopping
+	std::vector<int> wakeFds;
+
+	std::vector<pthread_t> threads;
+
+	/// Every registered handler, keyed by its address
+	std::map<EventHandler*, Registration> registrations;
+
+	/// Mutex for adding/removing registrations
+	pthread_mutex_t registrationsMutex;
+
+	/// Which loop thread to give the next handler to
+	int nextLoopIndex;
+
+	/// Flag telling the loop threads to exit
+	bool stopFlag;
+
+	WorkerPool workers;
+
+	/// Where the connections on this loop submit their sends, if io_uring
+	/// is available
+	std::shared_ptr<IoUring> ioUring;
+
+	/// Maximum number of events to pull out of epoll_wait() at once
+	static const int MAX_EVENTS = 64;
+
+	void
+	loopThread (int index);
+
+	/**
+	 * Looks up the handler registered at the given address.
+	 * @return A reference to it, or an empty pointer if it was removed
+	 */
+	std::shared_ptr<EventHandler>
+	find (EventHandler* handler_p);
+
+  public:
+
+	/**
+	 * Sets up the epoll descriptors. Call start() to actually get going.
+	 *
+	 * @param numLoopThreads    Number of epoll threads. Zero means one per core.
+	 * @param numWorkerThreads  Number of worker threads. Zero means one per core.
+	 * @param useIoUring        Whether to send through io_uring, if it was
+	 *                          compiled in and the kernel supports it
+	 */
+	EventLoop (int numLoopThreads = 0, int numWorkerThreads = 0, bool useIoUring = true);
+
+	~EventLoop ();
+
+	/// Starts the loop threads
+	void
+	start ();
+
+	/// Stops the loop threads and waits for them to exit
+	void
+	stop ();
+
+	/**
+	 * Starts watching a handler's file descriptor.
+	 *
+	 * @param handler  The handler. The loop keeps a reference to it until it
+	 *                 is removed.
+	 * @param events   Bitmask of EPOLL* flags to watch for
+	 */
+	void
+	add (std::shared_ptr<EventHandler> handler, uint32_t events);
+
+	/**
+	 * Changes the set of events a handler is watching for.
+	 * If the handler isn't registered, nothing happens.
+	 */
+	void
+	modify (EventHandler& handler, uint32_t events);
+
+	/**
+	 * Stops watching a handler's file descriptor and releases the loop's
+	 * reference to it. If it isn't registered, nothing happens.
+	 */
+	void
+	remove (EventHandler& handler);
+
+	/// Queues a task to run on the worker pool
+	void
+	post (std::function<void()> task);
+
+	/// The loop's io_uring, or an empty pointer if sends use sendmsg()
+	std::shared_ptr<IoUring>
+	getIoUring ();
+
+	/// Number of processors online, with a floor of one
+	static int
+	getNumCores ();
+};
+
+#endif // EVENT_LOOP_H
@@ -0,0 +1,186 @@
+#ifndef FRAME_RING_H
+#define FRAME_RING_H
+
+#include <atomic>       // atomic counters
+#include <memory>       // shared_ptr
+#include <pthread.h>    // multithreading
+#include <stdint.h>     // uint32_t, etc.
+
+#include "Sockets.h"
+
+/**
+ * Sits at the front of a frame ring's memfd. The writer fills in the sizes
+ * once; after that, only the counters change.
+ */
+struct FrameRingHeader
+{
+	/// FRAME_RING_MAGIC, so a reader knows what it's been handed
+	uint32_t magic;
+
+	/// Number of slots in the ring
+	uint32_t slotCount;
+
+	/// Most bytes of frame a slot can hold
+	uint64_t slotSize;
+
+	/// Bytes from the start of one slot to the start of the next
+	uint64_t slotStride;
+
+	/// Sequence number of the newest complete frame (0 before the first)
+	std::atomic<uint64_t> published;
+
+	/// Bumped after every frame. Readers sleep on it (FUTEX_WAIT).
+	std::atomic<uint32_t> futex;
+
+	uint32_t reserved;
+};
+
+/**
+ * Sits at the front of every slot, followed by the frame itself
+ */
+struct FrameRingSlot
+{
+	/**
+	 * Twice the sequence number of the frame in the slot. It's odd (one
+	 * less) while that frame is being written, so a reader can tell
+	 * whether the frame it read was overwritten underneath it.
+	 */
+	std::atomic<uint64_t> generation;
+
+	/// Message type the frame is delivered as
+	uint32_t type;
+
+	/// Length of the frame
+	uint32_t length;
+};
+
+const uint32_t FRAME_RING_MAGIC = 0x46524e47; // "FRNG"
+
+/**
+ * Publishes frames into a ring of slots in shared memory (a memfd). Any
+ * number of processes on this host can map the ring and read frames
+ * straight out of it, with no copies beyond the one made here. A reader
+ * only enters the kernel to sleep once it has caught up.
+ *
+ * Readers are never waited for. If one falls more than a ring's worth of
+ * frames behind, the slots it hasn't read yet are overwritten, and the
+ * generation counters tell it so.
+ */
+class FrameRingWriter
+{
+	/// The memfd, writable
+	int fd;
+
+	/// A read-only descriptor for the same memfd, to give to readers
+	int readerFd;
+
+	FrameRingHeader* header;
+
+	size_t mappingLength;
+
+  public:
+
+	/**
+	 * @param slotCount  Number of frames the ring holds
+	 * @param slotSize   Most bytes a frame can take
+	 */
+	FrameRingWriter (uint32_t slotCount, size_t slotSize);
+
+	~FrameRingWriter ();
+
+	/**
+	 * Copies a frame into the next slot and wakes up the readers.
+	 *
+	 * @param type          Message type to deliver the frame as
+	 * @param length        Number of bytes to copy from *data
+	 * @param data          The frame
+	 * @param prefix        Bytes to put ahead of the frame (e.g. a
+	 *                      frame_header), counted in its length
+	 * @param prefixLength  Number of bytes to copy from *prefix
+	 * @return              false if the frame is too big for a slot
+	 */
+	bool
+	publish (message_t type, size_t length, void* data,
+	         const void* prefix = NULL, size_t prefixLength = 0);
+
+	/**
+	 * A read-only descriptor for the ring, to pass to readers (see
+	 * Connection::sendDescriptor()). It stays owned by the writer.
+	 */
+	int
+	getReaderFd ();
+
+	size_t
+	getSlotSize ();
+};
+
+/**
+ * Reads frames published by a FrameRingWriter in another process, passing
+ * each one to a message handler from a thread of its own.
+ *
+ * Frames are handed to the handler where they sit in the ring, which is
+ * mapped read-only: the handler must not write to them, or hold on to them
+ * after it returns. Frames are read in order; if the reader falls so far
+ * behind that the writer laps it, it skips ahead to the newest frame.
+ */
+class FrameRingReader
+{
+	int fd;
+
+	const FrameRingHeader* header;
+
+	size_t mappingLength;
+
+	const Connection::message_handler_t handler;
+
+	/// Sequence number of the next frame to read
+	uint64_t nextSeq;
+
+	pthread_t readerThreadHandle;
+
+	bool readerThreadStarted;
+
+	/// Tells the reader thread to return
+	bool stopFlag;
+
+	uint64_t framesRead;
+
+	uint64_t framesOverrun;
+
+	void
+	readerThread (void* unused);
+
+	/// Reads and handles the frame numbered nextSeq
+	void
+	readFrame ();
+
+  public:
+
+	/**
+	 * Maps a ring. Call start() to start reading; the first frame read is
+	 * the next one published.
+	 *
+	 * @param handler  Called from the reader thread with each frame
+	 * @param fd_      The ring, as passed by the writer. The reader takes
+	 *                 ownership of it.
+	 */
+	FrameRingReader (Connection::message_handler_t handler, int fd_);
+
+	~FrameRingReader ();
+
+	void
+	start ();
+
+	/// Stops the reader thread and waits for it to exit
+	void
+	stop ();
+
+	uint64_t
+	getFramesRead ();
+
+	/// Frames which were overwritten before (or while) they were read
+	uint64_t
+	getFramesOverrun ();
+};
+
+#endif // FRAME_RING_H
@@ -0,0 +1,345 @@
+#ifndef HTTP_H
+#define HTTP_H
+
+#include <netinet/in.h> // in_addr_t, in_port_t
+
+#include <deque>        // double-ended queues
+#include <functional>   // lambdas
+#include <list>         // doubly-linked lists
+#include <map>          // maps
+#include <memory>       // shared_ptr
+#include <pthread.h>    // multithreading
+#include <string>       // strings
+
+#include "EventLoop.h"
+
+class HttpListener;
+
+/// What an HTTP client asked for
+struct HttpRequest
+{
+	/// e.g. "GET"
+	std::string method;
+
+	/// The path, without the query string
+	std::string path;
+
+	/// Everything after the '?', or nothing
+	std::string query;
+
+	/// Header fields, keyed by lowercase name
+	std::map<std::string, std::string> headers;
+
+	/// As much as Content-Length said was coming, or nothing
+	std::string body;
+
+	/// Looks up a parameter in the query string, then in a form-encoded
+	/// body, percent-decoded, returning the fallback if it isn't there
+	std::string
+	getParameter (const std::string& name, const std::string& fallback = "") const;
+};
+
+/**
+ * One client of an HttpListener. It reads a single request, hands it to the
+ * listener's route for the path, and closes once the response has gone out
+ * (every response says Connection: close).
+ *
+ * A response can be sent all at once with respond(), or written a piece at
+ * a time with write() and ended with finish(), which suits responses which
+ * go on for as long as the client is listening. write() and finish() may
+ * be called from any thread; writes go out in the background, on the event
+ * loop, if the socket doesn't have room for them straight away.
+ *
+ * writeShared() queues bytes without copying them, so the same buffer can
+ * be written to any number of clients.
+ *
+ * A WebSocket handshake can be answered with acceptWebSocket(), which hands
+ * the socket over to whatever speaks the protocol from then on.
+ */
+class HttpConnection: public EventHandler,
+                      public std::enable_shared_from_this<HttpConnection>
+{
+  public:
+	/// Called once the connection has closed
+	typedef std::function<void()> close_handler_t;
+
+  private:
+	/// Some bytes waiting to be written, and whatever keeps them alive
+	struct Chunk
+	{
+		std::shared_ptr<const void> pin;
+
+		const char* data;
+
+		size_t length;
+	};
+
+	int fd;
+
+	const in_addr_t remoteAddress;
+
+	const in_port_t remotePort;
+
+	/// Whose routes the request goes to
+	std::shared_ptr<HttpListener> listener;
+
+	std::weak_ptr<EventLoop> eventLoop;
+
+	/// The request so far. Only the loop thread touches this.
+	std::string incoming;
+
+	/// Set once the request has been handed to its route
+	bool requestReceived;
+
+	/// Bytes waiting to be written. The first chunk has had outgoingOffset
+	/// bytes written already.
+	std::deque<Chunk> outgoing;
+	size_t outgoingOffset;
+
+	/// Bytes in outgoing which haven't been written
+	size_t queuedBytes;
+
+	/// Whether the loop is watching for room to write
+	bool writeArmed;
+
+	/// Set by finish(): close once outgoing is empty
+	bool finishing;
+
+	/// Set once the connection has closed; writes are dropped after that
+	bool closed;
+
+	close_handler_t closeHandler;
+
+	/// Mutex for the outgoing bytes and the flags above
+	pthread_mutex_t outgoingMutex;
+
+	/// Longest request accepted, headers, body and all
+	static const size_t MAX_REQUEST_BYTES = 8192;
+
+	/// Most chunks handed to the kernel at once
+	static const int MAX_IOVECS = 64;
+
+	/**
+	 * Writes as much of outgoing as the socket will take.
+	 * Needs the outgoing mutex.
+	 *
+	 * @return false if the socket failed
+	 */
+	bool
+	flush ();
+
+	/// Has the loop watch for room to write, or stop watching.
+	/// Needs the outgoing mutex.
+	void
+	setWriteArmed (bool armed);
+
+	/**
+	 * Parses the request, once its headers have arrived
+	 *
+	 * @param request  Filled in with the request
+	 * @param missing  Set to how many bytes of the body are still to come
+	 * @return false if the request is malformed
+	 */
+	bool
+	parseRequest (HttpRequest& request, size_t& missing);
+
+	/// Queues a chunk and writes what the socket will take
+	void
+	enqueue (const Chunk& chunk);
+
+  public:
+
+	HttpConnection (int fd_, in_addr_t remoteAddress_, in_port_t remotePort_,
+	                std::shared_ptr<HttpListener> listener_);
+
+	~HttpConnection ();
+
+	/// Starts reading the request on the given loop
+	void
+	attach (std::shared_ptr<EventLoop> loop);
+
+	int
+	getEventFd ();
+
+	bool
+	handleEvents (uint32_t events);
+
+	void
+	handleRemoved ();
+
+	/// IP address of the client, in network byte order
+	in_addr_t
+	getRemoteAddress ();
+
+	/// Port of the client, in network byte order
+	in_port_t
+	getRemotePort ();
+
+	/**
+	 * Sends a whole response and closes the connection once it's gone.
+	 *
+	 * @param status       e.g. 200
+	 * @param contentType  Content-Type of the body
+	 * @param body         The body
+	 */
+	void
+	respond (int status, const std::string& contentType, const std::string& body);
+
+	/**
+	 * Sends a response's status line and headers, for a body which will
+	 * follow with write(). There's no Content-Length: the body ends when
+	 * the connection closes.
+	 *
+	 * @param status   e.g. 200
+	 * @param headers  Further header lines, each ending in "\r\n"
+	 */
+	void
+	respondStreaming (int status, const std::string& headers);
+
+	/// Queues bytes to be written. Does nothing once the connection has
+	/// closed.
+	void
+	write (const void* data, size_t length);
+
+	void
+	write (const std::string& data);
+
+	/**
+	 * Queues bytes to be written without copying them.
+	 *
+	 * @param data    Bytes to write
+	 * @param length  How many
+	 * @param pin     Keeps the bytes alive until they've been written
+	 */
+	void
+	writeShared (const void* data, size_t length, std::shared_ptr<const void> pin);
+
+	/// Hangs up straight away, without writing whatever's queued
+	void
+	close ();
+
+	/**
+	 * Answers a WebSocket opening handshake (RFC 6455) with 101 Switching
+	 * Protocols, and gives up the socket: the loop stops watching it, and
+	 * it's the caller's to close. Nothing may have been written yet.
+	 *
+	 * If the request isn't a handshake, it's answered with an error
+	 * instead, and the connection closes as usual.
+	 *
+	 * @return The socket, or -1 if it wasn't a handshake
+	 */
+	int
+	acceptWebSocket (const HttpRequest& request);
+
+	/// Closes the connection once everything queued has been written
+	void
+	finish ();
+
+	/// Bytes queued which the socket hasn't taken yet, so writers can
+	/// tell when the client isn't keeping up
+	size_t
+	getQueuedBytes ();
+
+	bool
+	isClosed ();
+
+	/**
+	 * Sets a function to call once the connection has closed, from
+	 * whichever thread noticed. If it's closed already, the function is
+	 * called straight away.
+	 */
+	void
+	setCloseHandler (close_handler_t closeHandler_);
+
+	/// Reason phrase for a status code, e.g. "Not Found"
+	static std::string
+	statusText (int status);
+};
+
+/**
+ * A minimal HTTP/1.1 server which runs on an EventLoop rather than
+ * threads of its own: a listening socket whose connections are read and
+ * answered by the loop. Requests are routed by their exact path.
+ *
+ * It's meant for side channels on a server which mostly speaks something
+ * else (metrics, browser viewers), not for serving much traffic: each
+ * connection carries one request.
+ */
+class HttpListener: public EventHandler,
+                    public std::enable_shared_from_this<HttpListener>
+{
+  public:
+	/**
+	 * Answers a request. It's called on the loop thread, so it mustn't
+	 * block; it can either respond() straight away, or hang on to the
+	 * connection and write to it later from elsewhere.
+	 */
+	typedef std::function<void(std::shared_ptr<HttpConnection>, const HttpRequest&)>
+	request_handler_t;
+
+  private:
+	int fd;
+
+	std::weak_ptr<EventLoop> eventLoop;
+
+	struct Route
+	{
+		request_handler_t handler;
+
+		/// Whether POST and PUT are taken as well as GET
+		bool takesChanges;
+	};
+
+	/// Handlers keyed by path
+	std::map<std::string, Route> routes;
+
+	/// Connections accepted, which detach() hangs up on
+	std::list< std::weak_ptr<HttpConnection> > connections;
+
+	/// Mutex for the connections
+	pthread_mutex_t connectionsMutex;
+
+  public:
+
+	/**
+	 * Opens a socket listening on the given port, on every interface
+	 *
+	 * @param port  Port to listen on
+	 */
+	HttpListener (in_port_t port);
+
+	~HttpListener ();
+
+	/**
+	 * Adds a handler for a path. Routes must all be added before attach().
+	 *
+	 * @param path          The path, without a query string
+	 * @param handler       Answers requests for the path
+	 * @param takesChanges  Whether to hand the handler POST and PUT requests
+	 *                      too, which it can tell apart by their method.
+	 *                      Otherwise only GET gets through.
+	 */
+	void
+	addRoute (const std::string& path, request_handler_t handler, bool takesChanges = false);
+
+	/// Starts accepting connections on the given loop
+	void
+	attach (std::shared_ptr<EventLoop> loop);
+
+	/// Stops accepting connections, and hangs up on the ones already
+	/// accepted
+	void
+	detach ();
+
+	/// Hands a request to its route, or answers it with an error
+	void
+	route (std::shared_ptr<HttpConnection> connection, const HttpRequest& request);
+
+	int
+	getEventFd ();
+
+	bool
+	handleEvents (uint32_t events);
+};
+
+#endif // HTTP_H
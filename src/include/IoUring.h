@@ -0,0 +1,199 @@
+#ifndef IO_URING_H
+#define IO_URING_H
+
+#include <sys/socket.h> // struct msghdr
+
+#include <atomic>       // atomic counters
+#include <functional>   // lambdas
+#include <memory>       // shared_ptr
+#include <pthread.h>    // multithreading
+#include <stdint.h>     // uint64_t
+#include <vector>       // vectors
+
+/**
+ * An io_uring submission and completion queue pair. Sends are written
+ * into the submission queue and handed to the kernel in batches, and a
+ * thread of its own collects the results and calls whoever submitted
+ * them. A burst of sends to many sockets costs one system call instead of
+ * one apiece.
+ *
+ * Only compiled in when built with USE_IO_URING (make IO_URING=1); without
+ * it, or if the kernel won't set up a ring, open() returns nothing and
+ * everything sticks to epoll and sendmsg().
+ *
+ * The liburing helpers aren't used; the rings are mapped and driven with
+ * the raw system calls.
+ */
+class IoUring: public std::enable_shared_from_this<IoUring>
+{
+  public:
+
+	/**
+	 * Called from the completion thread with the operation's result: what
+	 * the system call would have returned, or minus the errno. It mustn't
+	 * submit anything itself, since a full ring only gets room back from
+	 * the completion thread; anything which follows on from the operation
+	 * belongs on another thread (see EventLoop::post()).
+	 */
+	typedef std::function<void(int)> completion_t;
+
+	/**
+	 * While one of these exists, sends submitted from the thread that made
+	 * it are only queued, and the kernel is handed all of them at once when
+	 * the last one is destroyed. They can be nested.
+	 */
+	class Batch
+	{
+	  public:
+		Batch ();
+
+		~Batch ();
+	};
+
+  private:
+
+	/// The ring's file descriptor
+	int fd;
+
+	/// The mapped submission queue ring, completion queue ring, and
+	/// submission queue entries
+	void* sqRing;
+	void* cqRing;
+	void* sqes;
+
+	size_t sqRingLength;
+	size_t cqRingLength;
+	size_t sqesLength;
+
+	/// Pointers into the mapped rings
+	unsigned* sqHead;
+	unsigned* sqTail;
+	unsigned* sqArray;
+	unsigned  sqMask;
+	unsigned  sqEntries;
+	unsigned* cqHead;
+	unsigned* cqTail;
+	unsigned  cqMask;
+	void*     cqes;
+
+	/// Entries written to the submission queue but not yet given to the kernel
+	unsigned unsubmitted;
+
+	/// Mutex for the submission queue
+	pthread_mutex_t submitMutex;
+
+	/// Signalled (with submitMutex) when the completion thread collects
+	/// completions while a submitter is waiting for room for them
+	pthread_cond_t roomCond;
+
+	/// Submitters waiting on roomCond
+	std::atomic<int> waitingForRoom;
+
+	/// Completions collected so far, so a waiting submitter can tell
+	std::atomic<uint64_t> completionsCollected;
+
+	/// Operations submitted whose completions haven't been collected
+	std::atomic<int> inFlight;
+
+	pthread_t completionThreadHandle;
+
+	bool completionThreadStarted;
+
+	/// Tells the completion thread to return once nothing is in flight
+	bool stopFlag;
+
+	/// Keeps the ring alive until the completion thread has exited
+	std::shared_ptr<IoUring> completionKeepalive;
+
+	/// Number of io_uring_enter() calls made to submit, and entries submitted
+	std::atomic<uint64_t> submitCalls;
+	std::atomic<uint64_t> submitted;
+
+	/// Size of the submission queue open() asks for
+	static const unsigned DEFAULT_ENTRIES = 256;
+
+	/// Longest a submitter waits for room before trying again anyway
+	static const int ROOM_WAIT_MS = 10;
+
+	IoUring (unsigned entries);
+
+	void
+	completionThread (void* unused);
+
+	/**
+	 * Claims the next free submission queue entry, zeroed, submitting what's
+	 * waiting if the queue is full. The caller must hold submitMutex.
+	 */
+	void*
+	nextSqe ();
+
+	/**
+	 * Hands the kernel whatever is waiting in the submission queue, unless
+	 * this thread is in a Batch. The caller must hold submitMutex.
+	 */
+	void
+	submitOrDefer ();
+
+	/// Hands the kernel whatever is waiting. The caller must hold submitMutex.
+	void
+	submitLocked ();
+
+	/**
+	 * Gives up submitMutex until the completion thread has collected more
+	 * than the given number of completions, or ROOM_WAIT_MS has passed.
+	 * The caller must hold submitMutex.
+	 */
+	void
+	waitForRoom (uint64_t collected);
+
+  public:
+
+	~IoUring ();
+
+	/**
+	 * Sets up a ring and starts its completion thread.
+	 *
+	 * @param entries  Size of the submission queue
+	 * @return         The ring, or an empty pointer if io_uring isn't
+	 *                 available (not compiled in, or refused by the kernel)
+	 */
+	static std::shared_ptr<IoUring>
+	open (unsigned entries = DEFAULT_ENTRIES);
+
+	/**
+	 * Submits a sendmsg(). The message header, everything it points to,
+	 * and the memory the iovecs refer to must stay valid until onComplete
+	 * is called.
+	 *
+	 * As with a blocking sendmsg(), the kernel waits for room in the socket
+	 * rather than failing, but it may still write less than was asked.
+	 *
+	 * Mustn't be called from a completion.
+	 *
+	 * @param sockFd      Socket to send on
+	 * @param msg         The message
+	 * @param flags       MSG_* flags
+	 * @param onComplete  Called with the number of bytes sent, or -errno
+	 * @return            false if the ring has been stopped, in which case
+	 *                    nothing was submitted
+	 */
+	bool
+	sendmsg (int sockFd, const msghdr* msg, int flags, completion_t onComplete);
+
+	/// Hands the kernel whatever has been submitted but deferred by a Batch
+	void
+	submit ();
+
+	/**
+	 * Waits for everything in flight to complete, then stops the
+	 * completion thread. Nothing more may be submitted afterwards.
+	 */
+	void
+	stop ();
+
+	/// Average number of operations handed to the kernel per system call
+	double
+	getAverageBatchSize ();
+};
+
+#endif // IO_URING_H
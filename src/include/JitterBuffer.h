@@ -0,0 +1,190 @@
+#ifndef JITTER_BUFFER_H
+#define JITTER_BUFFER_H
+
+#include <functional>   // lambdas
+#include <map>          // maps
+#include <memory>       // shared_ptr
+#include <pthread.h>    // multithreading
+#include <stddef.h>     // size_t
+#include <stdint.h>     // uint64_t
+
+#include "BufferPool.h"
+
+/**
+ * Holds incoming frames back for a moment and presents them at the pace
+ * they were captured at, rather than the pace they happened to arrive at.
+ *
+ * Frames are keyed on their capture timestamps. The buffer works out the
+ * offset between the sender's clock and ours from the frames which got
+ * here fastest, and presents each frame targetLatency after a frame with
+ * no delay at all would have arrived. Frames delayed by less than the
+ * target come out evenly spaced; frames delayed by more are late, and go
+ * out as soon as they arrive.
+ *
+ * In latest-wins mode, whenever several frames are due at once (after a
+ * stall, say), only the newest is presented, so the display catches up
+ * rather than replaying the backlog.
+ */
+class JitterBuffer
+{
+  public:
+
+	/// Called from the presenter thread with each frame, when it's due
+	typedef std::function<void(void* data, size_t length)> present_t;
+
+  private:
+
+	/// A frame waiting to be presented
+	struct PendingFrame
+	{
+		void* data;
+
+		size_t length;
+
+		/// Keeps the frame's memory alive
+		std::shared_ptr<void> pin;
+	};
+
+	const present_t present;
+
+	/// How long frames are held back, in microseconds
+	int64_t targetLatency;
+
+	bool latestWins;
+
+	/// Frames waiting to be presented, keyed by capture timestamp
+	std::map<uint64_t, PendingFrame> pending;
+
+	/// Our clock minus the sender's, as of the least delayed frame, in
+	/// microseconds
+	int64_t clockOffset;
+
+	bool haveClockOffset;
+
+	/// Capture timestamp of the last frame presented
+	uint64_t lastPresented;
+
+	bool presentedAny;
+
+	/// Where frames wait, sized so that a full buffer of them doesn't
+	/// drain the pool the connections receive into
+	std::shared_ptr<BufferPool> pool;
+
+	/// Mutex for everything above
+	pthread_mutex_t mutex;
+
+	/// Signalled (with the mutex) when a frame arrives, or it's time to stop
+	pthread_cond_t frameArrivedCond;
+
+	pthread_t presenterThreadHandle;
+
+	bool presenterThreadStarted;
+
+	/// Tells the presenter thread to return
+	bool stopFlag;
+
+	uint64_t framesPresented;
+
+	uint64_t framesLate;
+
+	uint64_t framesDropped;
+
+	/**
+	 * How far the clock offset creeps up per frame, in microseconds. The
+	 * offset only ever drops to match a faster frame, so without this a
+	 * sender whose clock runs slow would see its frames fall further and
+	 * further behind the target.
+	 */
+	static const int64_t CLOCK_OFFSET_DRIFT_US = 10;
+
+	void
+	presenterThread (void* unused);
+
+	/// When a frame is due, on our clock. Needs the mutex.
+	int64_t
+	dueTime (uint64_t timestamp);
+
+  public:
+
+	/// Default for targetLatency, in milliseconds
+	static const int DEFAULT_TARGET_LATENCY_MS = 100;
+
+	/// Most frames held at once. Past this, the oldest are dropped.
+	static const size_t MAX_PENDING_FRAMES = 32;
+
+	/**
+	 * Call start() to start presenting.
+	 *
+	 * @param present         Called from the presenter thread with each frame
+	 * @param targetLatencyMs How long to hold frames back, in milliseconds.
+	 *                        More smooths over more jitter.
+	 * @param latestWins_     Whether to skip to the newest frame when
+	 *                        several are due at once
+	 */
+	JitterBuffer (present_t present, int targetLatencyMs = DEFAULT_TARGET_LATENCY_MS,
+	              bool latestWins_ = false);
+
+	~JitterBuffer ();
+
+	void
+	start ();
+
+	/// Stops the presenter thread and waits for it to exit. Frames still
+	/// waiting are thrown away.
+	void
+	stop ();
+
+	/**
+	 * A slot for a frame to be received straight into, and then pushed
+	 * (with the slot as its pin) without being copied.
+	 *
+	 * @param length  Number of bytes needed
+	 */
+	BufferPool::buffer_ptr
+	acquireSlot (size_t length);
+
+	/**
+	 * Takes in a frame. It's copied before this returns.
+	 *
+	 * @param timestamp  When the frame was captured, in microseconds, by
+	 *                   the sender's clock
+	 * @param data       The frame
+	 * @param length     Number of bytes to copy from *data
+	 */
+	void
+	push (uint64_t timestamp, const void* data, size_t length);
+
+	/**
+	 * Takes in a frame without copying it. The frame mustn't change until
+	 * it's been presented or dropped, when the pin is let go of.
+	 *
+	 * @param timestamp  When the frame was captured, in microseconds, by
+	 *                   the sender's clock
+	 * @param data       The frame
+	 * @param length     Its length in bytes
+	 * @param pin        Keeps *data alive
+	 */
+	void
+	push (uint64_t timestamp, void* data, size_t length, std::shared_ptr<void> pin);
+
+	/// Changes how long frames are held back, in milliseconds
+	void
+	setTargetLatency (int targetLatencyMs);
+
+	void
+	setLatestWins (bool latestWins_);
+
+	uint64_t
+	getFramesPresented ();
+
+	/// Frames which arrived after they were due
+	uint64_t
+	getFramesLate ();
+
+	/// Frames which were never presented: they came in after a newer frame
+	/// had been, were skipped in latest-wins mode, or didn't fit
+	uint64_t
+	getFramesDropped ();
+};
+
+#endif // JITTER_BUFFER_H
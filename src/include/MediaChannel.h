@@ -0,0 +1,281 @@
+#ifndef MEDIA_CHANNEL_H
+#define MEDIA_CHANNEL_H
+
+#include <netinet/in.h> // in_addr_t, in_port_t
+#include <sys/socket.h> // mmsghdr
+#include <sys/uio.h>    // iovec
+
+#include <map>          // maps
+#include <memory>       // shared_ptr
+#include <pthread.h>    // multithreading
+#include <stdint.h>     // uint32_t, etc.
+#include <vector>       // vectors
+
+#include "BufferPool.h"
+#include "Sockets.h"
+
+/**
+ * Header at the front of every media datagram. All fields are in network
+ * byte order.
+ */
+struct MediaDatagramHeader
+{
+	/// Which frame this is part of
+	uint32_t frameSeq;
+
+	/// Length of the whole frame
+	uint32_t frameLength;
+
+	/// Message type the frame is delivered as
+	uint32_t type;
+
+	/// Index of this fragment, or for parity, of the first fragment it covers
+	uint16_t fragIndex;
+
+	/// Number of data fragments in the frame
+	uint16_t fragCount;
+
+	/// MEDIA_FLAG_* bits
+	uint8_t flags;
+
+	/// Data fragments covered by each parity fragment (0 if there's no FEC)
+	uint8_t fecGroupSize;
+
+	uint16_t reserved;
+};
+
+/// The datagram carries the XOR of a group of fragments instead of data
+const uint8_t MEDIA_FLAG_PARITY = 0x01;
+
+/// Largest datagram sent, chosen to fit in a standard Ethernet frame
+const size_t MEDIA_MAX_DATAGRAM = 1500 - 20 - 8; // less IPv4 and UDP headers
+
+/// Largest piece of a frame carried by one datagram
+const size_t MEDIA_MAX_PAYLOAD = MEDIA_MAX_DATAGRAM - sizeof(MediaDatagramHeader);
+
+/// Largest frame sent or reassembled, comfortably above an uncompressed 4K image
+const size_t MEDIA_MAX_FRAME_LENGTH = 32 * 1024 * 1024;
+
+/**
+ * Sends frames to one peer over UDP, alongside a TCP Connection which
+ * carries everything else. A frame is split into datagrams small enough
+ * not to be fragmented by IP, so a lost packet costs one frame instead of
+ * stalling every frame after it.
+ *
+ * Optionally, each group of fecGroupSize fragments is followed by a parity
+ * datagram (the XOR of the group), which lets the receiver rebuild any one
+ * lost fragment in the group.
+ */
+class MediaSender
+{
+	int fd;
+
+	/// Sequence number of the next frame
+	uint32_t nextFrameSeq;
+
+	/// Fragments per parity datagram, or 0 for no parity
+	int fecGroupSize;
+
+	/// Scratch space for building a frame's datagrams
+	std::vector<MediaDatagramHeader> headers;
+	std::vector<iovec> iovs;
+	std::vector<mmsghdr> messages;
+	std::vector< std::vector<uint8_t> > parity;
+
+	/// Datagrams the socket wouldn't take
+	uint64_t datagramsDropped;
+
+	/// Mutex for sending
+	pthread_mutex_t sendMutex;
+
+  public:
+
+	/**
+	 * @param address             Peer's IP address, or a multicast group, in
+	 *                            network byte order
+	 * @param port                Peer's UDP port, in network byte order
+	 * @param fecGroupSize        Data fragments per parity fragment, or 0 for
+	 *                            none
+	 * @param multicastInterface  For a multicast group, the address of the
+	 *                            interface to send from. INADDR_ANY leaves
+	 *                            it up to the routing table.
+	 */
+	MediaSender (in_addr_t address, in_port_t port, int fecGroupSize = 0,
+	             in_addr_t multicastInterface = INADDR_ANY);
+
+	~MediaSender ();
+
+	/**
+	 * Fragments a frame and sends it. This never blocks: if the socket
+	 * buffer is full, the rest of the frame is dropped, and the receiver
+	 * discards the incomplete frame.
+	 *
+	 * @param type          Message type to deliver the frame as
+	 * @param length        Number of bytes to send from *data
+	 * @param data          The frame. It's copied before this returns.
+	 * @param prefix        Bytes to send ahead of the frame, as part of it
+	 *                      (e.g. a frame_header). At most MEDIA_MAX_PAYLOAD.
+	 * @param prefixLength  Number of bytes to send from *prefix
+	 */
+	void
+	sendFrame (message_t type, size_t length, void* data,
+	           const void* prefix = NULL, size_t prefixLength = 0);
+
+	/// Number of datagrams dropped because the socket buffer was full
+	uint64_t
+	getDatagramsDropped ();
+};
+
+/**
+ * Receives frames sent by a MediaSender, reassembling them from their
+ * fragments and passing each complete frame to a message handler.
+ *
+ * Frames are only ever delivered in order. Once a frame is delivered,
+ * any older frame still being reassembled is dropped; so is any frame
+ * which is still incomplete after the deadline.
+ */
+class MediaReceiver
+{
+	/// A frame which is still missing fragments
+	struct PartialFrame
+	{
+		message_t type;
+
+		BufferPool::buffer_ptr buffer;
+
+		uint32_t length;
+
+		/// Which data fragments have arrived
+		std::vector<bool> received;
+
+		uint16_t receivedCount;
+
+		/// Parity payloads, keyed by the first fragment they cover
+		std::map< uint16_t, std::vector<uint8_t> > parity;
+
+		uint8_t fecGroupSize;
+
+		/// When the frame is given up on, in milliseconds (CLOCK_MONOTONIC)
+		uint64_t deadline;
+	};
+
+	int fd;
+
+	in_port_t port;
+
+	/// The only address datagrams are accepted from, in network byte order
+	in_addr_t sourceAddress;
+
+	const Connection::message_handler_t handler;
+
+	/// How long to wait for a frame's missing fragments
+	int deadlineMs;
+
+	std::map<uint32_t, PartialFrame> partials;
+
+	/// Sequence number of the last frame delivered
+	uint32_t lastDeliveredSeq;
+
+	bool deliveredAny;
+
+	std::shared_ptr<BufferPool> pool;
+
+	pthread_t receiverThreadHandle;
+
+	bool receiverThreadStarted;
+
+	/// Tells the receiver thread to return
+	bool stopFlag;
+
+	uint64_t framesDelivered;
+
+	uint64_t framesDropped;
+
+	uint64_t fragmentsRecovered;
+
+	/// Datagrams to pull out of the socket at once
+	static const int BATCH_SIZE = 32;
+
+	/// Creates the socket and binds it (both in network byte order)
+	void
+	openSocket (in_addr_t address, in_port_t port_);
+
+	void
+	receiverThread (void* unused);
+
+	void
+	handleDatagram (uint8_t* datagram, size_t length);
+
+	/// Rebuilds a group's missing fragment from its parity, if possible
+	void
+	recoverFragment (PartialFrame& frame, uint16_t groupStart);
+
+	/// Delivers a complete frame, dropping everything older
+	void
+	deliverFrame (uint32_t seq);
+
+	/// Drops frames which have passed their deadline
+	void
+	expireFrames ();
+
+  public:
+
+	/// Default for how long to wait for a frame's missing fragments
+	static const int DEFAULT_DEADLINE_MS = 100;
+
+	/**
+	 * Binds a UDP socket to an ephemeral port. Call start() to start
+	 * receiving.
+	 *
+	 * @param handler     Called from the receiver thread with each frame
+	 * @param source      Address of the sender, in network byte order.
+	 *                    Datagrams from anywhere else are ignored.
+	 * @param deadlineMs  How long to wait for a frame's missing fragments
+	 */
+	MediaReceiver (Connection::message_handler_t handler, in_addr_t source,
+	               int deadlineMs = DEFAULT_DEADLINE_MS);
+
+	/**
+	 * Joins a multicast group. Call start() to start receiving.
+	 *
+	 * @param handler           Called from the receiver thread with each frame
+	 * @param group             The group's address, in network byte order
+	 * @param port              The group's UDP port, in network byte order
+	 * @param interfaceAddress  Address of the interface to join on, in
+	 *                          network byte order. INADDR_ANY leaves it up
+	 *                          to the routing table.
+	 * @param source            Address the group is published from, in
+	 *                          network byte order. Datagrams from anywhere
+	 *                          else are ignored.
+	 * @param deadlineMs        How long to wait for a frame's missing fragments
+	 */
+	MediaReceiver (Connection::message_handler_t handler, in_addr_t group, in_port_t port,
+	               in_addr_t interfaceAddress, in_addr_t source,
+	               int deadlineMs = DEFAULT_DEADLINE_MS);
+
+	~MediaReceiver ();
+
+	/// The UDP port the receiver is bound to, in host byte order
+	in_port_t
+	getPort ();
+
+	void
+	start ();
+
+	/// Stops the receiver thread and waits for it to exit
+	void
+	stop ();
+
+	uint64_t
+	getFramesDelivered ();
+
+	/// Frames which were never completed
+	uint64_t
+	getFramesDropped ();
+
+	/// Fragments rebuilt from parity
+	uint64_t
+	getFragmentsRecovered ();
+};
+
+#endif // MEDIA_CHANNEL_H
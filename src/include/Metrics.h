@@ -0,0 +1,118 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <atomic>       // atomic counters
+#include <memory>       // unique_ptr
+#include <sstream>      // stringstream
+#include <stdint.h>     // uint64_t
+#include <string>       // strings
+#include <vector>       // vectors
+
+/**
+ * Counts observations (durations, in microseconds) into fixed buckets, the
+ * way a Prometheus histogram does. Observing is lock-free, so it's cheap
+ * enough to do on hot paths from any thread.
+ */
+class Histogram
+{
+	/// Upper bound of each bucket, in microseconds, in increasing order.
+	/// There's an extra bucket after these for everything bigger.
+	std::vector<uint64_t> bounds;
+
+	/// Observations in each bucket (not cumulative)
+	std::unique_ptr< std::atomic<uint64_t>[] > counts;
+
+	/// Total of every observation, in microseconds
+	std::atomic<uint64_t> sum;
+
+  public:
+
+	/**
+	 * @param bounds_  Upper bound of each bucket, in microseconds, in
+	 *                 increasing order
+	 */
+	Histogram (const std::vector<uint64_t>& bounds_);
+
+	/// Buckets from 10µs to 1s, spaced roughly evenly on a log scale, which
+	/// suits most latencies worth measuring
+	static std::vector<uint64_t>
+	latencyBounds ();
+
+	void
+	observe (uint64_t us);
+
+	const std::vector<uint64_t>&
+	getBounds ();
+
+	/// Observations no bigger than bounds[i], or every observation if i
+	/// is bounds.size()
+	uint64_t
+	getCumulativeCount (size_t i);
+
+	/// Total of every observation, in microseconds
+	uint64_t
+	getSum ();
+};
+
+/**
+ * Histograms which aren't tied to any one object, so that code anywhere
+ * can feed them
+ */
+namespace Metrics
+{
+	/// How long MutexLock waited for mutexes which were already locked.
+	/// Uncontended locks aren't timed, and don't count.
+	Histogram&
+	lockWait ();
+
+	/// How long messages waited in connections' send queues before the
+	/// kernel took the last of them
+	Histogram&
+	sendQueueWait ();
+}
+
+/**
+ * Builds a page in the Prometheus text exposition format (version 0.0.4).
+ * Each metric family is introduced with family(), then given its samples.
+ * Durations are written out in seconds, as Prometheus expects.
+ */
+class MetricsWriter
+{
+	std::stringstream out;
+
+  public:
+
+	/// Content-Type the page should be served with
+	static const char* const CONTENT_TYPE;
+
+	/**
+	 * Formats a label for sample() or histogram(), escaping the value.
+	 * Several can be joined with commas.
+	 */
+	static std::string
+	label (const std::string& name, const std::string& value);
+
+	/**
+	 * Starts a metric family
+	 *
+	 * @param name  The metric's name
+	 * @param type  "counter", "gauge" or "histogram"
+	 * @param help  One line describing it
+	 */
+	void
+	family (const std::string& name, const std::string& type, const std::string& help);
+
+	/// Writes a sample of the current family
+	void
+	sample (const std::string& name, const std::string& labels, double value);
+
+	/// Writes a histogram's buckets, sum and count, in seconds
+	void
+	histogram (const std::string& name, const std::string& labels, Histogram& histogram);
+
+	/// The page so far
+	std::string
+	str ();
+};
+
+#endif // METRICS_H
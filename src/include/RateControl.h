@@ -0,0 +1,327 @@
+#ifndef RATE_CONTROL_H
+#define RATE_CONTROL_H
+
+#include <netinet/in.h> // in_addr_t
+#include <pthread.h>    // multithreading
+#include <stddef.h>     // size_t
+#include <stdint.h>     // uint64_t
+
+#include <map>          // maps
+
+#include "Sockets.h"
+
+/**
+ * Keeps a running estimate of how fast frames get through to one client,
+ * and how long they take. It's fed from three places:
+ *
+ *   - what the server sends (recordSent()),
+ *   - TCP_INFO and the connection's send queue (sample()), which give the
+ *     round trip time, the kernel's delivery rate, and how much is waiting
+ *     to go out, and
+ *   - the client's receive reports (recordReport()), which give the rate
+ *     frames are actually arriving at, even when they go over UDP.
+ *
+ * Everything is safe to call from any thread.
+ */
+class BandwidthEstimator
+{
+	pthread_mutex_t mutex;
+
+	/// Smoothed throughput, in bytes per second (0 until something's known)
+	double throughput;
+
+	/// Smoothed round trip time, in milliseconds
+	double rtt;
+
+	/// Bytes waiting to go out, in our queue and in the kernel's
+	size_t backlog;
+
+	/// Frames and bytes sent since the connection opened
+	uint64_t framesSent;
+	uint64_t bytesSent;
+
+	/// The last receive report, and what had been sent when it arrived
+	bool haveReport;
+	uint32_t reportFrames;
+	uint64_t reportBytes;
+	uint64_t reportTime;
+	uint64_t reportFramesSent;
+
+	/// Whether the last report showed frames going missing
+	bool losing;
+
+	/// Folds a new throughput measurement into the running estimate
+	void
+	updateThroughput (double bytesPerSecond);
+
+  public:
+
+	BandwidthEstimator ();
+
+	~BandwidthEstimator ();
+
+	/// Counts a frame handed to the connection
+	void
+	recordSent (size_t length);
+
+	/**
+	 * Takes in a receive report from the client.
+	 *
+	 * @param framesReceived  Frames the client has received so far
+	 * @param bytesReceived   Bytes of frames the client has received so far
+	 */
+	void
+	recordReport (uint32_t framesReceived, uint64_t bytesReceived);
+
+	/// Reads TCP_INFO and the send queue. Call this every so often.
+	void
+	sample (Connection& connection);
+
+	/// Bytes per second getting through, or 0 if there's no telling yet
+	double
+	getThroughput ();
+
+	/// Round trip time, in milliseconds
+	double
+	getRtt ();
+
+	/**
+	 * How long a frame sent now would take to reach the client, in
+	 * milliseconds: the time to drain everything ahead of it, plus half a
+	 * round trip.
+	 */
+	double
+	getLatency ();
+
+	/// Whether the client is receiving noticeably fewer frames than are sent
+	bool
+	isLosing ();
+};
+
+/**
+ * Decides which frames one client gets. Every frame is offered, and one
+ * out of every `interval` is let through; the interval doubles whenever
+ * the estimated latency goes over the target (or frames are being dropped
+ * or lost), and comes back down one step at a time once the link has
+ * stayed comfortably under the target for a while.
+ *
+ * Resolution and format are shared by every client of a webcam, so
+ * skipping frames is the one thing that can be done for a client on its
+ * own.
+ *
+ * It also works out how fast to pace frames out: just fast enough for
+ * each frame to be through before the next one the client gets, so it
+ * doesn't go out in a burst which swamps the link.
+ */
+class RateController
+{
+	BandwidthEstimator estimator;
+
+	pthread_mutex_t mutex;
+
+	/// Latency to stay under, in milliseconds
+	double targetLatency;
+
+	/// One out of this many frames is sent
+	int interval;
+
+	/// Frames offered so far
+	uint64_t framesOffered;
+
+	/// When the estimate was last sampled, and the interval last raised
+	uint64_t lastSampleTime;
+	uint64_t lastRaiseTime;
+
+	/// Since when the link has been comfortably under the target
+	uint64_t calmSince;
+
+	/// The connection's count of dropped frames, as of the last sample
+	uint64_t lastFramesDropped;
+
+	/// Smoothed time between frames being offered, in microseconds (0
+	/// until two have been), and when the last one was
+	double offerInterval;
+	uint64_t lastOfferTime;
+
+	/// Adjusts the interval according to a fresh sample. Needs the mutex.
+	void
+	adjust (Connection& connection, uint64_t now);
+
+  public:
+
+	/// Default for targetLatency, in milliseconds
+	static const int DEFAULT_TARGET_LATENCY_MS = 200;
+
+	/// How often the estimate is refreshed, in milliseconds
+	static const int SAMPLE_PERIOD_MS = 250;
+
+	/// How long the link must stay calm before the interval comes down
+	static const int STEP_DOWN_HOLD_MS = 2000;
+
+	/// Most frames skipped per frame sent, plus one
+	static const int MAX_INTERVAL = 16;
+
+	/// How much of the time until the next frame a frame is paced to take,
+	/// in percent. The rest is slack for the link to catch up in.
+	static const int PACING_SPREAD_PERCENT = 80;
+
+	/// Slowest pacing rate, in bytes per second, so replies don't crawl
+	/// out behind tiny frames
+	static const uint64_t MIN_PACING_RATE = 64 * 1024;
+
+	/**
+	 * @param targetLatency_  Latency to stay under, in milliseconds
+	 */
+	RateController (int targetLatency_ = DEFAULT_TARGET_LATENCY_MS);
+
+	~RateController ();
+
+	/**
+	 * Offers a frame, refreshing the estimate if it's due.
+	 *
+	 * @param connection  The connection the frame would go out on
+	 * @param length      Length of the frame
+	 * @return            true if the frame should be sent (and it's
+	 *                    counted as sent)
+	 */
+	bool
+	admitFrame (Connection& connection, size_t length);
+
+	/// Passes a client's receive report on to the estimator
+	void
+	recordReport (uint32_t framesReceived, uint64_t bytesReceived);
+
+	/// One out of this many frames is currently sent
+	int
+	getInterval ();
+
+	/**
+	 * How fast to send a frame so it's spread over the time until the
+	 * next one the client gets
+	 *
+	 * @param length  Length of the frame
+	 * @return        Bytes per second, or 0 if the frame rate isn't known
+	 *                yet
+	 */
+	uint64_t
+	getPacingRate (size_t length);
+
+	BandwidthEstimator&
+	getEstimator ();
+};
+
+/**
+ * Lets bytes through at an average rate. A message may always go once the
+ * bucket isn't in debt, however big it is, and the bucket saves up at most
+ * BURST_MS worth of bytes while nothing's sent.
+ *
+ * Not thread-safe.
+ */
+class TokenBucket
+{
+	/// Bytes which may be sent, which goes negative after a big message
+	double tokens;
+
+	/// When tokens were last added, in microseconds
+	uint64_t lastRefill;
+
+  public:
+
+	/// Most time's worth of bytes saved up, in milliseconds
+	static const int BURST_MS = 1000;
+
+	TokenBucket ();
+
+	/**
+	 * Takes a message's bytes out of the bucket, if there's room for it
+	 *
+	 * @param length  Length of the message
+	 * @param rate    Bytes per second to let through, or 0 for no limit
+	 * @return        Whether the message may be sent
+	 */
+	bool
+	admit (size_t length, uint64_t rate);
+};
+
+/**
+ * How much bandwidth a server's clients may have: a ceiling for each
+ * client, overrides of it for particular addresses, and a ceiling for all
+ * of them together, which is split evenly between the clients which have
+ * been sent frames lately. Everything can be changed at any time, and
+ * takes effect at each client's next frame.
+ *
+ * Rates are in bytes per second, with 0 meaning no limit. Everything is
+ * safe to call from any thread.
+ */
+class BandwidthLimits
+{
+	pthread_mutex_t mutex;
+
+	uint64_t clientLimit;
+
+	uint64_t globalLimit;
+
+	/// Ceilings for particular clients, in place of clientLimit, keyed by
+	/// IP address in network byte order
+	std::map<in_addr_t, uint64_t> overrides;
+
+	/// When each client was last asked about, in milliseconds
+	std::map<const void*, uint64_t> lastActive;
+
+	/// When clients which had gone quiet were last let go of
+	uint64_t lastPruned;
+
+  public:
+
+	/// How long a client counts towards splitting the global ceiling
+	/// after its last frame, in milliseconds
+	static const int ACTIVE_WINDOW_MS = 2000;
+
+	BandwidthLimits ();
+
+	~BandwidthLimits ();
+
+	void
+	setClientLimit (uint64_t bytesPerSecond);
+
+	uint64_t
+	getClientLimit ();
+
+	void
+	setGlobalLimit (uint64_t bytesPerSecond);
+
+	uint64_t
+	getGlobalLimit ();
+
+	/// Gives one address its own ceiling, which may be 0 to exempt it from
+	/// the per-client ceiling. The global ceiling still applies.
+	void
+	setOverride (in_addr_t address, uint64_t bytesPerSecond);
+
+	/// Puts an address back under the per-client ceiling
+	void
+	clearOverride (in_addr_t address);
+
+	std::map<in_addr_t, uint64_t>
+	getOverrides ();
+
+	/**
+	 * The most a client may be sent right now, counting it as active
+	 *
+	 * @param client   Identifies the client (its connection, say)
+	 * @param address  The client's IP address, in network byte order
+	 * @return         Bytes per second, or 0 for no limit
+	 */
+	uint64_t
+	getLimit (const void* client, in_addr_t address);
+
+	/// Stops counting a client towards splitting the global ceiling
+	void
+	forget (const void* client);
+
+	/// Clients the global ceiling is currently split between
+	size_t
+	getActiveClients ();
+};
+
+#endif // RATE_CONTROL_H
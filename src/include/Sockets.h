@@ -3,8 +3,12 @@
 
 #include <arpa/inet.h>  // inet_pton
 #include <netinet/in.h> // in_addr_t, in_port_t
+#include <sys/socket.h> // msghdr, CMSG_SPACE
+#include <sys/uio.h>    // iovec
 
+#include <atomic>       // atomic counters
 #include <functional>   // lambdas (:D)
+#include <future>       // futures, for request()
 #include <map>          // maps
 #include <memory>       // shared_ptr
 #include <list>         // doubly-linked lists
@@ -12,6 +16,9 @@
 #include <string>       // strings
 #include <vector>       // vectors
 
+#include "BufferPool.h"
+#include "EventLoop.h"
+
 /**
  * Converts an IP address into a string
  *
@@ -21,9 +28,104 @@
 std::string
 ip2string (in_addr_t ipAddr);
 
+/// Milliseconds on the monotonic clock
+uint64_t
+monotonicMs ();
+
+/// Microseconds on the monotonic clock
+uint64_t
+monotonicUs ();
+
 typedef uint32_t message_t;
 typedef uint32_t message_len_t;
 
+/**
+ * Precedes every message on the wire, where all fields are in network
+ * byte order. Connection converts them on the way out and on the way in,
+ * so everywhere else they're in host order.
+ */
+struct MessageHeader
+{
+	message_t type;
+	message_len_t length;
+
+	/**
+	 * Matches replies to the request they answer (see
+	 * Connection::request()). Replies have REPLY_FLAG set; 0 means the
+	 * message is neither.
+	 */
+	uint32_t requestId;
+};
+
+/// Set in MessageHeader::requestId on replies, to tell them from requests
+const uint32_t REPLY_FLAG = 0x80000000;
+
+/**
+ * Message type reserved for marking the end of the replies to a request.
+ * It's sent, carrying the request's id, once the peer's handlers for the
+ * request have returned. Handlers never see this message.
+ */
+const message_t REQUEST_COMPLETE_MESSAGE = 0xFFFFFFFE;
+
+/**
+ * Message type passed to a request's response handler when the connection
+ * closes before the request is complete. It never goes over the wire.
+ */
+const message_t CONNECTION_CLOSED_MESSAGE = 0xFFFFFFFD;
+
+/**
+ * Message type reserved for frames passed by reference over a unix domain
+ * socket. The body is a SharedFrameHeader, and the frame itself is in a
+ * memfd sent along with it (SCM_RIGHTS). The receiving Connection maps the
+ * memfd and dispatches the frame as its real type, so handlers never see
+ * this message.
+ */
+const message_t SHARED_FRAME_MESSAGE = 0xFFFFFFFF;
+
+/**
+ * Body of a SHARED_FRAME_MESSAGE
+ */
+struct SharedFrameHeader
+{
+	/// Type the frame is dispatched as
+	message_t type;
+
+	/// Length of the frame (the memfd may be bigger)
+	message_len_t length;
+};
+
+/**
+ * A frame copied into a sealed memfd, so that it can be handed to any
+ * number of local peers by passing the descriptor instead of the bytes.
+ * The seals guarantee the receivers that it won't change under them.
+ */
+class SharedFrame
+{
+	int fd;
+
+	size_t length;
+
+  public:
+
+	/**
+	 * @param data          The frame. It's copied before this returns.
+	 * @param length_       Number of bytes to copy from *data
+	 * @param prefix        Bytes to put ahead of the frame (e.g. a
+	 *                      frame_header), counted in the length
+	 * @param prefixLength  Number of bytes to copy from *prefix
+	 */
+	SharedFrame (const void* data, size_t length_,
+	             const void* prefix = NULL, size_t prefixLength = 0);
+
+	~SharedFrame ();
+
+	int
+	getFd ();
+
+	size_t
+	getLength ();
+};
+
 /**
  * Wraps around a mutex, locks it, and unlocks it when it goes out of scope.
  * Kinda like how auto_ptr frees a pointer when it's destructed.
@@ -61,8 +163,9 @@ class MutexLock {
 	relock();
 };
 
-class Connection {
-
+class Connection: public EventHandler,
+                  public std::enable_shared_from_this<Connection>
+{
   public:
 	/**
 	 * Message handler function prototype
@@ -87,6 +190,59 @@ class Connection {
 	/// A mapping between a message type and the set of functions to process it
 	typedef std::map< message_t, message_handler_set > message_handler_map;
 
+	/// Called when the peer closes the connection (see setCloseHandler())
+	typedef std::function<void()> close_handler_t;
+
+	/**
+	 * Called with the reply to a request (see request())
+	 *
+	 * @param type    Type of the last reply, REQUEST_COMPLETE_MESSAGE if
+	 *                there wasn't one, or CONNECTION_CLOSED_MESSAGE
+	 * @param length  Length of the reply, in bytes
+	 * @param buffer  Pointer to the reply, valid until the handler returns
+	 */
+	typedef std::function<void(message_t, message_len_t, void*)> response_handler_t;
+
+	/// The reply to a request, as a future from request() gives it
+	struct Reply
+	{
+		/// Type of the last reply, or REQUEST_COMPLETE_MESSAGE if there
+		/// wasn't one
+		message_t type;
+
+		/// Copy of its body
+		std::vector<uint8_t> body;
+	};
+
+	/**
+	 * Where the body of an incoming message should be read to (see
+	 * setReceiveTarget()): up to MAX_PARTS pieces of memory, filled in
+	 * order, which between them hold exactly the body. Handlers are given
+	 * the first piece.
+	 */
+	struct ReceiveTarget
+	{
+		static const int MAX_PARTS = 4;
+
+		iovec parts[MAX_PARTS];
+
+		int numParts;
+
+		/// Keeps the memory alive until the handlers are done with it (or
+		/// longer, for handlers which hang on to it; see getMessagePin())
+		std::shared_ptr<void> pin;
+
+		ReceiveTarget (): numParts(0) { }
+	};
+
+	/**
+	 * Chooses where an incoming message's body goes, given its header (in
+	 * host byte order). It's called on whichever thread reads the socket,
+	 * as soon as the header has arrived, so it mustn't block. Returning a
+	 * target with no parts has the body read into a buffer as usual.
+	 */
+	typedef std::function<ReceiveTarget(const MessageHeader&)> receive_target_provider_t;
+
 	/// IP address of the remote computer
 	const in_addr_t remoteAddress;
 
@@ -103,12 +259,271 @@ class Connection {
 	/// File descriptor for the connection
 	int fd;
 
+	/// Whether the connection is a unix domain socket rather than TCP
+	bool local;
+
+	/// Whether messages are carried in WebSocket frames (see enableWebSocket())
+	bool webSocket;
+
+	/// Longest WebSocket frame header we write (no mask, 64-bit length)
+	static const size_t MAX_FRAMING_BYTES = 10;
+
 	/// Mutex for writing to the connection
 	pthread_mutex_t writerMutex;
 
+	/**
+	 * A message waiting in the send queue, or one the kernel is still
+	 * reading from after a zero-copy send
+	 */
+	struct OutgoingMessage
+	{
+		MessageHeader header;
+
+		/// The header as it's written, in network byte order, after a
+		/// WebSocket frame header on a WebSocket connection
+		uint8_t wire[MAX_FRAMING_BYTES + sizeof(MessageHeader)];
+
+		/// Bytes of wire which are written
+		size_t wireLength;
+
+		/// Bytes sent ahead of the body (a frame's metadata), counted in
+		/// header.length
+		std::vector<uint8_t> prefix;
+
+		/// Copy of the body, for control messages
+		std::vector<uint8_t> copy;
+
+		/// The body to send; either the copy or someone else's memory
+		void* data;
+
+		/// Keeps someone else's memory from being reused until it's sent
+		std::shared_ptr<void> pin;
+
+		/// Frames may be dropped in favor of newer ones; control messages may not
+		bool isFrame;
+
+		/// Descriptor to pass along with the message, or -1. It's kept open by
+		/// the pin.
+		int passFd;
+
+		/// Whether to send the body with MSG_ZEROCOPY
+		bool zeroCopy;
+
+		/// Bytes of the header and body which have been written so far
+		size_t offset;
+
+		/// Whether any of it has gone out with MSG_ZEROCOPY
+		bool zeroCopySent;
+
+		/// Kernel sequence number of the last zero-copy sendmsg() which
+		/// included part of this message
+		uint32_t lastSeq;
+
+		/// Whether it's part of an io_uring send which hasn't completed
+		bool inFlight;
+
+		/// When it joined the send queue, in microseconds (monotonic)
+		uint64_t queuedAt;
+	};
+
+	typedef std::list< std::shared_ptr<OutgoingMessage> > outgoing_list;
+
+	/// Messages waiting to be written, oldest first
+	outgoing_list sendQueue;
+
+	/// Scratch space for gathering the send queue into sendmsg() calls
+	std::vector<iovec> flushIov;
+
+	/// The sendmsg() gathered from the send queue. It stays put while an
+	/// io_uring send is using it.
+	msghdr flushMsg;
+
+	/// Room for passing a descriptor along with flushMsg (aligned like the
+	/// cmsghdr it holds, whose first member is a size_t)
+	union
+	{
+		char buffer[CMSG_SPACE(sizeof(int))];
+		size_t align;
+	} flushControl;
+
+	/// Whether sends go through the event loop's io_uring
+	bool useIoUring;
+
+	/// Whether an io_uring send from the queue hasn't completed yet. Only
+	/// one is in flight at a time, so they complete in order.
+	bool uringSendInFlight;
+
+	/// Signalled (with the writer mutex) when an io_uring send completes
+	pthread_cond_t uringSendCond;
+
+	/// Bytes of control messages in the send queue
+	size_t queuedControlBytes;
+
+	/// Whether the event loop is watching for room in the socket
+	bool writeArmed;
+
+	/// Frames which were replaced by newer ones before they could be sent
+	uint64_t framesDropped;
+
+	/// Zero-copy sends awaiting completion, oldest first
+	outgoing_list zeroCopyPending;
+
+	/// Mutex for the zero-copy bookkeeping. This is separate from the
+	/// writer mutex so completions can be collected while a send is
+	/// waiting for room in the socket.
+	pthread_mutex_t zeroCopyMutex;
+
+	/// Whether SO_ZEROCOPY has been turned on for the socket
+	bool zeroCopyEnabled;
+
+	/// Cleared if the kernel refuses SO_ZEROCOPY, or ends up copying anyway
+	bool zeroCopyAllowed;
+
+	/// Sequence number the kernel will assign to the next MSG_ZEROCOPY send
+	uint32_t zeroCopyNextSeq;
+
+	/// Every zero-copy send numbered below this has completed
+	uint32_t zeroCopyCompletedSeq;
+
+	/**
+	 * Once this many bytes of control messages are waiting in the send
+	 * queue, sendMessage() blocks until some of them are written. They're
+	 * never dropped, but they can't pile up without limit, either.
+	 */
+	static const size_t MAX_QUEUED_CONTROL_BYTES = 1 << 20;
+
+	/**
+	 * Unsent data the kernel will hold for a connection before it reports
+	 * the socket as full (TCP_NOTSENT_LOWAT). Keeping this small keeps
+	 * stale frames in our queue, where they can be replaced, rather than
+	 * in the kernel's, where they can't.
+	 */
+	static const int NOTSENT_LOWAT = 128 * 1024;
+
+	/// Below this size, copying is cheaper than the page pinning and the
+	/// completion notification
+	static const size_t ZEROCOPY_MIN_LENGTH = 16384;
+
+	/// Below this size, frames sent over a unix domain socket are copied
+	/// into the socket rather than passed in a memfd
+	static const size_t SHARED_FRAME_MIN_LENGTH = 16384;
+
+	/// Most descriptors accepted with a single message
+	static const int MAX_RECEIVED_FDS = 4;
+
 	/// Handle for the reader thread
 	pthread_t readerThreadHandle;
 
+	/// Whether startReaderThread() was used, as opposed to an event loop
+	bool readerThreadStarted;
+
+	/// The event loop servicing this connection, if any
+	std::weak_ptr<EventLoop> eventLoop;
+
+	/// Header of the message the event loop is in the middle of reading
+	MessageHeader incomingHeader;
+
+	/// Where the body of the message the event loop is in the middle of
+	/// reading is going
+	ReceiveTarget incomingTarget;
+
+	/// How much of the incoming header and body have arrived so far
+	size_t incomingBytes;
+
+	/// Descriptors which arrived with the message being read
+	std::vector<int> incomingFds;
+
+	/**
+	 * Bytes read ahead from a TCP socket which haven't been cut into
+	 * messages yet, from receiveStart to receiveEnd. Reading ahead lets a
+	 * burst of small messages arrive in one recv() rather than two apiece.
+	 * Whatever part of a body hasn't arrived by the time its header is cut
+	 * out is read straight into the message's own buffer instead, so big
+	 * frames aren't copied through here.
+	 *
+	 * Unix domain sockets aren't read ahead: a descriptor passed with a
+	 * message belongs to where it was sent in the stream.
+	 */
+	std::vector<uint8_t> receiveBuffer;
+	size_t receiveStart;
+	size_t receiveEnd;
+
+	static const size_t RECEIVE_BUFFER_SIZE = 64 * 1024;
+
+	/// WebSocket frames read but not yet unwrapped
+	std::vector<uint8_t> webSocketFrames;
+
+	/// Messages unwrapped from WebSocket frames, not yet complete
+	std::vector<uint8_t> webSocketMessages;
+
+	/// Longest WebSocket frame, and longest message, accepted from the
+	/// peer. Peers only send control messages, which are much shorter.
+	static const size_t MAX_WEBSOCKET_MESSAGE = 16 * 1024;
+
+	/// A message which has been read but not yet handled
+	struct ReceivedMessage
+	{
+		MessageHeader header;
+
+		/// The body
+		void* data;
+
+		/// Keeps the body valid (a receive buffer or a shared frame's mapping)
+		std::shared_ptr<void> keepalive;
+
+		/// Descriptor passed along with the message, if any
+		std::shared_ptr<int> passedFd;
+	};
+
+	/// Messages waiting to be handed to the handlers on the worker pool
+	std::list<ReceivedMessage> dispatchQueue;
+
+	/// Mutex for the dispatch queue and dispatchScheduled
+	pthread_mutex_t dispatchMutex;
+
+	/// Whether a worker has been asked to drain the dispatch queue
+	bool dispatchScheduled;
+
+	/// Where buffers for incoming messages come from
+	std::shared_ptr<BufferPool> receivePool;
+
+	/// Descriptor passed with the message being handled (see takeDescriptor())
+	std::shared_ptr<int> dispatchFd;
+
+	/// Keeps the body of the message being handled alive (see getMessagePin())
+	std::shared_ptr<void> dispatchPin;
+
+	/// Receive target providers, keyed by message type
+	std::map<message_t, receive_target_provider_t> receiveTargets;
+
+	/// Mutex for the receive target providers
+	pthread_mutex_t receiveTargetsMutex;
+
+	/// Whether the message being handled is a reply (see handlingReply())
+	bool dispatchingReply;
+
+	/// What's been read, for getStats(). Only the thread reading the
+	/// socket changes these.
+	std::atomic<uint64_t> bytesIn;
+	std::atomic<uint64_t> messagesIn;
+
+	/// What's been written, for getStats(). These need the writer mutex.
+	uint64_t bytesOut;
+	uint64_t messagesOut;
+	uint64_t framesSent;
+
+	/// Smoothed time messages spend in the send queue, in microseconds.
+	/// Needs the writer mutex.
+	uint64_t sendLatency;
+
+	/// The socket's pacing rate, in bytes per second, or 0 for none (see
+	/// setPacingRate())
+	std::atomic<uint64_t> pacingRate;
+
+	/// Counts a message which has finished being read
+	void
+	countIncoming (const MessageHeader& header);
+
 	/// Functions to process expected message types
 	message_handler_map handlers;
 
@@ -121,6 +536,51 @@ class Connection {
 	/// Flag indicating that the connection is closed (set by the reader thread)
 	bool connectionClosedFlag;
 
+	/// Set by the reader thread as the last thing it does
+	bool readerThreadExited;
+
+	/// Told when the reader thread finds the connection closed from the
+	/// other end
+	close_handler_t closeHandler;
+
+	/// Mutex for closeHandler, held while it's being called
+	pthread_mutex_t closeHandlerMutex;
+
+	/// A request which hasn't been completed yet
+	struct PendingRequest
+	{
+		response_handler_t handler;
+
+		/// Whether anything has come back yet, and if so, the last of it
+		bool replied;
+		message_t replyType;
+		std::vector<uint8_t> replyBody;
+	};
+
+	/// Requests awaiting REQUEST_COMPLETE_MESSAGE, by id
+	std::map<uint32_t, PendingRequest> pendingRequests;
+
+	/// Id for the next request (never 0, and never with REPLY_FLAG set)
+	uint32_t nextRequestId;
+
+	/// Mutex for pendingRequests and nextRequestId
+	pthread_mutex_t requestsMutex;
+
+	/// Sets up a newly connected TCP socket
+	void
+	configureSocket ();
+
+	/**
+	 * Writes a message's header as it goes on the wire: in network byte
+	 * order, in a WebSocket frame if need be.
+	 *
+	 * @param header  The header, in host byte order
+	 * @param wire    Room for MAX_FRAMING_BYTES + sizeof(MessageHeader)
+	 * @return Bytes written to wire
+	 */
+	size_t
+	encodeHeader (const MessageHeader& header, uint8_t* wire);
+
   public:
 
 	Connection (int fd, in_addr_t remoteAddress, in_port_t remotePort);
@@ -139,6 +599,88 @@ class Connection {
 	void
 	joinReaderThread ();
 
+	/**
+	 * Whether nothing is reading from the connection any more: its reader
+	 * thread has exited, or the event loop has let go of it. A finished
+	 * connection can be thrown away (after joinReaderThread(), if it had a
+	 * reader thread).
+	 */
+	bool
+	isFinished ();
+
+	/// Whether startReaderThread() was used, and the thread hasn't been
+	/// joined yet
+	bool
+	hasReaderThread ();
+
+	/**
+	 * Sets a function to call when the reader thread finds the connection
+	 * closed or broken from the other end. It isn't called when close() is
+	 * called on this end. It runs on the reader thread, so it mustn't wait
+	 * for that thread or close the connection.
+	 *
+	 * @param handler  The function, or an empty one for none. Once this
+	 *                 returns, the old handler isn't running any more.
+	 */
+	void
+	setCloseHandler (close_handler_t handler);
+
+	/**
+	 * Carries on over a new socket, to the same peer, after this one has
+	 * closed. The old socket is closed, anything still queued on it is
+	 * thrown away, and a new reader thread is started. Handlers, and
+	 * whatever subclasses keep, are left as they were.
+	 *
+	 * Only for connections which use a reader thread, and not to be called
+	 * from it.
+	 *
+	 * @param fd_  The new socket, which the connection takes over
+	 */
+	void
+	reconnect (int fd_);
+
+	/**
+	 * Begins processing messages on an event loop instead of a dedicated
+	 * reader thread. The socket is switched to non-blocking mode; messages
+	 * are read on one of the loop threads and handled on its worker pool.
+	 *
+	 * Messages on a given connection are still handled one at a time, in
+	 * the order they arrived.
+	 *
+	 * @param loop  A running event loop
+	 */
+	void
+	attachToEventLoop (std::shared_ptr<EventLoop> loop);
+
+	/**
+	 * Carries messages in WebSocket binary frames (RFC 6455), for a socket
+	 * which has been through the WebSocket handshake (see
+	 * HttpConnection::acceptWebSocket()). Each message goes out as a frame
+	 * of its own, header and body; the peer may split its messages across
+	 * frames however it likes. Frames are still sent straight out of the
+	 * caller's memory, so one buffer can go to WebSocket and plain peers
+	 * alike.
+	 *
+	 * Only the server end is supported, and only on an event loop. Call
+	 * it before attachToEventLoop().
+	 */
+	void
+	enableWebSocket ();
+
+	/// Whether messages are carried in WebSocket frames
+	bool
+	isWebSocket ();
+
+	int
+	getEventFd ();
+
+	/// Reads whatever has arrived without blocking (called by the event loop)
+	bool
+	handleEvents (uint32_t events);
+
+	void
+	handleRemoved ();
+
 	/**
 	 * Sends data through the socket
 	 *
@@ -168,6 +710,215 @@ class Connection {
 	void
 	sendMessage (message_t type);
 
+	/**
+	 * Sends a control message as a request, and calls the given function
+	 * once the peer has finished handling it. Any number of requests can be
+	 * in flight at once; replies are matched to their requests whatever
+	 * order they come back in.
+	 *
+	 * Everything the peer's handlers send back over this connection while
+	 * they handle the request counts as a reply. The function is given the
+	 * last reply, after the handlers registered for its type have seen it
+	 * as usual. If the connection closes first, it's given
+	 * CONNECTION_CLOSED_MESSAGE instead.
+	 *
+	 * The function runs on the thread handling messages, or on the thread
+	 * closing the connection, so it mustn't block waiting for replies.
+	 *
+	 * @param type     Integer indicating the type of the message
+	 * @param length   Number of bytes to send from *data
+	 * @param data     Data to send
+	 * @param handler  Function to call with the reply
+	 */
+	void
+	request (message_t type, size_t length, void* data, const response_handler_t& handler);
+
+	/**
+	 * Sends a control message as a request, as above, and returns the
+	 * reply as a future. The future fails with a runtime_error if the
+	 * connection closes before the request is complete.
+	 *
+	 * @param type    Integer indicating the type of the message
+	 * @param length  Number of bytes to send from *data
+	 * @param data    Data to send
+	 */
+	std::future<Reply>
+	request (message_t type, size_t length = 0, void* data = NULL);
+
+	/**
+	 * Wrapper that calls request(message_t, size_t, void*) on a string
+	 * buffer.
+	 */
+	std::future<Reply>
+	request (message_t type, std::string data);
+
+	/**
+	 * Queues a frame to be sent as soon as the socket has room, without
+	 * waiting for it to be written or copying it.
+	 *
+	 * If an older frame is still waiting in the queue (i.e. the peer isn't
+	 * keeping up), the older frame is dropped and the new one goes to the
+	 * back of the queue. A slow peer sees fewer frames rather than older
+	 * ones.
+	 *
+	 * The body is read straight out of the given memory, possibly some time
+	 * after this returns, so the caller passes a reference which keeps that
+	 * memory from being reused. It is released once the frame has been sent
+	 * (for large frames sent with MSG_ZEROCOPY, once the kernel reports
+	 * it's finished with them) or dropped.
+	 *
+	 * On a connection without an event loop, this blocks until the frame is
+	 * written, as sendMessage() does.
+	 *
+	 * Subclasses may send frames some other way (e.g. a MediaSender).
+	 *
+	 * @param type          Integer indicating the type of the message
+	 * @param length        Number of bytes to send from *data
+	 * @param data          Data to send
+	 * @param pin           Reference keeping the data valid
+	 * @param prefix        Bytes to send ahead of the data, as part of the
+	 *                      same message (e.g. a frame_header). They're
+	 *                      copied before this returns.
+	 * @param prefixLength  Number of bytes to send from *prefix
+	 */
+	virtual void
+	sendFrame (message_t type, size_t length, void* data, std::shared_ptr<void> pin,
+	           const void* prefix = NULL, size_t prefixLength = 0);
+
+	/**
+	 * Passes a frame to the peer by reference. The peer gets the memfd and
+	 * maps it rather than receiving the frame's bytes, so one SharedFrame can
+	 * go to any number of local peers for the cost of a single copy.
+	 *
+	 * Frames are dropped in favor of newer ones just as with sendFrame().
+	 * Only works on a local connection (see isLocal()).
+	 *
+	 * @param type   Integer indicating the type of the message
+	 * @param frame  The frame to send
+	 */
+	void
+	sendSharedFrame (message_t type, std::shared_ptr<SharedFrame> frame);
+
+	/**
+	 * Sends a control message with a file descriptor attached (SCM_RIGHTS).
+	 * The peer's handler collects it with takeDescriptor().
+	 *
+	 * The descriptor is duplicated, so the caller may close theirs as soon
+	 * as this returns. Only works on a local connection (see isLocal()).
+	 *
+	 * @param type    Integer indicating the type of the message
+	 * @param length  Number of bytes to send from *data
+	 * @param data    Data to send
+	 * @param passFd  Descriptor to pass
+	 */
+	void
+	sendDescriptor (message_t type, size_t length, void* data, int passFd);
+
+	/**
+	 * Copies a message into the send queue without trying to write it.
+	 * Everything queued goes out together, in as few system calls as
+	 * possible, on the next flushMessages() or sendMessage().
+	 *
+	 * Meant for bursts of small control messages; the data is copied, so
+	 * don't use this for frames.
+	 *
+	 * @param type    Integer indicating the type of the message
+	 * @param length  Number of bytes to send from *data
+	 * @param data    Data to send
+	 */
+	void
+	queueMessage (message_t type, size_t length, void* data);
+
+	/**
+	 * Wrapper that calls queueMessage(message_t, size_t, void*) with no data.
+	 *
+	 * @param type    Integer indicating the type of the message
+	 */
+	void
+	queueMessage (message_t type);
+
+	/// Writes whatever the socket will take from the send queue
+	void
+	flushMessages ();
+
+	/// Number of frames dropped because the peer wasn't keeping up
+	uint64_t
+	getFramesDropped ();
+
+	/**
+	 * Caps how fast the kernel sends on the connection (SO_MAX_PACING_RATE),
+	 * so a big frame goes out spread over time rather than in one burst at
+	 * line rate. TCP paces by itself; the fq qdisc isn't needed. Does
+	 * nothing on a unix domain socket.
+	 *
+	 * @param bytesPerSecond  The cap, or 0 for none
+	 */
+	void
+	setPacingRate (uint64_t bytesPerSecond);
+
+	/// The pacing rate, in bytes per second, or 0 if there isn't one
+	uint64_t
+	getPacingRate ();
+
+	/// A snapshot of the connection's counters
+	struct Stats
+	{
+		uint64_t bytesIn;
+		uint64_t bytesOut;
+		uint64_t messagesIn;
+		uint64_t messagesOut;
+
+		/// Frames written out, and dropped because the peer wasn't
+		/// keeping up
+		uint64_t framesSent;
+		uint64_t framesDropped;
+
+		/// Messages in the send queue, and the bytes of them left to write
+		size_t queueDepth;
+		size_t queuedBytes;
+
+		/// Smoothed time messages have spent waiting in the send queue, in
+		/// microseconds. Messages written straight away don't count.
+		uint64_t sendLatency;
+
+		/// Pacing rate, in bytes per second, or 0 for none
+		uint64_t pacingRate;
+	};
+
+	Stats
+	getStats ();
+
+	/// Bytes of frames in the send queue which haven't been written yet
+	size_t
+	getQueuedFrameBytes ();
+
+	/// IP address of the remote computer, in network byte order
+	in_addr_t
+	getRemoteAddress ();
+
+	/// Port of the remote computer, in network byte order
+	in_port_t
+	getRemotePort ();
+
+	/**
+	 * IP address this end of the connection is bound to, in network byte
+	 * order. For a local connection, this is the loopback address.
+	 */
+	in_addr_t
+	getLocalAddress ();
+
+	/// Whether the connection is a unix domain socket, and so can be sent
+	/// frames by reference
+	bool
+	isLocal ();
+
+	/**
+	 * Drops any frames which haven't started going out yet, releasing
+	 * their pins. Frames which are partway out are left to finish.
+	 */
+	void
+	dropQueuedFrames ();
+
   protected:
 
 	/**
@@ -223,6 +974,64 @@ class Connection {
 	void
 	removeDefaultMessageHandler (const message_handler_t& handler);
 
+	/**
+	 * Takes ownership of the descriptor passed along with the message being
+	 * handled (see sendDescriptor()). Only meaningful inside a message
+	 * handler; descriptors which nobody takes are closed once the handlers
+	 * return.
+	 *
+	 * @return The descriptor, or -1 if none came with the message
+	 */
+	int
+	takeDescriptor ();
+
+	/**
+	 * Whether the message being handled is a reply to one of our requests
+	 * (see request()). Only meaningful inside a message handler.
+	 */
+	bool
+	handlingReply ();
+
+	/**
+	 * Has the bodies of one type of message read straight into memory of
+	 * the handler's choosing (a texture, a ring buffer slot) rather than
+	 * into a buffer the handler then copies out of. The provider is asked
+	 * for a target as each message's header arrives; a target which
+	 * doesn't add up to the body's length is ignored, with a warning.
+	 *
+	 * Bodies which arrived together with the message before them (small
+	 * ones, mostly) are copied into the target rather than read into it.
+	 * Messages carried over a WebSocket, and shared frames, don't use
+	 * targets. Replies to requests shouldn't either: their bodies are
+	 * copied from the first part alone.
+	 *
+	 * @param type      Type ID passed to sendMessage()
+	 * @param provider  Chooses each message's target, or an empty function
+	 *                  to stop using targets for the type
+	 */
+	void
+	setReceiveTarget (message_t type, const receive_target_provider_t& provider);
+
+	/**
+	 * Takes a reference to the body of the message being handled, so the
+	 * handler can keep it (queued for display, say) without copying it.
+	 * Only meaningful inside a message handler run by the reader thread or
+	 * the event loop.
+	 *
+	 * @return The body's pin (the target's, for a message with a receive
+	 *         target), or an empty pointer outside a handler
+	 */
+	std::shared_ptr<void>
+	getMessagePin ();
+
+	/**
+	 * Called when the connection closes, from either end. It runs on
+	 * whichever thread noticed (the reader thread, an event loop thread,
+	 * or the one calling close()), and may be called more than once.
+	 */
+	virtual void
+	connectionClosed ();
+
   private:
 
 	/**
@@ -231,12 +1040,239 @@ class Connection {
 	 */
 	void
 	readerThread (void* unused);
-	
+
+	/**
+	 * Passes a message to the handlers registered for its type, or to the
+	 * default handlers if there aren't any.
+	 */
+	void
+	dispatchMessage (MessageHeader& header, void* buffer,
+	                 std::shared_ptr<int> passedFd = std::shared_ptr<int>(),
+	                 std::shared_ptr<void> keepalive = std::shared_ptr<void>());
+
+	/// Queues a message read by the event loop to be handled on a worker
+	void
+	queueDispatch (const MessageHeader& header, void* data, std::shared_ptr<void> keepalive,
+	               std::shared_ptr<int> passedFd);
+
+	/**
+	 * Reads from the socket like recv(), collecting any descriptors passed
+	 * along with the data.
+	 */
+	ssize_t
+	receive (void* buffer, size_t length, int flags, std::vector<int>& fds);
+
+	/// Like receive(), scattering what's read across several pieces of
+	/// memory, in order
+	ssize_t
+	receive (const iovec* parts, int numParts, int flags, std::vector<int>& fds);
+
+	/**
+	 * Chooses where a message's body goes: its type's receive target, if
+	 * there's a provider for it which gives a sensible one, or otherwise
+	 * a buffer from the receive pool
+	 */
+	ReceiveTarget
+	chooseReceiveTarget (const MessageHeader& header);
+
+	/**
+	 * If a message is a shared frame, maps the memfd that came with it and
+	 * rewrites the message into the frame it carries, closing the
+	 * descriptors. Other messages are left alone, descriptors and all.
+	 *
+	 * @return false if the message should be dropped
+	 */
+	bool
+	openSharedFrame (MessageHeader& header, void*& data, std::shared_ptr<void>& keepalive,
+	                 std::vector<int>& fds);
+
+	/// Handles everything in the dispatch queue (runs on a worker thread)
+	void
+	drainDispatchQueue ();
+
+	/**
+	 * Reads messages until the socket runs dry, and queues them to be
+	 * handled (called by the event loop)
+	 *
+	 * @return false if the connection has closed
+	 */
+	bool
+	readMessages ();
+
+	/// Like readMessages(), for a WebSocket connection
+	bool
+	readWebSocket ();
+
+	/**
+	 * Cuts whole messages out of the receive buffer and queues them to be
+	 * handled. If the last one's body hasn't all arrived, it's left as
+	 * the incoming message for readMessages() to finish.
+	 */
+	void
+	takeBufferedMessages ();
+
+	/// Queues the incoming message to be handled, once it's all arrived
+	void
+	finishIncoming ();
+
+	/// Moves whatever's left in the receive buffer to the front, making
+	/// room to read into
+	void
+	compactReceiveBuffer ();
+
+	/**
+	 * Reads the next message, blocking until it's all arrived (for the
+	 * reader thread)
+	 *
+	 * @param header  Set to the message's header, in host byte order
+	 * @param target  Set to where the message's body was read to
+	 * @param fds     Descriptors passed with it are added to these
+	 * @return false if the peer closed the connection
+	 */
+	bool
+	receiveMessage (MessageHeader& header, ReceiveTarget& target, std::vector<int>& fds);
+
+	/// Queues a WebSocket control frame (a pong, or a close) and writes
+	/// what it can
+	void
+	sendWebSocketControl (uint8_t opcode, const uint8_t* payload, size_t length);
+
+	/**
+	 * Starts the closing handshake because the peer broke the rules, for
+	 * readWebSocket() to return false after
+	 *
+	 * @param status  Why, as one of the RFC 6455 status codes
+	 */
+	void
+	failWebSocket (uint16_t status);
+
+	/**
+	 * Adds a frame to the send queue, dropping an older one which hasn't
+	 * started going out, and writes what it can.
+	 */
+	void
+	queueFrame (std::shared_ptr<OutgoingMessage> frame);
+
+	/**
+	 * Adds a control message to the send queue, copying the body.
+	 * The caller must hold the writer mutex.
+	 */
+	void
+	enqueueControl (message_t type, size_t length, void* data, size_t offset,
+	                uint32_t requestId);
+
+	/// Does the work of sendMessage(), with the given request id
+	void
+	sendControl (message_t type, size_t length, void* data, uint32_t requestId);
+
+	/**
+	 * Request id for a control message sent now: the id of the request
+	 * being handled, marked as a reply, if it's being handled on the
+	 * calling thread; otherwise 0.
+	 */
+	uint32_t
+	replyRequestId ();
+
+	/// Keeps a copy of a reply, to hand over when its request is complete
+	void
+	recordReply (const MessageHeader& header, void* buffer);
+
+	/// Calls a request's handler with whatever it got back, and forgets it
+	void
+	completeRequest (uint32_t requestId);
+
+	/// Gives every incomplete request CONNECTION_CLOSED_MESSAGE
+	void
+	failRequests ();
+
+	/**
+	 * Writes as much of the send queue as the socket will take, in as few
+	 * sendmsg() calls as possible, picking up partially-written messages
+	 * where they left off.
+	 *
+	 * In non-blocking mode this stops when the socket is full; otherwise
+	 * it blocks until everything is written. The caller must hold the
+	 * writer mutex.
+	 *
+	 * @return true if the queue is now empty
+	 */
+	bool
+	flushSendQueue ();
+
+	/**
+	 * Gathers messages from the front of the send queue into flushMsg:
+	 * as many as one sendmsg() can take, or just the first if it's a
+	 * zero-copy frame. The caller must hold the writer mutex.
+	 *
+	 * @return Number of messages gathered
+	 */
+	size_t
+	gatherSendQueue ();
+
+	/**
+	 * Credits bytes written to the messages at the front of the send queue,
+	 * oldest first, and removes the ones which are finished. The caller
+	 * must hold the writer mutex.
+	 */
+	void
+	creditWritten (size_t written);
+
+	/**
+	 * Submits the front of the send queue to the event loop's io_uring,
+	 * unless a send is already in flight. The caller must hold the writer
+	 * mutex.
+	 */
+	void
+	submitSendQueue ();
+
+	/// Called from the io_uring's completion thread when a send finishes.
+	/// Whatever's left in the queue is submitted from the worker pool.
+	void
+	handleSendCompletion (int result);
+
+	/**
+	 * Flushes the send queue, then has the event loop watch for room in
+	 * the socket if anything's left over. The caller must hold the writer
+	 * mutex.
+	 */
+	void
+	flushOrArm ();
+
+	/// Starts or stops watching for room in the socket
+	void
+	setWriteArmed (bool armed);
+
+	/**
+	 * Blocks while there are too many control messages queued, writing
+	 * them out as room appears. The caller must not hold the writer mutex.
+	 */
+	void
+	waitForControlBacklog ();
+
+	/// Blocks until the socket has room to write
+	void
+	waitUntilWritable ();
+
+	/// Turns on SO_ZEROCOPY if it isn't already. Returns false if it can't.
+	bool
+	enableZeroCopy ();
+
+	/**
+	 * Collects zero-copy completion notifications from the socket's error
+	 * queue without blocking, and releases whatever they were pinning.
+	 */
+	void
+	reapZeroCopyCompletions ();
 };
 
 class Server
 {
-	int fd;
+	/// Listening sockets. TCP servers have one per acceptor, all bound to
+	/// the same port with SO_REUSEPORT; a unix domain socket is shared.
+	std::vector<int> listenFds;
+
+	/// Mutex for listenFds
+	pthread_mutex_t listenFdsMutex;
 
 	typedef std::list< std::shared_ptr<Connection> > connection_list_t;
 
@@ -246,11 +1282,60 @@ class Server
 	/// Mutex for adding/removing elements to/from the list of connections
 	pthread_mutex_t connectionsMutex;
 
+	/// Signalled (with connectionsMutex) to wake the reaper early
+	pthread_cond_t reaperCond;
+
 	/// Flag to tell start() to stop accepting new connections
 	bool stopAcceptingFlag;
 
-	/// How many connections can wait in line for accept()
-	static const int INCOMING_CONNECTION_QUEUE_SIZE = 5;
+	/// Whether to service connections with an event loop rather than a
+	/// reader thread apiece
+	bool useEventLoop;
+
+	/// Reads from and dispatches messages for all the connections
+	std::shared_ptr<EventLoop> eventLoop;
+
+	/// Path of the unix domain socket, if that's what's listening
+	std::string socketPath;
+
+	/// How many threads accept connections
+	int numAcceptors;
+
+	/// How many connections can wait in line for accept(), per socket
+	int backlog;
+
+	pthread_t reaperThreadHandle;
+
+	bool reaperThreadStarted;
+
+	/// Flag telling the reaper thread to return
+	bool stopReapingFlag;
+
+	/// Opens a socket listening on the given port
+	int
+	listenTcp (in_port_t port);
+
+	/**
+	 * Starts the reaper and the other acceptors, then accepts connections
+	 * on the calling thread until stopped. Closes the listening sockets
+	 * once every acceptor has returned.
+	 */
+	void
+	serve ();
+
+	/// Accepts connections on the given listening socket until stopped
+	void
+	acceptConnections (int listenFd);
+
+	/// Runs acceptConnections() on another acceptor thread, stopping the
+	/// whole server if it fails, rather than leaving its share of
+	/// connections waiting
+	void
+	acceptorThread (int listenFd);
+
+	/// Reaps connections every REAP_INTERVAL_MS until stopped
+	void
+	reaperThread (void* unused);
 
   protected:
 
@@ -262,9 +1347,48 @@ class Server
 	virtual std::shared_ptr<Connection>
 	newConnection (int fd, in_addr_t remoteAddress, in_port_t remotePort) = 0;
 
+	/**
+	 * Called as the server starts accepting connections, so subclasses
+	 * can put handlers of their own on the event loop. If it throws, the
+	 * server stops and start() passes the exception on.
+	 *
+	 * @param loop  The loop servicing the connections, or an empty pointer
+	 *              if each connection has a reader thread
+	 */
+	virtual void
+	started (std::shared_ptr<EventLoop> loop);
+
+	/// Called when the server stops, before the event loop does. Undo
+	/// started() in here.
+	virtual void
+	stopped ();
+
+	/**
+	 * Takes on a connection which arrived some other way than start()
+	 * (e.g. upgraded from HTTP), servicing it like the rest.
+	 *
+	 * @param conn  The connection, from newConnection()
+	 * @param loop  Event loop to service it with, or an empty pointer for
+	 *              the server's own (or a reader thread, if it has none)
+	 */
+	void
+	adoptConnection (std::shared_ptr<Connection> conn,
+	                 std::shared_ptr<EventLoop> loop = std::shared_ptr<EventLoop>());
+
   public:
 
-	Server ();
+	/// Default for the backlog. The kernel caps it at net.core.somaxconn.
+	static const int DEFAULT_BACKLOG = SOMAXCONN;
+
+	/// How often finished connections are thrown away, in milliseconds
+	static const int REAP_INTERVAL_MS = 1000;
+
+	/**
+	 * @param useEventLoop_  If true, connections are serviced by an epoll
+	 *                       event loop and a worker pool. If false, each
+	 *                       connection gets its own reader thread.
+	 */
+	Server (bool useEventLoop_ = true);
 
 	~Server ();
 
@@ -274,17 +1398,60 @@ class Server
 	 * to stop from the operating system, the incoming socket is broken or one of
 	 * the threads tells it to stop.
 	 *
+	 * The socket is opened with SO_REUSEPORT, so other processes (or other
+	 * servers in this one) can listen on the same port, and the kernel
+	 * spreads new connections between them.
+	 *
 	 * @param port  A number between and 1 (inclusive) and 2^16 (exclusive).
 	 */
 	void
 	start (in_port_t port);
 
+	/**
+	 * Like start(), but listens on a unix domain socket for peers on the
+	 * same host. Frames sent to them with sendFrame() are passed by
+	 * reference rather than copied through the socket.
+	 *
+	 * Whatever's at the path already is replaced, and the socket is removed
+	 * again when the server stops.
+	 *
+	 * @param path  Where to create the socket
+	 */
+	void
+	startUnix (std::string path);
+
 	/**
 	 * If the server is running, stop accepting new connections
 	 */
 	void
 	stop ();
 
+	/**
+	 * Sets how many threads accept connections. Over TCP, each gets a
+	 * listening socket of its own, so a burst of connections isn't held up
+	 * behind a single accept() loop. Takes effect at the next start().
+	 */
+	void
+	setAcceptors (int numAcceptors_);
+
+	/// Sets how many connections can wait in line for accept(), per
+	/// listening socket. Takes effect at the next start().
+	void
+	setBacklog (int backlog_);
+
+	/**
+	 * Throws away connections which have finished (see
+	 * Connection::isFinished()). This happens every REAP_INTERVAL_MS while
+	 * the server is running anyway. Subclasses may extend it to clean up
+	 * after connections of their own.
+	 */
+	virtual void
+	reapConnections ();
+
+	/// Number of connections, including any finished ones not yet reaped
+	size_t
+	getConnectionCount ();
+
 	void
 	forEachConnection (std::function<void(Connection&)> f);
 };
@@ -293,6 +1460,41 @@ class Client
 {
 	std::shared_ptr<Connection> connection;
 
+	/// Where the server is, for reconnecting
+	sockaddr_storage serverAddress;
+	socklen_t serverAddressLength;
+
+	/// Mutex for the things below
+	pthread_mutex_t reconnectMutex;
+
+	/// Signalled (with reconnectMutex) when the connection is closed from
+	/// the other end, or it's time for the reconnect thread to stop
+	pthread_cond_t reconnectCond;
+
+	pthread_t reconnectThreadHandle;
+
+	bool reconnectThreadStarted;
+
+	/// Tells the reconnect thread to return
+	bool stopReconnectingFlag;
+
+	/// Set when the server closes the connection, and cleared once it's
+	/// been reconnected
+	bool connectionLost;
+
+	/// Opens a socket to wherever serverAddress says
+	int
+	dial ();
+
+	/// Wraps a newly opened socket in a connection and starts it
+	void
+	attach (int fd, in_addr_t remoteAddress, in_port_t remotePort);
+
+	/// Reconnects, backing off between attempts, whenever the connection is
+	/// lost, until stopped
+	void
+	reconnectThread (void* unused);
+
   protected:
 
 	/**
@@ -302,8 +1504,22 @@ class Client
 	 */
 	virtual std::shared_ptr<Connection>
 	newConnection (int fd, in_addr_t remoteAddress, in_port_t remotePort) = 0;
+
+	/**
+	 * Called on the reconnect thread once a lost connection has been
+	 * reconnected, so that subclasses can pick up where they left off.
+	 */
+	virtual void
+	reconnected (std::shared_ptr<Connection> connection);
 	
   public:
+
+	/// Wait before the first attempt to reconnect, in milliseconds. Each
+	/// failed attempt doubles it, up to RECONNECT_MAX_DELAY_MS.
+	static const int RECONNECT_MIN_DELAY_MS = 50;
+
+	static const int RECONNECT_MAX_DELAY_MS = 2000;
+
 	Client ();
 
 	~Client ();
@@ -313,6 +1529,22 @@ class Client
 	 */
 	std::shared_ptr<Connection>
 	connect (std::string ipAddress, in_port_t port);
+
+	/**
+	 * Attempts to connect to a server listening on a unix domain socket
+	 * (see Server::startUnix()).
+	 */
+	std::shared_ptr<Connection>
+	connectUnix (std::string path);
+
+	/**
+	 * Sets whether to reconnect, in the background, when the server closes
+	 * the connection or it breaks. The connection object stays the same
+	 * (see Connection::reconnect()). Turning it off waits for any attempt
+	 * in progress.
+	 */
+	void
+	setAutoReconnect (bool autoReconnect);
 };
 
 #endif // SOCKETS_H
@@ -31,6 +31,18 @@ class MappedBuffer {
 	int index;
 	void *data;
 
+	/// Whether the device is still streaming into this buffer. Once it
+	/// isn't, released frames are no longer handed back to the driver.
+	bool streaming;
+
+	/// When the driver last filled the buffer, and the V4L2_BUF_FLAG_* bits
+	/// it gave that frame
+	timeval timestamp;
+	uint32_t flags;
+
+	/// The driver's count of frames it's captured, gaps and all
+	uint32_t sequence;
+
   public:
 
 	MappedBuffer (int _fd, int _index);
@@ -67,7 +79,13 @@ class Webcam {
 
 	std::vector< std::shared_ptr<MappedBuffer> > framebuffers;
 
-	int currentBuffer;
+	/**
+	 * How many buffers to ask the driver for. Frames stay out of the
+	 * driver's hands until everyone is done with them (which, for a
+	 * zero-copy send, is when the kernel says the data has left), so there
+	 * need to be enough left over for the camera to keep filling.
+	 */
+	static const int NUM_FRAMEBUFFERS = 4;
 
 	bool capturing;
 
@@ -98,6 +116,15 @@ class Webcam {
 	resolution_t
 	getResolution ();
 
+	/// Most bytes a frame can take in the current format (the driver's sizeimage)
+	size_t
+	getFrameSize ();
+
+	/// Bytes from one row of a frame to the next (the driver's bytesperline),
+	/// or 0 for compressed formats
+	size_t
+	getStride ();
+
 	void
 	setResolution (uint32_t width, uint32_t height);
 
@@ -107,12 +134,24 @@ class Webcam {
 	void
 	displayInfo ();
 
+	/// How many buffers the driver is filling (or would be, once capture starts)
+	int
+	getNumFramebuffers ();
+
 	void
 	startCapture ();
 
 	void
 	stopCapture ();
 
+	/**
+	 * Waits for the camera to fill a buffer and returns it.
+	 *
+	 * The buffer is handed back to the driver to be refilled once the last
+	 * copy of the returned pointer is released, so hold on to it for as
+	 * long as something is still reading the data -- but no longer, or the
+	 * camera runs out of buffers to fill.
+	 */
 	std::shared_ptr<MappedBuffer>
 	getFrame();
 
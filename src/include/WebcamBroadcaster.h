@@ -0,0 +1,364 @@
+#ifndef WEBCAM_BROADCASTER_H
+#define WEBCAM_BROADCASTER_H
+
+#include <atomic>       // atomic counters
+#include <map>          // maps
+#include <memory>       // shared_ptr
+#include <pthread.h>    // multithreading
+#include <stdint.h>     // uint64_t
+#include <string>       // strings
+#include <vector>       // vectors
+
+#include "BufferPool.h"
+#include "FrameRing.h"
+#include "Http.h"
+#include "MediaChannel.h"
+#include "Metrics.h"
+#include "Sockets.h"
+#include "Webcam.h"
+#include "webcam_stream_common.h"
+
+/**
+ * Shares one webcam between every connection that has it open. A single
+ * capture thread reads each frame once and hands it to every connection
+ * that's streaming, so fifty viewers cost one capture and fifty sends.
+ *
+ * There's at most one broadcaster per device, found through open(). The
+ * device stays open for as long as anyone holds a reference to its
+ * broadcaster, and capture runs for as long as anyone is subscribed.
+ */
+class WebcamBroadcaster: public std::enable_shared_from_this<WebcamBroadcaster>
+{
+	struct Subscriber
+	{
+		std::weak_ptr<Connection> connection;
+
+		/// Whether the connection wants frames, or just spec changes
+		bool streaming;
+
+		/// Whether the connection is getting frames from the multicast group
+		bool multicast;
+
+		/// Whether the connection is reading frames from the frame ring
+		bool ring;
+
+		/// Sequence number of the last frame handed to the connection
+		uint64_t cursor;
+	};
+
+	typedef std::map<Connection*, Subscriber> subscriber_map;
+
+	std::shared_ptr<Webcam> webcam;
+
+	/// Mutex for the webcam itself
+	pthread_mutex_t webcamMutex;
+
+	/// Everyone who has this webcam open, keyed by connection
+	subscriber_map subscribers;
+
+	/// HTTP clients being sent the frames as MJPEG (see addViewer())
+	std::vector< std::shared_ptr<HttpConnection> > viewers;
+
+	/// Mutex for the subscriber list and the viewers
+	pthread_mutex_t subscribersMutex;
+
+	/// Serializes starting capture and changing the spec
+	pthread_mutex_t controlMutex;
+
+	/// Whether the capture thread is running, even if it's been told to stop
+	bool captureThreadStarted;
+
+	/// Tells the capture thread to stop and return
+	bool captureActiveFlag;
+
+	/// Signalled (with subscribersMutex) when the capture thread exits
+	pthread_cond_t captureStoppedCond;
+
+	/// Keeps the broadcaster alive until the capture thread has exited
+	std::shared_ptr<WebcamBroadcaster> captureKeepalive;
+
+	/// Sequence number of the last captured frame
+	uint64_t frameSeq;
+
+	/// Tells this webcam's frames apart from other webcams' (see frame_header)
+	uint32_t streamId;
+
+	/// Number of the driver's buffers held by someone other than the driver
+	std::shared_ptr< std::atomic<int> > framesOut;
+
+	/// Where frames get copied when the driver is running out of buffers
+	BufferPool copyPool;
+
+	/// Counters for getStats(). Only the capture thread changes them.
+	std::atomic<uint64_t> framesCaptured;
+	std::atomic<uint64_t> framesSkipped;
+	std::atomic<uint64_t> framesCopied;
+
+	/// Smoothed time between captured frames, in microseconds
+	std::atomic<uint64_t> frameInterval;
+
+	/// Every time between captured frames, for the metrics
+	Histogram frameIntervals;
+
+	/**
+	 * Publishes frames to the multicast group. It's created before the
+	 * first member is counted and never replaced, so the capture thread
+	 * can use it without a lock.
+	 */
+	std::shared_ptr<MediaSender> multicastSender;
+
+	/// This webcam's multicast group, in host byte order
+	uint32_t multicastGroup;
+
+	/// Address the multicast sender publishes from, in host byte order
+	uint32_t multicastSource;
+
+	/**
+	 * Publishes frames to local readers through shared memory. Like the
+	 * multicast sender, it's created before the first reader is counted,
+	 * and it's only ever replaced while capture is stopped.
+	 */
+	std::shared_ptr<FrameRingWriter> frameRing;
+
+	/// Number of frames the frame ring holds
+	static const uint32_t FRAME_RING_SLOTS = 8;
+
+	/// Separates the frames sent to viewers
+	static const char* const MJPEG_BOUNDARY;
+
+	/**
+	 * How many buffers to leave the driver. Past this, frames are copied
+	 * out so that slow subscribers can't stall the camera.
+	 */
+	static const int MIN_FREE_FRAMEBUFFERS = 2;
+
+	/// Every broadcaster, keyed by device path
+	static std::map< std::string, std::weak_ptr<WebcamBroadcaster> > registry;
+
+	/// Mutex for the registry
+	static pthread_mutex_t registryMutex;
+
+	/// Multicast settings shared by every webcam (see configureMulticast())
+	static uint32_t multicastBaseGroup;
+	static in_port_t multicastPort;
+	static in_addr_t multicastInterface;
+	static int multicastFecGroupSize;
+
+	/// Offset from multicastBaseGroup of the next webcam's group
+	static uint32_t nextMulticastOffset;
+
+	/// Stream id for the next broadcaster created
+	static std::atomic<uint32_t> nextStreamId;
+
+	WebcamBroadcaster (std::string filename);
+
+	void
+	captureThread (void* unused);
+
+	void
+	startCaptureThread ();
+
+	/// Waits for a capture thread that's been told to stop to exit
+	void
+	waitForCaptureThread ();
+
+	/**
+	 * Gets the driver's buffers back from the subscribers, waiting a little
+	 * while for the ones which are partway out.
+	 */
+	void
+	reclaimFramebuffers ();
+
+	/// Number of subscribers and viewers which want frames, one way or
+	/// another
+	int
+	countStreaming ();
+
+	/// Starts the capture thread if it isn't running. Needs controlMutex.
+	void
+	ensureCapturing ();
+
+	/**
+	 * Wraps a frame so that framesOut counts it, or copies it out if the
+	 * driver has too few buffers left.
+	 */
+	std::shared_ptr<void>
+	pinFrame (std::shared_ptr<MappedBuffer> frame, void*& data);
+
+  public:
+
+	/// A snapshot of a webcam's counters
+	struct Stats
+	{
+		std::string filename;
+
+		uint32_t streamId;
+
+		/// Frames captured since the webcam was opened
+		uint64_t framesCaptured;
+
+		/// Frames the driver dropped (gaps in its sequence numbers)
+		uint64_t framesDropped;
+
+		/// Frames copied out because the driver was running short of buffers
+		uint64_t framesCopied;
+
+		/// Smoothed capture rate, or 0 while capture is stopped
+		double captureFps;
+
+		/// Driver buffers held by subscribers, out of how many there are
+		int buffersInFlight;
+		int numBuffers;
+
+		/// Connections with the webcam open, and how many of them (or of
+		/// the viewers) want frames
+		int subscribers;
+		int streaming;
+
+		/// HTTP clients being sent MJPEG
+		int viewers;
+	};
+
+	~WebcamBroadcaster ();
+
+	/**
+	 * Finds the broadcaster for the given device, opening the device if
+	 * nobody has it open yet.
+	 *
+	 * @param filename  Path to the device (e.g. /dev/video0)
+	 * @return          The device's broadcaster
+	 */
+	static std::shared_ptr<WebcamBroadcaster>
+	open (std::string filename);
+
+	/// Every webcam which is open
+	static std::vector< std::shared_ptr<WebcamBroadcaster> >
+	getOpen ();
+
+	Stats
+	getStats ();
+
+	/// Times between captured frames
+	Histogram&
+	getFrameIntervals ();
+
+	std::string
+	getFilename ();
+
+	/// Registers a connection to be told about spec changes
+	void
+	attach (std::shared_ptr<Connection> connection);
+
+	/// Stops telling a connection anything, unsubscribing it if necessary
+	void
+	detach (Connection& connection);
+
+	/**
+	 * Starts sending frames to an attached connection. Capture starts with
+	 * the first subscriber.
+	 */
+	void
+	subscribe (Connection& connection);
+
+	/// Stops sending frames to a connection. Capture stops with the last one.
+	void
+	unsubscribe (Connection& connection);
+
+	/// Whether a connection is being sent frames
+	bool
+	isSubscribed (Connection& connection);
+
+	/**
+	 * Counts a connection as a member of the webcam's multicast group,
+	 * starting to publish to the group if it's the first.
+	 *
+	 * @return Everything the client needs to join the group
+	 */
+	struct multicast_spec
+	joinMulticast (Connection& connection);
+
+	/// Stops counting a connection as a member of the multicast group
+	void
+	leaveMulticast (Connection& connection);
+
+	/// Whether a connection is a member of the multicast group
+	bool
+	isMulticastMember (Connection& connection);
+
+	/**
+	 * Counts a connection as a reader of the webcam's frame ring, creating
+	 * the ring if it's the first.
+	 *
+	 * @return The ring, whose reader descriptor the connection should be sent
+	 */
+	std::shared_ptr<FrameRingWriter>
+	openRing (Connection& connection);
+
+	/// Stops counting a connection as a reader of the frame ring
+	void
+	closeRing (Connection& connection);
+
+	/// Whether a connection is reading from the frame ring
+	bool
+	isRingReader (Connection& connection);
+
+	/**
+	 * Sends the webcam's frames to an HTTP client as MJPEG (a
+	 * multipart/x-mixed-replace stream of JPEGs) until it hangs up, which
+	 * browsers and NVRs can show as they are. The frames come from the same
+	 * capture as everyone else's, and go out just as the driver produced
+	 * them, so every viewer shares one copy. A viewer which falls behind
+	 * skips frames.
+	 *
+	 * The response is started here; there's no need to respond() first.
+	 *
+	 * @throws runtime_error  If the webcam isn't capturing MJPEG
+	 */
+	void
+	addViewer (std::shared_ptr<HttpConnection> viewer);
+
+	/// Stops sending frames to an HTTP client. Capture stops with the last
+	/// viewer or subscriber.
+	void
+	removeViewer (HttpConnection& viewer);
+
+	/**
+	 * Sets where multicast groups come from. Webcams which are already
+	 * publishing aren't affected.
+	 *
+	 * @param baseGroup         First group address, in host byte order. Each
+	 *                          webcam gets the next one up.
+	 * @param port              UDP port, in host byte order
+	 * @param interfaceAddress  Interface to send from, in network byte order.
+	 *                          INADDR_ANY means whichever interface the first
+	 *                          member is connected through.
+	 * @param fecGroupSize      Data fragments per parity fragment, or 0
+	 */
+	static void
+	configureMulticast (uint32_t baseGroup, in_port_t port, in_addr_t interfaceAddress,
+	                    int fecGroupSize);
+
+	/**
+	 * Changes the image spec for everyone. Capture is paused while the
+	 * change happens, and every other attached connection is sent
+	 * SERVER_MSG_IMAGE_SPEC afterwards. If the frames no longer fit in the
+	 * frame ring, it's replaced, and every reader is sent the new one.
+	 *
+	 * @param requester  The connection asking, which is left to reply itself
+	 */
+	void
+	setImageFormat (Connection& requester, Webcam::video_fmt_enum_t fmt,
+	                uint32_t width, uint32_t height);
+
+	Webcam::video_fmt_enum_t
+	getImageFormat ();
+
+	Webcam::resolution_t
+	getResolution ();
+
+	/// Every supported format and resolution combination
+	std::shared_ptr< std::vector<struct image_spec> >
+	getSupportedSpecs ();
+};
+
+#endif // WEBCAM_BROADCASTER_H
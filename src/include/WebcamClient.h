@@ -1,14 +1,19 @@
 #ifndef WEBCAM_CLIENT_H
 #define WEBCAM_CLIENT_H
 
+#include <atomic>
 #include <list>
 #include <pthread.h>
 #include <memory>    // shared_ptr>
 #include <string>
 
+#include "FrameRing.h"
+#include "JitterBuffer.h"
 #include "Log.h"
+#include "MediaChannel.h"
 #include "Sockets.h"
 #include "WebcamViewer.h"
+#include "webcam_stream_common.h"
 
 class WebcamClientConnection: public Connection
 {
@@ -16,10 +21,88 @@ class WebcamClientConnection: public Connection
 
 	std::shared_ptr<WebcamViewer> viewer;
 
+	/// Mutex for the viewer, which frames can reach from several threads
 	pthread_mutex_t viewerMutex;
 
+	/// What the viewer is set up to show
+	struct image_spec viewerSpec;
+
 	std::string cameraName;
 
+	/// Receives frames over UDP, once openMediaChannel() has been called
+	std::shared_ptr<MediaReceiver> mediaReceiver;
+
+	/// Receives frames from the server's multicast group, while a member
+	std::shared_ptr<MediaReceiver> multicastReceiver;
+
+	/// Reads frames from the server's shared memory, while the ring is open
+	std::shared_ptr<FrameRingReader> frameRingReader;
+
+	/// Paces frames out to the viewer, or nothing to show them as they
+	/// arrive. Replaced with the viewer mutex held.
+	std::shared_ptr<JitterBuffer> jitterBuffer;
+
+	/// Frames received so far, for the receive reports
+	std::atomic<uint32_t> framesReceived;
+	std::atomic<uint64_t> bytesReceived;
+
+	/// When the last receive report was sent, in milliseconds
+	std::atomic<uint64_t> lastReportTime;
+
+	/// Whether the server says it's streaming to us
+	std::atomic<bool> streaming;
+
+	/// FEC group size the media channel was opened with, or -1 if it's
+	/// closed
+	std::atomic<int> mediaChannelFecGroupSize;
+
+	/// Our session on the server, if it's given us one
+	struct session_token sessionToken;
+
+	bool haveSession;
+
+	/// Mutex for the session token
+	pthread_mutex_t sessionMutex;
+
+	/**
+	 * Starts over after the session couldn't be resumed: opens the webcam
+	 * again, in the spec the viewer was showing, and asks for whatever
+	 * else was going.
+	 */
+	void
+	restoreSession ();
+
+	/**
+	 * Opens the viewer, or changes what it expects, to show frames in the
+	 * given spec. The caller must hold viewerMutex.
+	 */
+	void
+	updateViewer (const struct image_spec& spec);
+
+	/// Shows a SERVER_MSG_FRAME whose header has already been checked
+	void
+	presentFrame (void* data, size_t length);
+
+	/// A frame being read straight into the viewer's canvas
+	struct CanvasFrame;
+
+	/// The frame the viewer's canvas is lent to, if any. Needs viewerMutex.
+	std::weak_ptr<CanvasFrame> lentCanvas;
+
+	/**
+	 * Chooses where a SERVER_MSG_FRAME is read to. With the jitter buffer
+	 * on, that's one of its slots. When frames are shown as they arrive,
+	 * it's the viewer's canvas, if the frame fits it and the viewer isn't
+	 * busy. Otherwise it's a buffer as usual.
+	 */
+	ReceiveTarget
+	chooseFrameTarget (const MessageHeader& header);
+
+	/// Shows a frame which was read into the canvas, or copies it out and
+	/// shows it the usual way if it isn't laid out the way the canvas is
+	void
+	presentCanvasFrame (std::shared_ptr<CanvasFrame> frame, size_t length);
+
 	/// Temporary: I need somewhere to store the bound handlers that
 	/// lives as long as the connection.
 	/// I'm planning on refactoring Connection so this isn't necessary.
@@ -31,6 +114,64 @@ class WebcamClientConnection: public Connection
 
 	~WebcamClientConnection ();
 
+	/**
+	 * Starts listening for frames over UDP and asks the server to send them
+	 * there instead of over this connection.
+	 *
+	 * @param fecGroupSize  Data fragments per parity fragment, or 0 for none
+	 */
+	void
+	openMediaChannel (int fecGroupSize = 0);
+
+	/// Asks the server to go back to sending frames over this connection
+	void
+	closeMediaChannel ();
+
+	/**
+	 * Sets up the jitter buffer, which holds frames back so they can be
+	 * shown at the pace they were captured at. It's on by default, with a
+	 * target of JitterBuffer::DEFAULT_TARGET_LATENCY_MS. Frames are read
+	 * straight into the jitter buffer's slots while it's on, and straight
+	 * into the viewer's canvas while it's off.
+	 *
+	 * @param targetLatencyMs  How long to hold frames back, in
+	 *                         milliseconds, or 0 to show them as soon as
+	 *                         they arrive
+	 * @param latestWins       Whether to skip to the newest frame when
+	 *                         several are due at once
+	 */
+	void
+	setJitterBuffer (int targetLatencyMs, bool latestWins = false);
+
+	/// The jitter buffer (for its counters), or nothing if it's off
+	std::shared_ptr<JitterBuffer>
+	getJitterBuffer ();
+
+	/**
+	 * Tells the server how many frames have arrived, unless it was told
+	 * less than RECEIVE_REPORT_INTERVAL_MS ago.
+	 */
+	void
+	sendReceiveReport ();
+
+	/**
+	 * Opens a webcam and starts it streaming, in whatever spec it's in.
+	 * The requests are pipelined, and this waits for the replies, so it
+	 * mustn't be called from a message handler.
+	 *
+	 * @param device  Path to the webcam on the server
+	 * @return Whether the stream started; if not, the reason is logged
+	 */
+	bool
+	startStream (std::string device);
+
+	/**
+	 * After reconnecting, asks the server to carry on with our session, or
+	 * sets everything up again if it's gone.
+	 */
+	void
+	resumeSession ();
+
 	void
 	handle_ERROR_MSG_INVALID_MSG            (message_t type, message_len_t length, void* data);
 	//void
@@ -39,8 +180,24 @@ class WebcamClientConnection: public Connection
 	void
 	handle_SERVER_MSG_FRAME                 (message_t type, message_len_t length, void* data);
 	void
+	handle_SERVER_MSG_FRAME_RING            (message_t type, message_len_t length, void* data);
+	void
+	handle_SERVER_MSG_FRAME_RING_IS_CLOSED  (message_t type, message_len_t length, void* data);
+	void
 	handle_SERVER_MSG_IMAGE_SPEC            (message_t type, message_len_t length, void* data);
 	void
+	handle_SERVER_MSG_MEDIA_CHANNEL_IS_CLOSED (message_t type, message_len_t length, void* data);
+	void
+	handle_SERVER_MSG_MEDIA_CHANNEL_IS_OPENED (message_t type, message_len_t length, void* data);
+	void
+	handle_SERVER_MSG_MULTICAST_GROUP       (message_t type, message_len_t length, void* data);
+	void
+	handle_SERVER_MSG_MULTICAST_IS_LEFT     (message_t type, message_len_t length, void* data);
+	void
+	handle_SERVER_MSG_SESSION               (message_t type, message_len_t length, void* data);
+	void
+	handle_SERVER_MSG_SESSION_RESUMED       (message_t type, message_len_t length, void* data);
+	void
 	handle_SERVER_MSG_STREAM_IS_STARTED     (message_t type, message_len_t length, void* data);
 	void
 	handle_SERVER_MSG_STREAM_IS_STOPPED     (message_t type, message_len_t length, void* data);
@@ -56,6 +213,8 @@ class WebcamClientConnection: public Connection
 	//handle_SERVER_ERR_INVALID_SPEC          (message_t type, message_len_t length, void* data);
 	//void
 	//handle_SERVER_ERR_NO_WEBCAM_OPENED      (message_t type, message_len_t length, void* data);
+	void
+	handle_SERVER_ERR_NO_SUCH_SESSION       (message_t type, message_len_t length, void* data);
 	//void
 	//handle_SERVER_ERR_RUNTIME_ERROR         (message_t type, message_len_t length, void* data);
 	//void
@@ -65,10 +224,23 @@ class WebcamClientConnection: public Connection
 
 };
 
+/**
+ * Connects to a WebcamServer. If the connection is lost, it's reconnected
+ * in the background and the session resumed, so the stream carries on.
+ */
 class WebcamClient: public Client
 {
 	std::shared_ptr<Connection>
 	newConnection (int fd, in_addr_t remoteAddress, in_port_t remotePort);
+
+	void
+	reconnected (std::shared_ptr<Connection> connection);
+
+  public:
+
+	WebcamClient ();
+
+	~WebcamClient ();
 };
 
 #endif // WEBCAM_CLIENT_H
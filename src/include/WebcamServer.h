@@ -2,12 +2,19 @@
 #define WEBCAM_SERVER_H
 
 #include <list>         // for the bound handlers
+#include <map>          // maps
 #include <pthread.h>    // multithreading
 #include <memory>       // shared_ptr
 #include <stdexcept>    // exceptions
+#include <stdint.h>     // uint64_t
+#include <string>       // strings
+#include <vector>       // vectors
 
+#include "Http.h"
+#include "MediaChannel.h"
+#include "RateControl.h"
 #include "Sockets.h"
-#include "Webcam.h"
+#include "WebcamBroadcaster.h"
 
 class NoWebcamOpenException: public std::runtime_error
 {
@@ -17,17 +24,38 @@ class NoWebcamOpenException: public std::runtime_error
 	{ }
 };
 
+class WebcamServer;
+
 class WebcamServerConnection: public Connection
 {
   private:
-	std::shared_ptr<Webcam> webcam;
+	/// Keeps the sessions, for CLIENT_MSG_GET_SESSION and
+	/// CLIENT_MSG_RESUME_SESSION
+	WebcamServer& server;
+
+	/// This connection's session token, once the client has asked for one
+	std::string sessionToken;
 
-	pthread_t streamerThreadHandle;
+	/// The open webcam, which may be shared with other connections
+	std::shared_ptr<WebcamBroadcaster> webcam;
 
 	pthread_mutex_t webcamMutex;
 
-	/// Tells the streamer thread to stop sending frames and return.
-	bool streamIsActiveFlag;
+	/// Where frames go instead of this connection, if the client asked
+	std::shared_ptr<MediaSender> mediaChannel;
+
+	/// What the client asked for when it opened the media channel
+	struct media_channel_spec mediaChannelSpec;
+
+	pthread_mutex_t mediaChannelMutex;
+
+	/// Decides how many of the webcam's frames the link has room for,
+	/// and how fast to pace them out
+	RateController rateController;
+
+	/// Keeps frames sent over the media channel under the client's
+	/// bandwidth limit. Needs mediaChannelMutex.
+	TokenBucket mediaChannelBucket;
 
 	/// Temporary: I need somewhere to store the bound handlers that
 	/// lives as long as the connection.
@@ -36,20 +64,43 @@ class WebcamServerConnection: public Connection
 	boundHandlers;
 
   public:
-	WebcamServerConnection (int fd, in_addr_t remoteAddress, in_port_t remotePort);
+	WebcamServerConnection (WebcamServer& server_, int fd, in_addr_t remoteAddress,
+	                        in_port_t remotePort);
 
 	~WebcamServerConnection ();
 
-  private:
+	/**
+	 * Sends the frame over the media channel, if one is open. Frames the
+	 * link doesn't seem to have room for are skipped.
+	 *
+	 * Over TCP, the socket is paced so the frame is spread over the time
+	 * until the next one, or slower if the client's bandwidth limit says
+	 * so. Over the media channel, frames are skipped to keep under the
+	 * limit instead.
+	 */
 	void
-	streamerThread (void* unused);
+	sendFrame (message_t type, size_t length, void* data, std::shared_ptr<void> pin,
+	           const void* prefix = NULL, size_t prefixLength = 0);
 
+  private:
 	void
 	startStream ();
 
 	void
 	stopStream();
 
+	/**
+	 * Carries on with a lost connection's webcam, stream and media channel.
+	 * This connection is subscribed before the lost one lets go, so the
+	 * webcam never stops capturing. The lost connection is closed.
+	 */
+	void
+	takeOver (WebcamServerConnection& lost);
+
+	/// What the session is doing, for SERVER_MSG_SESSION_RESUMED
+	struct session_state
+	getSessionState ();
+
   // Error handlers
 
 	void
@@ -59,11 +110,19 @@ class WebcamServerConnection: public Connection
 
   // Client message handlers
 
+	void
+	handle_CLIENT_MSG_CLOSE_FRAME_RING      (message_t type, message_len_t len, void* data);
+	void
+	handle_CLIENT_MSG_CLOSE_MEDIA_CHANNEL   (message_t type, message_len_t len, void* data);
 	void
 	handle_CLIENT_MSG_CLOSE_WEBCAM          (message_t type, message_len_t len, void* data);
 	void
 	handle_CLIENT_MSG_GET_CURRENT_SPEC      (message_t type, message_len_t len, void* data);
 	void
+	handle_CLIENT_MSG_GET_SESSION           (message_t type, message_len_t len, void* data);
+	void
+	handle_CLIENT_MSG_GET_STATS             (message_t type, message_len_t len, void* data);
+	void
 	handle_CLIENT_MSG_GET_STREAM_STATUS     (message_t type, message_len_t len, void* data);
 	void
 	handle_CLIENT_MSG_GET_SUPPORTED_SPECS   (message_t type, message_len_t len, void* data);
@@ -72,8 +131,20 @@ class WebcamServerConnection: public Connection
 	void
 	handle_CLIENT_MSG_GET_WEBCAM_LIST       (message_t type, message_len_t len, void* data);
 	void
+	handle_CLIENT_MSG_JOIN_MULTICAST        (message_t type, message_len_t len, void* data);
+	void
+	handle_CLIENT_MSG_LEAVE_MULTICAST       (message_t type, message_len_t len, void* data);
+	void
+	handle_CLIENT_MSG_OPEN_FRAME_RING       (message_t type, message_len_t len, void* data);
+	void
+	handle_CLIENT_MSG_OPEN_MEDIA_CHANNEL    (message_t type, message_len_t len, void* data);
+	void
 	handle_CLIENT_MSG_OPEN_WEBCAM           (message_t type, message_len_t len, void* data);
 	void
+	handle_CLIENT_MSG_RECEIVE_REPORT        (message_t type, message_len_t len, void* data);
+	void
+	handle_CLIENT_MSG_RESUME_SESSION        (message_t type, message_len_t len, void* data);
+	void
 	handle_CLIENT_MSG_STOP_STREAM           (message_t type, message_len_t len, void* data);
 	void
 	handle_CLIENT_MSG_SET_CURRENT_SPEC      (message_t type, message_len_t len, void* data);
@@ -82,10 +153,163 @@ class WebcamServerConnection: public Connection
 
 };
 
+/**
+ * Serves webcams. Clients which ask for a session token can resume their
+ * session over a new connection if theirs is lost, finding the webcam
+ * still open and still capturing. A session outlives its connection by
+ * SESSION_LINGER_MS, holding on to everything the connection had.
+ */
 class WebcamServer: public Server
 {
+	struct Session
+	{
+		/// The connection the session belongs to, which may have finished
+		std::shared_ptr<WebcamServerConnection> connection;
+
+		/// When the connection was first seen finished, in milliseconds,
+		/// or 0 if it hasn't been
+		uint64_t finishedAt;
+	};
+
+	/// Every session, keyed by token
+	std::map<std::string, Session> sessions;
+
+	/// Mutex for the sessions
+	pthread_mutex_t sessionsMutex;
+
+	/// When the server was created, in milliseconds, for the uptime
+	const uint64_t startedAt;
+
+	/// Port to serve HTTP on, or 0 for none (see setHttpPort())
+	in_port_t httpPort;
+
+	/// Devices which may be served over HTTP (see setHttpDevices())
+	std::vector<std::string> httpDevices;
+
+	/// Serves HTTP while the server's running
+	std::shared_ptr<HttpListener> httpListener;
+
+	/// Loop for the HTTP listener if the server doesn't have one
+	std::shared_ptr<EventLoop> httpLoop;
+
+	/// How much bandwidth clients may have
+	BandwidthLimits bandwidthLimits;
+
+	/// Answers /limits (see setHttpPort())
+	void
+	serveLimits (std::shared_ptr<HttpConnection> connection, const HttpRequest& request);
+
+	/// Answers GET /mjpeg, on the loop's worker pool (see setHttpPort())
+	void
+	serveMjpeg (std::shared_ptr<HttpConnection> connection, const HttpRequest& request);
+
+	/**
+	 * Resolves a device asked for over HTTP, following links.
+	 *
+	 * @param device    The path asked for
+	 * @param resolved  Set to where it leads
+	 * @return          Whether it's a device which may be served
+	 */
+	bool
+	resolveHttpDevice (const std::string& device, std::string& resolved);
+
 	std::shared_ptr<Connection>
 	newConnection (int fd, in_addr_t remoteAddress, in_port_t remotePort);
+
+  protected:
+
+	/// Starts serving HTTP, if there's a port for it
+	void
+	started (std::shared_ptr<EventLoop> loop);
+
+	void
+	stopped ();
+
+  public:
+
+	/// How long a session is kept after its connection is lost, in
+	/// milliseconds
+	static const int SESSION_LINGER_MS = 10000;
+
+	/// See Server::Server()
+	WebcamServer (bool useEventLoop_ = true);
+
+	~WebcamServer ();
+
+	/// Starts a session for a connection, returning its token
+	std::string
+	openSession (std::shared_ptr<WebcamServerConnection> connection);
+
+	/**
+	 * Hands a session over to another connection.
+	 *
+	 * @param token     The session's token
+	 * @param claimant  The connection taking it over
+	 * @return          The connection the session belonged to, or nothing
+	 *                  if there's no such session
+	 */
+	std::shared_ptr<WebcamServerConnection>
+	claimSession (const std::string& token, std::shared_ptr<WebcamServerConnection> claimant);
+
+	/// Forgets a session, letting go of its connection
+	void
+	endSession (const std::string& token);
+
+	/**
+	 * Takes a snapshot of every connection's and every open webcam's
+	 * counters.
+	 *
+	 * @return The body of a SERVER_MSG_STATS
+	 */
+	std::string
+	getStats ();
+
+	/**
+	 * Serves HTTP from the server's own event loop, for clients which
+	 * can't speak the webcam protocol:
+	 *
+	 *  - /metrics: the server's counters and histograms, in Prometheus'
+	 *    text format
+	 *  - /mjpeg?device=/dev/video0: the webcam as MJPEG, for browsers and
+	 *    NVRs (see WebcamBroadcaster::addViewer()). Only the devices
+	 *    allowed by setHttpDevices() are served.
+	 *  - /ws: the webcam protocol itself, over a WebSocket, for clients
+	 *    in browsers (see Connection::enableWebSocket())
+	 *  - /limits: the bandwidth limits, in bytes per second. A POST or PUT
+	 *    from this machine can change them with client=, global=, or
+	 *    address=10.0.0.5&limit= (limit=default drops the override), in
+	 *    the query string or a form body. 0 means no limit.
+	 *
+	 * Takes effect at the next start().
+	 *
+	 * @param port  Port to listen on, or 0 not to
+	 */
+	void
+	setHttpPort (in_port_t port);
+
+	/**
+	 * Limits the webcams served over HTTP to a list, since anyone who can
+	 * reach the port (or get a browser to) can ask for one. Without a list,
+	 * any /dev/video* device is served.
+	 *
+	 * @param devices  Paths of the devices which may be served
+	 */
+	void
+	setHttpDevices (const std::vector<std::string>& devices);
+
+	/// The page served at /metrics
+	std::string
+	getMetrics ();
+
+	/// How much bandwidth clients may have, which can be changed while
+	/// they're connected
+	BandwidthLimits&
+	getBandwidthLimits ();
+
+	/// Also lets go of sessions whose connections have been gone for
+	/// longer than SESSION_LINGER_MS
+	void
+	reapConnections ();
 };
 
 #endif // WEBCAM_SERVER_H
@@ -1,4 +1,5 @@
 #include <cstddef>
+#include <pthread.h>
 #include <stdexcept>
 #include <string>
 #include <utility>   // pair
@@ -37,6 +38,21 @@ class WebcamViewer {
 	SDL_Renderer *renderer;
 	SDL_Texture  *canvas;
 
+	/// Whether the canvas is locked and lent out (see borrowCanvas())
+	bool canvasLent;
+
+	/// Bytes per row of the canvas, as of the last time it was locked, or
+	/// 0 if it hasn't been yet
+	int canvasPitch;
+
+	/// Mutex for the canvas and the renderer, which frames can reach from
+	/// several threads at once
+	pthread_mutex_t canvasMutex;
+
+	/// Draws the canvas to the window. Needs the canvas mutex.
+	void
+	present ();
+
   public:
 
 	/**
@@ -102,12 +118,35 @@ class WebcamViewer {
 	 * Draws a frame to the screen
 	 * @param  sourceBuffer   The image data to draw
 	 * @param  sourceLength   The size of the image buffer
+	 * @param  sourcePitch    Bytes per row in the image buffer, if they may
+	 *                        differ from SDL's (0 if not)
 	 * @throws runtime_error  If sourceLength doesn't match the destination
 	 *                        image buffer, calculated by the image height and
-	 *                        pitch (bytes per row) given by SDL.
+	 *                        pitch (bytes per row) given by SDL or the source.
+	 */
+	void
+	showFrame (void* sourceBuffer, size_t sourceLength, size_t sourcePitch = 0);
+
+	/**
+	 * Lends out the canvas's pixels, so a frame can be read straight into
+	 * them instead of being copied in by showFrame(). Until returnCanvas()
+	 * is called, showing frames or changing the image size or format
+	 * throws.
+	 *
+	 * @param  length  The size of the image which is going to be written
+	 * @param  pitch   Set to the bytes per row the image must have
+	 * @return         The pixels, or NULL if the image isn't the canvas's
+	 *                 size or the canvas is lent out already
+	 */
+	void*
+	borrowCanvas (size_t length, int& pitch);
+
+	/**
+	 * Takes back the canvas lent out by borrowCanvas()
+	 * @param  show  Whether to draw what's been written to the screen
 	 */
 	void
-	showFrame (void* sourceBuffer, size_t sourceLength);
+	returnCanvas (bool show);
 
 	/**
  	 * Converts a Video4Linux image format to its equivalent SDL image formats, if
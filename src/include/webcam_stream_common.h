@@ -1,10 +1,18 @@
 #ifndef WEBCAM_STREAM_COMMON
 #define WEBCAM_STREAM_COMMON
 
+#include <endian.h>     // htobe64
 #include <netinet/in.h> // in_addr_t, in_port_t
 #include <sstream>
 #include <string>
 
+/*
+ * Every struct below goes over the wire in network byte order. Those with a
+ * swapByteOrder() are filled in in host byte order and swapped just before
+ * sending, and receivers swap their copy before reading it (the conversion
+ * is its own inverse). The rest are converted a field at a time.
+ */
+
 struct image_spec
 {
 	uint32_t width;
@@ -12,8 +20,275 @@ struct image_spec
 	uint32_t fmt;
 };
 
+/// Version of frame_header sent by this code. (Version 1 frames were just
+/// the image, with no header.)
+const uint8_t FRAME_HEADER_VERSION = 2;
+
+/// frame_header.flags: the frame stands on its own
+const uint16_t FRAME_FLAG_KEY        = 0x0001;
+
+/// frame_header.flags: the frame only makes sense on top of earlier ones
+const uint16_t FRAME_FLAG_DELTA      = 0x0002;
+
+/// frame_header.flags: the image is compressed (e.g. MJPEG), so its length
+/// varies and it has no stride
+const uint16_t FRAME_FLAG_COMPRESSED = 0x0004;
+
+/**
+ * Precedes the image in every SERVER_MSG_FRAME, however the frame is
+ * delivered, so that each frame says what it is. All fields are in network
+ * byte order.
+ *
+ * Later versions may add fields at the end; the image starts headerLength
+ * bytes in, whatever the version.
+ */
+struct frame_header
+{
+	/// FRAME_HEADER_VERSION, as of the sender
+	uint8_t version;
+
+	/// Bytes from the start of this header to the image
+	uint8_t headerLength;
+
+	/// FRAME_FLAG_* bits
+	uint16_t flags;
+
+	/// Which webcam on the server the frame came from
+	uint32_t streamId;
+
+	/// Counts every frame the webcam captured, whether this receiver got
+	/// it or not, so gaps show how many were skipped
+	uint64_t sequence;
+
+	/// When the frame was captured, in microseconds since the epoch (by
+	/// the server's clock)
+	uint64_t timestamp;
+
+	/// What the image looks like; the same as a struct image_spec
+	uint32_t width;
+	uint32_t height;
+	uint32_t fmt;
+
+	/// Bytes from the start of one row to the next, or 0 if compressed
+	uint32_t stride;
+};
+
+struct media_channel_spec
+{
+	/// UDP port the client is receiving on
+	uint16_t port;
+
+	/// Data fragments per parity fragment, or 0 for no parity
+	uint8_t fecGroupSize;
+
+	uint8_t reserved;
+};
+
 const in_port_t DEFAULT_PORT = 32123;
 
+/// First multicast group handed out (239.255.42.1, host byte order).
+/// Each webcam gets the next one up.
+const uint32_t DEFAULT_MULTICAST_GROUP = 0xEFFF2A01;
+
+const in_port_t DEFAULT_MULTICAST_PORT = 32124;
+
+struct multicast_spec
+{
+	/// IPv4 address of the group
+	uint32_t group;
+
+	/// UDP port frames are sent to
+	uint16_t port;
+
+	/// Data fragments per parity fragment, or 0 for no parity
+	uint8_t fecGroupSize;
+
+	uint8_t reserved;
+
+	/// IPv4 address the frames are sent from
+	uint32_t source;
+
+	/// What the frames look like
+	struct image_spec image;
+};
+
+struct receive_report
+{
+	/// Frames received since the connection opened (wraps around)
+	uint32_t framesReceived;
+
+	uint32_t reserved;
+
+	/// Bytes of frames received since the connection opened
+	uint64_t bytesReceived;
+};
+
+/// How often a client sends a receive report while frames are arriving
+const int RECEIVE_REPORT_INTERVAL_MS = 500;
+
+/// Identifies a session on the server, so that a client which loses its
+/// connection can pick the session back up over a new one
+struct session_token
+{
+	uint8_t bytes[16];
+};
+
+/// session_state.flags: frames are being sent to the client
+const uint32_t SESSION_FLAG_STREAMING     = 0x0001;
+
+/// session_state.flags: frames go over the client's media channel
+const uint32_t SESSION_FLAG_MEDIA_CHANNEL = 0x0002;
+
+/// session_state.flags: the client is a member of the multicast group
+const uint32_t SESSION_FLAG_MULTICAST     = 0x0004;
+
+/// session_state.flags: the client reads frames from the frame ring
+const uint32_t SESSION_FLAG_FRAME_RING    = 0x0008;
+
+/// What a resumed session was left doing
+struct session_state
+{
+	/// The webcam's current spec, or all zeroes if no webcam is open
+	struct image_spec image;
+
+	/// SESSION_FLAG_* bits
+	uint32_t flags;
+};
+
+inline void
+swapByteOrder (struct image_spec& spec)
+{
+	spec.width  = htonl(spec.width);
+	spec.height = htonl(spec.height);
+	spec.fmt    = htonl(spec.fmt);
+}
+
+inline void
+swapByteOrder (struct media_channel_spec& spec)
+{
+	spec.port = htons(spec.port);
+}
+
+inline void
+swapByteOrder (struct multicast_spec& spec)
+{
+	spec.group  = htonl(spec.group);
+	spec.port   = htons(spec.port);
+	spec.source = htonl(spec.source);
+	swapByteOrder(spec.image);
+}
+
+inline void
+swapByteOrder (struct receive_report& report)
+{
+	report.framesReceived = htonl(report.framesReceived);
+	report.bytesReceived  = htobe64(report.bytesReceived);
+}
+
+inline void
+swapByteOrder (struct session_state& state)
+{
+	swapByteOrder(state.image);
+	state.flags = htonl(state.flags);
+}
+
+/// Version of the stats structs sent by this code
+const uint8_t STATS_VERSION = 1;
+
+/**
+ * Starts every SERVER_MSG_STATS. It's followed by numConnections
+ * connection_stats, then numWebcams webcam_stats. All fields are in network
+ * byte order.
+ *
+ * Later versions may add fields to the end of any of the structs, so
+ * readers step through them using the lengths given here.
+ */
+struct stats_header
+{
+	/// STATS_VERSION, as of the sender
+	uint8_t version;
+
+	/// Bytes from the start of this header to the first connection_stats
+	uint8_t headerLength;
+
+	/// Size of each connection_stats
+	uint16_t connectionStatsLength;
+
+	/// Size of each webcam_stats
+	uint16_t webcamStatsLength;
+
+	uint16_t reserved;
+
+	uint32_t numConnections;
+	uint32_t numWebcams;
+
+	/// How long the server has been running, in milliseconds
+	uint64_t uptimeMs;
+};
+
+/// Counters for one connection to the server
+struct connection_stats
+{
+	/// IPv4 address of the client; 127.0.0.1 over a unix socket
+	uint32_t remoteAddress;
+	uint16_t remotePort;
+
+	/// 1 if the client is on a unix socket
+	uint8_t local;
+
+	uint8_t reserved;
+
+	uint64_t bytesIn;
+	uint64_t bytesOut;
+	uint64_t messagesIn;
+	uint64_t messagesOut;
+	uint64_t framesSent;
+	uint64_t framesDropped;
+
+	/// Bytes waiting to be sent
+	uint64_t queuedBytes;
+
+	/// Messages waiting to be sent
+	uint32_t queueDepth;
+
+	/// Smoothed time from queueing a message to the kernel taking it
+	uint32_t sendLatencyUs;
+};
+
+/// Counters for one open webcam
+struct webcam_stats
+{
+	/// Device path, NUL terminated (and truncated if need be)
+	char device[64];
+
+	/// frame_header.streamId of its frames
+	uint32_t streamId;
+
+	/// Connections with it open, and how many of them are streaming
+	uint32_t subscribers;
+	uint32_t streaming;
+
+	/// Frames per second being captured, times 1000; 0 while stopped
+	uint32_t captureMilliFps;
+
+	uint64_t framesCaptured;
+
+	/// Frames the driver dropped because nothing took them in time
+	uint64_t framesDropped;
+
+	/// Frames copied out of the driver's buffers to free them up
+	uint64_t framesCopied;
+
+	/// Driver buffers held by connections, out of how many there are
+	uint32_t buffersInFlight;
+	uint32_t numBuffers;
+};
+
+/**
+ * Message types. The numbers go over the wire, so they're given explicitly:
+ * never change one, and give a new message the next number up (44), wherever
+ * it's listed.
+ */
 enum WEBCAM_SOCKET_MSG_ENUM
 {
 	/**
@@ -21,7 +296,7 @@ enum WEBCAM_SOCKET_MSG_ENUM
 	 *
 	 * @param <uint32_t> The message ID that was received
 	 */
-	ERROR_MSG_INVALID_MSG,
+	ERROR_MSG_INVALID_MSG = 0,
 
 	/**
 	 * The server or client needs to terminate the connection;
@@ -29,7 +304,7 @@ enum WEBCAM_SOCKET_MSG_ENUM
 	 *
 	 * @param none
 	 */
-	ERROR_MSG_TERMINATING_CONNECTION,
+	ERROR_MSG_TERMINATING_CONNECTION = 1,
 
   /// @name Client messages
   /// Control messages sent from the WebcamClient to the WebcamServer.
@@ -43,7 +318,7 @@ enum WEBCAM_SOCKET_MSG_ENUM
 	 * @return SERVER_MSG_WEBCAM_IS_OPENED
 	 * @return SERVER_MSG_WEBCAM_IS_CLOSED
 	 */
-	CLIENT_MSG_GET_WEBCAM_STATUS,
+	CLIENT_MSG_GET_WEBCAM_STATUS = 2,
 
 	/**
 	 * Ask for list of available webcam devices.
@@ -52,7 +327,31 @@ enum WEBCAM_SOCKET_MSG_ENUM
 	 *
 	 * @return SERVER_MSG_WEBCAM_LIST
 	 */
-	CLIENT_MSG_GET_WEBCAM_LIST,
+	CLIENT_MSG_GET_WEBCAM_LIST = 3,
+
+	/**
+	 * Asks the server to publish the open webcam's frames to a multicast
+	 * group, which every viewer on the LAN can join. The frame is sent once
+	 * no matter how many viewers there are. Frames stop coming over this
+	 * connection (or its media channel) while the client is a member.
+	 *
+	 * @param none
+	 *
+	 * @return SERVER_MSG_MULTICAST_GROUP
+	 * @throws SERVER_ERR_NO_WEBCAM_OPENED   If no webcam has been opened
+	 * @throws SERVER_ERR_RUNTIME_ERROR      If the group couldn't be set up
+	 */
+	CLIENT_MSG_JOIN_MULTICAST = 24,
+
+	/**
+	 * Tells the server this client no longer needs the multicast group.
+	 * The server stops publishing once the last member leaves.
+	 *
+	 * @param none
+	 *
+	 * @return SERVER_MSG_MULTICAST_IS_LEFT
+	 */
+	CLIENT_MSG_LEAVE_MULTICAST = 25,
 
 	/**
 	 * Request that a webcam be opened.
@@ -71,7 +370,36 @@ enum WEBCAM_SOCKET_MSG_ENUM
 	 * @throws SERVER_ERR_WEBCAM_UNAVAILABLE  If there is an error opening the
 	 *                                        webcam; e.g. it's busy
 	 */
-	CLIENT_MSG_OPEN_WEBCAM,
+	CLIENT_MSG_OPEN_WEBCAM = 4,
+
+	/**
+	 * Asks the server to send frames over UDP instead of this connection.
+	 * Frames are split into datagrams (see MediaChannel.h), so a lost packet
+	 * costs one frame instead of holding up every frame behind it. Everything
+	 * else still goes over this connection.
+	 *
+	 * @param <struct media_channel_spec> Where to send frames, and how much
+	 *                                    parity to add
+	 *
+	 * @return SERVER_MSG_MEDIA_CHANNEL_IS_OPENED
+	 * @throws SERVER_ERR_RUNTIME_ERROR  If the channel couldn't be set up
+	 */
+	CLIENT_MSG_OPEN_MEDIA_CHANNEL = 26,
+
+	/**
+	 * Asks the server to publish the open webcam's frames to a ring in
+	 * shared memory, which any number of processes on the server's host can
+	 * read without copying. Only works over a unix domain socket. Frames stop
+	 * coming over this connection while the ring is open.
+	 *
+	 * @param none
+	 *
+	 * @return SERVER_MSG_FRAME_RING
+	 * @throws SERVER_ERR_NO_WEBCAM_OPENED   If no webcam has been opened
+	 * @throws SERVER_ERR_RUNTIME_ERROR      If this isn't a local connection,
+	 *                                       or the ring couldn't be set up
+	 */
+	CLIENT_MSG_OPEN_FRAME_RING = 27,
 
 	/**
 	 * Request that a webcam be closed.
@@ -84,7 +412,27 @@ enum WEBCAM_SOCKET_MSG_ENUM
 	 * @return SERVER_MSG_WEBCAM_IS_CLOSED
 	 * @return SERVER_MSG_STREAM_IS_STOPPED
 	 */
-	CLIENT_MSG_CLOSE_WEBCAM,
+	CLIENT_MSG_CLOSE_WEBCAM = 5,
+
+	/**
+	 * Asks the server to stop sending frames over UDP. They go back to being
+	 * sent over this connection.
+	 *
+	 * @param none
+	 *
+	 * @return SERVER_MSG_MEDIA_CHANNEL_IS_CLOSED
+	 */
+	CLIENT_MSG_CLOSE_MEDIA_CHANNEL = 28,
+
+	/**
+	 * Tells the server this client is done with the frame ring. The server
+	 * stops publishing to it once the last reader is done.
+	 *
+	 * @param none
+	 *
+	 * @return SERVER_MSG_FRAME_RING_IS_CLOSED
+	 */
+	CLIENT_MSG_CLOSE_FRAME_RING = 29,
 
 	/**
 	 * Query whether the server is streaming data from an open webcam.
@@ -94,7 +442,7 @@ enum WEBCAM_SOCKET_MSG_ENUM
 	 * @return SERVER_MSG_STREAM_IS_STARTED
 	 * @return SERVER_MSG_STREAM_IS_STOPPED
 	 */
-	CLIENT_MSG_GET_STREAM_STATUS,
+	CLIENT_MSG_GET_STREAM_STATUS = 6,
 
 	/**
 	 * Query the current image specification
@@ -105,7 +453,7 @@ enum WEBCAM_SOCKET_MSG_ENUM
 	 * @return SERVER_MSG_IMAGE_SPEC
 	 * @throws SERVER_ERR_NO_WEBCAM_OPENED   If no webcam has been opened
 	 */
-	CLIENT_MSG_GET_CURRENT_SPEC,
+	CLIENT_MSG_GET_CURRENT_SPEC = 7,
 
 	/**
 	 * Enumerate all available image specifications
@@ -116,10 +464,11 @@ enum WEBCAM_SOCKET_MSG_ENUM
 	 * @return SERVER_MSG_SUPPORTED_SPECS
 	 * @throws SERVER_ERR_NO_WEBCAM_OPENED   If no webcam has been opened
 	 */
-	CLIENT_MSG_GET_SUPPORTED_SPECS,
+	CLIENT_MSG_GET_SUPPORTED_SPECS = 8,
 
 	/**
-	 * Change the current image specification.
+	 * Change the current image specification. The webcam may be shared with
+	 * other clients, which are each sent SERVER_MSG_IMAGE_SPEC as well.
 	 *
 	 * @param <struct image_spec> The new image specification
 	 *
@@ -128,7 +477,7 @@ enum WEBCAM_SOCKET_MSG_ENUM
 	 *                                       by SERVER_MSG_SUPPORTED_SPECS
 	 * @throws SERVER_ERR_NO_WEBCAM_OPENED   If no webcam has been opened
 	 */
-	CLIENT_MSG_SET_CURRENT_SPEC,
+	CLIENT_MSG_SET_CURRENT_SPEC = 9,
 
 	/**
 	 * Asks the server to start streaming frames.
@@ -138,7 +487,7 @@ enum WEBCAM_SOCKET_MSG_ENUM
 	 * @return SERVER_MSG_STREAM_IS_STARTED
 	 * @throws SERVER_ERR_NO_WEBCAM_OPENED   If no webcam has been opened
 	 */
-	CLIENT_MSG_START_STREAM,
+	CLIENT_MSG_START_STREAM = 10,
 
 	/**
 	 * Asks the server to stop sending frames.
@@ -147,20 +496,88 @@ enum WEBCAM_SOCKET_MSG_ENUM
 	 *
 	 * @return SERVER_MSG_STREAM_IS_STOPPED
 	 */
-	CLIENT_MSG_STOP_STREAM,
+	CLIENT_MSG_STOP_STREAM = 11,
+
+	/**
+	 * Tells the server how many frames have arrived, so it can tell how fast
+	 * they're getting through and send fewer if the link can't keep up.
+	 * Sent every RECEIVE_REPORT_INTERVAL_MS or so while frames are arriving.
+	 *
+	 * @param <struct receive_report> Totals since the connection opened
+	 *
+	 * @return nothing
+	 */
+	CLIENT_MSG_RECEIVE_REPORT = 30,
+
+	/**
+	 * Asks for this connection's session token. If the connection is lost,
+	 * the token can be passed to CLIENT_MSG_RESUME_SESSION over a new one
+	 * to carry on where this one left off.
+	 *
+	 * @param none
+	 *
+	 * @return SERVER_MSG_SESSION
+	 */
+	CLIENT_MSG_GET_SESSION = 31,
+
+	/**
+	 * Takes over the session of a lost connection: its webcam, the spec,
+	 * its stream, and where frames were going. The webcam isn't closed or
+	 * stopped in between, so frames carry on with the next one captured.
+	 * The lost connection, if the server hadn't noticed yet, is closed.
+	 *
+	 * Sessions are kept for a while after their connection goes (see
+	 * WebcamServer::SESSION_LINGER_MS).
+	 *
+	 * @param <struct session_token> The token from SERVER_MSG_SESSION
+	 *
+	 * @return SERVER_MSG_SESSION_RESUMED
+	 * @throws SERVER_ERR_NO_SUCH_SESSION  If the session has expired, or
+	 *                                     never existed
+	 */
+	CLIENT_MSG_RESUME_SESSION = 32,
+
+	/**
+	 * Asks for a snapshot of the server's counters: every connection's
+	 * traffic and queue, and every open webcam's capture.
+	 *
+	 * @param none
+	 *
+	 * @return SERVER_MSG_STATS
+	 */
+	CLIENT_MSG_GET_STATS = 33,
 
   ///@}
 
-  /// @name Client messages
-  /// Control messages sent from the WebcamClient to the WebcamServer.
+  /// @name Server messages
+  /// Replies and frames sent from the WebcamServer to the WebcamClient.
   ///@{
 
 	/**
-	 * A single frame captured by the camera.
+	 * A single frame captured by the camera. The header describes the
+	 * image, which may not be in the spec last announced: a spec change
+	 * can overtake frames captured before it, or lag behind the frames
+	 * captured after it.
 	 *
-	 * @param Raw binary data conforming to the current image specification
+	 * @param <struct frame_header> What the frame is, followed by the image
+	 */
+	SERVER_MSG_FRAME = 12,
+
+	/**
+	 * Frames from the open webcam are being published to a ring in shared
+	 * memory. The ring's memfd comes with this message (see FrameRing.h).
+	 * This is sent again, with a new ring, if frames outgrow the old one.
+	 *
+	 * @param <struct image_spec> What the frames look like
+	 */
+	SERVER_MSG_FRAME_RING = 34,
+
+	/**
+	 * Frames are no longer being published to a ring for this client.
+	 *
+	 * @param none
 	 */
-	SERVER_MSG_FRAME,
+	SERVER_MSG_FRAME_RING_IS_CLOSED = 35,
 
 	/**
 	 * The current specification (pixel format and resolution) of frames that
@@ -168,7 +585,60 @@ enum WEBCAM_SOCKET_MSG_ENUM
 	 *
 	 * @param <struct image_spec> The current specification
 	 */
-	SERVER_MSG_IMAGE_SPEC,
+	SERVER_MSG_IMAGE_SPEC = 13,
+
+	/**
+	 * Frames are being sent over this connection.
+	 *
+	 * @param none
+	 */
+	SERVER_MSG_MEDIA_CHANNEL_IS_CLOSED = 36,
+
+	/**
+	 * Frames are being sent over UDP, to the port the client asked for.
+	 *
+	 * @param none
+	 */
+	SERVER_MSG_MEDIA_CHANNEL_IS_OPENED = 37,
+
+	/**
+	 * Frames from the open webcam are being published to a multicast group.
+	 * Join it (on the interface this connection uses) to receive them.
+	 *
+	 * @param <struct multicast_spec> The group and stream parameters
+	 */
+	SERVER_MSG_MULTICAST_GROUP = 38,
+
+	/**
+	 * The client is no longer counted as a member of the multicast group.
+	 *
+	 * @param none
+	 */
+	SERVER_MSG_MULTICAST_IS_LEFT = 39,
+
+	/**
+	 * This connection's session token. It stays the same if the session is
+	 * resumed over another connection.
+	 *
+	 * @param <struct session_token> The token
+	 */
+	SERVER_MSG_SESSION = 40,
+
+	/**
+	 * The session has been taken over by this connection, and everything
+	 * in it carries on from here.
+	 *
+	 * @param <struct session_state> What the session was doing
+	 */
+	SERVER_MSG_SESSION_RESUMED = 41,
+
+	/**
+	 * A snapshot of the server's counters.
+	 *
+	 * @param <struct stats_header> Followed by the connection_stats and
+	 *                              webcam_stats it counts
+	 */
+	SERVER_MSG_STATS = 42,
 
 	/**
 	 * The opened webcam is currently sending SERVER_MSG_FRAME messages as
@@ -176,7 +646,7 @@ enum WEBCAM_SOCKET_MSG_ENUM
 	 *
 	 * @param none
 	 */
-	SERVER_MSG_STREAM_IS_STARTED,
+	SERVER_MSG_STREAM_IS_STARTED = 14,
 
 	/**
 	 * No stream is running; in particular, if a stream was previously active,
@@ -184,14 +654,14 @@ enum WEBCAM_SOCKET_MSG_ENUM
 	 *
 	 * @param none
 	 */
-	SERVER_MSG_STREAM_IS_STOPPED,
+	SERVER_MSG_STREAM_IS_STOPPED = 15,
 
 	/**
 	 * A list of legal image specifications the webcam is capable of supplying.
 	 *
 	 * @param <struct image_spec[]> An array of supported image specifications
 	 */
-	SERVER_MSG_SUPPORTED_SPECS,
+	SERVER_MSG_SUPPORTED_SPECS = 16,
 
 	/**
 	 * Any previously-opened webcam is now closed, or no webcam was open in
@@ -199,14 +669,14 @@ enum WEBCAM_SOCKET_MSG_ENUM
 	 *
 	 * @param none
 	 */
-	SERVER_MSG_WEBCAM_IS_CLOSED,
+	SERVER_MSG_WEBCAM_IS_CLOSED = 17,
 
 	/**
 	 * A webcam is open and available for streaming.
 	 *
 	 * @param <char[]> The name of the open webcam
 	 */
-	SERVER_MSG_WEBCAM_IS_OPENED,
+	SERVER_MSG_WEBCAM_IS_OPENED = 18,
 
 	/**
 	 * A list of webcams available to be opened.
@@ -215,7 +685,7 @@ enum WEBCAM_SOCKET_MSG_ENUM
 	 *                   strings, the last of which followed by a second '\0'
 	 *                   character.
 	 */
-	SERVER_MSG_WEBCAM_LIST,
+	SERVER_MSG_WEBCAM_LIST = 19,
 
 	/**
 	 * The previous call to CLIENT_MSG_SET_CURRENT_SPEC failed because it
@@ -223,14 +693,22 @@ enum WEBCAM_SOCKET_MSG_ENUM
 	 *
 	 * @param none
 	 */
-	SERVER_ERR_INVALID_SPEC,
+	SERVER_ERR_INVALID_SPEC = 20,
 
 	/**
 	 * The previous message failed because no webcam is currently opened.
 	 *
 	 * @param none
 	 */
-	SERVER_ERR_NO_WEBCAM_OPENED,
+	SERVER_ERR_NO_WEBCAM_OPENED = 21,
+
+	/**
+	 * The previous call to CLIENT_MSG_RESUME_SESSION failed because there
+	 * is no such session (any more). Start over as a new client.
+	 *
+	 * @param none
+	 */
+	SERVER_ERR_NO_SUCH_SESSION = 43,
 
 	/**
 	 * The server experienced an internal runtime error. It isn't necessarily
@@ -238,7 +716,7 @@ enum WEBCAM_SOCKET_MSG_ENUM
 	 * 
 	 * @param <char[]> The error message string
 	 */
-	SERVER_ERR_RUNTIME_ERROR,
+	SERVER_ERR_RUNTIME_ERROR = 22,
 
 	/**
 	 * The previous call to CLIENT_MSG_OPEN_WEBCAM failed because the webcam
@@ -246,7 +724,7 @@ enum WEBCAM_SOCKET_MSG_ENUM
 	 *
 	 * @param <char[]> The webcam the client tried to open
 	 */
-	SERVER_ERR_WEBCAM_UNAVAILABLE,
+	SERVER_ERR_WEBCAM_UNAVAILABLE = 23,
 
   ///@}
 };
@@ -266,18 +744,37 @@ webcamSocketMsgToString (uint32_t messageId)
 		DEFINE_MSG ( ERROR_MSG_TERMINATING_CONNECTION );
 
 		DEFINE_MSG ( CLIENT_MSG_CLOSE_WEBCAM          );
+		DEFINE_MSG ( CLIENT_MSG_CLOSE_MEDIA_CHANNEL   );
+		DEFINE_MSG ( CLIENT_MSG_CLOSE_FRAME_RING      );
 		DEFINE_MSG ( CLIENT_MSG_GET_CURRENT_SPEC      );
+		DEFINE_MSG ( CLIENT_MSG_GET_SESSION           );
+		DEFINE_MSG ( CLIENT_MSG_GET_STATS             );
 		DEFINE_MSG ( CLIENT_MSG_GET_STREAM_STATUS     );
 		DEFINE_MSG ( CLIENT_MSG_GET_SUPPORTED_SPECS   );
 		DEFINE_MSG ( CLIENT_MSG_GET_WEBCAM_STATUS     );
 		DEFINE_MSG ( CLIENT_MSG_GET_WEBCAM_LIST       );
+		DEFINE_MSG ( CLIENT_MSG_JOIN_MULTICAST        );
+		DEFINE_MSG ( CLIENT_MSG_LEAVE_MULTICAST       );
 		DEFINE_MSG ( CLIENT_MSG_OPEN_WEBCAM           );
+		DEFINE_MSG ( CLIENT_MSG_OPEN_MEDIA_CHANNEL    );
+		DEFINE_MSG ( CLIENT_MSG_OPEN_FRAME_RING       );
+		DEFINE_MSG ( CLIENT_MSG_RECEIVE_REPORT        );
+		DEFINE_MSG ( CLIENT_MSG_RESUME_SESSION        );
 		DEFINE_MSG ( CLIENT_MSG_STOP_STREAM           );
 		DEFINE_MSG ( CLIENT_MSG_SET_CURRENT_SPEC      );
 		DEFINE_MSG ( CLIENT_MSG_START_STREAM          );
 
 		DEFINE_MSG ( SERVER_MSG_FRAME                 );
+		DEFINE_MSG ( SERVER_MSG_FRAME_RING            );
+		DEFINE_MSG ( SERVER_MSG_FRAME_RING_IS_CLOSED  );
 		DEFINE_MSG ( SERVER_MSG_IMAGE_SPEC            );
+		DEFINE_MSG ( SERVER_MSG_MEDIA_CHANNEL_IS_CLOSED );
+		DEFINE_MSG ( SERVER_MSG_MEDIA_CHANNEL_IS_OPENED );
+		DEFINE_MSG ( SERVER_MSG_MULTICAST_GROUP       );
+		DEFINE_MSG ( SERVER_MSG_MULTICAST_IS_LEFT     );
+		DEFINE_MSG ( SERVER_MSG_SESSION               );
+		DEFINE_MSG ( SERVER_MSG_SESSION_RESUMED       );
+		DEFINE_MSG ( SERVER_MSG_STATS                 );
 		DEFINE_MSG ( SERVER_MSG_STREAM_IS_STARTED     );
 		DEFINE_MSG ( SERVER_MSG_STREAM_IS_STOPPED     );
 		DEFINE_MSG ( SERVER_MSG_SUPPORTED_SPECS       );
@@ -286,6 +783,7 @@ webcamSocketMsgToString (uint32_t messageId)
 		DEFINE_MSG ( SERVER_MSG_WEBCAM_LIST           );
 		DEFINE_MSG ( SERVER_ERR_INVALID_SPEC          );
 		DEFINE_MSG ( SERVER_ERR_NO_WEBCAM_OPENED      );
+		DEFINE_MSG ( SERVER_ERR_NO_SUCH_SESSION       );
 		DEFINE_MSG ( SERVER_ERR_RUNTIME_ERROR         );
 		DEFINE_MSG ( SERVER_ERR_WEBCAM_UNAVAILABLE    );
 
@@ -11,7 +11,7 @@ using namespace std;
 void
 usage (char* basename)
 {
-	cout << "Usage: " << basename << " [port]" << endl;
+	cout << "Usage: " << basename << " [address or unix socket path] [port]" << endl;
 }
 
 int
@@ -38,10 +38,13 @@ main (int argc, char* args[]) {
 		}
 
 		WebcamClient client;
-		shared_ptr<Connection> conn = client.connect(address, port);
-		//shared_ptr<WebcamClientConnection> conn =
-		//	dynamic_pointer_cast<WebcamClientConnection, Connection>
-		//	();
+		// A path means the server is on this host, listening on a unix
+		// domain socket
+		shared_ptr<Connection> conn = address.find('/') != string::npos
+			? client.connectUnix(address)
+			: client.connect(address, port);
+		shared_ptr<WebcamClientConnection> webcamConn =
+			dynamic_pointer_cast<WebcamClientConnection, Connection>(conn);
 
 		string input;
 		do {
@@ -53,13 +56,47 @@ main (int argc, char* args[]) {
 				conn->sendMessage(CLIENT_MSG_STOP_STREAM);
 			} else if (input == "open") {
 				conn->sendMessage(CLIENT_MSG_OPEN_WEBCAM, "/dev/video0");
+			} else if (input == "go") {
+				webcamConn->startStream("/dev/video0");
 			} else if (input == "close") {
 				conn->sendMessage(CLIENT_MSG_CLOSE_WEBCAM);
 			} else if (input == "getspec") {
 				conn->sendMessage(CLIENT_MSG_GET_CURRENT_SPEC);
+			} else if (input == "udp") {
+				webcamConn->openMediaChannel();
+			} else if (input == "udpfec") {
+				webcamConn->openMediaChannel(8);
+			} else if (input == "tcp") {
+				webcamConn->closeMediaChannel();
+			} else if (input == "join") {
+				conn->sendMessage(CLIENT_MSG_JOIN_MULTICAST);
+			} else if (input == "leave") {
+				conn->sendMessage(CLIENT_MSG_LEAVE_MULTICAST);
+			} else if (input == "ring") {
+				conn->sendMessage(CLIENT_MSG_OPEN_FRAME_RING);
+			} else if (input == "unring") {
+				conn->sendMessage(CLIENT_MSG_CLOSE_FRAME_RING);
+			} else if (input.compare(0, 7, "jitter ") == 0) {
+				// jitter <ms> [latest]
+				istringstream iss(input.substr(7));
+				int targetLatency = 0;
+				string mode;
+				iss >> targetLatency >> mode;
+				webcamConn->setJitterBuffer(targetLatency, mode == "latest");
+			} else if (input == "jitterstats") {
+				shared_ptr<JitterBuffer> jitterBuffer = webcamConn->getJitterBuffer();
+				if (jitterBuffer) {
+					MESSAGE("Frames presented: " << jitterBuffer->getFramesPresented()
+					     << ", late: " << jitterBuffer->getFramesLate()
+					     << ", dropped: " << jitterBuffer->getFramesDropped());
+				} else {
+					MESSAGE("The jitter buffer is off");
+				}
 			} else if (input == "exit") {
+				// Don't come back when the server hangs up
+				client.setAutoReconnect(false);
 				conn->sendMessage(ERROR_MSG_TERMINATING_CONNECTION);
-				exit;
+				break;
 			} else {
 				MESSAGE("Unknown command " << input);
 			}
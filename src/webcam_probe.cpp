@@ -0,0 +1,163 @@
+#include <cstring>      // memcpy()
+#include <future>       // promise
+#include <iostream>     // cout
+#include <memory>       // shared_ptr
+#include <sstream>      // istringstream
+#include <stdexcept>    // exceptions
+#include <string>       // strings
+#include <time.h>       // clock_gettime()
+
+#include "Coroutines.h"
+#include "Log.h"
+#include "Sockets.h"
+
+#include "webcam_stream_common.h"
+
+using namespace std;
+
+/**
+ * Opens a webcam on a server, streams a number of frames from it, and
+ * reports how fast they came. It's written as a coroutine, so the steps
+ * read in order even though nothing blocks waiting for the server.
+ */
+
+class ProbeClient: public Client
+{
+	shared_ptr<EventLoop> executor;
+
+  public:
+	ProbeClient (shared_ptr<EventLoop> executor_):
+		executor (executor_)
+	{ }
+
+	shared_ptr<Connection>
+	newConnection (int fd, in_addr_t remoteAddress, in_port_t remotePort)
+	{
+		return shared_ptr<Connection>(new CoConnection(fd, remoteAddress, remotePort, executor));
+	}
+};
+
+static double
+monotonicSeconds ()
+{
+	timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/// Throws unless a reply is the one expected
+static void
+expect (const Connection::Reply& reply, message_t expected)
+{
+	if (reply.type != expected)
+	{
+		THROW_ERROR("Expected " << webcamSocketMsgToString(expected)
+		         << ", got " << webcamSocketMsgToString(reply.type)
+		         << (reply.type == REQUEST_COMPLETE_MESSAGE ? "" :
+		             ": " + string(reply.body.begin(), reply.body.end())));
+	}
+}
+
+static Task<void>
+probe (shared_ptr<CoConnection> conn, string device, int numFrames, promise<void>* done)
+{
+	try
+	{
+		expect(co_await conn->roundTrip(CLIENT_MSG_OPEN_WEBCAM, device),
+		       SERVER_MSG_WEBCAM_IS_OPENED);
+
+		Connection::Reply reply = co_await conn->roundTrip(CLIENT_MSG_GET_CURRENT_SPEC);
+		expect(reply, SERVER_MSG_IMAGE_SPEC);
+		struct image_spec spec;
+		memcpy(&spec, &reply.body[0], sizeof(spec));
+		swapByteOrder(spec);
+		MESSAGE("Webcam is " << spec.width << "x" << spec.height);
+
+		expect(co_await conn->roundTrip(CLIENT_MSG_START_STREAM),
+		       SERVER_MSG_STREAM_IS_STARTED);
+
+		int frames = 0;
+		uint64_t bytes = 0;
+		double start = monotonicSeconds();
+		while (frames < numFrames)
+		{
+			CoConnection::Message message = co_await conn->recv();
+			if (message.type == SERVER_MSG_FRAME)
+			{
+				frames++;
+				bytes += message.body.size();
+			}
+		}
+		double elapsed = monotonicSeconds() - start;
+
+		MESSAGE(frames << " frames, " << bytes << " bytes in " << elapsed << " s ("
+		     << frames / elapsed << " frames/s)");
+
+		co_await conn->roundTrip(CLIENT_MSG_STOP_STREAM);
+		co_await conn->roundTrip(CLIENT_MSG_CLOSE_WEBCAM);
+	}
+	catch (runtime_error e)
+	{
+		ERROR(e.what());
+	}
+
+	done->set_value();
+}
+
+void
+usage (char* basename)
+{
+	cout << "Usage: " << basename << " [address or unix socket path] [port] [device] [frames]" << endl;
+}
+
+int
+main (int argc, char* args[])
+{
+	try
+	{
+		string address = argc >= 2 ? args[1] : "127.0.0.1";
+		int port = DEFAULT_PORT;
+		string device = argc >= 4 ? args[3] : "/dev/video0";
+		int numFrames = 100;
+
+		if (argc >= 3)
+		{
+			istringstream iss(args[2]);
+			iss >> port;
+			if (port == 0) {
+				usage(args[0]);
+				return 1;
+			}
+		}
+		if (argc >= 5)
+		{
+			istringstream iss(args[4]);
+			iss >> numFrames;
+		}
+
+		// Coroutines only need the worker pool; one loop thread is plenty
+		shared_ptr<EventLoop> executor(new EventLoop(1, 2));
+		executor->start();
+
+		ProbeClient client(executor);
+		shared_ptr<Connection> conn = address.find('/') != string::npos
+			? client.connectUnix(address)
+			: client.connect(address, port);
+
+		promise<void> done;
+		spawn(executor, probe(dynamic_pointer_cast<CoConnection>(conn), device, numFrames, &done));
+		done.get_future().wait();
+
+		conn->sendMessage(ERROR_MSG_TERMINATING_CONNECTION);
+		conn->close();
+		executor->stop();
+
+		return 0;
+	}
+	catch (runtime_error e)
+	{
+		cerr << "!! Caught exception:" << endl
+		     << "!! " << e.what() << endl;
+		return 1;
+	}
+}
@@ -1,7 +1,10 @@
 
+#include <cstring>      // strerror()
 #include <iostream>     // cout
+#include <pthread.h>    // multithreading
 #include <stdexcept>    // exceptions
 #include <string>       // strings
+#include <vector>       // vectors
 
 #include "Log.h"
 #include "WebcamServer.h"
@@ -13,7 +16,35 @@ using namespace std;
 void
 usage (char* basename)
 {
-	cout << "Usage: " << basename << " [port]" << endl;
+	cout << "Usage: " << basename << " [port] [unix socket path | -] [acceptors] [http port]"
+	     << " [client limit] [global limit] [http devices]" << endl
+	     << "Given an HTTP port, metrics are served at /metrics, webcams as MJPEG at" << endl
+	     << "/mjpeg?device=/dev/video0, and the webcam protocol over a WebSocket at /ws." << endl
+	     << "Limits are in bytes per second (0 for none), per client and for all clients" << endl
+	     << "together. They can be changed at /limits while the server's running." << endl
+	     << "HTTP devices are the webcams served as MJPEG, separated by commas; without" << endl
+	     << "them, any /dev/video* device is." << endl;
+}
+
+/**
+ * Serves local clients on a unix domain socket, alongside the TCP server.
+ * Both servers share the webcams, so local clients cost no extra captures.
+ */
+void*
+serveLocal (void* path_p)
+{
+	string path = *static_cast<string*>(path_p);
+	try
+	{
+		WebcamServer localServer;
+		localServer.startUnix(path);
+	}
+	catch (runtime_error e)
+	{
+		cerr << "!! Caught exception serving " << path << ":" << endl
+		     << "!! " << e.what() << endl;
+	}
+	return NULL;
 }
 
 int
@@ -21,18 +52,84 @@ main (int argc, char* args[]) {
 
 	try {
 		int port;
+		static string socketPath;
 
-		if (argc >= 3) {
-			istringstream iss(args[2]);
+		if (argc >= 2) {
+			istringstream iss(args[1]);
 			iss >> port;
 			if (port == 0) {
-				cerr << "Bad port number: " << args[2];
+				cerr << "Bad port number: " << args[1];
 			}
 		} else {
 			port = DEFAULT_PORT;
 		}
 
+		int acceptors = 1;
+		if (argc >= 4) {
+			istringstream iss(args[3]);
+			iss >> acceptors;
+			if (acceptors < 1) {
+				cerr << "Bad number of acceptors: " << args[3];
+				acceptors = 1;
+			}
+		}
+
+		int httpPort = 0;
+		if (argc >= 5) {
+			istringstream iss(args[4]);
+			iss >> httpPort;
+			if (httpPort <= 0 || httpPort > 65535) {
+				cerr << "Bad HTTP port: " << args[4];
+				httpPort = 0;
+			}
+		}
+
+		uint64_t clientLimit = 0;
+		if (argc >= 6) {
+			istringstream iss(args[5]);
+			if (!(iss >> clientLimit)) {
+				cerr << "Bad client limit: " << args[5];
+				clientLimit = 0;
+			}
+		}
+
+		uint64_t globalLimit = 0;
+		if (argc >= 7) {
+			istringstream iss(args[6]);
+			if (!(iss >> globalLimit)) {
+				cerr << "Bad global limit: " << args[6];
+				globalLimit = 0;
+			}
+		}
+
+		vector<string> httpDevices;
+		if (argc >= 8) {
+			istringstream iss(args[7]);
+			string device;
+			while (getline(iss, device, ',')) {
+				if (!device.empty()) {
+					httpDevices.push_back(device);
+				}
+			}
+		}
+
+		if (argc >= 3 && string(args[2]) != "-")
+		{
+			socketPath = args[2];
+			pthread_t localThread;
+			int err = pthread_create(&localThread, NULL, serveLocal, &socketPath);
+			if (err) {
+				THROW_ERROR("Unable to start local server: " << strerror(err));
+			}
+			pthread_detach(localThread);
+		}
+
 		WebcamServer server;
+		server.setAcceptors(acceptors);
+		server.setHttpPort(httpPort);
+		server.setHttpDevices(httpDevices);
+		server.getBandwidthLimits().setClientLimit(clientLimit);
+		server.getBandwidthLimits().setGlobalLimit(globalLimit);
 		server.start(port);
 
 		return 0;
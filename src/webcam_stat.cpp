@@ -0,0 +1,192 @@
+#include <endian.h>     // be64toh()
+#include <unistd.h>     // sleep()
+
+#include <cstring>      // memcpy()
+#include <iomanip>      // setw()
+#include <iostream>     // cout
+#include <memory>       // shared_ptr
+#include <sstream>      // istringstream
+#include <stdexcept>    // exceptions
+#include <string>       // strings
+
+#include "Log.h"
+#include "Sockets.h"
+
+#include "webcam_stream_common.h"
+
+using namespace std;
+
+/**
+ * Polls a webcam server for its counters (CLIENT_MSG_GET_STATS) and prints
+ * them: one line per connection, then one per open webcam.
+ */
+
+class StatClient: public Client
+{
+  public:
+	shared_ptr<Connection>
+	newConnection (int fd, in_addr_t remoteAddress, in_port_t remotePort)
+	{
+		return shared_ptr<Connection>(new Connection(fd, remoteAddress, remotePort));
+	}
+};
+
+/// Copies a struct out of a SERVER_MSG_STATS body. Fields a newer server
+/// added on the end are skipped; ones an older server left off are zeroed.
+template <typename T>
+static void
+readStruct (T& out, const Connection::Reply& reply, size_t offset, size_t length)
+{
+	if (offset + length > reply.body.size()) {
+		THROW_ERROR("Stats are truncated");
+	}
+	memset(&out, 0, sizeof(out));
+	memcpy(&out, &reply.body[offset], length < sizeof(out) ? length : sizeof(out));
+}
+
+static void
+printStats (const Connection::Reply& reply)
+{
+	struct stats_header header;
+	readStruct(header, reply, 0, sizeof(header));
+	if (header.version != STATS_VERSION) {
+		WARNING("Server sent stats version " << (int) header.version
+		     << "; expected " << (int) STATS_VERSION);
+	}
+
+	size_t connectionLength = ntohs(header.connectionStatsLength);
+	size_t webcamLength     = ntohs(header.webcamStatsLength);
+	uint32_t numConnections = ntohl(header.numConnections);
+	uint32_t numWebcams     = ntohl(header.numWebcams);
+	size_t offset = header.headerLength;
+
+	cout << "Uptime " << be64toh(header.uptimeMs) / 1000.0 << " s, "
+	     << numConnections << " connections, " << numWebcams << " webcams" << endl;
+
+	cout << left << setw(22) << "client" << right
+	     << setw(12) << "bytes in"  << setw(14) << "bytes out"
+	     << setw(9)  << "msgs in"   << setw(10) << "msgs out"
+	     << setw(10) << "frames"    << setw(9)  << "dropped"
+	     << setw(7)  << "queue"     << setw(12) << "queued B"
+	     << setw(12) << "latency us" << endl;
+	for (uint32_t i = 0; i < numConnections; i++, offset += connectionLength)
+	{
+		struct connection_stats stats;
+		readStruct(stats, reply, offset, connectionLength);
+
+		stringstream client;
+		if (stats.local) {
+			client << "(unix socket)";
+		} else {
+			client << ip2string(stats.remoteAddress) << ":" << ntohs(stats.remotePort);
+		}
+
+		cout << left << setw(22) << client.str() << right
+		     << setw(12) << be64toh(stats.bytesIn)
+		     << setw(14) << be64toh(stats.bytesOut)
+		     << setw(9)  << be64toh(stats.messagesIn)
+		     << setw(10) << be64toh(stats.messagesOut)
+		     << setw(10) << be64toh(stats.framesSent)
+		     << setw(9)  << be64toh(stats.framesDropped)
+		     << setw(7)  << ntohl(stats.queueDepth)
+		     << setw(12) << be64toh(stats.queuedBytes)
+		     << setw(12) << ntohl(stats.sendLatencyUs) << endl;
+	}
+
+	if (numWebcams == 0) {
+		return;
+	}
+
+	cout << left << setw(22) << "webcam" << right
+	     << setw(8)  << "stream" << setw(8)  << "fps"
+	     << setw(12) << "captured" << setw(9) << "dropped" << setw(9) << "copied"
+	     << setw(10) << "buffers" << setw(8) << "subs" << setw(11) << "streaming" << endl;
+	for (uint32_t i = 0; i < numWebcams; i++, offset += webcamLength)
+	{
+		struct webcam_stats stats;
+		readStruct(stats, reply, offset, webcamLength);
+		stats.device[sizeof(stats.device) - 1] = '\0';
+
+		stringstream buffers;
+		buffers << ntohl(stats.buffersInFlight) << "/" << ntohl(stats.numBuffers);
+
+		cout << left << setw(22) << stats.device << right
+		     << setw(8)  << ntohl(stats.streamId)
+		     << setw(8)  << fixed << setprecision(1) << ntohl(stats.captureMilliFps) / 1000.0
+		     << setw(12) << be64toh(stats.framesCaptured)
+		     << setw(9)  << be64toh(stats.framesDropped)
+		     << setw(9)  << be64toh(stats.framesCopied)
+		     << setw(10) << buffers.str()
+		     << setw(8)  << ntohl(stats.subscribers)
+		     << setw(11) << ntohl(stats.streaming) << endl;
+	}
+}
+
+void
+usage (char* basename)
+{
+	cout << "Usage: " << basename << " [address or unix socket path] [port] [interval seconds]" << endl
+	     << "An interval of 0 polls once." << endl;
+}
+
+int
+main (int argc, char* args[])
+{
+	try
+	{
+		string address = argc >= 2 ? args[1] : "127.0.0.1";
+		int port = DEFAULT_PORT;
+		int interval = 1;
+
+		if (argc >= 3)
+		{
+			istringstream iss(args[2]);
+			iss >> port;
+			if (port == 0) {
+				usage(args[0]);
+				return 1;
+			}
+		}
+		if (argc >= 4)
+		{
+			istringstream iss(args[3]);
+			if (!(iss >> interval) || interval < 0) {
+				usage(args[0]);
+				return 1;
+			}
+		}
+
+		StatClient client;
+		shared_ptr<Connection> conn = address.find('/') != string::npos
+			? client.connectUnix(address)
+			: client.connect(address, port);
+
+		while (true)
+		{
+			Connection::Reply reply = conn->request(CLIENT_MSG_GET_STATS).get();
+			if (reply.type != SERVER_MSG_STATS)
+			{
+				THROW_ERROR("Expected " << webcamSocketMsgToString(SERVER_MSG_STATS)
+				         << ", got " << webcamSocketMsgToString(reply.type));
+			}
+			printStats(reply);
+
+			if (interval == 0) {
+				break;
+			}
+			cout << endl;
+			sleep(interval);
+		}
+
+		conn->sendMessage(ERROR_MSG_TERMINATING_CONNECTION);
+		conn->close();
+
+		return 0;
+	}
+	catch (runtime_error e)
+	{
+		cerr << "!! Caught exception:" << endl
+		     << "!! " << e.what() << endl;
+		return 1;
+	}
+}